@@ -93,42 +93,55 @@ def benchmark_source(device=None, size_mb=100):
 
     analyze("source %dMiB" % size_mb, speeds)
 
-def benchmark_push(device=None, file_size_mb=100):
+# Writes a file that's half random and half zeros, a 64KiB run of each at a time, so that the
+# codecs have something to do without the result being either trivial or incompressible.
+def write_test_file(path, file_size_mb):
+    chunk = 64 * 1024
+    with open(path, "wb") as f:
+        for _ in range(0, file_size_mb * 1024 * 1024 // (2 * chunk)):
+            f.write(os.urandom(chunk))
+            f.write(bytes(chunk))
+
+def benchmark_push(device=None, file_size_mb=100, compression="none"):
     if device == None:
         device = adb.get_device()
 
     remote_path = "/dev/null"
     local_path = "/tmp/adb_benchmark_temp"
 
-    with open(local_path, "wb") as f:
-        f.truncate(file_size_mb * 1024 * 1024)
+    write_test_file(local_path, file_size_mb)
 
     speeds = list()
-    for _ in range(0, 10):
-        begin = time.time()
-        device.push(local=local_path, remote=remote_path)
-        end = time.time()
-        speeds.append(file_size_mb / float(end - begin))
+    cmd = device.adb_cmd + ["push", "-z", compression, local_path, remote_path]
+    with open(os.devnull, 'w') as devnull:
+        for _ in range(0, 10):
+            begin = time.time()
+            subprocess.check_call(cmd, stdout=devnull)
+            end = time.time()
+            speeds.append(file_size_mb / float(end - begin))
 
-    analyze("push %dMiB" % file_size_mb, speeds)
+    analyze("push %dMiB (%s)" % (file_size_mb, compression), speeds)
 
-def benchmark_pull(device=None, file_size_mb=100):
+def benchmark_pull(device=None, file_size_mb=100, compression="none"):
     if device == None:
         device = adb.get_device()
 
     remote_path = "/data/local/tmp/adb_benchmark_temp"
     local_path = "/tmp/adb_benchmark_temp"
 
-    device.shell(["dd", "if=/dev/zero", "of=" + remote_path, "bs=1m",
-                  "count=" + str(file_size_mb)])
+    write_test_file(local_path, file_size_mb)
+    device.push(local=local_path, remote=remote_path)
+
     speeds = list()
-    for _ in range(0, 10):
-        begin = time.time()
-        device.pull(remote=remote_path, local=local_path)
-        end = time.time()
-        speeds.append(file_size_mb / float(end - begin))
+    cmd = device.adb_cmd + ["pull", "-z", compression, remote_path, local_path]
+    with open(os.devnull, 'w') as devnull:
+        for _ in range(0, 10):
+            begin = time.time()
+            subprocess.check_call(cmd, stdout=devnull)
+            end = time.time()
+            speeds.append(file_size_mb / float(end - begin))
 
-    analyze("pull %dMiB" % file_size_mb, speeds)
+    analyze("pull %dMiB (%s)" % (file_size_mb, compression), speeds)
 
 def benchmark_shell(device=None, file_size_mb=100):
     if device == None:
@@ -149,8 +162,10 @@ def main():
     unlock(device)
     benchmark_sink(device)
     benchmark_source(device)
-    benchmark_push(device)
-    benchmark_pull(device)
+    # Pushing compresses on the host and decompresses on the device, and pulling does the reverse.
+    for compression in ["none", "brotli", "lz4", "zstd"]:
+        benchmark_push(device, compression=compression)
+        benchmark_pull(device, compression=compression)
 
 if __name__ == "__main__":
     main()
@@ -17,6 +17,7 @@
 #include "client/file_sync_client.h"
 
 #include <dirent.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <limits.h>
 #include <stdio.h>
@@ -28,12 +29,19 @@
 #include <unistd.h>
 #include <utime.h>
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <deque>
 #include <functional>
 #include <memory>
+#include <mutex>
+#include <queue>
+#include <random>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include "sysdeps.h"
@@ -42,28 +50,28 @@
 #include "adb_client.h"
 #include "adb_io.h"
 #include "adb_utils.h"
-#include "brotli_utils.h"
+#include "compression_policy.h"
+#include "compression_utils.h"
+#include "file_sync_delta.h"
 #include "file_sync_protocol.h"
 #include "line_printer.h"
+#include "ordered_work_queue.h"
 #include "sysdeps/errno.h"
 #include "sysdeps/stat.h"
 
 #include "client/commandline.h"
 
+#include <adb/tls/adb_ca_list.h>
 #include <android-base/file.h>
+#include <android-base/parseint.h>
 #include <android-base/strings.h>
 #include <android-base/stringprintf.h>
+#include <openssl/sha.h>
 
 using namespace std::literals;
 
 typedef void(sync_ls_cb)(unsigned mode, uint64_t size, uint64_t time, const char* name);
 
-struct syncsendbuf {
-    unsigned id;
-    unsigned size;
-    char data[SYNC_DATA_MAX];
-};
-
 static void ensure_trailing_separators(std::string& local_path, std::string& remote_path) {
     if (!adb_is_separator(local_path.back())) {
         local_path.push_back(OS_PATH_SEPARATOR);
@@ -81,6 +89,14 @@ static bool should_push_file(mode_t mode) {
     return S_ISREG(mode) || S_ISLNK(mode);
 }
 
+// What a push already knows about the device's copy of a file, from stat'ing it.
+enum class RemoteCopy {
+    Unknown,
+    Missing,
+    Regular,
+    Other,
+};
+
 struct copyinfo {
     std::string lpath;
     std::string rpath;
@@ -88,6 +104,7 @@ struct copyinfo {
     uint32_t mode;
     uint64_t size = 0;
     bool skip = false;
+    RemoteCopy remote = RemoteCopy::Unknown;
 
     copyinfo(const std::string& local_path,
              const std::string& remote_path,
@@ -113,6 +130,8 @@ struct TransferLedger {
     uint64_t files_transferred;
     uint64_t files_skipped;
     uint64_t bytes_transferred;
+    // Bytes that an earlier, interrupted transfer had already copied, and that weren't sent again.
+    uint64_t bytes_resumed;
     uint64_t bytes_expected;
     bool expect_multiple_files;
 
@@ -127,7 +146,9 @@ struct TransferLedger {
 
     bool operator==(const TransferLedger& other) const {
         return files_transferred == other.files_transferred &&
-               files_skipped == other.files_skipped && bytes_transferred == other.bytes_transferred;
+               files_skipped == other.files_skipped &&
+               bytes_transferred == other.bytes_transferred &&
+               bytes_resumed == other.bytes_resumed;
     }
 
     bool operator!=(const TransferLedger& other) const {
@@ -139,6 +160,7 @@ struct TransferLedger {
         files_transferred = 0;
         files_skipped = 0;
         bytes_transferred = 0;
+        bytes_resumed = 0;
         bytes_expected = 0;
         last_progress_str.clear();
         last_progress_time = {};
@@ -168,8 +190,9 @@ struct TransferLedger {
             return;
         }
         char overall_percentage_str[5] = "?";
-        if (bytes_expected != 0 && bytes_transferred <= bytes_expected) {
-            int overall_percentage = static_cast<int>(bytes_transferred * 100 / bytes_expected);
+        uint64_t bytes_done = bytes_transferred + bytes_resumed;
+        if (bytes_expected != 0 && bytes_done <= bytes_expected) {
+            int overall_percentage = static_cast<int>(bytes_done * 100 / bytes_expected);
             // If we're pulling symbolic links, we'll pull the target of the link rather than
             // just create a local link, and that will cause us to go over 100%.
             if (overall_percentage <= 100) {
@@ -214,19 +237,122 @@ struct TransferLedger {
             ss << display_name << ": ";
         }
         ss << files_transferred << " file" << ((files_transferred == 1) ? "" : "s") << " "
-           << direction_str << ", " << files_skipped << " skipped.";
-        ss << TransferRate();
+           << direction_str << ", " << files_skipped << " skipped";
+        if (bytes_resumed != 0) {
+            ss << ", " << bytes_resumed << " bytes resumed";
+        }
+        ss << "." << TransferRate();
 
         lp.Print(ss.str(), LinePrinter::LineType::INFO);
         lp.KeepInfoLine();
     }
 };
 
+enum class SyncPhase {
+    List,      // Listing and stat'ing files, to find out what to copy.
+    Transfer,  // Sending or receiving files.
+    AckWait,   // Waiting for adbd to acknowledge pushed files.
+};
+
+// Where the time of a push or pull went, written as JSON to $ADB_SYNC_STATS so that it can be
+// tracked by machine. Times are summed over every connection, so with several connections they can
+// add up to more than the time the whole transfer took.
+//
+// A pushed file's "seconds" are how long it took to hand it to the connection, or to bundle it
+// with others. adbd acknowledges pushes later, so the wait for a file's own acknowledgement isn't
+// charged to it, though it can be charged to a later file that had to wait for it. Every such wait
+// is counted in the "ack_wait" phase.
+struct SyncStats {
+    // A write to adbd, or a wait for the next part of a pulled file, that takes at least this long
+    // counts as a stall: adbd or the transport isn't keeping up.
+    static constexpr auto kStallThreshold = 10ms;
+
+    struct File {
+        std::string name;
+        uint64_t bytes;       // The file's size.
+        uint64_t wire_bytes;  // What was sent or received for it, compressed or not.
+        double seconds;       // For a push, until it was sent, not until it was acknowledged.
+    };
+
+    explicit SyncStats(std::string path) : path(std::move(path)) {}
+
+    bool Write(const TransferLedger& ledger, TransferDirection direction) const {
+        std::chrono::duration<double> elapsed =
+                std::chrono::steady_clock::now() - ledger.start_time;
+        std::string json = android::base::StringPrintf(
+                "{\n"
+                "  \"direction\": \"%s\",\n"
+                "  \"seconds\": %.6f,\n"
+                "  \"files_transferred\": %" PRIu64 ",\n"
+                "  \"files_skipped\": %" PRIu64 ",\n"
+                "  \"bytes_transferred\": %" PRIu64 ",\n"
+                "  \"bytes_resumed\": %" PRIu64 ",\n"
+                "  \"phases\": {\"list\": %.6f, \"transfer\": %.6f, \"ack_wait\": %.6f},\n"
+                "  \"stalls\": {\"count\": %" PRIu64 ", \"seconds\": %.6f},\n"
+                "  \"files\": [",
+                direction == TransferDirection::push ? "push" : "pull", elapsed.count(),
+                ledger.files_transferred, ledger.files_skipped, ledger.bytes_transferred,
+                ledger.bytes_resumed, phase_seconds[static_cast<int>(SyncPhase::List)],
+                phase_seconds[static_cast<int>(SyncPhase::Transfer)],
+                phase_seconds[static_cast<int>(SyncPhase::AckWait)], stalls, stall_seconds);
+        for (size_t i = 0; i < files.size(); ++i) {
+            const File& file = files[i];
+            json += android::base::StringPrintf(
+                    "%s\n    {\"name\": %s, \"bytes\": %" PRIu64 ", \"wire_bytes\": %" PRIu64
+                    ", \"seconds\": %.6f}",
+                    i == 0 ? "" : ",", JsonString(file.name).c_str(), file.bytes, file.wire_bytes,
+                    file.seconds);
+        }
+        json += files.empty() ? "]\n}\n" : "\n  ]\n}\n";
+        return android::base::WriteStringToFile(json, path);
+    }
+
+    std::string path;
+    double phase_seconds[3] = {};
+    uint64_t stalls = 0;
+    double stall_seconds = 0;
+    std::vector<File> files;
+
+  private:
+    static std::string JsonString(std::string_view s) {
+        std::string result = "\"";
+        for (char c : s) {
+            if (c == '"' || c == '\\') {
+                result += '\\';
+                result += c;
+            } else if (static_cast<unsigned char>(c) < 0x20) {
+                result += android::base::StringPrintf("\\u%04x", c);
+            } else {
+                result += c;
+            }
+        }
+        return result + "\"";
+    }
+};
+
+// Compressed files at least this big are sent as frames of kFrameSize bytes, if adbd can take them,
+// compressed on up to kMaxFrameThreads threads.
+static constexpr uint64_t kMinFramedSize = 4 * 1024 * 1024;
+static constexpr size_t kFrameSize = 1024 * 1024;
+static constexpr size_t kMaxFrameThreads = 16;
+static_assert(kFrameSize <= SYNC_FRAME_MAX);
+
+// Whether a local file takes up less space than its size, and so has holes that needn't be sent.
+#if defined(SEEK_HOLE)
+static bool is_sparse(const struct stat& st) {
+    return S_ISREG(st.st_mode) &&
+           static_cast<uint64_t>(st.st_blocks) * 512 < static_cast<uint64_t>(st.st_size);
+}
+#else
+static bool is_sparse(const struct stat&) {
+    return false;
+}
+#endif
+
 class SyncConnection {
   public:
     SyncConnection() : acknowledgement_buffer_(sizeof(sync_status) + SYNC_DATA_MAX) {
         acknowledgement_buffer_.resize(0);
-        max = SYNC_DATA_MAX; // TODO: decide at runtime.
 
         std::string error;
         if (!adb_get_feature_set(&features_, &error)) {
@@ -236,11 +362,65 @@ class SyncConnection {
             have_ls_v2_ = CanUseFeature(features_, kFeatureLs2);
             have_sendrecv_v2_ = CanUseFeature(features_, kFeatureSendRecv2);
             have_sendrecv_v2_brotli_ = CanUseFeature(features_, kFeatureSendRecv2Brotli);
+            have_sendrecv_v2_lz4_ = CanUseFeature(features_, kFeatureSendRecv2LZ4);
+            have_sendrecv_v2_zstd_ = CanUseFeature(features_, kFeatureSendRecv2Zstd);
+            have_sendrecv_v2_raw_fallback_ =
+                    CanUseFeature(features_, kFeatureSendRecv2RawFallback);
+            have_sendrecv_v2_framed_ = CanUseFeature(features_, kFeatureSendRecv2Framed);
+            have_send_size_ = CanUseFeature(features_, kFeatureSendSize);
+            have_recv_range_ = CanUseFeature(features_, kFeatureRecvRange);
+            have_send_range_ = CanUseFeature(features_, kFeatureSendRange);
+            have_sendrecv_v2_sparse_ = CanUseFeature(features_, kFeatureSendRecv2Sparse);
+            have_send_bundle_ = CanUseFeature(features_, kFeatureSendBundle);
+            have_resume_ = CanUseFeature(features_, kFeatureResume);
+            have_send_delta_ = CanUseFeature(features_, kFeatureSendDelta);
+            have_stat_batch_ = have_stat_v2_ && CanUseFeature(features_, kFeatureStatBatch);
+            have_list_recursive_ = CanUseFeature(features_, kFeatureListRecursive);
+            have_hash_batch_ = CanUseFeature(features_, kFeatureHashBatch);
+            const char* stats_path = getenv("ADB_SYNC_STATS");
+            if (stats_path != nullptr && *stats_path != '\0') {
+                stats_ = std::make_unique<SyncStats>(stats_path);
+            }
             fd.reset(adb_connect("sync:", &error));
             if (fd < 0) {
                 Error("connect failed: %s", error.c_str());
             }
         }
+        SetUpDataMax();
+    }
+
+    // Opens another connection to the same device, which records its transfers in |parent|'s
+    // ledgers and prints through |parent|, so that several connections can push at once.
+    explicit SyncConnection(SyncConnection* parent)
+        : acknowledgement_buffer_(sizeof(sync_status) + SYNC_DATA_MAX),
+          features_(parent->features_),
+          have_stat_v2_(parent->have_stat_v2_),
+          have_ls_v2_(parent->have_ls_v2_),
+          have_sendrecv_v2_(parent->have_sendrecv_v2_),
+          have_sendrecv_v2_brotli_(parent->have_sendrecv_v2_brotli_),
+          have_sendrecv_v2_lz4_(parent->have_sendrecv_v2_lz4_),
+          have_sendrecv_v2_zstd_(parent->have_sendrecv_v2_zstd_),
+          have_sendrecv_v2_raw_fallback_(parent->have_sendrecv_v2_raw_fallback_),
+          have_sendrecv_v2_framed_(parent->have_sendrecv_v2_framed_),
+          have_send_size_(parent->have_send_size_),
+          have_recv_range_(parent->have_recv_range_),
+          have_send_range_(parent->have_send_range_),
+          have_sendrecv_v2_sparse_(parent->have_sendrecv_v2_sparse_),
+          have_send_bundle_(parent->have_send_bundle_),
+          have_resume_(parent->have_resume_),
+          have_send_delta_(parent->have_send_delta_),
+          have_stat_batch_(parent->have_stat_batch_),
+          have_list_recursive_(parent->have_list_recursive_),
+          have_hash_batch_(parent->have_hash_batch_),
+          parent_(parent) {
+        acknowledgement_buffer_.resize(0);
+
+        std::string error;
+        fd.reset(adb_connect("sync:", &error));
+        if (fd < 0) {
+            Error("connect failed: %s", error.c_str());
+        }
+        SetUpDataMax();
     }
 
     ~SyncConnection() {
@@ -256,11 +436,62 @@ class SyncConnection {
             ReadOrderlyShutdown(fd);
         }
 
-        line_printer_.KeepInfoLine();
+        if (!parent_) {
+            line_printer_.KeepInfoLine();
+        }
     }
 
     bool HaveSendRecv2() const { return have_sendrecv_v2_; }
     bool HaveSendRecv2Brotli() const { return have_sendrecv_v2_brotli_; }
+    bool HaveSendRecv2LZ4() const { return have_sendrecv_v2_lz4_; }
+    bool HaveSendRecv2Zstd() const { return have_sendrecv_v2_zstd_; }
+    bool HaveSendRecv2RawFallback() const { return have_sendrecv_v2_raw_fallback_; }
+    bool HaveSendRecv2Framed() const { return have_sendrecv_v2_framed_; }
+    bool HaveSendSize() const { return have_send_size_; }
+    bool HaveRecvRange() const { return have_recv_range_; }
+    bool HaveSendRange() const { return have_send_range_; }
+    bool HaveSendRecv2Sparse() const { return have_sendrecv_v2_sparse_; }
+    bool HaveSendBundle() const { return have_send_bundle_; }
+    bool HaveResume() const { return have_resume_; }
+    bool HaveSendDelta() const { return have_send_delta_; }
+    bool HaveStatBatch() const { return have_stat_batch_; }
+    bool HaveListRecursive() const { return have_list_recursive_; }
+    bool HaveHashBatch() const { return have_hash_batch_; }
+
+    // Returns the codec to use to transfer |path|. CompressionType::Any picks the cheapest codec
+    // that the device supports, and a codec that the device doesn't support falls back to none at
+    // all, as does a file that's already compressed.
+    CompressionType ResolveCompressionType(CompressionType compression,
+                                           std::string_view path) const {
+        if (!HaveSendRecv2() || CompressionPolicy::IsPrecompressed(path)) {
+            return CompressionType::None;
+        }
+
+        switch (compression) {
+            case CompressionType::None:
+                return CompressionType::None;
+
+            case CompressionType::Any:
+                if (HaveSendRecv2Zstd()) {
+                    return CompressionType::Zstd;
+                } else if (HaveSendRecv2LZ4()) {
+                    return CompressionType::LZ4;
+                } else if (HaveSendRecv2Brotli()) {
+                    return CompressionType::Brotli;
+                }
+                return CompressionType::None;
+
+            case CompressionType::Brotli:
+                return HaveSendRecv2Brotli() ? compression : CompressionType::None;
+
+            case CompressionType::LZ4:
+                return HaveSendRecv2LZ4() ? compression : CompressionType::None;
+
+            case CompressionType::Zstd:
+                return HaveSendRecv2Zstd() ? compression : CompressionType::None;
+        }
+        return CompressionType::None;
+    }
 
     const FeatureSet& Features() const { return features_; }
 
@@ -271,8 +502,17 @@ class SyncConnection {
     }
 
     void RecordBytesTransferred(size_t bytes) {
-        current_ledger_.bytes_transferred += bytes;
-        global_ledger_.bytes_transferred += bytes;
+        SyncConnection& root = Root();
+        std::lock_guard<std::mutex> lock(root.output_mutex_);
+        root.current_ledger_.bytes_transferred += bytes;
+        root.global_ledger_.bytes_transferred += bytes;
+    }
+
+    void RecordBytesResumed(uint64_t bytes) {
+        SyncConnection& root = Root();
+        std::lock_guard<std::mutex> lock(root.output_mutex_);
+        root.current_ledger_.bytes_resumed += bytes;
+        root.global_ledger_.bytes_resumed += bytes;
     }
 
     void RecordFileSent(std::string from, std::string to) {
@@ -281,18 +521,25 @@ class SyncConnection {
     }
 
     void RecordFilesTransferred(size_t files) {
-        current_ledger_.files_transferred += files;
-        global_ledger_.files_transferred += files;
+        SyncConnection& root = Root();
+        std::lock_guard<std::mutex> lock(root.output_mutex_);
+        root.current_ledger_.files_transferred += files;
+        root.global_ledger_.files_transferred += files;
     }
 
     void RecordFilesSkipped(size_t files) {
-        current_ledger_.files_skipped += files;
-        global_ledger_.files_skipped += files;
+        SyncConnection& root = Root();
+        std::lock_guard<std::mutex> lock(root.output_mutex_);
+        root.current_ledger_.files_skipped += files;
+        root.global_ledger_.files_skipped += files;
     }
 
     void ReportProgress(const std::string& file, uint64_t file_copied_bytes,
                         uint64_t file_total_bytes) {
-        current_ledger_.ReportProgress(line_printer_, file, file_copied_bytes, file_total_bytes);
+        SyncConnection& root = Root();
+        std::lock_guard<std::mutex> lock(root.output_mutex_);
+        root.current_ledger_.ReportProgress(root.line_printer_, file, file_copied_bytes,
+                                            file_total_bytes);
     }
 
     void ReportTransferRate(const std::string& file, TransferDirection direction) {
@@ -303,6 +550,52 @@ class SyncConnection {
         if (current_ledger_ != global_ledger_) {
             global_ledger_.ReportTransferRate(line_printer_, "", direction);
         }
+        if (stats_ && !stats_->Write(global_ledger_, direction)) {
+            Warning("failed to write stats to '%s': %s", stats_->path.c_str(), strerror(errno));
+        }
+    }
+
+    // When a file's transfer started, and how much had gone over the connection by then.
+    struct FileStart {
+        std::chrono::steady_clock::time_point time;
+        uint64_t wire_bytes;
+    };
+
+    FileStart StartFile() const { return {std::chrono::steady_clock::now(), wire_bytes_}; }
+
+    // Records a file of |size| bytes that's been sent or received since |start|, if there's
+    // $ADB_SYNC_STATS to record it in.
+    void RecordFileStats(const FileStart& start, const std::string& name, uint64_t size) {
+        SyncConnection& root = Root();
+        if (!root.stats_) return;
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start.time;
+        std::lock_guard<std::mutex> lock(root.output_mutex_);
+        root.stats_->files.push_back({name, size, wire_bytes_ - start.wire_bytes, elapsed.count()});
+        root.stats_->phase_seconds[static_cast<int>(SyncPhase::Transfer)] += elapsed.count();
+    }
+
+    // Records the time since |start| as spent in |phase|.
+    void RecordPhase(SyncPhase phase, std::chrono::steady_clock::time_point start) {
+        SyncConnection& root = Root();
+        if (!root.stats_) return;
+
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::lock_guard<std::mutex> lock(root.output_mutex_);
+        root.stats_->phase_seconds[static_cast<int>(phase)] += elapsed.count();
+    }
+
+    // Counts what another connection sent or received for a file that this one is recording.
+    void RecordWireBytes(uint64_t bytes) { wire_bytes_ += bytes; }
+    uint64_t WireBytes() const { return wire_bytes_; }
+
+    // Reads part of the response to a recv request, counting it for the stats.
+    bool ReadFileData(void* data, size_t length) {
+        auto start = std::chrono::steady_clock::now();
+        if (!ReadFdExactly(fd, data, length)) return false;
+        wire_bytes_ += length;
+        RecordStall(start);
+        return true;
     }
 
     bool SendRequest(int id, const std::string& path) {
@@ -323,7 +616,13 @@ class SyncConnection {
         return WriteFdExactly(fd, buf.data(), buf.size());
     }
 
-    bool SendSend2(std::string_view path, mode_t mode, bool compressed) {
+    // |size| is passed on to adbd if it can use it to allocate the file's space up front. With
+    // |range|, which carries the size itself, the data that follows is just that range of the file.
+    // With |resume|, it's the rest of the file, which adbd adds to an earlier push's partial file.
+    // |flags| can add kSyncFlagFramed or kSyncFlagSparse to the codec's flag.
+    bool SendSend2(std::string_view path, mode_t mode, CompressionType compression, uint64_t size,
+                   uint32_t flags = 0, const sync_send_range* range = nullptr,
+                   const sync_send_resume* resume = nullptr) {
         if (path.length() > 1024) {
             Error("SendRequest failed: path too long: %zu", path.length());
             errno = ENAMETOOLONG;
@@ -339,20 +638,74 @@ class SyncConnection {
         syncmsg msg;
         msg.send_v2_setup.id = ID_SEND_V2;
         msg.send_v2_setup.mode = mode;
-        msg.send_v2_setup.flags = compressed ? kSyncFlagBrotli : kSyncFlagNone;
+        msg.send_v2_setup.flags = CompressionFlag(compression) | flags;
+        sync_send_size send_size = {.size = size};
+        // A sparse file's size says nothing about the space it needs.
+        bool send_size_flag = HaveSendSize() && !range && !(flags & kSyncFlagSparse);
+        if (send_size_flag) {
+            msg.send_v2_setup.flags |= kSyncFlagSize;
+        }
+        if (range) {
+            msg.send_v2_setup.flags |= kSyncFlagRange;
+        }
+        if (resume) {
+            msg.send_v2_setup.flags |= kSyncFlagResume;
+        }
 
-        buf.resize(sizeof(SyncRequest) + path.length() + sizeof(msg.send_v2_setup));
+        buf.resize(sizeof(SyncRequest) + path.length() + sizeof(msg.send_v2_setup) +
+                   (send_size_flag ? sizeof(send_size) : 0) + (range ? sizeof(*range) : 0) +
+                   (resume ? sizeof(*resume) : 0));
 
         void* p = buf.data();
 
         p = mempcpy(p, &req, sizeof(SyncRequest));
         p = mempcpy(p, path.data(), path.length());
         p = mempcpy(p, &msg.send_v2_setup, sizeof(msg.send_v2_setup));
+        if (send_size_flag) {
+            p = mempcpy(p, &send_size, sizeof(send_size));
+        }
+        if (range) {
+            p = mempcpy(p, range, sizeof(*range));
+        }
+        if (resume) {
+            p = mempcpy(p, resume, sizeof(*resume));
+        }
+
+        return WriteFdExactly(fd, buf.data(), buf.size());
+    }
+
+    bool SendSend3(std::string_view path, mode_t mode) {
+        if (path.length() > 1024) {
+            Error("SendRequest failed: path too long: %zu", path.length());
+            errno = ENAMETOOLONG;
+            return false;
+        }
+
+        Block buf;
+
+        SyncRequest req;
+        req.id = ID_SEND_V3;
+        req.path_length = path.length();
+
+        syncmsg msg;
+        msg.send_v3_setup.id = ID_SEND_V3;
+        msg.send_v3_setup.mode = mode;
+        msg.send_v3_setup.flags = kSyncFlagNone;
+
+        buf.resize(sizeof(SyncRequest) + path.length() + sizeof(msg.send_v3_setup));
+
+        void* p = buf.data();
+
+        p = mempcpy(p, &req, sizeof(SyncRequest));
+        p = mempcpy(p, path.data(), path.length());
+        p = mempcpy(p, &msg.send_v3_setup, sizeof(msg.send_v3_setup));
 
         return WriteFdExactly(fd, buf.data(), buf.size());
     }
 
-    bool SendRecv2(const std::string& path) {
+    // With |range|, asks for just that part of the file.
+    bool SendRecv2(const std::string& path, CompressionType compression,
+                   const sync_recv_range* range = nullptr) {
         if (path.length() > 1024) {
             Error("SendRequest failed: path too long: %zu", path.length());
             errno = ENAMETOOLONG;
@@ -367,15 +720,28 @@ class SyncConnection {
 
         syncmsg msg;
         msg.recv_v2_setup.id = ID_RECV_V2;
-        msg.recv_v2_setup.flags = kSyncFlagBrotli;
+        msg.recv_v2_setup.flags = CompressionFlag(compression);
+        if (HaveSendRecv2RawFallback()) {
+            msg.recv_v2_setup.flags |= kSyncFlagRawFallback;
+        }
+        if (HaveSendRecv2Sparse() && compression == CompressionType::None) {
+            msg.recv_v2_setup.flags |= kSyncFlagSparse;
+        }
+        if (range) {
+            msg.recv_v2_setup.flags |= kSyncFlagRange;
+        }
 
-        buf.resize(sizeof(SyncRequest) + path.length() + sizeof(msg.recv_v2_setup));
+        buf.resize(sizeof(SyncRequest) + path.length() + sizeof(msg.recv_v2_setup) +
+                   (range ? sizeof(*range) : 0));
 
         void* p = buf.data();
 
         p = mempcpy(p, &req, sizeof(SyncRequest));
         p = mempcpy(p, path.data(), path.length());
         p = mempcpy(p, &msg.recv_v2_setup, sizeof(msg.recv_v2_setup));
+        if (range) {
+            p = mempcpy(p, range, sizeof(*range));
+        }
 
         return WriteFdExactly(fd, buf.data(), buf.size());
     }
@@ -396,6 +762,95 @@ class SyncConnection {
         }
     }
 
+    // Asks for the (l)stat of every path in one request. Each answer is read with FinishStat.
+    bool SendStatBatch(const std::vector<std::string>& paths, bool lstat) {
+        if (!have_stat_batch_) {
+            errno = ENOTSUP;
+            return false;
+        }
+        if (paths.size() > SYNC_STAT_BATCH_MAX) {
+            Error("SendStatBatch failed: too many paths: %zu", paths.size());
+            errno = E2BIG;
+            return false;
+        }
+
+        std::vector<char> buf(sizeof(SyncRequest) + sizeof(sync_stat_batch));
+        SyncRequest* req = reinterpret_cast<SyncRequest*>(&buf[0]);
+        req->id = ID_STAT_BATCH;
+        req->path_length = 0;
+        sync_stat_batch* setup = reinterpret_cast<sync_stat_batch*>(req + 1);
+        setup->id = ID_STAT_BATCH;
+        setup->stat_id = lstat ? ID_LSTAT_V2 : ID_STAT_V2;
+        setup->count = paths.size();
+
+        return AppendPathList(&buf, paths) && WriteFdExactly(fd, buf.data(), buf.size());
+    }
+
+    // Asks for the SHA-256 digest of every path in one request. Each answer is read with
+    // FinishHash.
+    bool SendHashBatch(const std::vector<std::string>& paths) {
+        if (!have_hash_batch_) {
+            errno = ENOTSUP;
+            return false;
+        }
+        if (paths.size() > SYNC_HASH_BATCH_MAX) {
+            Error("SendHashBatch failed: too many paths: %zu", paths.size());
+            errno = E2BIG;
+            return false;
+        }
+
+        std::vector<char> buf(sizeof(SyncRequest) + sizeof(sync_hash_batch));
+        SyncRequest* req = reinterpret_cast<SyncRequest*>(&buf[0]);
+        req->id = ID_HASH_BATCH;
+        req->path_length = 0;
+        sync_hash_batch* setup = reinterpret_cast<sync_hash_batch*>(req + 1);
+        setup->id = ID_HASH_BATCH;
+        setup->count = paths.size();
+
+        return AppendPathList(&buf, paths) && WriteFdExactly(fd, buf.data(), buf.size());
+    }
+
+    // Asks for the SHA-256 digest of |length| bytes of the file from |offset|. The answer is read
+    // with FinishHash.
+    bool SendHashRange(const std::string& path, uint64_t offset, uint64_t length) {
+        if (!have_resume_) {
+            errno = ENOTSUP;
+            return false;
+        }
+        if (path.length() > 1024) {
+            Error("SendHashRange failed: path too long: %zu", path.length());
+            errno = ENAMETOOLONG;
+            return false;
+        }
+
+        std::vector<char> buf(sizeof(SyncRequest) + path.length() + sizeof(sync_hash_range));
+        SyncRequest* req = reinterpret_cast<SyncRequest*>(&buf[0]);
+        req->id = ID_HASH_RANGE;
+        req->path_length = path.length();
+        char* p = static_cast<char*>(mempcpy(req + 1, path.data(), path.length()));
+        sync_hash_range setup = {.id = ID_HASH_RANGE, .offset = offset, .length = length};
+        memcpy(p, &setup, sizeof(setup));
+        return WriteFdExactly(fd, buf.data(), buf.size());
+    }
+
+    bool FinishHash(std::string* digest, uint64_t* size) {
+        sync_hash msg;
+        if (!ReadFdExactly(fd.get(), &msg, sizeof(msg))) {
+            PLOG(FATAL) << "protocol fault: failed to read hash response";
+        }
+        if (msg.id != ID_HASH) {
+            LOG(FATAL) << "protocol fault: hash response has wrong message id: " << msg.id;
+        }
+        if (msg.error != 0) {
+            errno = errno_from_wire(msg.error);
+            return false;
+        }
+
+        digest->assign(reinterpret_cast<char*>(msg.sha256), sizeof(msg.sha256));
+        *size = msg.size;
+        return true;
+    }
+
     bool FinishStat(struct stat* st) {
         syncmsg msg;
 
@@ -455,6 +910,32 @@ class SyncConnection {
         return SendRequest(have_ls_v2_ ? ID_LIST_V2 : ID_LIST_V1, path);
     }
 
+    // Asks adbd to list everything beneath |path|.
+    bool SendListRecursive(const std::string& path) {
+        if (!have_list_recursive_) {
+            errno = ENOTSUP;
+            return false;
+        }
+        return SendRequest(ID_LIST_RECURSIVE, path);
+    }
+
+    // Reads the entries sent in response to SendListRecursive. The names passed to |callback|
+    // are relative to the directory that was listed.
+    bool FinishListRecursive(const std::function<sync_ls_cb>& callback) {
+        while (true) {
+            sync_rdent dent;
+            if (!ReadFdExactly(fd, &dent, sizeof(dent))) return false;
+            if (dent.id == ID_DONE) return true;
+            if (dent.id != ID_RDENT) return false;
+
+            if (dent.namelen > PATH_MAX) return false;
+            std::string name(dent.namelen, '\0');
+            if (!ReadFdExactly(fd, name.data(), name.size())) return false;
+
+            callback(dent.mode, dent.size, dent.mtime, name.c_str());
+        }
+    }
+
   private:
     template <bool v2>
     static bool FinishLsImpl(borrowed_fd fd, const std::function<sync_ls_cb>& callback) {
@@ -533,19 +1014,121 @@ class SyncConnection {
         return true;
     }
 
-    bool SendLargeFileCompressed(const std::string& path, mode_t mode, const std::string& lpath,
-                                 const std::string& rpath, unsigned mtime) {
-        if (!SendSend2(path, mode, true)) {
-            Error("failed to send ID_SEND_V2 message '%s': %s", path.c_str(), strerror(errno));
+    // Adds a small regular file to the bundle that goes to adbd in one send_bundle, sending the
+    // bundle first if there's no room left in it. Whatever's bundled is sent by SendBundle, or by
+    // ReadAcknowledgements(true).
+    bool AddToBundle(const std::string& path, mode_t mode, const std::string& lpath,
+                     const std::string& rpath, unsigned mtime, const char* data,
+                     size_t data_length) {
+        if (path.length() > 1024) {
+            Error("AddToBundle failed: path too long: %zu", path.length());
+            errno = ENAMETOOLONG;
+            return false;
+        }
+
+        size_t file_size = sizeof(sync_bundle_file) + path.length() + data_length;
+        CHECK_LE(file_size, static_cast<size_t>(SYNC_BUNDLE_MAX_SIZE));
+        if (bundled_files_.size() == SYNC_BUNDLE_MAX_FILES ||
+            bundle_.size() + file_size > SYNC_BUNDLE_MAX_SIZE) {
+            if (!SendBundle()) return false;
+        }
+
+        sync_bundle_file file = {
+                .mode = mode,
+                .mtime = mtime,
+                .path_length = static_cast<uint32_t>(path.length()),
+                .size = static_cast<uint32_t>(data_length),
+        };
+        size_t offset = bundle_.size();
+        bundle_.resize(offset + file_size);
+        char* p = bundle_.data() + offset;
+        p = static_cast<char*>(mempcpy(p, &file, sizeof(file)));
+        p = static_cast<char*>(mempcpy(p, path.data(), path.length()));
+        memcpy(p, data, data_length);
+        bundled_files_.push_back({lpath, rpath, data_length});
+        // Counted now, so that it's the file that the stats charge it to.
+        wire_bytes_ += file_size;
+
+        // The file only counts as transferred once adbd says that it's written it.
+        ReportProgress(rpath, data_length, data_length);
+        return true;
+    }
+
+    // Sends the files that AddToBundle has gathered, and reports any that adbd couldn't write.
+    bool SendBundle() {
+        if (bundled_files_.empty()) return true;
+
+        std::vector<char> bundle = std::move(bundle_);
+        std::vector<BundledFile> files = std::move(bundled_files_);
+        bundle_.clear();
+        bundled_files_.clear();
+
+        // The answer is read here rather than with the acknowledgements, so they have to be read
+        // first.
+        if (!ReadAcknowledgements(true)) return false;
+
+        std::vector<char> buf(sizeof(SyncRequest) + sizeof(sync_send_bundle) + bundle.size());
+        SyncRequest* req = reinterpret_cast<SyncRequest*>(&buf[0]);
+        req->id = ID_SEND_BUNDLE;
+        req->path_length = 0;
+        sync_send_bundle* setup = reinterpret_cast<sync_send_bundle*>(req + 1);
+        setup->id = ID_SEND_BUNDLE;
+        setup->count = files.size();
+        setup->size = bundle.size();
+        memcpy(setup + 1, bundle.data(), bundle.size());
+        auto start = std::chrono::steady_clock::now();
+        if (!WriteFdExactly(fd, buf.data(), buf.size())) {
+            Error("failed to send bundle: %s", strerror(errno));
             return false;
         }
+        RecordStall(start);
+
+        sync_send_bundle response;
+        start = std::chrono::steady_clock::now();
+        bool read = ReadFdExactly(fd, &response, sizeof(response));
+        RecordPhase(SyncPhase::AckWait, start);
+        if (!read) {
+            Error("failed to read bundle response");
+            return false;
+        } else if (response.id != ID_SEND_BUNDLE || response.count != files.size() ||
+                   response.size != files.size() * sizeof(uint32_t)) {
+            Error("unexpected bundle response from daemon: id = %#" PRIx32, response.id);
+            return false;
+        }
+        std::vector<uint32_t> errors(files.size());
+        if (!ReadFdExactly(fd, errors.data(), errors.size() * sizeof(uint32_t))) {
+            Error("failed to read bundle response");
+            return false;
+        }
+
+        bool success = true;
+        for (size_t i = 0; i < files.size(); ++i) {
+            if (errors[i] != 0) {
+                Error("failed to copy '%s' to '%s': remote %s", files[i].lpath.c_str(),
+                      files[i].rpath.c_str(), strerror(errno_from_wire(errors[i])));
+                success = false;
+            } else {
+                RecordFilesTransferred(1);
+                RecordBytesTransferred(files[i].size);
+            }
+        }
+        return success;
+    }
 
+    bool SendLargeFileCompressed(const std::string& path, mode_t mode, const std::string& lpath,
+                                 const std::string& rpath, unsigned mtime,
+                                 CompressionType compression) {
         struct stat st;
         if (stat(lpath.c_str(), &st) == -1) {
             Error("cannot stat '%s': %s", lpath.c_str(), strerror(errno));
             return false;
         }
 
+        if (!SendSend2(path, mode, compression, st.st_size)) {
+            Error("failed to send ID_SEND_V2 message '%s': %s", path.c_str(), strerror(errno));
+            return false;
+        }
+
         uint64_t total_size = st.st_size;
         uint64_t bytes_copied = 0;
 
@@ -555,52 +1138,68 @@ class SyncConnection {
             return false;
         }
 
-        syncsendbuf sbuf;
-        sbuf.id = ID_DATA;
-
-        BrotliEncoder<SYNC_DATA_MAX> encoder;
-        bool sending = true;
-        while (sending) {
-            Block input(SYNC_DATA_MAX);
+        std::unique_ptr<Encoder> encoder = CreateEncoder(compression, max);
+        CompressionPolicy policy;
+        bool compressing = true;
+        while (true) {
+            Block input(max);
             int r = adb_read(lfd.get(), input.data(), input.size());
             if (r < 0) {
                 Error("reading '%s' locally failed: %s", lpath.c_str(), strerror(errno));
                 return false;
             }
+            input.resize(r);
 
-            if (r == 0) {
-                encoder.Finish();
-            } else {
-                input.resize(r);
-                encoder.Append(std::move(input));
+            if (r > 0) {
                 RecordBytesTransferred(r);
                 bytes_copied += r;
                 ReportProgress(rpath, bytes_copied, total_size);
             }
 
-            while (true) {
-                Block output;
-                BrotliEncodeResult result = encoder.Encode(&output);
-                if (result == BrotliEncodeResult::Error) {
-                    Error("compressing '%s' locally failed", lpath.c_str());
-                    return false;
+            // If compression isn't paying for itself, end the compressed stream, and send the rest
+            // of the file as it is.
+            bool send_raw = !compressing;
+            if (compressing) {
+                if (r > 0 && HaveSendRecv2RawFallback() && !policy.ShouldCompress(input)) {
+                    send_raw = true;
+                    encoder->Finish();
+                } else if (r == 0) {
+                    encoder->Finish();
+                } else {
+                    encoder->Append(std::move(input));
                 }
 
-                if (!output.empty()) {
-                    sbuf.size = output.size();
-                    memcpy(sbuf.data, output.data(), output.size());
-                    WriteOrDie(lpath, rpath, &sbuf, sizeof(SyncRequest) + output.size());
-                }
+                while (true) {
+                    Block output;
+                    EncodeResult result = encoder->Encode(&output);
+                    if (result == EncodeResult::Error) {
+                        Error("compressing '%s' locally failed", lpath.c_str());
+                        return false;
+                    }
 
-                if (result == BrotliEncodeResult::Done) {
-                    sending = false;
-                    break;
-                } else if (result == BrotliEncodeResult::NeedInput) {
-                    break;
-                } else if (result == BrotliEncodeResult::MoreOutput) {
-                    continue;
+                    if (!output.empty()) {
+                        policy.RecordOutput(output.size());
+                        SendData(lpath, rpath, output.data(), output.size());
+                    }
+
+                    if (result == EncodeResult::Done) {
+                        compressing = false;
+                        break;
+                    } else if (result == EncodeResult::NeedInput) {
+                        break;
+                    } else if (result == EncodeResult::MoreOutput) {
+                        continue;
+                    }
                 }
             }
+
+            if (r == 0) {
+                break;
+            }
+
+            if (send_raw) {
+                SendData(lpath, rpath, input.data(), r);
+            }
         }
 
         syncmsg msg;
@@ -610,24 +1209,137 @@ class SyncConnection {
         return WriteOrDie(lpath, rpath, &msg.data, sizeof(msg.data));
     }
 
-    bool SendLargeFile(const std::string& path, mode_t mode, const std::string& lpath,
-                       const std::string& rpath, unsigned mtime, bool compressed) {
-        if (compressed && HaveSendRecv2Brotli()) {
-            return SendLargeFileCompressed(path, mode, lpath, rpath, mtime);
+    // Sends the file as frames that are compressed on as many threads as there are cores, since a
+    // single thread compressing a large file can't keep up with USB 3.
+    bool SendLargeFileFramed(const std::string& path, mode_t mode, const std::string& lpath,
+                             const std::string& rpath, unsigned mtime, uint64_t total_size,
+                             CompressionType compression) {
+        if (!SendSend2(path, mode, compression, total_size, kSyncFlagFramed)) {
+            Error("failed to send ID_SEND_V2 message '%s': %s", path.c_str(), strerror(errno));
+            return false;
         }
 
-        std::string path_and_mode = android::base::StringPrintf("%s,%d", path.c_str(), mode);
-        if (!SendRequest(ID_SEND_V1, path_and_mode)) {
-            Error("failed to send ID_SEND_V1 message '%s': %s", path_and_mode.c_str(),
-                  strerror(errno));
+        unique_fd lfd(adb_open(lpath.c_str(), O_RDONLY | O_CLOEXEC));
+        if (lfd < 0) {
+            Error("opening '%s' locally failed: %s", lpath.c_str(), strerror(errno));
             return false;
         }
 
+        size_t thread_count =
+                std::clamp<size_t>(std::thread::hardware_concurrency(), 1, kMaxFrameThreads);
+        OrderedWorkQueue queue(thread_count);
+        CompressionPolicy policy;
+
+        // The uncompressed size of each frame in the queue.
+        std::deque<uint32_t> sizes;
+        std::vector<char> buf(sizeof(sync_frame) + kFrameSize);
+        auto write_frame = [&]() {
+            Block block;
+            if (!queue.Pop(&block)) {
+                Error("compressing '%s' locally failed", lpath.c_str());
+                return false;
+            }
+
+            sync_frame* frame = reinterpret_cast<sync_frame*>(buf.data());
+            frame->id = ID_FRAME;
+            frame->size = sizes.front();
+            frame->compressed_size = block.size();
+            sizes.pop_front();
+            memcpy(frame + 1, block.data(), block.size());
+            policy.RecordOutput(block.size());
+            return WriteOrDie(lpath, rpath, buf.data(), sizeof(sync_frame) + block.size());
+        };
+
+        uint64_t bytes_copied = 0;
+        while (true) {
+            // Fill the whole frame, since the smaller frames are, the less they compress.
+            Block input(kFrameSize);
+            size_t r = 0;
+            while (r < input.size()) {
+                int rc = adb_read(lfd.get(), input.data() + r, input.size() - r);
+                if (rc < 0) {
+                    Error("reading '%s' locally failed: %s", lpath.c_str(), strerror(errno));
+                    return false;
+                } else if (rc == 0) {
+                    break;
+                }
+                r += rc;
+            }
+            if (r == 0) {
+                break;
+            }
+            input.resize(r);
+
+            RecordBytesTransferred(r);
+            bytes_copied += r;
+            ReportProgress(rpath, bytes_copied, total_size);
+
+            sizes.push_back(r);
+            if (policy.ShouldCompress(input)) {
+                queue.Push(std::move(input), [compression](Block* block) {
+                    CompressFrame(compression, block);
+                    return true;
+                });
+            } else {
+                queue.Push(std::move(input), [](Block*) { return true; });
+            }
+
+            // Keep every thread busy, without reading too far ahead of the socket.
+            if (queue.size() >= 2 * thread_count && !write_frame()) {
+                return false;
+            }
+        }
+
+        while (queue.size() > 0) {
+            if (!write_frame()) return false;
+        }
+
+        syncmsg msg;
+        msg.data.id = ID_DONE;
+        msg.data.size = mtime;
+        RecordFileSent(lpath, rpath);
+        return WriteOrDie(lpath, rpath, &msg.data, sizeof(msg.data));
+    }
+
+    bool SendLargeFile(const std::string& path, mode_t mode, const std::string& lpath,
+                       const std::string& rpath, unsigned mtime, CompressionType compression) {
+        compression = ResolveCompressionType(compression, lpath);
+        if (compression != CompressionType::None) {
+            struct stat st;
+            if (HaveSendRecv2Framed() && stat(lpath.c_str(), &st) == 0 &&
+                static_cast<uint64_t>(st.st_size) >= kMinFramedSize) {
+                return SendLargeFileFramed(path, mode, lpath, rpath, mtime, st.st_size,
+                                           compression);
+            }
+            return SendLargeFileCompressed(path, mode, lpath, rpath, mtime, compression);
+        }
+
         struct stat st;
         if (stat(lpath.c_str(), &st) == -1) {
             Error("cannot stat '%s': %s", lpath.c_str(), strerror(errno));
             return false;
         }
+#if defined(SEEK_HOLE)
+        if (HaveSendRecv2Sparse() && is_sparse(st)) {
+            return SendLargeFileSparse(path, mode, lpath, rpath, mtime, st.st_size);
+        }
+#endif
+
+        // send_v2 is only needed to tell adbd the size.
+        if (HaveSendSize()) {
+            if (!SendSend2(path, mode, CompressionType::None, st.st_size)) {
+                Error("failed to send ID_SEND_V2 message '%s': %s", path.c_str(),
+                      strerror(errno));
+                return false;
+            }
+        } else {
+            std::string path_and_mode = android::base::StringPrintf("%s,%d", path.c_str(), mode);
+            if (!SendRequest(ID_SEND_V1, path_and_mode)) {
+                Error("failed to send ID_SEND_V1 message '%s': %s", path_and_mode.c_str(),
+                      strerror(errno));
+                return false;
+            }
+        }
 
         uint64_t total_size = st.st_size;
         uint64_t bytes_copied = 0;
@@ -638,11 +1350,12 @@ class SyncConnection {
             return false;
         }
 
-        syncsendbuf sbuf;
-        sbuf.id = ID_DATA;
+        // Read straight into the message, rather than copying the data there.
+        sync_data* sbuf = reinterpret_cast<sync_data*>(send_buffer_.data());
+        sbuf->id = ID_DATA;
 
         while (true) {
-            int bytes_read = adb_read(lfd, sbuf.data, max);
+            int bytes_read = adb_read(lfd, sbuf + 1, max);
             if (bytes_read == -1) {
                 Error("reading '%s' locally failed: %s", lpath.c_str(), strerror(errno));
                 return false;
@@ -650,8 +1363,8 @@ class SyncConnection {
                 break;
             }
 
-            sbuf.size = bytes_read;
-            WriteOrDie(lpath, rpath, &sbuf, sizeof(SyncRequest) + bytes_read);
+            sbuf->size = bytes_read;
+            WriteOrDie(lpath, rpath, sbuf, sizeof(*sbuf) + bytes_read);
 
             RecordBytesTransferred(bytes_read);
             bytes_copied += bytes_read;
@@ -665,19 +1378,292 @@ class SyncConnection {
         return WriteOrDie(lpath, rpath, &msg.data, sizeof(msg.data));
     }
 
-    bool ReportCopyFailure(const std::string& from, const std::string& to, const syncmsg& msg) {
-        std::vector<char> buf(msg.status.msglen + 1);
-        if (!ReadFdExactly(fd, &buf[0], msg.status.msglen)) {
-            Error("failed to copy '%s' to '%s'; failed to read reason (!): %s", from.c_str(),
-                  to.c_str(), strerror(errno));
+#if defined(SEEK_HOLE)
+    // Sends the file's data, uncompressed, and its holes as ID_HOLE messages, rather than reading
+    // and sending the zeroes in them.
+    bool SendLargeFileSparse(const std::string& path, mode_t mode, const std::string& lpath,
+                             const std::string& rpath, unsigned mtime, uint64_t total_size) {
+        if (!SendSend2(path, mode, CompressionType::None, total_size, kSyncFlagSparse)) {
+            Error("failed to send ID_SEND_V2 message '%s': %s", path.c_str(), strerror(errno));
             return false;
         }
-        buf[msg.status.msglen] = 0;
-        Error("failed to copy '%s' to '%s': remote %s", from.c_str(), to.c_str(), &buf[0]);
-        return false;
-    }
-
-    void CopyDone() { deferred_acknowledgements_.pop_front(); }
+
+        unique_fd lfd(adb_open(lpath.c_str(), O_RDONLY | O_CLOEXEC));
+        if (lfd < 0) {
+            Error("opening '%s' locally failed: %s", lpath.c_str(), strerror(errno));
+            return false;
+        }
+
+        // Read straight into the message, rather than copying the data there.
+        sync_data* sbuf = reinterpret_cast<sync_data*>(send_buffer_.data());
+        sbuf->id = ID_DATA;
+
+        uint64_t bytes_copied = 0;
+        while (bytes_copied < total_size) {
+            // A filesystem that doesn't keep track of holes has the whole file as data.
+            uint64_t data_start = bytes_copied;
+            int64_t data = adb_lseek(lfd, bytes_copied, SEEK_DATA);
+            if (data != -1) {
+                data_start = std::min<uint64_t>(data, total_size);
+            } else if (errno == ENXIO) {
+                data_start = total_size;
+            }
+
+            while (bytes_copied < data_start) {
+                syncmsg msg;
+                msg.data.id = ID_HOLE;
+                msg.data.size = std::min<uint64_t>(data_start - bytes_copied, UINT32_MAX);
+                WriteOrDie(lpath, rpath, &msg.data, sizeof(msg.data));
+                bytes_copied += msg.data.size;
+                ReportProgress(rpath, bytes_copied, total_size);
+            }
+            if (bytes_copied == total_size) break;
+
+            int64_t hole = adb_lseek(lfd, data_start, SEEK_HOLE);
+            uint64_t data_end = hole == -1 ? total_size : std::min<uint64_t>(hole, total_size);
+            if (adb_lseek(lfd, data_start, SEEK_SET) == -1) {
+                Error("seeking in '%s' locally failed: %s", lpath.c_str(), strerror(errno));
+                return false;
+            }
+            while (bytes_copied < data_end) {
+                size_t want = std::min<uint64_t>(data_end - bytes_copied, max);
+                int bytes_read = adb_read(lfd, sbuf + 1, want);
+                if (bytes_read == -1) {
+                    Error("reading '%s' locally failed: %s", lpath.c_str(), strerror(errno));
+                    return false;
+                } else if (bytes_read == 0) {
+                    Error("'%s' got shorter while it was being pushed", lpath.c_str());
+                    return false;
+                }
+
+                sbuf->size = bytes_read;
+                WriteOrDie(lpath, rpath, sbuf, sizeof(*sbuf) + bytes_read);
+
+                RecordBytesTransferred(bytes_read);
+                bytes_copied += bytes_read;
+                ReportProgress(rpath, bytes_copied, total_size);
+            }
+        }
+
+        syncmsg msg;
+        msg.data.id = ID_DONE;
+        msg.data.size = mtime;
+        RecordFileSent(lpath, rpath);
+        return WriteOrDie(lpath, rpath, &msg.data, sizeof(msg.data));
+    }
+#endif
+
+    // Sends |range| of the file, uncompressed, as one part of a push that sync_send_ranged splits
+    // over several connections. The file only counts as sent once every range has been
+    // acknowledged, so that's left to the caller.
+    bool SendLargeFileRange(const std::string& path, mode_t mode, const std::string& lpath,
+                            const std::string& rpath, unsigned mtime,
+                            const sync_send_range& range) {
+        if (!SendSend2(path, mode, CompressionType::None, range.size, 0, &range)) {
+            Error("failed to send ID_SEND_V2 message '%s': %s", path.c_str(), strerror(errno));
+            return false;
+        }
+
+        unique_fd lfd(adb_open(lpath.c_str(), O_RDONLY | O_CLOEXEC));
+        if (lfd < 0) {
+            Error("opening '%s' locally failed: %s", lpath.c_str(), strerror(errno));
+            return false;
+        }
+        if (adb_lseek(lfd, range.offset, SEEK_SET) == -1) {
+            Error("seeking in '%s' locally failed: %s", lpath.c_str(), strerror(errno));
+            return false;
+        }
+
+        // Read straight into the message, rather than copying the data there.
+        sync_data* sbuf = reinterpret_cast<sync_data*>(send_buffer_.data());
+        sbuf->id = ID_DATA;
+
+        uint64_t bytes_copied = 0;
+        while (bytes_copied < range.length) {
+            size_t want = std::min<uint64_t>(range.length - bytes_copied, max);
+            int bytes_read = adb_read(lfd, sbuf + 1, want);
+            if (bytes_read == -1) {
+                Error("reading '%s' locally failed: %s", lpath.c_str(), strerror(errno));
+                return false;
+            } else if (bytes_read == 0) {
+                Error("'%s' got shorter while it was being pushed", lpath.c_str());
+                return false;
+            }
+
+            sbuf->size = bytes_read;
+            WriteOrDie(lpath, rpath, sbuf, sizeof(*sbuf) + bytes_read);
+
+            RecordBytesTransferred(bytes_read);
+            bytes_copied += bytes_read;
+            ReportProgress(rpath, bytes_copied, range.length);
+        }
+
+        syncmsg msg;
+        msg.data.id = ID_DONE;
+        msg.data.size = mtime;
+        deferred_acknowledgements_.emplace_back(lpath, rpath);
+        return WriteOrDie(lpath, rpath, &msg.data, sizeof(msg.data));
+    }
+
+    // Sends the file from |offset|, uncompressed, to be added to the partial file that an earlier
+    // push of it left on the device.
+    bool SendLargeFileResumed(const std::string& path, mode_t mode, const std::string& lpath,
+                              const std::string& rpath, unsigned mtime, uint64_t total_size,
+                              uint64_t offset) {
+        sync_send_resume resume = {.offset = offset};
+        if (!SendSend2(path, mode, CompressionType::None, total_size, 0, nullptr, &resume)) {
+            Error("failed to send ID_SEND_V2 message '%s': %s", path.c_str(), strerror(errno));
+            return false;
+        }
+
+        unique_fd lfd(adb_open(lpath.c_str(), O_RDONLY | O_CLOEXEC));
+        if (lfd < 0) {
+            Error("opening '%s' locally failed: %s", lpath.c_str(), strerror(errno));
+            return false;
+        }
+        if (adb_lseek(lfd, offset, SEEK_SET) == -1) {
+            Error("seeking in '%s' locally failed: %s", lpath.c_str(), strerror(errno));
+            return false;
+        }
+
+        // Read straight into the message, rather than copying the data there.
+        sync_data* sbuf = reinterpret_cast<sync_data*>(send_buffer_.data());
+        sbuf->id = ID_DATA;
+
+        uint64_t bytes_copied = offset;
+        while (true) {
+            int bytes_read = adb_read(lfd, sbuf + 1, max);
+            if (bytes_read == -1) {
+                Error("reading '%s' locally failed: %s", lpath.c_str(), strerror(errno));
+                return false;
+            } else if (bytes_read == 0) {
+                break;
+            }
+
+            sbuf->size = bytes_read;
+            WriteOrDie(lpath, rpath, sbuf, sizeof(*sbuf) + bytes_read);
+
+            RecordBytesTransferred(bytes_read);
+            bytes_copied += bytes_read;
+            ReportProgress(rpath, bytes_copied, total_size);
+        }
+
+        syncmsg msg;
+        msg.data.id = ID_DONE;
+        msg.data.size = mtime;
+        RecordFileSent(lpath, rpath);
+        return WriteOrDie(lpath, rpath, &msg.data, sizeof(msg.data));
+    }
+
+    // Sends the file as literal data and references to the blocks of the file that's already on
+    // the device, which adbd describes first.
+    bool SendLargeFileDelta(const std::string& path, mode_t mode, const std::string& lpath,
+                            const std::string& rpath, unsigned mtime) {
+        // The signatures come back in line with the acknowledgements of earlier files.
+        if (!ReadAcknowledgements(true)) {
+            return false;
+        }
+
+        if (!SendSend3(path, mode)) {
+            Error("failed to send ID_SEND_V3 message '%s': %s", path.c_str(), strerror(errno));
+            return false;
+        }
+
+        // The start of a sync_signatures lines up with a sync_status, in case adbd refused.
+        syncmsg msg;
+        if (!ReadFdExactly(fd, &msg.status, sizeof(msg.status))) {
+            Error("failed to read signatures of '%s': %s", rpath.c_str(), strerror(errno));
+            return false;
+        }
+        if (msg.status.id == ID_FAIL) {
+            return ReportCopyFailure(lpath, rpath, msg);
+        }
+        if (msg.signatures.id != ID_SIGNATURES) {
+            Error("unexpected response from daemon: id = %#" PRIx32, msg.signatures.id);
+            return false;
+        }
+        if (!ReadFdExactly(fd, &msg.signatures.count, sizeof(msg.signatures.count))) {
+            Error("failed to read signatures of '%s': %s", rpath.c_str(), strerror(errno));
+            return false;
+        }
+
+        uint32_t block_size = msg.signatures.block_size;
+        if (block_size == 0 || block_size > SYNC_DATA_MAX ||
+            msg.signatures.count > SYNC_DELTA_MAX_BLOCKS) {
+            Error("invalid signatures of '%s': %" PRIu32 " blocks of %" PRIu32 " bytes",
+                  rpath.c_str(), msg.signatures.count, block_size);
+            return false;
+        }
+
+        std::vector<sync_block_signature> signatures(msg.signatures.count);
+        if (!ReadFdExactly(fd, signatures.data(), signatures.size() * sizeof(signatures[0]))) {
+            Error("failed to read signatures of '%s': %s", rpath.c_str(), strerror(errno));
+            return false;
+        }
+
+        struct stat st;
+        if (stat(lpath.c_str(), &st) == -1) {
+            Error("cannot stat '%s': %s", lpath.c_str(), strerror(errno));
+            return false;
+        }
+
+        uint64_t total_size = st.st_size;
+        uint64_t bytes_copied = 0;
+
+        unique_fd lfd(adb_open(lpath.c_str(), O_RDONLY | O_CLOEXEC));
+        if (lfd < 0) {
+            Error("opening '%s' locally failed: %s", lpath.c_str(), strerror(errno));
+            return false;
+        }
+
+        DeltaEncoder encoder(block_size, signatures);
+        bool success = encoder.Encode(
+                lfd,
+                [&](const char* data, size_t length) {
+                    SendData(lpath, rpath, data, length);
+
+                    RecordBytesTransferred(length);
+                    bytes_copied += length;
+                    ReportProgress(rpath, bytes_copied, total_size);
+                    return true;
+                },
+                [&](uint64_t block, uint32_t count) {
+                    syncmsg copy;
+                    copy.copy.id = ID_COPY;
+                    copy.copy.count = count;
+                    copy.copy.block = block;
+                    WriteOrDie(lpath, rpath, &copy.copy, sizeof(copy.copy));
+
+                    // Blocks reused from the old file count towards progress, but weren't sent.
+                    bytes_copied =
+                            std::min(total_size, bytes_copied + uint64_t(count) * block_size);
+                    ReportProgress(rpath, bytes_copied, total_size);
+                    return true;
+                });
+        if (!success) {
+            Error("reading '%s' locally failed: %s", lpath.c_str(), strerror(errno));
+            return false;
+        }
+
+        msg.data.id = ID_DONE;
+        msg.data.size = mtime;
+        RecordFileSent(lpath, rpath);
+        return WriteOrDie(lpath, rpath, &msg.data, sizeof(msg.data));
+    }
+
+    bool ReportCopyFailure(const std::string& from, const std::string& to, const syncmsg& msg) {
+        std::vector<char> buf(msg.status.msglen + 1);
+        if (!ReadFdExactly(fd, &buf[0], msg.status.msglen)) {
+            Error("failed to copy '%s' to '%s'; failed to read reason (!): %s", from.c_str(),
+                  to.c_str(), strerror(errno));
+            return false;
+        }
+        buf[msg.status.msglen] = 0;
+        Error("failed to copy '%s' to '%s': remote %s", from.c_str(), to.c_str(), &buf[0]);
+        return false;
+    }
+
+    void CopyDone() { deferred_acknowledgements_.pop_front(); }
 
     void ReportDeferredCopyFailure(const std::string& msg) {
         auto& [from, to] = deferred_acknowledgements_.front();
@@ -685,7 +1671,12 @@ class SyncConnection {
         deferred_acknowledgements_.pop_front();
     }
 
+    // With |read_all|, sends anything that's bundled first, and waits for all of it.
     bool ReadAcknowledgements(bool read_all = false) {
+        if (read_all && !SendBundle()) {
+            return false;
+        }
+
         // We need to read enough such that adbd's intermediate socket's write buffer can't be
         // full. The default buffer on Linux is 212992 bytes, but there's 576 bytes of bookkeeping
         // overhead per write. The worst case scenario is a continuous string of failures, since
@@ -697,7 +1688,9 @@ class SyncConnection {
         while (!deferred_acknowledgements_.empty()) {
             bool should_block = read_all || deferred_acknowledgements_.size() >= max_deferred_acks;
 
+            auto start = std::chrono::steady_clock::now();
             ssize_t rc = adb_poll(&pfd, 1, should_block ? -1 : 0);
+            if (should_block) RecordPhase(SyncPhase::AckWait, start);
             if (rc == 0) {
                 CHECK(!should_block);
                 return true;
@@ -776,7 +1769,7 @@ class SyncConnection {
         android::base::StringAppendV(&s, fmt, ap);
         va_end(ap);
 
-        line_printer_.Print(s, LinePrinter::INFO);
+        Print(s, LinePrinter::INFO);
     }
 
     void Println(const char* fmt, ...) __attribute__((__format__(__printf__, 2, 3))) {
@@ -787,8 +1780,7 @@ class SyncConnection {
         android::base::StringAppendV(&s, fmt, ap);
         va_end(ap);
 
-        line_printer_.Print(s, LinePrinter::INFO);
-        line_printer_.KeepInfoLine();
+        Print(s, LinePrinter::INFO, true);
     }
 
     void Error(const char* fmt, ...) __attribute__((__format__(__printf__, 2, 3))) {
@@ -799,7 +1791,7 @@ class SyncConnection {
         android::base::StringAppendV(&s, fmt, ap);
         va_end(ap);
 
-        line_printer_.Print(s, LinePrinter::ERROR);
+        Print(s, LinePrinter::ERROR);
     }
 
     void Warning(const char* fmt, ...) __attribute__((__format__(__printf__, 2, 3))) {
@@ -810,7 +1802,7 @@ class SyncConnection {
         android::base::StringAppendV(&s, fmt, ap);
         va_end(ap);
 
-        line_printer_.Print(s, LinePrinter::WARNING);
+        Print(s, LinePrinter::WARNING);
     }
 
     void ComputeExpectedTotalBytes(const std::vector<copyinfo>& file_list) {
@@ -828,30 +1820,143 @@ class SyncConnection {
         current_ledger_.expect_multiple_files = false;
     }
 
-    // TODO: add a char[max] buffer here, to replace syncsendbuf...
     unique_fd fd;
+    // The biggest ID_DATA message, agreed with adbd.
     size_t max;
 
   private:
+    // Asks adbd for ID_DATA messages of up to SYNC_DATA_MAX_LARGE bytes rather than the default
+    // SYNC_DATA_MAX, if it can take them, so that there are fewer messages for each end to handle.
+    void SetUpDataMax() {
+        max = SYNC_DATA_MAX;
+        if (fd >= 0 && CanUseFeature(features_, kFeatureSyncDataMax)) {
+            syncmsg msg;
+            msg.data_max_setup.id = ID_DATA_MAX;
+            msg.data_max_setup.size = SYNC_DATA_MAX_LARGE;
+            if (!SendRequest(ID_DATA_MAX, "") ||
+                !WriteFdExactly(fd, &msg.data_max_setup, sizeof(msg.data_max_setup)) ||
+                !ReadFdExactly(fd, &msg.data_max_setup, sizeof(msg.data_max_setup))) {
+                Error("failed to set up data size: %s", strerror(errno));
+                fd.reset();
+            } else if (msg.data_max_setup.id != ID_DATA_MAX ||
+                       msg.data_max_setup.size < SYNC_DATA_MAX ||
+                       msg.data_max_setup.size > SYNC_DATA_MAX_LARGE) {
+                Error("invalid data_max response: id = %#x, size = %u", msg.data_max_setup.id,
+                      msg.data_max_setup.size);
+                fd.reset();
+            } else {
+                max = msg.data_max_setup.size;
+            }
+        }
+        send_buffer_.resize(sizeof(sync_data) + max);
+    }
+
+    // Sends |length| bytes, which can't be more than max, as an ID_DATA message.
+    bool SendData(const std::string& lpath, const std::string& rpath, const char* data,
+                  size_t length) {
+        sync_data* sbuf = reinterpret_cast<sync_data*>(send_buffer_.data());
+        sbuf->id = ID_DATA;
+        sbuf->size = length;
+        memcpy(sbuf + 1, data, length);
+        return WriteOrDie(lpath, rpath, sbuf, sizeof(*sbuf) + length);
+    }
+
     std::deque<std::pair<std::string, std::string>> deferred_acknowledgements_;
+    // The files that AddToBundle has gathered, as sync_bundle_files with their paths and data,
+    // and the local and remote paths and size of each.
+    struct BundledFile {
+        std::string lpath;
+        std::string rpath;
+        size_t size;
+    };
+    std::vector<char> bundle_;
+    std::vector<BundledFile> bundled_files_;
     Block acknowledgement_buffer_;
+    std::vector<char> send_buffer_;
     FeatureSet features_;
     bool have_stat_v2_;
     bool have_ls_v2_;
     bool have_sendrecv_v2_;
     bool have_sendrecv_v2_brotli_;
+    bool have_sendrecv_v2_lz4_;
+    bool have_sendrecv_v2_zstd_;
+    bool have_sendrecv_v2_raw_fallback_;
+    bool have_sendrecv_v2_framed_;
+    bool have_send_size_;
+    bool have_recv_range_;
+    bool have_send_range_;
+    bool have_sendrecv_v2_sparse_;
+    bool have_send_bundle_;
+    bool have_resume_;
+    bool have_send_delta_;
+    bool have_stat_batch_;
+    bool have_list_recursive_;
+    bool have_hash_batch_;
 
     TransferLedger global_ledger_;
     TransferLedger current_ledger_;
     LinePrinter line_printer_;
+    // Only the first connection keeps stats, for all of them.
+    std::unique_ptr<SyncStats> stats_;
+    // Everything that's been written to or read from a file's data on this connection, for the
+    // stats. Other connections can add to it when they carry part of a file that this one records.
+    std::atomic<uint64_t> wire_bytes_ = 0;
+
+    // Set for the extra connections used by a parallel push. Everything they record and print
+    // goes to the parent, under the parent's |output_mutex_|.
+    SyncConnection* parent_ = nullptr;
+    std::mutex output_mutex_;
+
+    SyncConnection& Root() { return parent_ ? *parent_ : *this; }
+
+    void Print(const std::string& s, LinePrinter::LineType type, bool keep_info_line = false) {
+        SyncConnection& root = Root();
+        std::lock_guard<std::mutex> lock(root.output_mutex_);
+        root.line_printer_.Print(s, type);
+        if (keep_info_line) {
+            root.line_printer_.KeepInfoLine();
+        }
+    }
 
     bool SendQuit() {
         return SendRequest(ID_QUIT, ""); // TODO: add a SendResponse?
     }
 
+    // Appends |paths| to a request, each preceded by its length.
+    bool AppendPathList(std::vector<char>* buf, const std::vector<std::string>& paths) {
+        for (const std::string& path : paths) {
+            if (path.length() > 1024) {
+                Error("path too long: %zu", path.length());
+                errno = ENAMETOOLONG;
+                return false;
+            }
+            uint32_t path_length = path.length();
+            buf->insert(buf->end(), reinterpret_cast<char*>(&path_length),
+                        reinterpret_cast<char*>(&path_length) + sizeof(path_length));
+            buf->insert(buf->end(), path.begin(), path.end());
+        }
+        return true;
+    }
+
+    // Counts a write or a read that took from |start| until now as a stall, if it took long enough.
+    void RecordStall(std::chrono::steady_clock::time_point start) {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        if (elapsed < SyncStats::kStallThreshold) return;
+
+        SyncConnection& root = Root();
+        if (!root.stats_) return;
+        std::lock_guard<std::mutex> lock(root.output_mutex_);
+        root.stats_->stalls++;
+        root.stats_->stall_seconds += elapsed.count();
+    }
+
     bool WriteOrDie(const std::string& from, const std::string& to, const void* data,
                     size_t data_length) {
-        if (!WriteFdExactly(fd, data, data_length)) {
+        auto start = std::chrono::steady_clock::now();
+        bool written = WriteFdExactly(fd, data, data_length);
+        wire_bytes_ += data_length;
+        RecordStall(start);
+        if (!written) {
             if (errno == ECONNRESET) {
                 // Assume adbd told us why it was closing the connection, and
                 // try to read failure reason from adbd.
@@ -920,8 +2025,196 @@ static bool sync_stat_fallback(SyncConnection& sc, const std::string& path, stru
     return true;
 }
 
+// The smallest file that's sent as a delta against the one on the device, if there is one.
+static constexpr int64_t kMinimumDeltaSize = 1024 * 1024;
+
+// The biggest file that's bundled with others, if adbd can take bundles. Each file sent on its own
+// costs a request and an acknowledgement, which only matters next to a small file's data.
+static constexpr size_t kMaxBundledFileSize = 16 * 1024;
+
+// Uncompressed pushes of files at least this big are split into ranges, each pushed over a
+// connection of its own, so that one connection's round trips don't bound the whole file.
+static constexpr uint64_t kMinRangedPushSize = 64 * 1024 * 1024;
+static constexpr size_t kRangedPushJobs = 4;
+
+// Pushes |lpath|, which is |size| bytes long, as kRangedPushJobs ranges at once. adbd creates the
+// file when the first range arrives, and only gives it its mode, owner and mtime once the last
+// range is in, so a push that fails part way doesn't leave a file that looks complete.
+static bool sync_send_ranged(SyncConnection& sc, const std::string& lpath,
+                             const std::string& rpath, unsigned mtime, mode_t mode,
+                             uint64_t size) {
+    // The ranges of one push are told apart from those of another push to the same path by an
+    // id that's unlikely to have been used before.
+    std::random_device random;
+    uint64_t id = (static_cast<uint64_t>(random()) << 32) | random();
+    uint64_t range_size = size / kRangedPushJobs;
+
+    // Earlier files have to be acknowledged first, since the ranges' acknowledgements are read
+    // on their own.
+    if (!sc.ReadAcknowledgements(true)) {
+        return false;
+    }
+
+    std::atomic<bool> success = true;
+    auto push_range = [&](SyncConnection& connection, size_t i) {
+        sync_send_range range = {
+                .id = id,
+                .size = size,
+                .offset = i * range_size,
+                .length = i + 1 < kRangedPushJobs ? range_size : size - i * range_size,
+        };
+        if (!connection.SendLargeFileRange(rpath, mode, lpath, rpath, mtime, range) ||
+            !connection.ReadAcknowledgements(true)) {
+            success = false;
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < kRangedPushJobs; ++i) {
+        threads.emplace_back([&sc, &success, &push_range, i]() {
+            SyncConnection connection(&sc);
+            if (!connection.IsValid()) {
+                success = false;
+                return;
+            }
+            push_range(connection, i);
+            sc.RecordWireBytes(connection.WireBytes());
+        });
+    }
+    push_range(sc, 0);
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    if (!success) {
+        return false;
+    }
+
+    sc.RecordFilesTransferred(1);
+    return true;
+}
+
+// With --resume, regular files at least this big are copied through a partial file that a later
+// transfer can carry on from. Before it does, the partial file is compared with the file being
+// copied in chunks of kResumeCheckSize bytes, with up to kResumeCheckDepth of the device's hashes
+// asked for at a time.
+static constexpr uint64_t kMinResumableSize = 1024 * 1024;
+static constexpr uint64_t kResumeCheckSize = 4 * 1024 * 1024;
+static constexpr uint64_t kResumeCheckDepth = 16;
+
+// Hashes |length| bytes of the local file |fd| from |offset|.
+static bool hash_local_range(borrowed_fd fd, uint64_t offset, uint64_t length,
+                             std::vector<char>& buffer, std::string* digest) {
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    for (uint64_t hashed = 0; hashed < length;) {
+        size_t want = std::min<uint64_t>(buffer.size(), length - hashed);
+        int rc = adb_pread(fd, buffer.data(), want, offset + hashed);
+        if (rc <= 0) return false;
+        SHA256_Update(&ctx, buffer.data(), rc);
+        hashed += rc;
+    }
+    digest->resize(SHA256_DIGEST_LENGTH);
+    SHA256_Final(reinterpret_cast<uint8_t*>(digest->data()), &ctx);
+    return true;
+}
+
+// Returns how much of a partial copy of a file can be kept: the chunks of its |length| bytes that
+// hash the same in |local_path| and |remote_path|, up to the first one that doesn't.
+static uint64_t verify_partial_copy(SyncConnection& sc, const std::string& local_path,
+                                    const std::string& remote_path, uint64_t length) {
+    unique_fd fd(adb_open(local_path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd < 0) {
+        return 0;
+    }
+
+    auto chunk_length = [length](uint64_t chunk) {
+        return std::min(kResumeCheckSize, length - chunk * kResumeCheckSize);
+    };
+    uint64_t chunks = (length + kResumeCheckSize - 1) / kResumeCheckSize;
+    uint64_t sent = 0;
+    uint64_t verified = 0;
+    bool matching = true;
+    std::vector<char> buffer(SYNC_DATA_MAX);
+    for (uint64_t chunk = 0; chunk < chunks; ++chunk) {
+        while (matching && sent < chunks && sent < chunk + kResumeCheckDepth) {
+            if (!sc.SendHashRange(remote_path, sent * kResumeCheckSize, chunk_length(sent))) {
+                matching = false;
+                break;
+            }
+            ++sent;
+        }
+        // Once a chunk differs, the hashes that have already been asked for are still read.
+        if (chunk == sent) break;
+
+        std::string remote_digest;
+        uint64_t remote_size;
+        bool hashed = sc.FinishHash(&remote_digest, &remote_size);
+        if (matching) {
+            std::string local_digest;
+            matching = hashed && remote_size == chunk_length(chunk) &&
+                       hash_local_range(fd, chunk * kResumeCheckSize, chunk_length(chunk), buffer,
+                                        &local_digest) &&
+                       local_digest == remote_digest;
+            if (matching) verified += chunk_length(chunk);
+        }
+    }
+    return verified;
+}
+
+// Pushes |lpath|, which is |size| bytes long, through the partial file that adbd keeps next to
+// |rpath| until the file is complete, carrying on from wherever an earlier push of it that was
+// cut off got to. A file that an earlier push completed is skipped.
+static bool sync_send_resumed(SyncConnection& sc, const std::string& lpath,
+                              const std::string& rpath, unsigned mtime, mode_t mode,
+                              uint64_t size) {
+    // The answers to these requests are read here rather than with the acknowledgements, so
+    // earlier files have to be acknowledged first.
+    if (!sc.ReadAcknowledgements(true)) {
+        return false;
+    }
+
+    struct stat st;
+    if (sync_lstat(sc, rpath, &st) && S_ISREG(st.st_mode) &&
+        static_cast<uint64_t>(st.st_size) == size && st.st_mtime == static_cast<time_t>(mtime)) {
+        sc.RecordFilesSkipped(1);
+        return true;
+    }
+
+    std::string partial_path = rpath + ".adbpart";
+    uint64_t offset = 0;
+    if (sync_lstat(sc, partial_path, &st) && S_ISREG(st.st_mode) && st.st_size > 0 &&
+        static_cast<uint64_t>(st.st_size) <= size) {
+        offset = verify_partial_copy(sc, lpath, partial_path, st.st_size);
+    }
+    sc.RecordBytesResumed(offset);
+
+    if (!sc.SendLargeFileResumed(rpath, mode, lpath, rpath, mtime, size, offset)) {
+        return false;
+    }
+    return sc.ReadAcknowledgements();
+}
+
+// Stat's the device's copy of |rpath|, if what it is isn't already known. That costs a round trip,
+// and earlier files have to be acknowledged first.
+static bool stat_remote_copy(SyncConnection& sc, const std::string& rpath, RemoteCopy* remote) {
+    if (*remote != RemoteCopy::Unknown) {
+        return true;
+    }
+    if (!sc.ReadAcknowledgements(true)) {
+        return false;
+    }
+    struct stat st;
+    if (!sync_lstat(sc, rpath, &st)) {
+        *remote = RemoteCopy::Missing;
+    } else {
+        *remote = S_ISREG(st.st_mode) ? RemoteCopy::Regular : RemoteCopy::Other;
+    }
+    return true;
+}
+
 static bool sync_send(SyncConnection& sc, const std::string& lpath, const std::string& rpath,
-                      unsigned mtime, mode_t mode, bool sync, bool compressed) {
+                      unsigned mtime, mode_t mode, bool sync, CompressionType compression,
+                      bool resume = false, RemoteCopy remote = RemoteCopy::Unknown) {
     if (sync) {
         struct stat st;
         if (sync_lstat(sc, rpath, &st)) {
@@ -929,6 +2222,9 @@ static bool sync_send(SyncConnection& sc, const std::string& lpath, const std::s
                 sc.RecordFilesSkipped(1);
                 return true;
             }
+            remote = S_ISREG(st.st_mode) ? RemoteCopy::Regular : RemoteCopy::Other;
+        } else {
+            remote = RemoteCopy::Missing;
         }
     }
 
@@ -954,81 +2250,482 @@ static bool sync_send(SyncConnection& sc, const std::string& lpath, const std::s
         sc.Error("failed to stat local file '%s': %s", lpath.c_str(), strerror(errno));
         return false;
     }
+    if (resume && sc.HaveResume() && S_ISREG(st.st_mode) &&
+        static_cast<uint64_t>(st.st_size) >= kMinResumableSize) {
+        return sync_send_resumed(sc, lpath, rpath, mtime, mode, st.st_size);
+    }
     if (st.st_size < SYNC_DATA_MAX) {
         std::string data;
         if (!android::base::ReadFileToString(lpath, &data, true)) {
             sc.Error("failed to read all of '%s': %s", lpath.c_str(), strerror(errno));
             return false;
         }
+        if (sc.HaveSendBundle() && S_ISREG(mode) && data.size() <= kMaxBundledFileSize) {
+            return sc.AddToBundle(rpath, mode, lpath, rpath, mtime, data.data(), data.size());
+        }
         if (!sc.SendSmallFile(rpath, mode, lpath, rpath, mtime, data.data(), data.size())) {
             return false;
         }
-    } else {
-        if (!sc.SendLargeFile(rpath, mode, lpath, rpath, mtime, compressed)) {
+        return sc.ReadAcknowledgements();
+    }
+
+    if (sc.HaveSendDelta() && st.st_size >= kMinimumDeltaSize) {
+        // Finding out what's already on the device costs a round trip, unless it's already been
+        // stat'ed, so a delta is only sent for large files, and only when there's an old version
+        // of the file to patch.
+        if (!stat_remote_copy(sc, rpath, &remote)) {
+            return false;
+        }
+        if (remote == RemoteCopy::Regular) {
+            if (!sc.SendLargeFileDelta(rpath, mode, lpath, rpath, mtime)) {
+                return false;
+            }
+            return sc.ReadAcknowledgements();
+        }
+    }
+
+    // Compressed pushes of big files are already spread over several cores by framing them, and
+    // sparse files are sent without their holes. Ranges only make a new regular file, so anything
+    // else that's already there, such as a block device, is written to as a whole file.
+    if (sc.HaveSendRange() && S_ISREG(st.st_mode) &&
+        static_cast<uint64_t>(st.st_size) >= kMinRangedPushSize &&
+        !(sc.HaveSendRecv2Sparse() && is_sparse(st)) &&
+        sc.ResolveCompressionType(compression, lpath) == CompressionType::None) {
+        if (!stat_remote_copy(sc, rpath, &remote)) {
             return false;
         }
+        if (remote != RemoteCopy::Other) {
+            return sync_send_ranged(sc, lpath, rpath, mtime, mode, st.st_size);
+        }
+    }
+
+    if (!sc.SendLargeFile(rpath, mode, lpath, rpath, mtime, compression)) {
+        return false;
     }
     return sc.ReadAcknowledgements();
 }
 
-static bool sync_recv_v1(SyncConnection& sc, const char* rpath, const char* lpath, const char* name,
-                         uint64_t expected_size) {
-    if (!sc.SendRequest(ID_RECV_V1, rpath)) return false;
+// One of the ranges of a file that's pulled over several connections at once by
+// sync_recv_ranged, or the rest of a file that sync_recv_resumed carries on with. Its data goes
+// into the local file that the caller opened, from |offset|, and the caller decides what becomes
+// of that file if the range fails.
+struct RecvRange {
+    borrowed_fd fd;
+    uint64_t offset;
+    uint64_t length;  // How many bytes of the file should arrive.
+};
+
+// Whether all of |range| arrived, if the pull is of a range.
+static bool check_recv_range(SyncConnection& sc, const char* rpath, const RecvRange* range,
+                             uint64_t bytes_copied) {
+    if (!range || bytes_copied == range->length) return true;
+    sc.Error("pulled %" PRIu64 " bytes of '%s' from offset %" PRIu64 ", expected %" PRIu64,
+             bytes_copied, rpath, range->offset, range->length);
+    return false;
+}
+
+// Creates the local file for a pull, unless the pull is of a |range| of a file that's already open.
+static bool open_recv_file(SyncConnection& sc, const char* lpath, const RecvRange* range,
+                           unique_fd* new_fd, borrowed_fd* lfd) {
+    if (range) {
+        *lfd = range->fd;
+        return true;
+    }
 
     adb_unlink(lpath);
-    unique_fd lfd(adb_creat(lpath, 0644));
-    if (lfd < 0) {
+    new_fd->reset(adb_creat(lpath, 0644));
+    if (*new_fd < 0) {
         sc.Error("cannot create '%s': %s", lpath, strerror(errno));
         return false;
     }
+    *lfd = *new_fd;
+    return true;
+}
+
+// Writes the next |length| bytes of a pulled file, which follow the |copied| bytes so far.
+static bool write_recv_data(borrowed_fd lfd, const RecvRange* range, uint64_t copied,
+                            const char* data, size_t length) {
+    if (!range) {
+        return WriteFdExactly(lfd, data, length);
+    }
+
+    uint64_t offset = range->offset + copied;
+    while (length > 0) {
+        int rc = adb_pwrite(lfd.get(), data, length, offset);
+        if (rc <= 0) {
+            if (rc == 0) errno = EIO;
+            return false;
+        }
+        data += rc;
+        length -= rc;
+        offset += rc;
+    }
+    return true;
+}
+
+// Skips a hole of |length| bytes in a pulled file. A range's writes each say where they go, and a
+// file that can't be seeked through, like a pipe, gets zeroes.
+static bool skip_recv_hole(borrowed_fd lfd, const RecvRange* range, uint64_t length,
+                           std::vector<char>& buffer) {
+    if (range || adb_lseek(lfd, length, SEEK_CUR) != -1) {
+        return true;
+    }
+
+    std::fill(buffer.begin(), buffer.end(), 0);
+    while (length > 0) {
+        size_t chunk = std::min<uint64_t>(length, buffer.size());
+        if (!WriteFdExactly(lfd, buffer.data(), chunk)) return false;
+        length -= chunk;
+    }
+    return true;
+}
+
+// Writes the last byte of a pulled file that ends in a hole, after the |copied| bytes so far, so
+// that the file comes out long enough to have the hole.
+static bool finish_recv_hole(borrowed_fd lfd, const RecvRange* range, uint64_t copied) {
+    if (!range && adb_lseek(lfd, -1, SEEK_CUR) == -1) {
+        // The zeroes have been written already.
+        return errno == ESPIPE;
+    }
+    char zero = 0;
+    return write_recv_data(lfd, range, copied - 1, &zero, 1);
+}
+
+static bool sync_finish_recv_v1(SyncConnection& sc, const char* rpath, const char* lpath,
+                                const char* name, uint64_t expected_size,
+                                const RecvRange* range = nullptr) {
+    unique_fd new_fd;
+    borrowed_fd lfd(-1);
+    if (!open_recv_file(sc, lpath, range, &new_fd, &lfd)) return false;
+    auto discard = [&]() {
+        if (!range) adb_unlink(lpath);
+    };
 
     uint64_t bytes_copied = 0;
+    bool ends_in_hole = false;
+    std::vector<char> buffer(sc.max);
     while (true) {
         syncmsg msg;
-        if (!ReadFdExactly(sc.fd, &msg.data, sizeof(msg.data))) {
-            adb_unlink(lpath);
+        if (!sc.ReadFileData(&msg.data, sizeof(msg.data))) {
+            discard();
             return false;
         }
 
-        if (msg.data.id == ID_DONE) break;
+        if (msg.data.id == ID_DONE) {
+            if (ends_in_hole && !finish_recv_hole(lfd, range, bytes_copied)) {
+                sc.Error("cannot write '%s': %s", lpath, strerror(errno));
+                discard();
+                return false;
+            }
+            break;
+        }
+
+        if (msg.data.id == ID_HOLE) {
+            if (!skip_recv_hole(lfd, range, msg.data.size, buffer)) {
+                sc.Error("cannot write '%s': %s", lpath, strerror(errno));
+                discard();
+                return false;
+            }
+            bytes_copied += msg.data.size;
+            ends_in_hole = msg.data.size > 0;
+            sc.ReportProgress(name != nullptr ? name : rpath, bytes_copied, expected_size);
+            continue;
+        }
 
         if (msg.data.id != ID_DATA) {
-            adb_unlink(lpath);
+            discard();
             sc.ReportCopyFailure(rpath, lpath, msg);
             return false;
         }
 
         if (msg.data.size > sc.max) {
             sc.Error("msg.data.size too large: %u (max %zu)", msg.data.size, sc.max);
-            adb_unlink(lpath);
+            discard();
             return false;
         }
 
-        char buffer[SYNC_DATA_MAX];
-        if (!ReadFdExactly(sc.fd, buffer, msg.data.size)) {
-            adb_unlink(lpath);
+        if (!sc.ReadFileData(buffer.data(), msg.data.size)) {
+            discard();
             return false;
         }
 
-        if (!WriteFdExactly(lfd, buffer, msg.data.size)) {
+        if (!write_recv_data(lfd, range, bytes_copied, buffer.data(), msg.data.size)) {
             sc.Error("cannot write '%s': %s", lpath, strerror(errno));
-            adb_unlink(lpath);
+            discard();
             return false;
         }
 
         bytes_copied += msg.data.size;
+        ends_in_hole = ends_in_hole && msg.data.size == 0;
+
+        sc.RecordBytesTransferred(msg.data.size);
+        sc.ReportProgress(name != nullptr ? name : rpath, bytes_copied, expected_size);
+    }
+
+    if (!check_recv_range(sc, rpath, range, bytes_copied)) return false;
+    if (!range) sc.RecordFilesTransferred(1);
+    return true;
+}
+
+static bool sync_finish_recv_v2(SyncConnection& sc, const char* rpath, const char* lpath,
+                                const char* name, uint64_t expected_size,
+                                CompressionType compression, const RecvRange* range = nullptr) {
+    unique_fd new_fd;
+    borrowed_fd lfd(-1);
+    if (!open_recv_file(sc, lpath, range, &new_fd, &lfd)) return false;
+    auto discard = [&]() {
+        if (!range) adb_unlink(lpath);
+    };
+
+    uint64_t bytes_copied = 0;
+
+    Block buffer(sc.max);
+    std::unique_ptr<Decoder> decoder =
+            CreateDecoder(compression, std::span(buffer.data(), buffer.size()));
+    bool reading = true;
+    while (reading) {
+        syncmsg msg;
+        if (!sc.ReadFileData(&msg.data, sizeof(msg.data))) {
+            discard();
+            return false;
+        }
+
+        if (msg.data.id == ID_DONE) {
+            discard();
+            sc.Error("unexpected ID_DONE");
+            return false;
+        }
+
+        if (msg.data.id != ID_DATA) {
+            discard();
+            sc.ReportCopyFailure(rpath, lpath, msg);
+            return false;
+        }
+
+        if (msg.data.size > sc.max) {
+            sc.Error("msg.data.size too large: %u (max %zu)", msg.data.size, sc.max);
+            discard();
+            return false;
+        }
+
+        Block block(msg.data.size);
+        if (!sc.ReadFileData(block.data(), msg.data.size)) {
+            discard();
+            return false;
+        }
+        decoder->Append(std::move(block));
+
+        while (true) {
+            std::span<char> output;
+            DecodeResult result = decoder->Decode(&output);
+
+            if (result == DecodeResult::Error) {
+                sc.Error("decompress failed");
+                discard();
+                return false;
+            }
+
+            if (!output.empty()) {
+                if (!write_recv_data(lfd, range, bytes_copied, output.data(), output.size())) {
+                    sc.Error("cannot write '%s': %s", lpath, strerror(errno));
+                    discard();
+                    return false;
+                }
+            }
+
+            bytes_copied += output.size();
+
+            sc.RecordBytesTransferred(msg.data.size);
+            sc.ReportProgress(name != nullptr ? name : rpath, bytes_copied, expected_size);
+
+            if (result == DecodeResult::NeedInput) {
+                break;
+            } else if (result == DecodeResult::MoreOutput) {
+                continue;
+            } else if (result == DecodeResult::Done) {
+                reading = false;
+                break;
+            } else {
+                LOG(FATAL) << "invalid DecodeResult: " << static_cast<int>(result);
+            }
+        }
+    }
+
+    // If adbd stopped compressing part way through the file, the rest of it follows as it is.
+    while (true) {
+        syncmsg msg;
+        if (!sc.ReadFileData(&msg.data, sizeof(msg.data))) {
+            sc.Error("failed to read ID_DONE");
+            discard();
+            return false;
+        }
+
+        if (msg.data.id == ID_DONE) {
+            break;
+        } else if (msg.data.id == ID_FAIL) {
+            discard();
+            sc.ReportCopyFailure(rpath, lpath, msg);
+            return false;
+        } else if (msg.data.id != ID_DATA) {
+            sc.Error("unexpected message after transfer: id = %d (expected ID_DONE)", msg.data.id);
+            discard();
+            return false;
+        }
+
+        if (msg.data.size > sc.max) {
+            sc.Error("msg.data.size too large: %u (max %zu)", msg.data.size, sc.max);
+            discard();
+            return false;
+        }
+
+        Block block(msg.data.size);
+        if (!sc.ReadFileData(block.data(), msg.data.size)) {
+            discard();
+            return false;
+        }
+
+        if (!write_recv_data(lfd, range, bytes_copied, block.data(), block.size())) {
+            sc.Error("cannot write '%s': %s", lpath, strerror(errno));
+            discard();
+            return false;
+        }
+
+        bytes_copied += block.size();
+
+        sc.RecordBytesTransferred(msg.data.size);
+        sc.ReportProgress(name != nullptr ? name : rpath, bytes_copied, expected_size);
+    }
+
+    if (!check_recv_range(sc, rpath, range, bytes_copied)) return false;
+    if (!range) sc.RecordFilesTransferred(1);
+    return true;
+}
+
+static bool sync_send_recv_request(SyncConnection& sc, const char* rpath,
+                                   CompressionType compression) {
+    compression = sc.ResolveCompressionType(compression, rpath);
+    if (compression != CompressionType::None || sc.HaveSendRecv2Sparse()) {
+        return sc.SendRecv2(rpath, compression);
+    } else {
+        return sc.SendRequest(ID_RECV_V1, rpath);
+    }
+}
+
+// Receives the response to a request sent by sync_send_recv_request. adbd answers requests in the
+// order they were sent, so several can be in flight at once.
+static bool sync_finish_recv(SyncConnection& sc, const char* rpath, const char* lpath,
+                             const char* name, uint64_t expected_size,
+                             CompressionType compression) {
+    compression = sc.ResolveCompressionType(compression, rpath);
+    if (compression != CompressionType::None) {
+        return sync_finish_recv_v2(sc, rpath, lpath, name, expected_size, compression);
+    } else {
+        return sync_finish_recv_v1(sc, rpath, lpath, name, expected_size);
+    }
+}
+
+static bool sync_recv(SyncConnection& sc, const char* rpath, const char* lpath, const char* name,
+                      uint64_t expected_size, CompressionType compression) {
+    return sync_send_recv_request(sc, rpath, compression) &&
+           sync_finish_recv(sc, rpath, lpath, name, expected_size, compression);
+}
+
+// Whether |lpath| is already a copy of a regular file of |size| bytes last modified at |mtime|, as
+// a pull with --resume leaves each file that it completes.
+static bool is_pulled_copy(const std::string& lpath, uint64_t size, int64_t mtime) {
+    struct stat st;
+    return stat(lpath.c_str(), &st) == 0 && S_ISREG(st.st_mode) &&
+           static_cast<uint64_t>(st.st_size) == size && st.st_mtime == mtime;
+}
+
+static bool should_pull_resumed(SyncConnection& sc, mode_t mode, uint64_t size) {
+    return sc.HaveResume() && sc.HaveRecvRange() && S_ISREG(mode) && size >= kMinResumableSize;
+}
+
+// Pulls |rpath|, which is |size| bytes long, into a partial file next to |lpath|, carrying on from
+// wherever an earlier pull of it that was cut off got to, and renames it into place once it's all
+// there. A pull that fails leaves the partial file behind for the next one.
+static bool sync_recv_resumed(SyncConnection& sc, const char* rpath, const char* lpath,
+                              const char* name, uint64_t size, CompressionType compression) {
+    compression = sc.ResolveCompressionType(compression, rpath);
+    std::string partial_path = std::string(lpath) + ".adbpart";
+
+    uint64_t offset = 0;
+    struct stat st;
+    if (stat(partial_path.c_str(), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+        static_cast<uint64_t>(st.st_size) <= size) {
+        offset = verify_partial_copy(sc, partial_path, rpath, st.st_size);
+    }
+
+    unique_fd lfd;
+    if (offset != 0) {
+        lfd.reset(adb_open(partial_path.c_str(), O_WRONLY | O_CLOEXEC));
+    } else {
+        adb_unlink(partial_path.c_str());
+        lfd.reset(adb_creat(partial_path.c_str(), 0644));
+    }
+    if (lfd < 0) {
+        sc.Error("cannot create '%s': %s", partial_path.c_str(), strerror(errno));
+        return false;
+    }
+    sc.RecordBytesResumed(offset);
+
+    sync_recv_range range = {.offset = offset, .length = UINT64_MAX};
+    RecvRange target = {.fd = lfd, .offset = offset, .length = size - offset};
+    bool pulled = sc.SendRecv2(rpath, compression, &range);
+    if (pulled && compression != CompressionType::None) {
+        pulled = sync_finish_recv_v2(sc, rpath, partial_path.c_str(), name, size, compression,
+                                     &target);
+    } else if (pulled) {
+        pulled = sync_finish_recv_v1(sc, rpath, partial_path.c_str(), name, size, &target);
+    }
+    if (!pulled) {
+        return false;
+    }
 
-        sc.RecordBytesTransferred(msg.data.size);
-        sc.ReportProgress(name != nullptr ? name : rpath, bytes_copied, expected_size);
+    // A file that changed since it was listed can't be pieced together from two pulls.
+    int64_t local_size = adb_lseek(lfd, 0, SEEK_END);
+    lfd.reset();
+    if (local_size < 0 || static_cast<uint64_t>(local_size) != size) {
+        sc.Error("pulled %" PRId64 " bytes of '%s', expected %" PRIu64, local_size, rpath, size);
+        adb_unlink(partial_path.c_str());
+        return false;
+    }
+    adb_unlink(lpath);
+    if (adb_rename(partial_path.c_str(), lpath) == -1) {
+        sc.Error("cannot rename '%s' to '%s': %s", partial_path.c_str(), lpath, strerror(errno));
+        return false;
     }
 
     sc.RecordFilesTransferred(1);
     return true;
 }
 
-static bool sync_recv_v2(SyncConnection& sc, const char* rpath, const char* lpath, const char* name,
-                         uint64_t expected_size) {
-    if (!sc.SendRecv2(rpath)) return false;
+// Pulls of regular files at least this big are split into ranges, each pulled over a connection of
+// its own, if adbd can send part of a file.
+static constexpr uint64_t kMinRangedPullSize = 64 * 1024 * 1024;
+static constexpr size_t kRangedPullJobs = 4;
+
+static bool should_pull_ranged(SyncConnection& sc, const struct stat& st, const char* lpath) {
+    if (!sc.HaveRecvRange() || !S_ISREG(st.st_mode) ||
+        static_cast<uint64_t>(st.st_size) < kMinRangedPullSize) {
+        return false;
+    }
+
+    // Each range is written in its place in the file, which can't be done to a pipe or a tty.
+    struct stat local_st;
+    return stat(lpath, &local_st) == -1 || S_ISREG(local_st.st_mode);
+}
+
+// Pulls |rpath|, which |st| describes, as kRangedPullJobs ranges at once, all written into the
+// same local file. The last range runs to the end of the file, whatever size it is by then, and
+// the file is stat'ed again afterwards, so that a file that changed part way through the pull is
+// reported rather than left looking like a good copy.
+static bool sync_recv_ranged(SyncConnection& sc, const char* rpath, const char* lpath,
+                             const char* name, const struct stat& st,
+                             CompressionType compression) {
+    compression = sc.ResolveCompressionType(compression, rpath);
+    uint64_t size = st.st_size;
 
     adb_unlink(lpath);
     unique_fd lfd(adb_creat(lpath, 0644));
@@ -1036,104 +2733,81 @@ static bool sync_recv_v2(SyncConnection& sc, const char* rpath, const char* lpat
         sc.Error("cannot create '%s': %s", lpath, strerror(errno));
         return false;
     }
+    auto fail = [&lfd, lpath]() {
+        lfd.reset();
+        adb_unlink(lpath);
+        return false;
+    };
 
-    uint64_t bytes_copied = 0;
-
-    Block buffer(SYNC_DATA_MAX);
-    BrotliDecoder decoder(std::span(buffer.data(), buffer.size()));
-    bool reading = true;
-    while (reading) {
-        syncmsg msg;
-        if (!ReadFdExactly(sc.fd, &msg.data, sizeof(msg.data))) {
-            adb_unlink(lpath);
-            return false;
-        }
-
-        if (msg.data.id == ID_DONE) {
-            adb_unlink(lpath);
-            sc.Error("unexpected ID_DONE");
-            return false;
-        }
-
-        if (msg.data.id != ID_DATA) {
-            adb_unlink(lpath);
-            sc.ReportCopyFailure(rpath, lpath, msg);
-            return false;
-        }
-
-        if (msg.data.size > sc.max) {
-            sc.Error("msg.data.size too large: %u (max %zu)", msg.data.size, sc.max);
-            adb_unlink(lpath);
-            return false;
-        }
-
-        Block block(msg.data.size);
-        if (!ReadFdExactly(sc.fd, block.data(), msg.data.size)) {
-            adb_unlink(lpath);
-            return false;
-        }
-        decoder.Append(std::move(block));
-
-        while (true) {
-            std::span<char> output;
-            BrotliDecodeResult result = decoder.Decode(&output);
-
-            if (result == BrotliDecodeResult::Error) {
-                sc.Error("decompress failed");
-                adb_unlink(lpath);
-                return false;
-            }
-
-            if (!output.empty()) {
-                if (!WriteFdExactly(lfd, output.data(), output.size())) {
-                    sc.Error("cannot write '%s': %s", lpath, strerror(errno));
-                    adb_unlink(lpath);
-                    return false;
-                }
-            }
-
-            bytes_copied += output.size();
+#if defined(__linux__)
+    // Allocate the whole file up front, rather than as the ranges arrive out of order. Not every
+    // filesystem can, and a failure here will show up again when the ranges are written. A file
+    // that might be sparse is left to keep its holes. The size is left for the ranges to set, so
+    // that the check of it below means something.
+    if (compression != CompressionType::None || !sc.HaveSendRecv2Sparse()) {
+        fallocate(lfd.get(), FALLOC_FL_KEEP_SIZE, 0, size);
+    }
+#endif
 
-            sc.RecordBytesTransferred(msg.data.size);
-            sc.ReportProgress(name != nullptr ? name : rpath, bytes_copied, expected_size);
+    uint64_t range_size = size / kRangedPullJobs;
+    std::atomic<bool> success = true;
+    auto pull_range = [&](SyncConnection& connection, size_t i) {
+        sync_recv_range range = {
+                .offset = i * range_size,
+                .length = i + 1 < kRangedPullJobs ? range_size : UINT64_MAX,
+        };
+        RecvRange target = {.fd = lfd,
+                            .offset = range.offset,
+                            .length = std::min(range.length, size - range.offset)};
+        bool pulled = connection.SendRecv2(rpath, compression, &range);
+        if (pulled && compression != CompressionType::None) {
+            pulled = sync_finish_recv_v2(connection, rpath, lpath, name, size, compression,
+                                         &target);
+        } else if (pulled) {
+            pulled = sync_finish_recv_v1(connection, rpath, lpath, name, size, &target);
+        }
+        if (!pulled) success = false;
+    };
 
-            if (result == BrotliDecodeResult::NeedInput) {
-                break;
-            } else if (result == BrotliDecodeResult::MoreOutput) {
-                continue;
-            } else if (result == BrotliDecodeResult::Done) {
-                reading = false;
-                break;
-            } else {
-                LOG(FATAL) << "invalid BrotliDecodeResult: " << static_cast<int>(result);
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < kRangedPullJobs; ++i) {
+        threads.emplace_back([&sc, &success, &pull_range, i]() {
+            SyncConnection connection(&sc);
+            if (!connection.IsValid()) {
+                success = false;
+                return;
             }
-        }
+            pull_range(connection, i);
+            sc.RecordWireBytes(connection.WireBytes());
+        });
     }
-
-    syncmsg msg;
-    if (!ReadFdExactly(sc.fd, &msg.data, sizeof(msg.data))) {
-        sc.Error("failed to read ID_DONE");
-        return false;
+    pull_range(sc, 0);
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    if (!success) {
+        return fail();
     }
 
-    if (msg.data.id != ID_DONE) {
-        sc.Error("unexpected message after transfer: id = %d (expected ID_DONE)", msg.data.id);
-        return false;
+    struct stat new_st;
+    if (!sync_stat_fallback(sc, rpath, &new_st)) {
+        sc.Error("failed to stat remote object '%s': %s", rpath, strerror(errno));
+        return fail();
+    }
+    if (new_st.st_size != st.st_size || new_st.st_mtime != st.st_mtime) {
+        sc.Error("'%s' changed while it was being pulled", rpath);
+        return fail();
+    }
+    int64_t local_size = adb_lseek(lfd, 0, SEEK_END);
+    if (local_size < 0 || static_cast<uint64_t>(local_size) != size) {
+        sc.Error("pulled %" PRId64 " bytes of '%s', expected %" PRIu64, local_size, rpath, size);
+        return fail();
     }
 
     sc.RecordFilesTransferred(1);
     return true;
 }
 
-static bool sync_recv(SyncConnection& sc, const char* rpath, const char* lpath, const char* name,
-                      uint64_t expected_size, bool compressed) {
-    if (sc.HaveSendRecv2() && compressed) {
-        return sync_recv_v2(sc, rpath, lpath, name, expected_size);
-    } else {
-        return sync_recv_v1(sc, rpath, lpath, name, expected_size);
-    }
-}
-
 bool do_sync_ls(const char* path) {
     SyncConnection sc;
     if (!sc.IsValid()) return false;
@@ -1209,8 +2883,313 @@ static bool is_root_dir(std::string_view path) {
     return true;
 }
 
+// SHA-256 digests of the files in a local tree. They're kept in the .android directory between
+// runs, and are reused for as long as a file's size and mtime stay the same. Entries that a run
+// didn't use are dropped when their files are gone, or when there are more than kMaxEntries.
+class LocalDigestCache {
+  public:
+    static constexpr size_t kMaxEntries = 100000;
+
+    explicit LocalDigestCache(const std::string& root) {
+        std::string root_digest(SHA256_DIGEST_LENGTH, '\0');
+        SHA256(reinterpret_cast<const uint8_t*>(root.data()), root.size(),
+               reinterpret_cast<uint8_t*>(root_digest.data()));
+
+        std::string dir = adb_get_android_dir_path() + OS_PATH_SEPARATOR + "sync_digests";
+        adb_mkdir(dir, 0750);
+        std::string name = adb::tls::SHA256BitsToHexString(root_digest).substr(0, 16);
+        path_ = dir + OS_PATH_SEPARATOR + name;
+        Load();
+    }
+
+    ~LocalDigestCache() {
+        Prune();
+        if (dirty_) Save();
+    }
+
+    // Hashes the files in |files| that don't have an up to date digest yet, several at a time.
+    void Update(const std::vector<copyinfo*>& files) {
+        std::vector<const copyinfo*> stale;
+        for (const copyinfo* ci : files) {
+            auto it = entries_.find(ci->lpath);
+            if (it == entries_.end() || it->second.size != ci->size ||
+                it->second.mtime != ci->time) {
+                stale.push_back(ci);
+            } else {
+                it->second.used = true;
+            }
+        }
+        if (stale.empty()) return;
+
+        std::vector<std::string> digests(stale.size());
+        std::atomic<size_t> next = 0;
+        auto hash_files = [&]() {
+            for (size_t i = next++; i < stale.size(); i = next++) {
+                digests[i] = HashFile(stale[i]->lpath);
+            }
+        };
+        size_t thread_count = std::min<size_t>(
+                {stale.size(), 8, std::max<size_t>(1, std::thread::hardware_concurrency())});
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < thread_count; ++i) {
+            threads.emplace_back(hash_files);
+        }
+        hash_files();
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+
+        for (size_t i = 0; i < stale.size(); ++i) {
+            if (digests[i].empty()) {
+                entries_.erase(stale[i]->lpath);
+            } else {
+                entries_[stale[i]->lpath] = {stale[i]->size, stale[i]->time, std::move(digests[i]),
+                                             true};
+            }
+        }
+        dirty_ = true;
+    }
+
+    // Returns the digest of a file passed to Update, or the empty string if it couldn't be read.
+    std::string Digest(const copyinfo& ci) const {
+        auto it = entries_.find(ci.lpath);
+        if (it == entries_.end() || it->second.size != ci.size || it->second.mtime != ci.time) {
+            return "";
+        }
+        return it->second.digest;
+    }
+
+  private:
+    struct Entry {
+        uint64_t size;
+        int64_t mtime;
+        std::string digest;
+        bool used = false;  // By this run.
+    };
+
+    static std::string HashFile(const std::string& path) {
+        unique_fd fd(adb_open(path.c_str(), O_RDONLY | O_CLOEXEC));
+        if (fd < 0) return "";
+
+        SHA256_CTX ctx;
+        SHA256_Init(&ctx);
+        std::vector<char> buffer(SYNC_DATA_MAX);
+        while (true) {
+            int rc = adb_read(fd, buffer.data(), buffer.size());
+            if (rc < 0) return "";
+            if (rc == 0) break;
+            SHA256_Update(&ctx, buffer.data(), rc);
+        }
+
+        std::string digest(SHA256_DIGEST_LENGTH, '\0');
+        SHA256_Final(reinterpret_cast<uint8_t*>(digest.data()), &ctx);
+        return digest;
+    }
+
+    void Prune() {
+        for (auto it = entries_.begin(); it != entries_.end();) {
+            struct stat st;
+            if (!it->second.used &&
+                (entries_.size() > kMaxEntries || stat(it->first.c_str(), &st) != 0)) {
+                it = entries_.erase(it);
+                dirty_ = true;
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    // The cache is a text file with a "<digest> <size> <mtime> <path>" line per file.
+    void Load() {
+        std::string content;
+        if (!android::base::ReadFileToString(path_, &content)) return;
+
+        for (const std::string& line : android::base::Split(content, "\n")) {
+            std::vector<std::string> fields = android::base::Split(line, " ");
+            if (fields.size() < 4) continue;
+
+            std::optional<std::string> digest = adb::tls::SHA256HexStringToBits(fields[0]);
+            Entry entry;
+            if (!digest || !android::base::ParseUint(fields[1], &entry.size) ||
+                !android::base::ParseInt(fields[2], &entry.mtime)) {
+                continue;
+            }
+            entry.digest = std::move(*digest);
+
+            // Paths can contain spaces, but not newlines.
+            std::string path = android::base::Join(
+                    std::vector<std::string>(fields.begin() + 3, fields.end()), " ");
+            entries_[std::move(path)] = std::move(entry);
+        }
+    }
+
+    void Save() {
+        std::string content;
+        for (const auto& [path, entry] : entries_) {
+            if (path.find('\n') != std::string::npos) continue;
+            std::string digest = adb::tls::SHA256BitsToHexString(entry.digest);
+            content += android::base::StringPrintf("%s %" PRIu64 " %" PRId64 " %s\n",
+                                                   digest.c_str(), entry.size, entry.mtime,
+                                                   path.c_str());
+        }
+        std::string tmp_path = path_ + ".tmp";
+        if (android::base::WriteStringToFile(content, tmp_path)) {
+            adb_rename(tmp_path.c_str(), path_.c_str());
+        }
+    }
+
+    std::string path_;
+    std::unordered_map<std::string, Entry> entries_;
+    bool dirty_ = false;
+};
+
+// Gives the device's copies of |files| the local files' timestamps, so that the next sync can skip
+// them without hashing them again. There's no sync request for that, so it's done with touch, when
+// the shell can be trusted with long commands.
+static void set_remote_mtimes(SyncConnection& sc, const std::vector<copyinfo*>& files) {
+    if (files.empty() || !CanUseFeature(sc.Features(), kFeatureShell2)) {
+        return;
+    }
+
+    SilentStandardStreamsCallbackInterface cb;
+    std::string cmd;
+    for (const copyinfo* ci : files) {
+        // Every version of toybox's touch takes this format, with the Z for UTC.
+        time_t mtime = ci->time;
+        char date[32];
+        strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&mtime));
+        std::string touch = android::base::StringPrintf("touch -c -m -d %s %s;", date,
+                                                        escape_arg(ci->rpath).c_str());
+        if (!cmd.empty() && cmd.size() + touch.size() > 32768) {
+            send_shell_command(cmd, false, &cb);
+            cmd.clear();
+        }
+        cmd += touch;
+    }
+    send_shell_command(cmd, false, &cb);
+}
+
+// Marks the files in |files| that are identical on the device as skipped, by comparing the
+// digests adbd computes with those of the local files.
+static bool skip_identical_files(SyncConnection& sc, const std::string& lpath,
+                                 const std::vector<copyinfo*>& files) {
+    if (!sc.HaveHashBatch()) {
+        sc.Warning("device doesn't support checksums, comparing timestamps instead");
+        return true;
+    }
+
+    LocalDigestCache cache(lpath);
+    std::vector<copyinfo*> identical;
+    for (size_t i = 0; i < files.size(); i += SYNC_HASH_BATCH_MAX) {
+        size_t end = std::min(files.size(), i + SYNC_HASH_BATCH_MAX);
+        std::vector<copyinfo*> batch(files.begin() + i, files.begin() + end);
+        std::vector<std::string> paths;
+        for (const copyinfo* ci : batch) {
+            paths.push_back(ci->rpath);
+        }
+        if (!sc.SendHashBatch(paths)) {
+            sc.Error("failed to send hash request");
+            return false;
+        }
+
+        // Hash the local files while adbd is hashing the remote ones.
+        cache.Update(batch);
+
+        for (copyinfo* ci : batch) {
+            std::string remote_digest;
+            uint64_t remote_size;
+            if (sc.FinishHash(&remote_digest, &remote_size) && remote_size == ci->size &&
+                remote_digest == cache.Digest(*ci)) {
+                ci->skip = true;
+                identical.push_back(ci);
+            }
+        }
+    }
+    set_remote_mtimes(sc, identical);
+    return true;
+}
+
+// Splits the files that need pushing into at most |count| shards of about the same cost, by handing
+// each file, largest first, to the cheapest shard so far. Every file also costs a fixed amount, so
+// that a shard of many small files isn't mistaken for a cheap one.
+static std::vector<std::vector<const copyinfo*>> shard_file_list(
+        const std::vector<copyinfo>& file_list, size_t count) {
+    static constexpr uint64_t kPerFileCost = 64 * 1024;
+
+    std::vector<const copyinfo*> files;
+    for (const copyinfo& ci : file_list) {
+        if (!ci.skip) files.push_back(&ci);
+    }
+    std::stable_sort(files.begin(), files.end(),
+                     [](const copyinfo* a, const copyinfo* b) { return a->size > b->size; });
+
+    std::vector<std::vector<const copyinfo*>> shards(std::min(count, files.size()));
+    using ShardCost = std::pair<uint64_t, size_t>;
+    std::priority_queue<ShardCost, std::vector<ShardCost>, std::greater<ShardCost>> costs;
+    for (size_t i = 0; i < shards.size(); ++i) {
+        costs.emplace(0, i);
+    }
+    for (const copyinfo* ci : files) {
+        auto [cost, i] = costs.top();
+        costs.pop();
+        shards[i].push_back(ci);
+        costs.emplace(cost + ci->size + kPerFileCost, i);
+    }
+    return shards;
+}
+
+// Pushes the files in |file_list| over |jobs| connections at once: |sc| itself, and jobs - 1 more
+// that report their progress through it.
+static bool sync_send_parallel(SyncConnection& sc, const std::vector<copyinfo>& file_list,
+                               size_t jobs, CompressionType compression, bool resume) {
+    std::vector<std::vector<const copyinfo*>> shards = shard_file_list(file_list, jobs);
+    std::atomic<bool> success = true;
+
+    auto send_shard = [&success, compression, resume](SyncConnection& connection,
+                                                      const std::vector<const copyinfo*>& shard) {
+        for (const copyinfo* ci : shard) {
+            if (!success) return;
+            auto start = connection.StartFile();
+            if (!sync_send(connection, ci->lpath, ci->rpath, ci->time, ci->mode, false,
+                           compression, resume, ci->remote)) {
+                success = false;
+                return;
+            }
+            connection.RecordFileStats(start, ci->rpath, ci->size);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < shards.size(); ++i) {
+        threads.emplace_back([&sc, &shards, &success, &send_shard, i]() {
+            SyncConnection connection(&sc);
+            if (!connection.IsValid()) {
+                success = false;
+                return;
+            }
+            send_shard(connection, shards[i]);
+            if (!connection.ReadAcknowledgements(true)) {
+                success = false;
+            }
+        });
+    }
+
+    if (!shards.empty()) {
+        send_shard(sc, shards[0]);
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    return success;
+}
+
+// With |checksum|, files of the same size whose timestamps differ are compared by content. With
+// |resume|, the timestamps are checked too, since they're how the files that an interrupted push
+// completed are told apart.
 static bool copy_local_dir_remote(SyncConnection& sc, std::string lpath, std::string rpath,
-                                  bool check_timestamps, bool list_only, bool compressed) {
+                                  bool check_timestamps, bool list_only,
+                                  CompressionType compression, size_t jobs = 1,
+                                  bool checksum = false, bool resume = false) {
     sc.NewTransfer();
 
     // Make sure that both directory paths end in a slash.
@@ -1227,6 +3206,7 @@ static bool copy_local_dir_remote(SyncConnection& sc, std::string lpath, std::st
     std::reverse(directory_list.begin(), directory_list.end());
 
     int skipped = 0;
+    auto list_start = std::chrono::steady_clock::now();
     if (!local_build_list(sc, &file_list, &directory_list, lpath, rpath)) {
         return false;
     }
@@ -1268,33 +3248,84 @@ static bool copy_local_dir_remote(SyncConnection& sc, std::string lpath, std::st
         }
     }
 
-    if (check_timestamps) {
-        for (const copyinfo& ci : file_list) {
-            if (!sc.SendLstat(ci.rpath)) {
-                sc.Error("failed to send lstat");
-                return false;
-            }
-        }
-        for (copyinfo& ci : file_list) {
+    if (check_timestamps || resume) {
+        std::vector<copyinfo*> checksum_candidates;
+        auto check_timestamp = [&](copyinfo& ci) {
             struct stat st;
-            if (sc.FinishStat(&st)) {
-                if (st.st_size == static_cast<off_t>(ci.size) && st.st_mtime == ci.time) {
-                    ci.skip = true;
+            if (!sc.FinishStat(&st)) {
+                ci.remote = RemoteCopy::Missing;
+            } else {
+                ci.remote = S_ISREG(st.st_mode) ? RemoteCopy::Regular : RemoteCopy::Other;
+                if (st.st_size == static_cast<off_t>(ci.size)) {
+                    if (st.st_mtime == ci.time) {
+                        ci.skip = true;
+                    } else if (checksum && !ci.skip) {
+                        checksum_candidates.push_back(&ci);
+                    }
+                }
+            }
+        };
+
+        if (sc.HaveStatBatch()) {
+            // Each batch is answered before the next is sent, so that neither side can block on
+            // a full socket while the other is doing the same.
+            for (size_t i = 0; i < file_list.size(); i += SYNC_STAT_BATCH_MAX) {
+                size_t end = std::min(file_list.size(), i + SYNC_STAT_BATCH_MAX);
+                std::vector<std::string> paths;
+                for (size_t j = i; j < end; ++j) {
+                    paths.push_back(file_list[j].rpath);
+                }
+                if (!sc.SendStatBatch(paths, true)) {
+                    sc.Error("failed to send lstat");
+                    return false;
+                }
+                for (size_t j = i; j < end; ++j) {
+                    check_timestamp(file_list[j]);
+                }
+            }
+        } else {
+            for (const copyinfo& ci : file_list) {
+                if (!sc.SendLstat(ci.rpath)) {
+                    sc.Error("failed to send lstat");
+                    return false;
                 }
             }
+            for (copyinfo& ci : file_list) {
+                check_timestamp(ci);
+            }
+        }
+
+        if (!checksum_candidates.empty() &&
+            !skip_identical_files(sc, lpath, checksum_candidates)) {
+            return false;
         }
     }
+    sc.RecordPhase(SyncPhase::List, list_start);
 
     sc.ComputeExpectedTotalBytes(file_list);
 
+    if (jobs > 1 && !list_only) {
+        for (const copyinfo& ci : file_list) {
+            if (ci.skip) skipped++;
+        }
+        sc.RecordFilesSkipped(skipped);
+        bool success = sync_send_parallel(sc, file_list, jobs, compression, resume);
+        success &= sc.ReadAcknowledgements(true);
+        sc.ReportTransferRate(lpath, TransferDirection::push);
+        return success;
+    }
+
     for (const copyinfo& ci : file_list) {
         if (!ci.skip) {
             if (list_only) {
                 sc.Println("would push: %s -> %s", ci.lpath.c_str(), ci.rpath.c_str());
             } else {
-                if (!sync_send(sc, ci.lpath, ci.rpath, ci.time, ci.mode, false, compressed)) {
+                auto start = sc.StartFile();
+                if (!sync_send(sc, ci.lpath, ci.rpath, ci.time, ci.mode, false, compression,
+                               resume, ci.remote)) {
                     return false;
                 }
+                sc.RecordFileStats(start, ci.rpath, ci.size);
             }
         } else {
             skipped++;
@@ -1308,10 +3339,14 @@ static bool copy_local_dir_remote(SyncConnection& sc, std::string lpath, std::st
 }
 
 bool do_sync_push(const std::vector<const char*>& srcs, const char* dst, bool sync,
-                  bool compressed) {
+                  CompressionType compression, size_t jobs, bool checksum, bool resume) {
     SyncConnection sc;
     if (!sc.IsValid()) return false;
 
+    if (resume && !sc.HaveResume()) {
+        sc.Warning("device doesn't support resuming, pushing whole files");
+    }
+
     bool success = true;
     bool dst_exists;
     bool dst_isdir;
@@ -1373,7 +3408,8 @@ bool do_sync_push(const std::vector<const char*>& srcs, const char* dst, bool sy
                 dst_dir.append(android::base::Basename(src_path));
             }
 
-            success &= copy_local_dir_remote(sc, src_path, dst_dir, sync, false, compressed);
+            success &= copy_local_dir_remote(sc, src_path, dst_dir, sync, false, compression, jobs,
+                                             checksum, resume);
             continue;
         } else if (!should_push_file(st.st_mode)) {
             sc.Warning("skipping special file '%s' (mode = 0o%o)", src_path, st.st_mode);
@@ -1394,7 +3430,13 @@ bool do_sync_push(const std::vector<const char*>& srcs, const char* dst, bool sy
 
         sc.NewTransfer();
         sc.SetExpectedTotalBytes(st.st_size);
-        success &= sync_send(sc, src_path, dst_path, st.st_mtime, st.st_mode, sync, compressed);
+        auto start = sc.StartFile();
+        if (sync_send(sc, src_path, dst_path, st.st_mtime, st.st_mode, sync, compression,
+                      resume)) {
+            sc.RecordFileStats(start, dst_path, st.st_size);
+        } else {
+            success = false;
+        }
         sc.ReportTransferRate(src_path, TransferDirection::push);
     }
 
@@ -1403,8 +3445,36 @@ bool do_sync_push(const std::vector<const char*>& srcs, const char* dst, bool sy
     return success;
 }
 
+// Builds the same list as remote_build_list with a single request, by having adbd walk the tree.
+static bool remote_build_list_recursive(SyncConnection& sc, std::vector<copyinfo>* file_list,
+                                        const std::string& rpath, const std::string& lpath) {
+    copyinfo ci(android::base::Dirname(lpath), android::base::Dirname(rpath),
+                android::base::Basename(lpath), S_IFDIR);
+    file_list->push_back(ci);
+
+    // adbd follows symbolic links itself, and sends each directory before its contents.
+    auto callback = [&](unsigned mode, uint64_t size, uint64_t time, const char* name) {
+        copyinfo ci(lpath, rpath, name, mode);
+        if (!S_ISDIR(mode)) {
+            if (!should_pull_file(ci.mode)) {
+                sc.Warning("skipping special file '%s' (mode = 0o%o)", ci.rpath.c_str(), ci.mode);
+                ci.skip = true;
+            }
+            ci.time = time;
+            ci.size = size;
+        }
+        file_list->push_back(ci);
+    };
+
+    return sc.SendListRecursive(rpath) && sc.FinishListRecursive(callback);
+}
+
 static bool remote_build_list(SyncConnection& sc, std::vector<copyinfo>* file_list,
                               const std::string& rpath, const std::string& lpath) {
+    if (sc.HaveListRecursive()) {
+        return remote_build_list_recursive(sc, file_list, rpath, lpath);
+    }
+
     std::vector<copyinfo> dirlist;
     std::vector<copyinfo> linklist;
 
@@ -1466,10 +3536,14 @@ static bool remote_build_list(SyncConnection& sc, std::vector<copyinfo>* file_li
     return true;
 }
 
+static int set_time(const std::string& lpath, time_t time) {
+    struct utimbuf times = { time, time };
+    return utime(lpath.c_str(), &times);
+}
+
 static int set_time_and_mode(const std::string& lpath, time_t time,
                              unsigned int mode) {
-    struct utimbuf times = { time, time };
-    int r1 = utime(lpath.c_str(), &times);
+    int r1 = set_time(lpath, time);
 
     /* use umask for permissions */
     mode_t mask = umask(0000);
@@ -1479,8 +3553,15 @@ static int set_time_and_mode(const std::string& lpath, time_t time,
     return r1 ? r1 : r2;
 }
 
+// Bounds on the RECV requests that copy_remote_dir_local keeps in flight.
+static constexpr size_t kMaxPipelinedRecvFiles = 64;
+static constexpr uint64_t kMaxPipelinedRecvBytes = 1024 * 1024;
+
+// With |resume|, files that are already there with the same size and timestamp are skipped, and
+// each file that's pulled is given its timestamp so that a later pull can do the same.
 static bool copy_remote_dir_local(SyncConnection& sc, std::string rpath, std::string lpath,
-                                  bool copy_attrs, bool compressed) {
+                                  bool copy_attrs, CompressionType compression,
+                                  bool resume = false) {
     sc.NewTransfer();
 
     // Make sure that both directory paths end in a slash.
@@ -1489,13 +3570,52 @@ static bool copy_remote_dir_local(SyncConnection& sc, std::string rpath, std::st
 
     // Recursively build the list of files to copy.
     sc.Printf("pull: building file list...");
+    auto list_start = std::chrono::steady_clock::now();
     std::vector<copyinfo> file_list;
     if (!remote_build_list(sc, &file_list, rpath, lpath)) {
         return false;
     }
 
+    if (resume) {
+        for (copyinfo& ci : file_list) {
+            if (!S_ISDIR(ci.mode) && is_pulled_copy(ci.lpath, ci.size, ci.time)) {
+                ci.skip = true;
+            }
+        }
+    }
+    sc.RecordPhase(SyncPhase::List, list_start);
+
     sc.ComputeExpectedTotalBytes(file_list);
 
+    // Keep requests for the files after the one being received in flight, so that pulling lots of
+    // small files isn't dominated by round trips. There's always at least one request in flight,
+    // however large its file is, except that a file that's resumed makes requests of its own, so
+    // none are sent past it until it's done.
+    size_t next_request = 0;
+    size_t files_in_flight = 0;
+    uint64_t bytes_in_flight = 0;
+    auto send_requests = [&]() {
+        for (; next_request < file_list.size(); ++next_request) {
+            const copyinfo& ci = file_list[next_request];
+            if (ci.skip || S_ISDIR(ci.mode)) {
+                continue;
+            }
+            if (resume && should_pull_resumed(sc, ci.mode, ci.size)) {
+                break;
+            }
+            if (files_in_flight != 0 && (files_in_flight == kMaxPipelinedRecvFiles ||
+                                         bytes_in_flight + ci.size > kMaxPipelinedRecvBytes)) {
+                break;
+            }
+            if (!sync_send_recv_request(sc, ci.rpath.c_str(), compression)) {
+                return false;
+            }
+            ++files_in_flight;
+            bytes_in_flight += ci.size;
+        }
+        return true;
+    };
+
     int skipped = 0;
     for (const copyinfo &ci : file_list) {
         if (!ci.skip) {
@@ -1510,12 +3630,30 @@ static bool copy_remote_dir_local(SyncConnection& sc, std::string rpath, std::st
                 continue;
             }
 
-            if (!sync_recv(sc, ci.rpath.c_str(), ci.lpath.c_str(), nullptr, ci.size, compressed)) {
+            auto start = sc.StartFile();
+            if (!send_requests()) {
                 return false;
             }
+            if (resume && should_pull_resumed(sc, ci.mode, ci.size)) {
+                if (!sync_recv_resumed(sc, ci.rpath.c_str(), ci.lpath.c_str(), nullptr, ci.size,
+                                       compression)) {
+                    return false;
+                }
+                ++next_request;
+            } else {
+                if (!sync_finish_recv(sc, ci.rpath.c_str(), ci.lpath.c_str(), nullptr, ci.size,
+                                      compression)) {
+                    return false;
+                }
+                --files_in_flight;
+                bytes_in_flight -= ci.size;
+            }
+            sc.RecordFileStats(start, ci.rpath, ci.size);
 
             if (copy_attrs && set_time_and_mode(ci.lpath, ci.time, ci.mode)) {
                 return false;
+            } else if (resume && set_time(ci.lpath, ci.time)) {
+                return false;
             }
         } else {
             skipped++;
@@ -1528,10 +3666,14 @@ static bool copy_remote_dir_local(SyncConnection& sc, std::string rpath, std::st
 }
 
 bool do_sync_pull(const std::vector<const char*>& srcs, const char* dst, bool copy_attrs,
-                  bool compressed, const char* name) {
+                  CompressionType compression, const char* name, bool resume) {
     SyncConnection sc;
     if (!sc.IsValid()) return false;
 
+    if (resume && !(sc.HaveResume() && sc.HaveRecvRange())) {
+        sc.Warning("device doesn't support resuming, pulling whole files");
+    }
+
     bool success = true;
     struct stat st;
     bool dst_exists = true;
@@ -1602,7 +3744,8 @@ bool do_sync_pull(const std::vector<const char*>& srcs, const char* dst, bool co
                 dst_dir.append(android::base::Basename(src_path));
             }
 
-            success &= copy_remote_dir_local(sc, src_path, dst_dir, copy_attrs, compressed);
+            success &= copy_remote_dir_local(sc, src_path, dst_dir, copy_attrs, compression,
+                                             resume);
             continue;
         } else if (!should_pull_file(src_st.st_mode)) {
             sc.Warning("skipping special file '%s' (mode = 0o%o)", src_path, src_st.st_mode);
@@ -1621,14 +3764,32 @@ bool do_sync_pull(const std::vector<const char*>& srcs, const char* dst, bool co
 
         sc.NewTransfer();
         sc.SetExpectedTotalBytes(src_st.st_size);
-        if (!sync_recv(sc, src_path, dst_path, name, src_st.st_size, compressed)) {
+        if (resume && is_pulled_copy(dst_path, src_st.st_size, src_st.st_mtime)) {
+            sc.RecordFilesSkipped(1);
+            sc.ReportTransferRate(src_path, TransferDirection::pull);
+            continue;
+        }
+        auto start = sc.StartFile();
+        bool pulled;
+        if (resume && should_pull_resumed(sc, src_st.st_mode, src_st.st_size)) {
+            pulled = sync_recv_resumed(sc, src_path, dst_path, name, src_st.st_size, compression);
+        } else if (should_pull_ranged(sc, src_st, dst_path)) {
+            pulled = sync_recv_ranged(sc, src_path, dst_path, name, src_st, compression);
+        } else {
+            pulled = sync_recv(sc, src_path, dst_path, name, src_st.st_size, compression);
+        }
+        if (!pulled) {
             success = false;
             continue;
         }
+        sc.RecordFileStats(start, src_path, src_st.st_size);
 
         if (copy_attrs && set_time_and_mode(dst_path, src_st.st_mtime, src_st.st_mode) != 0) {
             success = false;
             continue;
+        } else if (resume && set_time(dst_path, src_st.st_mtime) != 0) {
+            success = false;
+            continue;
         }
         sc.ReportTransferRate(src_path, TransferDirection::pull);
     }
@@ -1638,11 +3799,12 @@ bool do_sync_pull(const std::vector<const char*>& srcs, const char* dst, bool co
 }
 
 bool do_sync_sync(const std::string& lpath, const std::string& rpath, bool list_only,
-                  bool compressed) {
+                  CompressionType compression, bool checksum) {
     SyncConnection sc;
     if (!sc.IsValid()) return false;
 
-    bool success = copy_local_dir_remote(sc, lpath, rpath, true, list_only, compressed);
+    bool success =
+            copy_local_dir_remote(sc, lpath, rpath, true, list_only, compression, 1, checksum);
     if (!list_only) {
         sc.ReportOverallTransferRate(TransferDirection::push);
     }
@@ -19,11 +19,20 @@
 #include <string>
 #include <vector>
 
+#include "file_sync_protocol.h"
+
 bool do_sync_ls(const char* path);
+// Directories are pushed over |jobs| sync connections at once. With |sync| and |checksum|, files
+// that only differ from the device's copy in their timestamp are compared by content. With
+// |resume|, files that an interrupted push already copied are skipped, and big files that it was
+// part way through are carried on with.
 bool do_sync_push(const std::vector<const char*>& srcs, const char* dst, bool sync,
-                  bool compressed);
+                  CompressionType compression, size_t jobs = 1, bool checksum = false,
+                  bool resume = false);
+// With |resume|, pulled files keep their timestamps, so that a later pull can skip them, and big
+// files that an interrupted pull was part way through are carried on with.
 bool do_sync_pull(const std::vector<const char*>& srcs, const char* dst, bool copy_attrs,
-                  bool compressed, const char* name = nullptr);
+                  CompressionType compression, const char* name = nullptr, bool resume = false);
 
 bool do_sync_sync(const std::string& lpath, const std::string& rpath, bool list_only,
-                  bool compressed);
+                  CompressionType compression, bool checksum = false);
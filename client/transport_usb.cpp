@@ -20,10 +20,17 @@
 
 #include "client/usb.h"
 
+#include <atomic>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <android-base/stringprintf.h>
 
 #include "sysdeps.h"
 #include "transport.h"
+#include "usb_endpoint_pairs.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -41,7 +48,7 @@
 
 // Call usb_read using a buffer having a multiple of usb_get_max_packet_size() bytes
 // to avoid overflow. See http://libusb.sourceforge.net/api-1.0/packetoverflow.html.
-static int UsbReadMessage(usb_handle* h, amessage* msg) {
+static int UsbReadMessage(usb_handle* h, size_t pair, amessage* msg) {
     D("UsbReadMessage");
 
 #if CHECK_PACKET_OVERFLOW
@@ -50,7 +57,7 @@ static int UsbReadMessage(usb_handle* h, amessage* msg) {
     CHECK_LT(usb_packet_size, 4096ULL);
 
     char buffer[4096];
-    int n = usb_read(h, buffer, usb_packet_size);
+    int n = usb_read_pair(h, pair, buffer, usb_packet_size);
     if (n != sizeof(*msg)) {
         D("usb_read returned unexpected length %d (expected %zu)", n, sizeof(*msg));
         return -1;
@@ -58,13 +65,13 @@ static int UsbReadMessage(usb_handle* h, amessage* msg) {
     memcpy(msg, buffer, sizeof(*msg));
     return n;
 #else
-    return usb_read(h, msg, sizeof(*msg));
+    return usb_read_pair(h, pair, msg, sizeof(*msg));
 #endif
 }
 
 // Call usb_read using a buffer having a multiple of usb_get_max_packet_size() bytes
 // to avoid overflow. See http://libusb.sourceforge.net/api-1.0/packetoverflow.html.
-static int UsbReadPayload(usb_handle* h, apacket* p) {
+static int UsbReadPayload(usb_handle* h, size_t pair, apacket* p) {
     D("UsbReadPayload(%d)", p->msg.data_length);
 
     if (p->msg.data_length > MAX_PAYLOAD) {
@@ -84,7 +91,7 @@ static int UsbReadPayload(usb_handle* h, apacket* p) {
     }
 
     p->payload.resize(len);
-    int rc = usb_read(h, &p->payload[0], p->payload.size());
+    int rc = usb_read_pair(h, pair, &p->payload[0], p->payload.size());
     if (rc != static_cast<int>(p->msg.data_length)) {
         return -1;
     }
@@ -93,12 +100,12 @@ static int UsbReadPayload(usb_handle* h, apacket* p) {
     return rc;
 #else
     p->payload.resize(p->msg.data_length);
-    return usb_read(h, &p->payload[0], p->payload.size());
+    return usb_read_pair(h, pair, &p->payload[0], p->payload.size());
 #endif
 }
 
-static int remote_read(apacket* p, usb_handle* usb) {
-    int n = UsbReadMessage(usb, &p->msg);
+static int remote_read(apacket* p, usb_handle* usb, size_t pair) {
+    int n = UsbReadMessage(usb, pair, &p->msg);
     if (n < 0) {
         D("remote usb: read terminated (message)");
         return -1;
@@ -108,7 +115,7 @@ static int remote_read(apacket* p, usb_handle* usb) {
         return -1;
     }
     if (p->msg.data_length) {
-        n = UsbReadPayload(usb, p);
+        n = UsbReadPayload(usb, pair, p);
         if (n < 0) {
             D("remote usb: terminated (data)");
             return -1;
@@ -126,8 +133,8 @@ static int remote_read(apacket* p, usb_handle* usb) {
 
 // On Android devices, we rely on the kernel to provide buffered read.
 // So we can recover automatically from EOVERFLOW.
-static int remote_read(apacket* p, usb_handle* usb) {
-    if (usb_read(usb, &p->msg, sizeof(amessage)) != sizeof(amessage)) {
+static int remote_read(apacket* p, usb_handle* usb, size_t pair) {
+    if (usb_read_pair(usb, pair, &p->msg, sizeof(amessage)) != sizeof(amessage)) {
         PLOG(ERROR) << "remote usb: read terminated (message)";
         return -1;
     }
@@ -139,7 +146,7 @@ static int remote_read(apacket* p, usb_handle* usb) {
         }
 
         p->payload.resize(p->msg.data_length);
-        if (usb_read(usb, &p->payload[0], p->payload.size()) !=
+        if (usb_read_pair(usb, pair, &p->payload[0], p->payload.size()) !=
             static_cast<int>(p->payload.size())) {
             PLOG(ERROR) << "remote usb: terminated (data)";
             return -1;
@@ -151,23 +158,26 @@ static int remote_read(apacket* p, usb_handle* usb) {
 #endif
 
 UsbConnection::~UsbConnection() {
-    usb_close(handle_);
+    if (pair_ == 0) {
+        usb_close(handle_);
+    }
 }
 
 bool UsbConnection::Read(apacket* packet) {
-    int rc = remote_read(packet, handle_);
+    int rc = remote_read(packet, handle_, pair_);
     return rc == 0;
 }
 
 bool UsbConnection::Write(apacket* packet) {
     int size = packet->msg.data_length;
 
-    if (usb_write(handle_, &packet->msg, sizeof(packet->msg)) != sizeof(packet->msg)) {
+    if (usb_write_pair(handle_, pair_, &packet->msg, sizeof(packet->msg)) != sizeof(packet->msg)) {
         PLOG(ERROR) << "remote usb: 1 - write terminated";
         return false;
     }
 
-    if (packet->msg.data_length != 0 && usb_write(handle_, packet->payload.data(), size) != size) {
+    if (packet->msg.data_length != 0 &&
+        usb_write_pair(handle_, pair_, packet->payload.data(), size) != size) {
         PLOG(ERROR) << "remote usb: 2 - write terminated";
         return false;
     }
@@ -190,10 +200,83 @@ void UsbConnection::Close() {
     usb_kick(handle_);
 }
 
+// A USB connection that's spread over several bulk endpoint pairs, each of which is driven by a
+// BlockingConnectionAdapter of its own. Everything goes over pair 0 until the device says that it
+// supports kFeatureUsbEndpointPairs.
+struct UsbEndpointPairsConnection : public Connection {
+    UsbEndpointPairsConnection(usb_handle* handle, size_t pair_count)
+        : router_(pair_count, true) {
+        for (size_t pair = 0; pair < pair_count; ++pair) {
+            pairs_.push_back(std::make_unique<BlockingConnectionAdapter>(
+                    std::make_unique<UsbConnection>(handle, pair)));
+        }
+    }
+
+    ~UsbEndpointPairsConnection() {
+        Stop();
+
+        // Pair 0 owns the handle, so it has to be destroyed last.
+        while (!pairs_.empty()) {
+            pairs_.pop_back();
+        }
+    }
+
+    bool Write(std::unique_ptr<apacket> packet) override final {
+        size_t pair = enabled_ ? router_.RouteOutgoing(*packet) : 0;
+        return pairs_[pair]->Write(std::move(packet));
+    }
+
+    void Start() override final {
+        for (size_t pair = 0; pair < pairs_.size(); ++pair) {
+            Connection* connection = pairs_[pair].get();
+            connection->SetTransportName(
+                    android::base::StringPrintf("%s pair %zu", transport_name_.c_str(), pair));
+            connection->SetReadCallback([this, pair](Connection*, std::unique_ptr<apacket> packet) {
+                router_.HandleIncoming(packet->msg, pair);
+                return read_callback_(this, std::move(packet));
+            });
+            connection->SetErrorCallback([this](Connection*, const std::string& error) {
+                std::call_once(error_flag_, [this, &error]() { error_callback_(this, error); });
+            });
+            connection->Start();
+        }
+    }
+
+    void Stop() override final {
+        for (auto& connection : pairs_) {
+            connection->Stop();
+        }
+    }
+
+    bool DoTlsHandshake(RSA* key, std::string* auth_key) override final {
+        return pairs_[0]->DoTlsHandshake(key, auth_key);
+    }
+
+    void Reset() override final {
+        pairs_[0]->Reset();
+        Stop();
+    }
+
+    void SetPeerFeatures(const FeatureSet& features) override final {
+        enabled_ = CanUseFeature(features, kFeatureUsbEndpointPairs);
+    }
+
+    UsbEndpointPairRouter router_;
+    std::vector<std::unique_ptr<BlockingConnectionAdapter>> pairs_;
+    std::atomic<bool> enabled_ = false;
+    std::once_flag error_flag_;
+};
+
 void init_usb_transport(atransport* t, usb_handle* h) {
     D("transport: usb");
-    auto connection = std::make_unique<UsbConnection>(h);
-    t->SetConnection(std::make_unique<BlockingConnectionAdapter>(std::move(connection)));
+    size_t pair_count = usb_endpoint_pair_count(h);
+    if (pair_count > 1) {
+        D("transport: usb with %zu endpoint pairs", pair_count);
+        t->SetConnection(std::make_unique<UsbEndpointPairsConnection>(h, pair_count));
+    } else {
+        auto connection = std::make_unique<UsbConnection>(h);
+        t->SetConnection(std::make_unique<BlockingConnectionAdapter>(std::move(connection)));
+    }
     t->type = kTransportUsb;
     t->SetUsbHandle(h);
 }
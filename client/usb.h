@@ -38,6 +38,11 @@
 namespace libusb {
 struct usb_handle;
 ADB_USB_INTERFACE(libusb::usb_handle*);
+
+// Only the libusb implementation uses bulk endpoint pairs beyond the first one.
+size_t usb_endpoint_pair_count(usb_handle* h);
+int usb_write_pair(usb_handle* h, size_t pair, const void* data, int len);
+int usb_read_pair(usb_handle* h, size_t pair, void* data, int len);
 }  // namespace libusb
 
 namespace native {
@@ -50,13 +55,20 @@ struct usb_handle {};
 
 ADB_USB_INTERFACE(::usb_handle*);
 
+// The number of bulk endpoint pairs that can be used to talk to the device. usb_read and usb_write
+// use pair 0.
+size_t usb_endpoint_pair_count(::usb_handle* h);
+int usb_write_pair(::usb_handle* h, size_t pair, const void* data, int len);
+int usb_read_pair(::usb_handle* h, size_t pair, void* data, int len);
+
 // USB device detection.
 int is_adb_interface(int usb_class, int usb_subclass, int usb_protocol);
 
 bool should_use_libusb();
 
 struct UsbConnection : public BlockingConnection {
-    explicit UsbConnection(usb_handle* handle) : handle_(handle) {}
+    // Only the connection for pair 0 closes the handle.
+    explicit UsbConnection(usb_handle* handle, size_t pair = 0) : handle_(handle), pair_(pair) {}
     ~UsbConnection();
 
     bool Read(apacket* packet) override final;
@@ -67,4 +79,5 @@ struct UsbConnection : public BlockingConnection {
     virtual void Reset() override final;
 
     usb_handle* handle_;
+    size_t pair_;
 };
@@ -48,6 +48,28 @@ int usb_read(usb_handle* h, void* data, int len) {
                : native::usb_read(reinterpret_cast<native::usb_handle*>(h), data, len);
 }
 
+size_t usb_endpoint_pair_count(usb_handle* h) {
+    return should_use_libusb()
+                   ? libusb::usb_endpoint_pair_count(reinterpret_cast<libusb::usb_handle*>(h))
+                   : 1;
+}
+
+int usb_write_pair(usb_handle* h, size_t pair, const void* data, int len) {
+    if (!should_use_libusb()) {
+        CHECK_EQ(0U, pair);
+        return native::usb_write(reinterpret_cast<native::usb_handle*>(h), data, len);
+    }
+    return libusb::usb_write_pair(reinterpret_cast<libusb::usb_handle*>(h), pair, data, len);
+}
+
+int usb_read_pair(usb_handle* h, size_t pair, void* data, int len) {
+    if (!should_use_libusb()) {
+        CHECK_EQ(0U, pair);
+        return native::usb_read(reinterpret_cast<native::usb_handle*>(h), data, len);
+    }
+    return libusb::usb_read_pair(reinterpret_cast<libusb::usb_handle*>(h), pair, data, len);
+}
+
 int usb_close(usb_handle* h) {
     return should_use_libusb() ? libusb::usb_close(reinterpret_cast<libusb::usb_handle*>(h))
                                : native::usb_close(reinterpret_cast<native::usb_handle*>(h));
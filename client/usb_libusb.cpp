@@ -29,6 +29,8 @@
 #include <string>
 #include <thread>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include <libusb/libusb.h>
 
@@ -87,20 +89,35 @@ struct transfer_info {
 };
 
 namespace libusb {
+struct endpoint_pair {
+    endpoint_pair(uint8_t bulk_in, uint8_t bulk_out, uint16_t zero_mask)
+        : read("read", zero_mask, false),
+          write("write", zero_mask, true),
+          bulk_in(bulk_in),
+          bulk_out(bulk_out) {}
+
+    transfer_info read;
+    transfer_info write;
+
+    uint8_t bulk_in;
+    uint8_t bulk_out;
+};
+
 struct usb_handle : public ::usb_handle {
     usb_handle(const std::string& device_address, const std::string& serial,
-               unique_device_handle&& device_handle, uint8_t interface, uint8_t bulk_in,
-               uint8_t bulk_out, size_t zero_mask, size_t max_packet_size)
+               unique_device_handle&& device_handle, uint8_t interface,
+               const std::vector<std::pair<uint8_t, uint8_t>>& bulk_endpoints, size_t zero_mask,
+               size_t max_packet_size)
         : device_address(device_address),
           serial(serial),
           closing(false),
           device_handle(device_handle.release()),
-          read("read", zero_mask, false),
-          write("write", zero_mask, true),
           interface(interface),
-          bulk_in(bulk_in),
-          bulk_out(bulk_out),
-          max_packet_size(max_packet_size) {}
+          max_packet_size(max_packet_size) {
+        for (const auto& [bulk_in, bulk_out] : bulk_endpoints) {
+            endpoint_pairs.push_back(std::make_unique<endpoint_pair>(bulk_in, bulk_out, zero_mask));
+        }
+    }
 
     ~usb_handle() {
         Close();
@@ -123,8 +140,10 @@ struct usb_handle : public ::usb_handle {
         device_handle = nullptr;
 
         // Cancel already dispatched transfers.
-        libusb_cancel_transfer(read.transfer);
-        libusb_cancel_transfer(write.transfer);
+        for (const auto& pair : endpoint_pairs) {
+            libusb_cancel_transfer(pair->read.transfer);
+            libusb_cancel_transfer(pair->write.transfer);
+        }
 
         libusb_release_interface(handle, interface);
         libusb_close(handle);
@@ -137,12 +156,11 @@ struct usb_handle : public ::usb_handle {
     std::mutex device_handle_mutex;
     libusb_device_handle* device_handle;
 
-    transfer_info read;
-    transfer_info write;
+    // The first pair is the one that every device has. Devices can have more if they support
+    // kFeatureUsbEndpointPairs.
+    std::vector<std::unique_ptr<endpoint_pair>> endpoint_pairs;
 
     uint8_t interface;
-    uint8_t bulk_in;
-    uint8_t bulk_out;
 
     size_t max_packet_size;
 };
@@ -221,7 +239,7 @@ static void process_device(libusb_device* device) {
     // Use size_t for interface_num so <iostream>s don't mangle it.
     size_t interface_num;
     uint16_t zero_mask = 0;
-    uint8_t bulk_in = 0, bulk_out = 0;
+    std::vector<uint8_t> bulk_ins, bulk_outs;
     size_t packet_size = 0;
     bool found_adb = false;
 
@@ -246,8 +264,8 @@ static void process_device(libusb_device* device) {
         LOG(VERBOSE) << "found potential adb interface at " << device_address << " (interface "
                      << interface_num << ")";
 
-        bool found_in = false;
-        bool found_out = false;
+        bulk_ins.clear();
+        bulk_outs.clear();
         for (size_t endpoint_num = 0; endpoint_num < interface_desc.bNumEndpoints; ++endpoint_num) {
             const auto& endpoint_desc = interface_desc.endpoint[endpoint_num];
             const uint8_t endpoint_addr = endpoint_desc.bEndpointAddress;
@@ -259,13 +277,15 @@ static void process_device(libusb_device* device) {
                 continue;
             }
 
-            if (endpoint_is_output(endpoint_addr) && !found_out) {
-                found_out = true;
-                bulk_out = endpoint_addr;
-                zero_mask = endpoint_desc.wMaxPacketSize - 1;
-            } else if (!endpoint_is_output(endpoint_addr) && !found_in) {
-                found_in = true;
-                bulk_in = endpoint_addr;
+            // Endpoints are paired up in the order they appear in: the first bulk out endpoint
+            // goes with the first bulk in endpoint, and so on.
+            if (endpoint_is_output(endpoint_addr)) {
+                if (bulk_outs.empty()) {
+                    zero_mask = endpoint_desc.wMaxPacketSize - 1;
+                }
+                bulk_outs.push_back(endpoint_addr);
+            } else {
+                bulk_ins.push_back(endpoint_addr);
             }
 
             size_t endpoint_packet_size = endpoint_desc.wMaxPacketSize;
@@ -277,13 +297,14 @@ static void process_device(libusb_device* device) {
             }
         }
 
-        if (found_in && found_out) {
+        if (!bulk_ins.empty() && !bulk_outs.empty()) {
             found_adb = true;
             break;
         } else {
             LOG(VERBOSE) << "rejecting potential adb interface at " << device_address
                          << "(interface " << interface_num << "): missing bulk endpoints "
-                         << "(found_in = " << found_in << ", found_out = " << found_out << ")";
+                         << "(found_in = " << !bulk_ins.empty()
+                         << ", found_out = " << !bulk_outs.empty() << ")";
         }
     }
 
@@ -292,6 +313,11 @@ static void process_device(libusb_device* device) {
         return;
     }
 
+    std::vector<std::pair<uint8_t, uint8_t>> bulk_endpoints;
+    for (size_t i = 0; i < std::min(bulk_ins.size(), bulk_outs.size()); ++i) {
+        bulk_endpoints.emplace_back(bulk_ins[i], bulk_outs[i]);
+    }
+
     {
         std::unique_lock<std::mutex> lock(usb_handles_mutex);
         if (usb_handles.find(device_address) != usb_handles.end()) {
@@ -307,7 +333,9 @@ static void process_device(libusb_device* device) {
     unique_device_handle handle(handle_raw);
     if (rc == 0) {
         LOG(DEBUG) << "successfully opened adb device at " << device_address << ", "
-                   << StringPrintf("bulk_in = %#x, bulk_out = %#x", bulk_in, bulk_out);
+                   << StringPrintf("bulk_in = %#x, bulk_out = %#x", bulk_endpoints[0].first,
+                                   bulk_endpoints[0].second)
+                   << ", " << bulk_endpoints.size() << " endpoint pair(s)";
 
         device_serial.resize(255);
         rc = libusb_get_string_descriptor_ascii(handle_raw, device_desc.iSerialNumber,
@@ -331,14 +359,16 @@ static void process_device(libusb_device* device) {
             return;
         }
 
-        for (uint8_t endpoint : {bulk_in, bulk_out}) {
-            rc = libusb_clear_halt(handle.get(), endpoint);
-            if (rc != 0) {
-                LOG(WARNING) << "failed to clear halt on device '" << device_serial
-                             << "' endpoint 0x" << std::hex << endpoint << ": "
-                             << libusb_error_name(rc);
-                libusb_release_interface(handle.get(), interface_num);
-                return;
+        for (const auto& [bulk_in, bulk_out] : bulk_endpoints) {
+            for (uint8_t endpoint : {bulk_in, bulk_out}) {
+                rc = libusb_clear_halt(handle.get(), endpoint);
+                if (rc != 0) {
+                    LOG(WARNING) << "failed to clear halt on device '" << device_serial
+                                 << "' endpoint 0x" << std::hex << endpoint << ": "
+                                 << libusb_error_name(rc);
+                    libusb_release_interface(handle.get(), interface_num);
+                    return;
+                }
             }
         }
     } else {
@@ -364,8 +394,8 @@ static void process_device(libusb_device* device) {
     }
 
     std::unique_ptr<usb_handle> result(new usb_handle(device_address, device_serial,
-                                                      std::move(handle), interface_num, bulk_in,
-                                                      bulk_out, zero_mask, packet_size));
+                                                      std::move(handle), interface_num,
+                                                      bulk_endpoints, zero_mask, packet_size));
     usb_handle* usb_handle_raw = result.get();
 
     {
@@ -562,7 +592,11 @@ static int perform_usb_transfer(usb_handle* h, transfer_info* info,
 }
 
 int usb_write(usb_handle* h, const void* d, int len) {
-    LOG(DEBUG) << "usb_write of length " << len;
+    return usb_write_pair(h, 0, d, len);
+}
+
+int usb_write_pair(usb_handle* h, size_t pair, const void* d, int len) {
+    LOG(DEBUG) << "usb_write of length " << len << " on pair " << pair;
 
     std::unique_lock<std::mutex> lock(h->device_handle_mutex);
     if (!h->device_handle) {
@@ -570,10 +604,10 @@ int usb_write(usb_handle* h, const void* d, int len) {
         return -1;
     }
 
-    transfer_info* info = &h->write;
+    transfer_info* info = &h->endpoint_pairs[pair]->write;
     info->transfer->dev_handle = h->device_handle;
     info->transfer->flags = 0;
-    info->transfer->endpoint = h->bulk_out;
+    info->transfer->endpoint = h->endpoint_pairs[pair]->bulk_out;
     info->transfer->type = LIBUSB_TRANSFER_TYPE_BULK;
     info->transfer->length = len;
     info->transfer->buffer = reinterpret_cast<unsigned char*>(const_cast<void*>(d));
@@ -585,7 +619,11 @@ int usb_write(usb_handle* h, const void* d, int len) {
 }
 
 int usb_read(usb_handle* h, void* d, int len) {
-    LOG(DEBUG) << "usb_read of length " << len;
+    return usb_read_pair(h, 0, d, len);
+}
+
+int usb_read_pair(usb_handle* h, size_t pair, void* d, int len) {
+    LOG(DEBUG) << "usb_read of length " << len << " on pair " << pair;
 
     std::unique_lock<std::mutex> lock(h->device_handle_mutex);
     if (!h->device_handle) {
@@ -593,10 +631,10 @@ int usb_read(usb_handle* h, void* d, int len) {
         return -1;
     }
 
-    transfer_info* info = &h->read;
+    transfer_info* info = &h->endpoint_pairs[pair]->read;
     info->transfer->dev_handle = h->device_handle;
     info->transfer->flags = 0;
-    info->transfer->endpoint = h->bulk_in;
+    info->transfer->endpoint = h->endpoint_pairs[pair]->bulk_in;
     info->transfer->type = LIBUSB_TRANSFER_TYPE_BULK;
     info->transfer->length = len;
     info->transfer->buffer = reinterpret_cast<unsigned char*>(d);
@@ -611,6 +649,10 @@ int usb_read(usb_handle* h, void* d, int len) {
     return info->transfer->actual_length;
 }
 
+size_t usb_endpoint_pair_count(usb_handle* h) {
+    return h->endpoint_pairs.size();
+}
+
 int usb_close(usb_handle* h) {
     std::unique_lock<std::mutex> lock(usb_handles_mutex);
     auto it = usb_handles.find(h->device_address);
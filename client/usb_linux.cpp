@@ -213,7 +213,9 @@ static void find_usb_device(const std::string& base,
                          interface->bInterfaceClass, interface->bInterfaceSubClass,
                          interface->bInterfaceProtocol, interface->bNumEndpoints);
 
-                    if (interface->bNumEndpoints == 2 &&
+                    // Devices that support kFeatureUsbEndpointPairs have more than one pair of
+                    // bulk endpoints, of which only the first is used here.
+                    if (interface->bNumEndpoints >= 2 &&
                         is_adb_interface(interface->bInterfaceClass, interface->bInterfaceSubClass,
                                          interface->bInterfaceProtocol)) {
                         struct stat st;
@@ -393,12 +393,13 @@ static std::unique_ptr<usb_handle> CheckInterface(IOUSBInterfaceInterface550** i
 
         if (kUSBBulk != transferType) continue;
 
-        if (kUSBIn == direction) {
+        // Devices can have more than one pair of bulk endpoints, but only the first is used here.
+        if (kUSBIn == direction && handle->bulkIn == 0) {
             handle->bulkIn = endpoint;
             if (!ClearPipeStallBothEnds(interface, handle->bulkIn)) goto err_get_pipe_props;
         }
 
-        if (kUSBOut == direction) {
+        if (kUSBOut == direction && handle->bulkOut == 0) {
             handle->bulkOut = endpoint;
             if (!ClearPipeStallBothEnds(interface, handle->bulkOut)) goto err_get_pipe_props;
         }
@@ -516,8 +516,8 @@ int recognized_device(usb_handle* handle) {
         return 0;
     }
 
-    // Must have two endpoints
-    if (2 != interf_desc.bNumEndpoints) {
+    // Must have at least two endpoints. Only the first pair is used if there are more.
+    if (interf_desc.bNumEndpoints < 2) {
         return 0;
     }
 
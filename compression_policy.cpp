@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "compression_policy.h"
+
+#include <math.h>
+
+#include <algorithm>
+
+#include <android-base/strings.h>
+
+// How much of the start of a file to measure the entropy of.
+static constexpr uint64_t kEntropySampleSize = 128 * 1024;
+
+// Already compressed data is close to 8 bits of entropy per byte. Text and code are well below.
+static constexpr double kMaxEntropy = 7.5;
+
+// How much of a file to compress before judging the ratio. The encoders hold on to some of their
+// output, so this has to be large enough for that not to skew the result.
+static constexpr uint64_t kRatioSampleSize = 8 * 1024 * 1024;
+
+// Compression has to save at least 5% to be worth it.
+static constexpr uint64_t kMaxRatioPercent = 95;
+
+bool CompressionPolicy::IsPrecompressed(std::string_view path) {
+    static constexpr std::string_view kExtensions[] = {
+            ".7z",  ".aac", ".apex", ".apk",  ".avif", ".br",   ".bz2", ".capex", ".flac",
+            ".gif", ".gz",  ".heic", ".jar",  ".jpeg", ".jpg",  ".lz4", ".m4a",   ".mkv",
+            ".mp3", ".mp4", ".ogg",  ".opus", ".png",  ".rar",  ".tgz", ".webm",  ".webp",
+            ".xz",  ".zip", ".zst",
+    };
+
+    for (std::string_view extension : kExtensions) {
+        if (android::base::EndsWithIgnoreCase(path, extension)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+double CompressionPolicy::SampleEntropy() const {
+    uint64_t total = std::min(input_bytes_, kEntropySampleSize);
+    double entropy = 0;
+    for (uint64_t count : histogram_) {
+        if (count == 0) continue;
+        double p = static_cast<double>(count) / total;
+        entropy -= p * log2(p);
+    }
+    return entropy;
+}
+
+bool CompressionPolicy::ShouldCompress(std::span<const char> input) {
+    if (!compressing_) {
+        return false;
+    }
+
+    if (input_bytes_ < kEntropySampleSize) {
+        size_t length = std::min<uint64_t>(input.size(), kEntropySampleSize - input_bytes_);
+        for (size_t i = 0; i < length; ++i) {
+            ++histogram_[static_cast<uint8_t>(input[i])];
+        }
+        input_bytes_ += input.size();
+        if (input_bytes_ >= kEntropySampleSize && SampleEntropy() > kMaxEntropy) {
+            compressing_ = false;
+        }
+        return compressing_;
+    }
+
+    if (input_bytes_ >= kRatioSampleSize && output_bytes_ * 100 > input_bytes_ * kMaxRatioPercent) {
+        compressing_ = false;
+    }
+    input_bytes_ += input.size();
+    return compressing_;
+}
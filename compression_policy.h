@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <array>
+#include <span>
+#include <string_view>
+
+// Decides, as a file goes by, whether compressing it is worth the CPU it costs on both ends.
+class CompressionPolicy {
+  public:
+    // Whether |path|'s extension says that it's already compressed: an APK, an image, an archive.
+    static bool IsPrecompressed(std::string_view path);
+
+    // Called with each block of the file before it's compressed. Returns false once compression
+    // should stop, either because the start of the file looks like noise, or because the ratio
+    // achieved so far doesn't make up for the time spent. Once it's returned false, it always does.
+    bool ShouldCompress(std::span<const char> input);
+
+    // Called with the size of each block of compressed output.
+    void RecordOutput(size_t length) { output_bytes_ += length; }
+
+  private:
+    double SampleEntropy() const;
+
+    bool compressing_ = true;
+    uint64_t input_bytes_ = 0;
+    uint64_t output_bytes_ = 0;
+    std::array<uint64_t, 256> histogram_ = {};
+};
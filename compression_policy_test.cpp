@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "compression_policy.h"
+
+#include <gtest/gtest.h>
+
+#include <random>
+#include <string>
+
+static std::string RandomData(size_t length, uint32_t seed) {
+    std::mt19937 generator(seed);
+    std::string result(length, '\0');
+    for (char& c : result) {
+        c = static_cast<char>(generator());
+    }
+    return result;
+}
+
+TEST(compression_policy, IsPrecompressed) {
+    EXPECT_TRUE(CompressionPolicy::IsPrecompressed("/data/local/tmp/app.apk"));
+    EXPECT_TRUE(CompressionPolicy::IsPrecompressed("photo.JPG"));
+    EXPECT_TRUE(CompressionPolicy::IsPrecompressed("dir/archive.tar.gz"));
+    EXPECT_FALSE(CompressionPolicy::IsPrecompressed("/system/lib64/libc.so"));
+    EXPECT_FALSE(CompressionPolicy::IsPrecompressed("notes.txt"));
+    EXPECT_FALSE(CompressionPolicy::IsPrecompressed("zip"));
+}
+
+TEST(compression_policy, compressible) {
+    std::string block(64 * 1024, 'a');
+    CompressionPolicy policy;
+    for (int i = 0; i < 256; ++i) {
+        ASSERT_TRUE(policy.ShouldCompress(block)) << "block " << i;
+        policy.RecordOutput(100);
+    }
+}
+
+TEST(compression_policy, high_entropy) {
+    CompressionPolicy policy;
+    EXPECT_TRUE(policy.ShouldCompress(RandomData(64 * 1024, 1)));
+    EXPECT_FALSE(policy.ShouldCompress(RandomData(64 * 1024, 2)));
+    EXPECT_FALSE(policy.ShouldCompress(std::string(64 * 1024, 'a')));
+}
+
+TEST(compression_policy, poor_ratio) {
+    std::string block(64 * 1024, 'a');
+    CompressionPolicy policy;
+
+    // Data that passes the entropy check, but that the encoder makes nothing of.
+    for (int i = 0; i < 128; ++i) {
+        ASSERT_TRUE(policy.ShouldCompress(block)) << "block " << i;
+        policy.RecordOutput(block.size());
+    }
+    EXPECT_FALSE(policy.ShouldCompress(block));
+}
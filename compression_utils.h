@@ -0,0 +1,487 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+#include <span>
+
+#include <android-base/logging.h>
+
+#include <brotli/decode.h>
+#include <brotli/encode.h>
+#include <lz4frame.h>
+#include <zstd.h>
+
+#include "file_sync_protocol.h"
+#include "types.h"
+
+enum class DecodeResult {
+    Error,
+    Done,
+    NeedInput,
+    MoreOutput,
+};
+
+enum class EncodeResult {
+    Error,
+    Done,
+    NeedInput,
+    MoreOutput,
+};
+
+// Decompresses a stream that's been appended a block at a time. Each call to Decode fills as
+// much of the output buffer as it can.
+struct Decoder {
+    virtual ~Decoder() = default;
+
+    void Append(Block&& block) { input_buffer_.append(std::move(block)); }
+
+    virtual DecodeResult Decode(std::span<char>* output) = 0;
+
+  protected:
+    explicit Decoder(std::span<char> output_buffer) : output_buffer_(output_buffer) {}
+
+    IOVector input_buffer_;
+    std::span<char> output_buffer_;
+};
+
+// Compresses a stream that's been appended a block at a time, into blocks of at most
+// output_block_size bytes. Call Finish after appending the last block.
+struct Encoder {
+    virtual ~Encoder() = default;
+
+    void Append(Block input) { input_buffer_.append(std::move(input)); }
+    void Finish() { finished_ = true; }
+
+    virtual EncodeResult Encode(Block* output) = 0;
+
+  protected:
+    explicit Encoder(size_t output_block_size) : output_block_size_(output_block_size) {}
+
+    const size_t output_block_size_;
+    bool finished_ = false;
+    IOVector input_buffer_;
+};
+
+struct BrotliDecoder final : public Decoder {
+    explicit BrotliDecoder(std::span<char> output_buffer)
+        : Decoder(output_buffer),
+          decoder_(BrotliDecoderCreateInstance(nullptr, nullptr, nullptr),
+                   BrotliDecoderDestroyInstance) {}
+
+    DecodeResult Decode(std::span<char>* output) final {
+        size_t available_in = input_buffer_.front_size();
+        const uint8_t* next_in = reinterpret_cast<const uint8_t*>(input_buffer_.front_data());
+
+        size_t available_out = output_buffer_.size();
+        uint8_t* next_out = reinterpret_cast<uint8_t*>(output_buffer_.data());
+
+        BrotliDecoderResult r = BrotliDecoderDecompressStream(
+                decoder_.get(), &available_in, &next_in, &available_out, &next_out, nullptr);
+
+        size_t bytes_consumed = input_buffer_.front_size() - available_in;
+        input_buffer_.drop_front(bytes_consumed);
+
+        size_t bytes_emitted = output_buffer_.size() - available_out;
+        *output = std::span<char>(output_buffer_.data(), bytes_emitted);
+
+        switch (r) {
+            case BROTLI_DECODER_RESULT_SUCCESS:
+                return DecodeResult::Done;
+            case BROTLI_DECODER_RESULT_ERROR:
+                return DecodeResult::Error;
+            case BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT:
+                // Brotli guarantees as one of its invariants that if it returns NEEDS_MORE_INPUT,
+                // it will consume the entire input buffer passed in, so we don't have to worry
+                // about bytes left over in the front block with more input remaining.
+                if (!input_buffer_.empty()) {
+                    return DecodeResult::MoreOutput;
+                }
+                return DecodeResult::NeedInput;
+            case BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT:
+                return DecodeResult::MoreOutput;
+        }
+    }
+
+  private:
+    std::unique_ptr<BrotliDecoderState, void (*)(BrotliDecoderState*)> decoder_;
+};
+
+struct BrotliEncoder final : public Encoder {
+    explicit BrotliEncoder(size_t output_block_size)
+        : Encoder(output_block_size),
+          output_block_(output_block_size),
+          output_bytes_left_(output_block_size),
+          encoder_(BrotliEncoderCreateInstance(nullptr, nullptr, nullptr),
+                   BrotliEncoderDestroyInstance) {
+        BrotliEncoderSetParameter(encoder_.get(), BROTLI_PARAM_QUALITY, 1);
+    }
+
+    EncodeResult Encode(Block* output) final {
+        output->clear();
+        while (true) {
+            size_t available_in = input_buffer_.front_size();
+            const uint8_t* next_in = reinterpret_cast<const uint8_t*>(input_buffer_.front_data());
+
+            size_t available_out = output_bytes_left_;
+            uint8_t* next_out = reinterpret_cast<uint8_t*>(
+                    output_block_.data() + (output_block_size_ - output_bytes_left_));
+
+            BrotliEncoderOperation op = BROTLI_OPERATION_PROCESS;
+            if (finished_) {
+                op = BROTLI_OPERATION_FINISH;
+            }
+
+            if (!BrotliEncoderCompressStream(encoder_.get(), op, &available_in, &next_in,
+                                             &available_out, &next_out, nullptr)) {
+                return EncodeResult::Error;
+            }
+
+            size_t bytes_consumed = input_buffer_.front_size() - available_in;
+            input_buffer_.drop_front(bytes_consumed);
+
+            output_bytes_left_ = available_out;
+
+            if (BrotliEncoderIsFinished(encoder_.get())) {
+                output_block_.resize(output_block_size_ - output_bytes_left_);
+                *output = std::move(output_block_);
+                return EncodeResult::Done;
+            } else if (output_bytes_left_ == 0) {
+                *output = std::move(output_block_);
+                output_block_.resize(output_block_size_);
+                output_bytes_left_ = output_block_size_;
+                return EncodeResult::MoreOutput;
+            } else if (input_buffer_.empty()) {
+                return EncodeResult::NeedInput;
+            }
+        }
+    }
+
+  private:
+    Block output_block_;
+    size_t output_bytes_left_;
+    std::unique_ptr<BrotliEncoderState, void (*)(BrotliEncoderState*)> encoder_;
+};
+
+struct LZ4Decoder final : public Decoder {
+    explicit LZ4Decoder(std::span<char> output_buffer)
+        : Decoder(output_buffer), decoder_(nullptr, LZ4F_freeDecompressionContext) {
+        LZ4F_dctx* dctx;
+        if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION))) {
+            LOG(FATAL) << "failed to create LZ4 decompression context";
+        }
+        decoder_.reset(dctx);
+    }
+
+    DecodeResult Decode(std::span<char>* output) final {
+        size_t available_in = input_buffer_.front_size();
+        size_t available_out = output_buffer_.size();
+
+        // LZ4F_decompress replaces the sizes with the number of bytes consumed and produced.
+        size_t rc = LZ4F_decompress(decoder_.get(), output_buffer_.data(), &available_out,
+                                    input_buffer_.front_data(), &available_in, nullptr);
+        if (LZ4F_isError(rc)) {
+            LOG(ERROR) << "LZ4F_decompress failed: " << LZ4F_getErrorName(rc);
+            return DecodeResult::Error;
+        }
+
+        input_buffer_.drop_front(available_in);
+        *output = std::span<char>(output_buffer_.data(), available_out);
+
+        if (rc == 0) {
+            // The frame has been decoded and flushed.
+            return DecodeResult::Done;
+        } else if (!input_buffer_.empty() || available_out == output_buffer_.size()) {
+            return DecodeResult::MoreOutput;
+        }
+        return DecodeResult::NeedInput;
+    }
+
+  private:
+    std::unique_ptr<LZ4F_dctx, decltype(&LZ4F_freeDecompressionContext)> decoder_;
+};
+
+struct LZ4Encoder final : public Encoder {
+    explicit LZ4Encoder(size_t output_block_size)
+        : Encoder(output_block_size), encoder_(nullptr, LZ4F_freeCompressionContext) {
+        LZ4F_cctx* cctx;
+        if (LZ4F_isError(LZ4F_createCompressionContext(&cctx, LZ4F_VERSION))) {
+            LOG(FATAL) << "failed to create LZ4 compression context";
+        }
+        encoder_.reset(cctx);
+
+        Block header(LZ4F_HEADER_SIZE_MAX);
+        size_t rc = LZ4F_compressBegin(encoder_.get(), header.data(), header.size(), nullptr);
+        if (LZ4F_isError(rc)) {
+            LOG(FATAL) << "LZ4F_compressBegin failed: " << LZ4F_getErrorName(rc);
+        }
+        header.resize(rc);
+        output_buffer_.append(std::move(header));
+    }
+
+    EncodeResult Encode(Block* output) final {
+        output->clear();
+
+        // LZ4 can't pick up where it left off if the output buffer is too small, so compress
+        // into buffers that are big enough for the worst case, and hand out blocks of the
+        // requested size from those.
+        while (!input_buffer_.empty()) {
+            size_t available_in = std::min<size_t>(input_buffer_.front_size(), kMaxInputSize);
+            Block block(LZ4F_compressBound(available_in, nullptr));
+            size_t rc = LZ4F_compressUpdate(encoder_.get(), block.data(), block.size(),
+                                            input_buffer_.front_data(), available_in, nullptr);
+            if (LZ4F_isError(rc)) {
+                LOG(ERROR) << "LZ4F_compressUpdate failed: " << LZ4F_getErrorName(rc);
+                return EncodeResult::Error;
+            }
+            input_buffer_.drop_front(available_in);
+            block.resize(rc);
+            output_buffer_.append(std::move(block));
+        }
+
+        if (finished_ && !lz4_done_) {
+            Block block(LZ4F_compressBound(0, nullptr));
+            size_t rc = LZ4F_compressEnd(encoder_.get(), block.data(), block.size(), nullptr);
+            if (LZ4F_isError(rc)) {
+                LOG(ERROR) << "LZ4F_compressEnd failed: " << LZ4F_getErrorName(rc);
+                return EncodeResult::Error;
+            }
+            block.resize(rc);
+            output_buffer_.append(std::move(block));
+            lz4_done_ = true;
+        }
+
+        // Only hand out whole blocks until the end of the stream.
+        if (output_buffer_.size() >= output_block_size_ || (lz4_done_ && !output_buffer_.empty())) {
+            size_t length = std::min(output_block_size_, output_buffer_.size());
+            *output = output_buffer_.take_front(length).coalesce();
+        }
+
+        if (lz4_done_ && output_buffer_.empty()) {
+            return EncodeResult::Done;
+        } else if (lz4_done_ || output_buffer_.size() >= output_block_size_) {
+            return EncodeResult::MoreOutput;
+        }
+        return EncodeResult::NeedInput;
+    }
+
+  private:
+    // LZ4F_compressBound is at its most efficient for whole LZ4 blocks, which are 64KiB by default.
+    static constexpr size_t kMaxInputSize = 64 * 1024;
+
+    bool lz4_done_ = false;
+    IOVector output_buffer_;
+    std::unique_ptr<LZ4F_cctx, decltype(&LZ4F_freeCompressionContext)> encoder_;
+};
+
+struct ZstdDecoder final : public Decoder {
+    explicit ZstdDecoder(std::span<char> output_buffer)
+        : Decoder(output_buffer), decoder_(ZSTD_createDStream(), ZSTD_freeDStream) {
+        if (!decoder_) {
+            LOG(FATAL) << "failed to create zstd decompression context";
+        }
+    }
+
+    DecodeResult Decode(std::span<char>* output) final {
+        ZSTD_inBuffer in = {input_buffer_.front_data(), input_buffer_.front_size(), 0};
+        ZSTD_outBuffer out = {output_buffer_.data(), output_buffer_.size(), 0};
+
+        size_t rc = ZSTD_decompressStream(decoder_.get(), &out, &in);
+        if (ZSTD_isError(rc)) {
+            LOG(ERROR) << "ZSTD_decompressStream failed: " << ZSTD_getErrorName(rc);
+            return DecodeResult::Error;
+        }
+
+        input_buffer_.drop_front(in.pos);
+        *output = std::span<char>(output_buffer_.data(), out.pos);
+
+        if (rc == 0) {
+            // The frame has been decoded and flushed.
+            return DecodeResult::Done;
+        } else if (!input_buffer_.empty() || out.pos == out.size) {
+            return DecodeResult::MoreOutput;
+        }
+        return DecodeResult::NeedInput;
+    }
+
+  private:
+    std::unique_ptr<ZSTD_DStream, size_t (*)(ZSTD_DStream*)> decoder_;
+};
+
+struct ZstdEncoder final : public Encoder {
+    explicit ZstdEncoder(size_t output_block_size)
+        : Encoder(output_block_size),
+          output_block_(output_block_size),
+          output_bytes_left_(output_block_size),
+          encoder_(ZSTD_createCStream(), ZSTD_freeCStream) {
+        if (!encoder_) {
+            LOG(FATAL) << "failed to create zstd compression context";
+        }
+        ZSTD_CCtx_setParameter(encoder_.get(), ZSTD_c_compressionLevel, 1);
+    }
+
+    EncodeResult Encode(Block* output) final {
+        output->clear();
+        while (true) {
+            ZSTD_inBuffer in = {input_buffer_.front_data(), input_buffer_.front_size(), 0};
+            ZSTD_outBuffer out = {output_block_.data() + (output_block_size_ - output_bytes_left_),
+                                  output_bytes_left_, 0};
+
+            ZSTD_EndDirective op = ZSTD_e_continue;
+            if (finished_ && input_buffer_.front_size() == input_buffer_.size()) {
+                op = ZSTD_e_end;
+            }
+
+            size_t rc = ZSTD_compressStream2(encoder_.get(), &out, &in, op);
+            if (ZSTD_isError(rc)) {
+                LOG(ERROR) << "ZSTD_compressStream2 failed: " << ZSTD_getErrorName(rc);
+                return EncodeResult::Error;
+            }
+
+            input_buffer_.drop_front(in.pos);
+            output_bytes_left_ -= out.pos;
+
+            if (op == ZSTD_e_end && rc == 0) {
+                output_block_.resize(output_block_size_ - output_bytes_left_);
+                *output = std::move(output_block_);
+                return EncodeResult::Done;
+            } else if (output_bytes_left_ == 0) {
+                *output = std::move(output_block_);
+                output_block_.resize(output_block_size_);
+                output_bytes_left_ = output_block_size_;
+                return EncodeResult::MoreOutput;
+            } else if (input_buffer_.empty() && !finished_) {
+                return EncodeResult::NeedInput;
+            }
+        }
+    }
+
+  private:
+    Block output_block_;
+    size_t output_bytes_left_;
+    std::unique_ptr<ZSTD_CStream, size_t (*)(ZSTD_CStream*)> encoder_;
+};
+
+// CompressionType::None and CompressionType::Any aren't codecs, and have to be resolved first.
+inline std::unique_ptr<Decoder> CreateDecoder(CompressionType compression,
+                                              std::span<char> output_buffer) {
+    switch (compression) {
+        case CompressionType::Brotli:
+            return std::make_unique<BrotliDecoder>(output_buffer);
+        case CompressionType::LZ4:
+            return std::make_unique<LZ4Decoder>(output_buffer);
+        case CompressionType::Zstd:
+            return std::make_unique<ZstdDecoder>(output_buffer);
+        case CompressionType::None:
+        case CompressionType::Any:
+            break;
+    }
+    LOG(FATAL) << "no decoder for compression type " << static_cast<int>(compression);
+    return nullptr;
+}
+
+inline std::unique_ptr<Encoder> CreateEncoder(CompressionType compression,
+                                              size_t output_block_size) {
+    switch (compression) {
+        case CompressionType::Brotli:
+            return std::make_unique<BrotliEncoder>(output_block_size);
+        case CompressionType::LZ4:
+            return std::make_unique<LZ4Encoder>(output_block_size);
+        case CompressionType::Zstd:
+            return std::make_unique<ZstdEncoder>(output_block_size);
+        case CompressionType::None:
+        case CompressionType::Any:
+            break;
+    }
+    LOG(FATAL) << "no encoder for compression type " << static_cast<int>(compression);
+    return nullptr;
+}
+
+// The send_v2/recv_v2 flag that asks for |compression|, which must not be CompressionType::Any.
+inline SyncFlag CompressionFlag(CompressionType compression) {
+    switch (compression) {
+        case CompressionType::None:
+            return kSyncFlagNone;
+        case CompressionType::Brotli:
+            return kSyncFlagBrotli;
+        case CompressionType::LZ4:
+            return kSyncFlagLZ4;
+        case CompressionType::Zstd:
+            return kSyncFlagZstd;
+        case CompressionType::Any:
+            break;
+    }
+    LOG(FATAL) << "no sync flag for compression type " << static_cast<int>(compression);
+    return kSyncFlagNone;
+}
+
+// Compresses |block| as a stream of its own, for a sync_frame. Leaves it as it is if compressing
+// it doesn't make it any smaller.
+inline bool CompressFrame(CompressionType compression, Block* block) {
+    std::unique_ptr<Encoder> encoder = CreateEncoder(compression, block->size());
+    Block input(block->size());
+    memcpy(input.data(), block->data(), block->size());
+    encoder->Append(std::move(input));
+    encoder->Finish();
+
+    // Anything that doesn't fit in a single output block of the input's size isn't worth sending.
+    Block output;
+    EncodeResult result = encoder->Encode(&output);
+    if (result == EncodeResult::Error) {
+        return false;
+    }
+    if (result == EncodeResult::Done && output.size() < block->size()) {
+        *block = std::move(output);
+    }
+    return true;
+}
+
+// Decompresses the contents of a sync_frame, which has to come to exactly |size| bytes.
+inline bool DecompressFrame(CompressionType compression, size_t size, Block* block) {
+    Block output(size);
+    size_t offset = 0;
+
+    Block buffer(SYNC_DATA_MAX);
+    std::unique_ptr<Decoder> decoder =
+            CreateDecoder(compression, std::span(buffer.data(), buffer.size()));
+    decoder->Append(std::move(*block));
+    while (true) {
+        std::span<char> chunk;
+        DecodeResult result = decoder->Decode(&chunk);
+        if (result == DecodeResult::Error || chunk.size() > size - offset) {
+            return false;
+        }
+        memcpy(output.data() + offset, chunk.data(), chunk.size());
+        offset += chunk.size();
+
+        if (result == DecodeResult::Done) {
+            break;
+        } else if (result == DecodeResult::NeedInput) {
+            // The frame was cut short.
+            return false;
+        }
+    }
+
+    if (offset != size) {
+        return false;
+    }
+    *block = std::move(output);
+    return true;
+}
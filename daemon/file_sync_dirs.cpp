@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "daemon/file_sync_dirs.h"
+
+#include "sysdeps.h"
+
+#include <errno.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include <android-base/macros.h>
+#include <android-base/strings.h>
+
+#include <adbd_fs.h>
+
+#if defined(__ANDROID__)
+#include <linux/capability.h>
+#include <selinux/android.h>
+#include <sys/xattr.h>
+#endif
+
+bool should_use_fs_config(const std::string& path) {
+#if defined(__ANDROID__)
+    // TODO: use fs_config to configure permissions on /data too.
+    return !android::base::StartsWith(path, "/data/");
+#else
+    UNUSED(path);
+    return false;
+#endif
+}
+
+bool update_capabilities(const char* path, uint64_t capabilities) {
+#if defined(__ANDROID__)
+    if (capabilities == 0) {
+        // Ensure we clean up in case the capabilities weren't 0 in the past.
+        removexattr(path, XATTR_NAME_CAPS);
+        return true;
+    }
+
+    vfs_cap_data cap_data = {};
+    cap_data.magic_etc = VFS_CAP_REVISION_2 | VFS_CAP_FLAGS_EFFECTIVE;
+    cap_data.data[0].permitted = (capabilities & 0xffffffff);
+    cap_data.data[0].inheritable = 0;
+    cap_data.data[1].permitted = (capabilities >> 32);
+    cap_data.data[1].inheritable = 0;
+    return setxattr(path, XATTR_NAME_CAPS, &cap_data, sizeof(cap_data), 0) != -1;
+#else
+    UNUSED(path, capabilities);
+    return true;
+#endif
+}
+
+bool SyncDirectoryCache::SecureMkdirs(const std::string& path) {
+    if (path[0] != '/') {
+        errno = EINVAL;
+        return false;
+    }
+
+    // Our caller only comes here when |path| turned out to be missing, so if we think we made it,
+    // something else has removed it since, and maybe its parents too.
+    if (known_.count(path)) {
+        Clear();
+    }
+
+    if (MakeMissing(path)) return true;
+
+    // A directory we skipped might have been removed too, so try again without skipping any.
+    if (!known_.empty()) {
+        Clear();
+        if (MakeMissing(path)) return true;
+    }
+    Clear();
+    return false;
+}
+
+bool SyncDirectoryCache::MakeMissing(const std::string& path) {
+    std::vector<std::string> path_components = android::base::Split(path, "/");
+    std::string partial_path;
+    for (const auto& path_component : path_components) {
+        uid_t uid = -1;
+        gid_t gid = -1;
+        mode_t mode = 0775;
+        uint64_t capabilities = 0;
+
+        if (path_component.empty()) {
+            continue;
+        }
+
+        if (partial_path.empty() || partial_path.back() != OS_PATH_SEPARATOR) {
+            partial_path += OS_PATH_SEPARATOR;
+        }
+        partial_path += path_component;
+
+        if (known_.count(partial_path)) {
+            continue;
+        }
+
+        if (should_use_fs_config(partial_path)) {
+            adbd_fs_config(partial_path.c_str(), 1, nullptr, &uid, &gid, &mode, &capabilities);
+        }
+        if (adb_mkdir(partial_path.c_str(), mode) == -1) {
+            if (errno != EEXIST) {
+                return false;
+            }
+        } else {
+            if (chown(partial_path.c_str(), uid, gid) == -1) return false;
+
+#if defined(__ANDROID__)
+            // Not all filesystems support setting SELinux labels. http://b/23530370.
+            selinux_android_restorecon(partial_path.c_str(), 0);
+#endif
+
+            if (!update_capabilities(partial_path.c_str(), capabilities)) return false;
+        }
+        known_.insert(partial_path);
+    }
+    return true;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+#include <unordered_set>
+
+// Whether pushing to |path| takes the owner, mode and capabilities from fs_config.
+bool should_use_fs_config(const std::string& path);
+
+// Sets the file capabilities of |path|, or removes them if |capabilities| is 0.
+bool update_capabilities(const char* path, uint64_t capabilities);
+
+// The directories that a sync session has found or made. Pushing many files into a new tree
+// would otherwise go through every directory on the way to each new one again: looking it up in
+// fs_config, and trying to make it.
+class SyncDirectoryCache {
+  public:
+    // Makes the directory |path|, which has turned out to be missing, along with any of its
+    // parents that are missing too. Each new directory gets the owner, mode and capabilities that
+    // fs_config says it should have. Failing forgets every directory, leaving errno set.
+    bool SecureMkdirs(const std::string& path);
+
+    // Forgets every directory.
+    void Clear() { known_.clear(); }
+
+  private:
+    // Makes the directories on the way to |path| that aren't in |known_|, and adds them to it.
+    bool MakeMissing(const std::string& path);
+
+    std::unordered_set<std::string> known_;
+};
@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <benchmark/benchmark.h>
+
+#include "adb_unique_fd.h"
+#include "daemon/file_sync_dirs.h"
+
+using android::base::StringPrintf;
+
+static constexpr int kLeafDirectories = 64;
+static constexpr int kFilesPerDirectory = 4;
+
+// Makes its directory on tmpfs if there is one, so that the benchmark is about the syscalls we
+// make rather than the disk.
+struct TmpfsDir {
+    TmpfsDir() {
+        std::string parent = access("/dev/shm", W_OK) == 0 ? "/dev/shm" : "/tmp";
+        path = parent + "/adbd_file_sync_dirs.XXXXXX";
+        CHECK(mkdtemp(path.data()) != nullptr) << "couldn't make a directory in " << parent;
+    }
+
+    ~TmpfsDir() { Remove(); }
+
+    void Remove() {
+        std::string command = "rm -rf " + path + "/*";
+        CHECK_EQ(0, system(command.c_str()));
+    }
+
+    std::string path;
+};
+
+// The names of the files in a push into a new tree, each |depth| directories down, spread over
+// |kLeafDirectories| directories whose parents they share.
+static std::vector<std::string> PushedFiles(const std::string& root, int depth) {
+    std::string parent = root;
+    for (int i = 0; i < depth - 1; ++i) {
+        parent += StringPrintf("/dir%d", i);
+    }
+
+    std::vector<std::string> files;
+    for (int dir = 0; dir < kLeafDirectories; ++dir) {
+        for (int file = 0; file < kFilesPerDirectory; ++file) {
+            files.push_back(StringPrintf("%s/leaf%d/file%d", parent.c_str(), dir, file));
+        }
+    }
+    return files;
+}
+
+// Creates each file the way handle_send_file does: making its directory only once the open says
+// it's missing. Without |cached|, every file starts from an empty cache, as if there were none.
+static void Push(const std::vector<std::string>& files, bool cached) {
+    SyncDirectoryCache dirs;
+    for (const std::string& file : files) {
+        if (!cached) dirs.Clear();
+        unique_fd fd(open(file.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644));
+        if (fd < 0 && errno == ENOENT) {
+            CHECK(dirs.SecureMkdirs(android::base::Dirname(file)));
+            fd.reset(open(file.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644));
+        }
+        CHECK(fd >= 0) << "couldn't create " << file;
+    }
+}
+
+// Every file with a missing directory walks that directory's parents from /, as it used to.
+void BM_SecureMkdirs_Uncached(benchmark::State& state) {
+    TmpfsDir root;
+    std::vector<std::string> files = PushedFiles(root.path, state.range(0));
+    for (auto _ : state) {
+        Push(files, false);
+
+        state.PauseTiming();
+        root.Remove();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * files.size());
+}
+BENCHMARK(BM_SecureMkdirs_Uncached)->Arg(2)->Arg(4)->Arg(8)->Arg(16);
+
+// One cache for the whole push, as a sync session has.
+void BM_SecureMkdirs_Cached(benchmark::State& state) {
+    TmpfsDir root;
+    std::vector<std::string> files = PushedFiles(root.path, state.range(0));
+    for (auto _ : state) {
+        Push(files, true);
+
+        state.PauseTiming();
+        root.Remove();
+        state.ResumeTiming();
+    }
+    state.SetItemsProcessed(state.iterations() * files.size());
+}
+BENCHMARK(BM_SecureMkdirs_Cached)->Arg(2)->Arg(4)->Arg(8)->Arg(16);
+
+BENCHMARK_MAIN();
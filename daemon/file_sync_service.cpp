@@ -22,122 +22,66 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <utime.h>
 
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <memory>
+#include <mutex>
 #include <optional>
+#include <set>
 #include <span>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include <android-base/file.h>
-#include <android-base/macros.h>
 #include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 
 #include <adbd_fs.h>
+#include <openssl/sha.h>
 
 // Needed for __android_log_security_bswrite.
 #include <private/android_logger.h>
 
 #if defined(__ANDROID__)
-#include <linux/capability.h>
 #include <selinux/android.h>
-#include <sys/xattr.h>
 #endif
 
 #include "adb.h"
 #include "adb_io.h"
 #include "adb_trace.h"
 #include "adb_utils.h"
-#include "brotli_utils.h"
+#include "compression_policy.h"
+#include "compression_utils.h"
+#include "file_sync_delta.h"
 #include "file_sync_protocol.h"
+#include "ordered_work_queue.h"
 #include "security_log_tags.h"
 #include "sysdeps/errno.h"
 
+#include "daemon/file_sync_dirs.h"
+
 using android::base::borrowed_fd;
 using android::base::Dirname;
 using android::base::StringPrintf;
 
-static bool should_use_fs_config(const std::string& path) {
-#if defined(__ANDROID__)
-    // TODO: use fs_config to configure permissions on /data too.
-    return !android::base::StartsWith(path, "/data/");
-#else
-    UNUSED(path);
-    return false;
-#endif
-}
-
-static bool update_capabilities(const char* path, uint64_t capabilities) {
-#if defined(__ANDROID__)
-    if (capabilities == 0) {
-        // Ensure we clean up in case the capabilities weren't 0 in the past.
-        removexattr(path, XATTR_NAME_CAPS);
-        return true;
-    }
-
-    vfs_cap_data cap_data = {};
-    cap_data.magic_etc = VFS_CAP_REVISION_2 | VFS_CAP_FLAGS_EFFECTIVE;
-    cap_data.data[0].permitted = (capabilities & 0xffffffff);
-    cap_data.data[0].inheritable = 0;
-    cap_data.data[1].permitted = (capabilities >> 32);
-    cap_data.data[1].inheritable = 0;
-    return setxattr(path, XATTR_NAME_CAPS, &cap_data, sizeof(cap_data), 0) != -1;
-#else
-    UNUSED(path, capabilities);
-    return true;
-#endif
-}
-
-static bool secure_mkdirs(const std::string& path) {
-    if (path[0] != '/') return false;
-
-    std::vector<std::string> path_components = android::base::Split(path, "/");
-    std::string partial_path;
-    for (const auto& path_component : path_components) {
-        uid_t uid = -1;
-        gid_t gid = -1;
-        mode_t mode = 0775;
-        uint64_t capabilities = 0;
-
-        if (path_component.empty()) {
-            continue;
-        }
-
-        if (partial_path.empty() || partial_path.back() != OS_PATH_SEPARATOR) {
-            partial_path += OS_PATH_SEPARATOR;
-        }
-        partial_path += path_component;
-
-        if (should_use_fs_config(partial_path)) {
-            adbd_fs_config(partial_path.c_str(), 1, nullptr, &uid, &gid, &mode, &capabilities);
-        }
-        if (adb_mkdir(partial_path.c_str(), mode) == -1) {
-            if (errno != EEXIST) {
-                return false;
-            }
-        } else {
-            if (chown(partial_path.c_str(), uid, gid) == -1) return false;
-
-#if defined(__ANDROID__)
-            // Not all filesystems support setting SELinux labels. http://b/23530370.
-            selinux_android_restorecon(partial_path.c_str(), 0);
-#endif
-
-            if (!update_capabilities(partial_path.c_str(), capabilities)) return false;
-        }
-    }
-    return true;
-}
-
 static bool do_lstat_v1(int s, const char* path) {
     syncmsg msg = {};
     msg.stat_v1.id = ID_LSTAT_V1;
@@ -150,9 +94,9 @@ static bool do_lstat_v1(int s, const char* path) {
     return WriteFdExactly(s, &msg.stat_v1, sizeof(msg.stat_v1));
 }
 
-static bool do_stat_v2(int s, uint32_t id, const char* path) {
-    syncmsg msg = {};
-    msg.stat_v2.id = id;
+static void stat_v2(uint32_t id, const char* path, sync_stat_v2* msg) {
+    *msg = {};
+    msg->id = id;
 
     decltype(&stat) stat_fn;
     if (id == ID_STAT_V2) {
@@ -164,20 +108,24 @@ static bool do_stat_v2(int s, uint32_t id, const char* path) {
     struct stat st = {};
     int rc = stat_fn(path, &st);
     if (rc == -1) {
-        msg.stat_v2.error = errno_to_wire(errno);
+        msg->error = errno_to_wire(errno);
     } else {
-        msg.stat_v2.dev = st.st_dev;
-        msg.stat_v2.ino = st.st_ino;
-        msg.stat_v2.mode = st.st_mode;
-        msg.stat_v2.nlink = st.st_nlink;
-        msg.stat_v2.uid = st.st_uid;
-        msg.stat_v2.gid = st.st_gid;
-        msg.stat_v2.size = st.st_size;
-        msg.stat_v2.atime = st.st_atime;
-        msg.stat_v2.mtime = st.st_mtime;
-        msg.stat_v2.ctime = st.st_ctime;
+        msg->dev = st.st_dev;
+        msg->ino = st.st_ino;
+        msg->mode = st.st_mode;
+        msg->nlink = st.st_nlink;
+        msg->uid = st.st_uid;
+        msg->gid = st.st_gid;
+        msg->size = st.st_size;
+        msg->atime = st.st_atime;
+        msg->mtime = st.st_mtime;
+        msg->ctime = st.st_ctime;
     }
+}
 
+static bool do_stat_v2(int s, uint32_t id, const char* path) {
+    syncmsg msg;
+    stat_v2(id, path, &msg.stat_v2);
     return WriteFdExactly(s, &msg.stat_v2, sizeof(msg.stat_v2));
 }
 
@@ -266,15 +214,475 @@ static bool SendSyncFailErrno(borrowed_fd fd, const std::string& reason) {
     return SendSyncFail(fd, StringPrintf("%s: %s", reason.c_str(), strerror(errno)));
 }
 
-static bool handle_send_file_compressed(borrowed_fd s, unique_fd fd, uint32_t* timestamp) {
+// Reads the `count` length-prefixed paths that follow a stat_batch or hash_batch request.
+static bool read_path_list(int s, uint32_t count, std::vector<std::string>* paths) {
+    paths->resize(count);
+    for (std::string& path : *paths) {
+        uint32_t path_length;
+        if (!ReadFdExactly(s, &path_length, sizeof(path_length))) {
+            SendSyncFail(s, "path length read failure");
+            return false;
+        }
+        if (path_length > 1024) {
+            SendSyncFail(s, "path too long");
+            return false;
+        }
+        path.resize(path_length);
+        if (!ReadFdExactly(s, path.data(), path_length)) {
+            SendSyncFail(s, "filename read failure");
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool do_stat_batch(int s) {
+    syncmsg msg;
+    if (!ReadFdExactly(s, &msg.stat_batch_setup, sizeof(msg.stat_batch_setup))) {
+        PLOG(ERROR) << "failed to read stat_batch setup packet";
+        return false;
+    }
+
+    uint32_t id = msg.stat_batch_setup.stat_id;
+    if (id != ID_STAT_V2 && id != ID_LSTAT_V2) {
+        SendSyncFail(s, android::base::StringPrintf("unknown stat id: %#x", id));
+        return false;
+    }
+    uint32_t count = msg.stat_batch_setup.count;
+    if (count > SYNC_STAT_BATCH_MAX) {
+        SendSyncFail(s, "too many paths");
+        return false;
+    }
+
+    // Read every path before answering, so that the client never has to read while it's still
+    // writing the request.
+    std::vector<std::string> paths;
+    if (!read_path_list(s, count, &paths)) {
+        return false;
+    }
+
+    std::vector<sync_stat_v2> responses(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        stat_v2(id, paths[i].c_str(), &responses[i]);
+    }
+    return WriteFdExactly(s, responses.data(), responses.size() * sizeof(sync_stat_v2));
+}
+
+// Hashes |length| bytes of the file from |offset|, or as many as there are.
+static void hash_file(const std::string& path, sync_hash* msg, uint64_t offset = 0,
+                      uint64_t length = UINT64_MAX) {
+    *msg = {};
+    msg->id = ID_HASH;
+
+    unique_fd fd(adb_open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd < 0) {
+        msg->error = errno_to_wire(errno);
+        return;
+    }
+    if (offset != 0 && adb_lseek(fd, offset, SEEK_SET) == -1) {
+        msg->error = errno_to_wire(errno);
+        return;
+    }
+    posix_fadvise(fd.get(), offset, 0, POSIX_FADV_SEQUENTIAL | POSIX_FADV_NOREUSE);
+
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    std::vector<char> buffer(SYNC_DATA_MAX);
+    while (msg->size < length) {
+        size_t want = std::min<uint64_t>(buffer.size(), length - msg->size);
+        ssize_t rc = adb_read(fd, buffer.data(), want);
+        if (rc < 0) {
+            msg->error = errno_to_wire(errno);
+            return;
+        } else if (rc == 0) {
+            break;
+        }
+        SHA256_Update(&ctx, buffer.data(), rc);
+        msg->size += rc;
+    }
+    SHA256_Final(msg->sha256, &ctx);
+}
+
+static bool do_hash_batch(int s) {
+    syncmsg msg;
+    if (!ReadFdExactly(s, &msg.hash_batch_setup, sizeof(msg.hash_batch_setup))) {
+        PLOG(ERROR) << "failed to read hash_batch setup packet";
+        return false;
+    }
+
+    uint32_t count = msg.hash_batch_setup.count;
+    if (count > SYNC_HASH_BATCH_MAX) {
+        SendSyncFail(s, "too many paths");
+        return false;
+    }
+    std::vector<std::string> paths;
+    if (!read_path_list(s, count, &paths)) {
+        return false;
+    }
+
+    // Hashing is CPU bound, so spread the batch over a few threads.
+    std::vector<sync_hash> responses(count);
+    std::atomic<size_t> next = 0;
+    auto hash_files = [&]() {
+        for (size_t i = next++; i < count; i = next++) {
+            hash_file(paths[i], &responses[i]);
+        }
+    };
+    size_t thread_count = std::min<size_t>(
+            {count, 4, std::max<size_t>(1, std::thread::hardware_concurrency())});
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < thread_count; ++i) {
+        threads.emplace_back(hash_files);
+    }
+    hash_files();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    return WriteFdExactly(s, responses.data(), responses.size() * sizeof(sync_hash));
+}
+
+static bool do_hash_range(int s, const char* path) {
+    syncmsg msg;
+    if (!ReadFdExactly(s, &msg.hash_range_setup, sizeof(msg.hash_range_setup))) {
+        PLOG(ERROR) << "failed to read hash_range setup packet";
+        return false;
+    }
+
+    sync_hash response;
+    hash_file(path, &response, msg.hash_range_setup.offset, msg.hash_range_setup.length);
+    return WriteFdExactly(s, &response, sizeof(response));
+}
+
+static bool do_list_recursive(int s, const char* path) {
+    // Entries are batched up into writes of about SYNC_DATA_MAX bytes.
+    std::string buffer;
+    auto flush = [&]() {
+        bool result = WriteFdExactly(s, buffer.data(), buffer.size());
+        buffer.clear();
+        return result;
+    };
+    auto append = [&](uint32_t id, const std::string& name, const struct stat& st) {
+        sync_rdent dent = {};
+        dent.id = id;
+        dent.mode = st.st_mode;
+        dent.size = st.st_size;
+        dent.mtime = st.st_mtime;
+        dent.namelen = name.size();
+        buffer.append(reinterpret_cast<const char*>(&dent), sizeof(dent));
+        buffer.append(name);
+        return buffer.size() < SYNC_DATA_MAX || flush();
+    };
+
+    // Directories that were reached through more than one path (via symbolic links) are only
+    // walked once.
+    std::set<std::pair<dev_t, ino_t>> visited;
+    struct stat root_st;
+    if (stat(path, &root_st) == 0) {
+        visited.emplace(root_st.st_dev, root_st.st_ino);
+    }
+
+    // Relative paths of the directories still to be walked.
+    std::vector<std::string> pending = {""};
+    while (!pending.empty()) {
+        std::string dir_name = std::move(pending.back());
+        pending.pop_back();
+
+        std::string dir_path =
+                dir_name.empty() ? path : StringPrintf("%s/%s", path, dir_name.c_str());
+        std::unique_ptr<DIR, int (*)(DIR*)> d(opendir(dir_path.c_str()), closedir);
+        if (!d) continue;
+
+        dirent* de;
+        while ((de = readdir(d.get()))) {
+            if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+
+            std::string name = dir_name.empty() ? de->d_name : dir_name + "/" + de->d_name;
+            std::string filename = dir_path + "/" + de->d_name;
+
+            struct stat st;
+            if (lstat(filename.c_str(), &st) != 0) continue;
+            if (S_ISLNK(st.st_mode)) {
+                // Report what the link points to, or the link itself if it's dangling.
+                struct stat target_st;
+                if (stat(filename.c_str(), &target_st) == 0) {
+                    st = target_st;
+                }
+            }
+
+            if (S_ISDIR(st.st_mode) && visited.emplace(st.st_dev, st.st_ino).second) {
+                pending.push_back(name);
+            }
+
+            if (!append(ID_RDENT, name, st)) {
+                return false;
+            }
+        }
+    }
+
+    struct stat done_st = {};
+    return append(ID_DONE, "", done_st) && flush();
+}
+
+// Starts writeback of a pushed file as it's written, and waits for the writeback of the data
+// before that, so that pushing a multi-GB file can't fill a low-RAM device with dirty pages.
+class WritebackLimiter {
+  public:
+    // The writes start wherever |fd| is positioned, which is only past the start of the file for
+    // a range of it.
+    explicit WritebackLimiter(borrowed_fd fd)
+        : fd_(fd), start_(std::max<int64_t>(adb_lseek(fd, 0, SEEK_CUR), 0)) {}
+
+    // Called after the next |length| bytes of the file have been written.
+    void Wrote(size_t length) {
+        written_ += length;
+        while (written_ - started_ >= kChunkSize) {
+            sync_file_range(fd_.get(), start_ + started_, kChunkSize, SYNC_FILE_RANGE_WRITE);
+            if (started_ >= kChunkSize) {
+                sync_file_range(fd_.get(), start_ + started_ - kChunkSize, kChunkSize,
+                                SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                                        SYNC_FILE_RANGE_WAIT_AFTER);
+            }
+            started_ += kChunkSize;
+        }
+    }
+
+  private:
+    static constexpr uint64_t kChunkSize = 8 * 1024 * 1024;
+
+    borrowed_fd fd_;
+    uint64_t start_;
+    uint64_t written_ = 0;
+    uint64_t started_ = 0;
+};
+
+// Writes a pushed file on a thread of its own, so that reading the next data from the socket
+// overlaps with writing the data before it to storage. Push can then go as fast as the slower of
+// the two, rather than having to wait for each in turn.
+class SendFileWriter {
+  public:
+    explicit SendFileWriter(borrowed_fd fd)
+        : fd_(fd), writeback_(fd), thread_([this]() { Run(); }) {}
+
+    // Throws away anything that hasn't been written yet.
+    ~SendFileWriter() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            blocks_.clear();
+            finishing_ = true;
+        }
+        work_available_.notify_one();
+        if (thread_.joinable()) thread_.join();
+    }
+
+    // Queues |block| to be written, first waiting for earlier blocks to be written if too much is
+    // queued already. Returns false, with errno set, if an earlier write failed.
+    bool Write(Block&& block) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        space_available_.wait(lock, [this]() {
+            return error_ != 0 || queued_bytes_ < kMaxQueuedBytes;
+        });
+        if (error_ != 0) {
+            errno = error_;
+            return false;
+        }
+        queued_bytes_ += block.size();
+        blocks_.push_back(std::move(block));
+        work_available_.notify_one();
+        return true;
+    }
+
+    bool Write(std::span<const char> data) {
+        Block block(data.size());
+        memcpy(block.data(), data.data(), data.size());
+        return Write(std::move(block));
+    }
+
+    // Waits for everything queued to be written. Returns false, with errno set, if any of it
+    // couldn't be.
+    bool Finish() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            finishing_ = true;
+        }
+        work_available_.notify_one();
+        thread_.join();
+        if (error_ != 0) {
+            errno = error_;
+            return false;
+        }
+        return true;
+    }
+
+  private:
+    // Enough to ride out the flash stalling for a moment, without holding on to too much memory
+    // on a low-RAM device.
+    static constexpr size_t kMaxQueuedBytes = 4 * SYNC_DATA_MAX_LARGE;
+
+    void Run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            work_available_.wait(lock, [this]() { return finishing_ || !blocks_.empty(); });
+            if (blocks_.empty()) return;
+
+            Block block = std::move(blocks_.front());
+            blocks_.pop_front();
+            if (error_ == 0) {
+                lock.unlock();
+                int error = 0;
+                if (WriteFdExactly(fd_, block.data(), block.size())) {
+                    writeback_.Wrote(block.size());
+                } else {
+                    error = errno;
+                }
+                lock.lock();
+                if (error_ == 0) error_ = error;
+            }
+            queued_bytes_ -= block.size();
+            space_available_.notify_one();
+        }
+    }
+
+    borrowed_fd fd_;
+    WritebackLimiter writeback_;
+
+    std::mutex mutex_;
+    std::condition_variable work_available_;
+    std::condition_variable space_available_;
+    std::deque<Block> blocks_;
+    size_t queued_bytes_ = 0;
+    bool finishing_ = false;
+    int error_ = 0;
+
+    std::thread thread_;
+};
+
+// Moves pushed data from the socket to the file through a pipe, so that it's never copied through
+// adbd. As with SendFileWriter, the file is written on a thread of its own, with the pipe as the
+// queue. Either end that can't splice falls back to reading and writing.
+class SpliceFileWriter {
+  public:
+    // Returns nullptr if there's no pipe to be had.
+    static std::unique_ptr<SpliceFileWriter> Create(borrowed_fd fd) {
+        unique_fd pipe_read, pipe_write;
+        if (!android::base::Pipe(&pipe_read, &pipe_write)) {
+            return nullptr;
+        }
+        // The bigger the pipe, the less each thread waits for the other. The default will do if
+        // the system won't allow this.
+        fcntl(pipe_write.get(), F_SETPIPE_SZ, SYNC_DATA_MAX_LARGE);
+        return std::unique_ptr<SpliceFileWriter>(
+                new SpliceFileWriter(fd, std::move(pipe_read), std::move(pipe_write)));
+    }
+
+    ~SpliceFileWriter() { Finish(); }
+
+    // Moves the next |length| bytes from |s| to the file. Returns false if |s| couldn't be read, or
+    // if writing the file failed, in which case Finish() says so. Either way, |unread| is set to
+    // how many of the |length| bytes are still to be read from |s|.
+    bool Write(borrowed_fd s, size_t length, std::vector<char>& buffer, size_t* unread) {
+        *unread = length;
+        while (*unread > 0) {
+            ssize_t rc;
+            if (splice_in_) {
+                rc = TEMP_FAILURE_RETRY(splice(s.get(), nullptr, pipe_write_.get(), nullptr,
+                                               *unread, SPLICE_F_MOVE));
+                if (rc == -1 && errno == EINVAL) {
+                    splice_in_ = false;
+                    continue;
+                }
+            } else {
+                rc = adb_read(s, buffer.data(), std::min(*unread, buffer.size()));
+                if (rc > 0 && !WriteFdExactly(pipe_write_, buffer.data(), rc)) {
+                    *unread -= rc;
+                    return false;
+                }
+            }
+            if (rc <= 0) {
+                return false;
+            }
+            *unread -= rc;
+        }
+        return true;
+    }
+
+    // Waits for everything to be written. Returns false, with errno set, if any of it couldn't be.
+    bool Finish() {
+        pipe_write_.reset();
+        if (thread_.joinable()) thread_.join();
+        if (error_ != 0) {
+            errno = error_;
+            return false;
+        }
+        return true;
+    }
+
+  private:
+    SpliceFileWriter(borrowed_fd fd, unique_fd pipe_read, unique_fd pipe_write)
+        : fd_(fd),
+          writeback_(fd),
+          pipe_read_(std::move(pipe_read)),
+          pipe_write_(std::move(pipe_write)),
+          thread_([this]() { Run(); }) {}
+
+    void Run() {
+        bool splice_out = true;
+        std::vector<char> buffer;
+        while (true) {
+            ssize_t rc;
+            if (splice_out) {
+                rc = TEMP_FAILURE_RETRY(splice(pipe_read_.get(), nullptr, fd_.get(), nullptr,
+                                               SYNC_DATA_MAX_LARGE, SPLICE_F_MOVE));
+                if (rc == -1 && errno == EINVAL) {
+                    splice_out = false;
+                    buffer.resize(SYNC_DATA_MAX);
+                    continue;
+                }
+            } else {
+                rc = adb_read(pipe_read_, buffer.data(), buffer.size());
+                if (rc > 0 && !WriteFdExactly(fd_, buffer.data(), rc)) {
+                    rc = -1;
+                }
+            }
+
+            if (rc == 0) {
+                return;
+            } else if (rc < 0) {
+                error_ = errno;
+                // Stop Write() too, with EPIPE.
+                pipe_read_.reset();
+                return;
+            }
+            writeback_.Wrote(rc);
+        }
+    }
+
+    borrowed_fd fd_;
+    WritebackLimiter writeback_;
+    unique_fd pipe_read_;
+    unique_fd pipe_write_;
+    bool splice_in_ = true;
+    int error_ = 0;
+
+    std::thread thread_;
+};
+
+static bool handle_send_file_compressed(borrowed_fd s, unique_fd fd, uint32_t* timestamp,
+                                        CompressionType compression, std::vector<char>& buffer) {
     syncmsg msg;
-    Block decode_buffer(SYNC_DATA_MAX);
-    BrotliDecoder decoder(std::span(decode_buffer.data(), decode_buffer.size()));
+    SendFileWriter writer(fd);
+    std::unique_ptr<Decoder> decoder =
+            CreateDecoder(compression, std::span(buffer.data(), buffer.size()));
+    bool decoding = true;
     while (true) {
         if (!ReadFdExactly(s, &msg.data, sizeof(msg.data))) return false;
 
         if (msg.data.id != ID_DATA) {
             if (msg.data.id == ID_DONE) {
+                if (!writer.Finish()) {
+                    SendSyncFailErrno(s, "write failed");
+                    return false;
+                }
                 *timestamp = msg.data.size;
                 return true;
             }
@@ -282,31 +690,45 @@ static bool handle_send_file_compressed(borrowed_fd s, unique_fd fd, uint32_t* t
             return false;
         }
 
+        if (msg.data.size > buffer.size()) {
+            SendSyncFail(s, "oversize data message");
+            return false;
+        }
         Block block(msg.data.size);
         if (!ReadFdExactly(s, block.data(), msg.data.size)) return false;
-        decoder.Append(std::move(block));
+
+        // Anything after the end of the compressed stream is the rest of the file as it is.
+        if (!decoding) {
+            if (!writer.Write(std::move(block))) {
+                SendSyncFailErrno(s, "write failed");
+                return false;
+            }
+            continue;
+        }
+        decoder->Append(std::move(block));
 
         while (true) {
             std::span<char> output;
-            BrotliDecodeResult result = decoder.Decode(&output);
-            if (result == BrotliDecodeResult::Error) {
+            DecodeResult result = decoder->Decode(&output);
+            if (result == DecodeResult::Error) {
                 SendSyncFailErrno(s, "decompress failed");
                 return false;
             }
 
-            if (!WriteFdExactly(fd, output.data(), output.size())) {
+            if (!output.empty() && !writer.Write(output)) {
                 SendSyncFailErrno(s, "write failed");
                 return false;
             }
 
-            if (result == BrotliDecodeResult::NeedInput) {
+            if (result == DecodeResult::NeedInput) {
                 break;
-            } else if (result == BrotliDecodeResult::MoreOutput) {
+            } else if (result == DecodeResult::MoreOutput) {
                 continue;
-            } else if (result == BrotliDecodeResult::Done) {
+            } else if (result == DecodeResult::Done) {
+                decoding = false;
                 break;
             } else {
-                LOG(FATAL) << "invalid BrotliDecodeResult: " << static_cast<int>(result);
+                LOG(FATAL) << "invalid DecodeResult: " << static_cast<int>(result);
             }
         }
     }
@@ -314,15 +736,148 @@ static bool handle_send_file_compressed(borrowed_fd s, unique_fd fd, uint32_t* t
     __builtin_unreachable();
 }
 
+// Receives a file sent as sync_frames, decompressing several of them at once.
+static bool handle_send_file_framed(borrowed_fd s, unique_fd fd, uint32_t* timestamp,
+                                    CompressionType compression) {
+    // Leave some cores for whatever else the device is doing.
+    size_t thread_count = std::clamp<size_t>(std::thread::hardware_concurrency() / 2, 1, 4);
+    OrderedWorkQueue queue(thread_count);
+    SendFileWriter writer(fd);
+
+    auto write_frame = [&]() {
+        Block block;
+        if (!queue.Pop(&block)) {
+            SendSyncFail(s, "decompress failed");
+            return false;
+        }
+        if (!writer.Write(std::move(block))) {
+            SendSyncFailErrno(s, "write failed");
+            return false;
+        }
+        return true;
+    };
+
+    syncmsg msg;
+    while (true) {
+        if (!ReadFdExactly(s, &msg.data, sizeof(msg.data))) return false;
+
+        if (msg.data.id == ID_DONE) {
+            while (queue.size() > 0) {
+                if (!write_frame()) return false;
+            }
+            if (!writer.Finish()) {
+                SendSyncFailErrno(s, "write failed");
+                return false;
+            }
+            *timestamp = msg.data.size;
+            return true;
+        } else if (msg.data.id != ID_FRAME) {
+            SendSyncFail(s, "invalid data message");
+            return false;
+        }
+
+        if (!ReadFdExactly(s, &msg.frame.compressed_size, sizeof(msg.frame.compressed_size))) {
+            return false;
+        }
+        uint32_t size = msg.frame.size;
+        uint32_t compressed_size = msg.frame.compressed_size;
+        if (size > SYNC_FRAME_MAX || compressed_size > size) {
+            SendSyncFail(s, "invalid frame size");
+            return false;
+        }
+
+        Block block(compressed_size);
+        if (!ReadFdExactly(s, block.data(), compressed_size)) return false;
+
+        if (compressed_size == size) {
+            queue.Push(std::move(block), [](Block*) { return true; });
+        } else {
+            queue.Push(std::move(block), [compression, size](Block* block) {
+                return DecompressFrame(compression, size, block);
+            });
+        }
+
+        // Keep every thread busy, without letting frames pile up.
+        if (queue.size() >= 2 * thread_count && !write_frame()) {
+            return false;
+        }
+    }
+}
+
+// Moves |fd| past a hole of |length| bytes, punching out whatever the file already has there, or
+// writing zeroes where that can't be done, as on a block device.
+static bool skip_hole(borrowed_fd fd, uint64_t length, std::vector<char>& buffer) {
+    int64_t offset = adb_lseek(fd, 0, SEEK_CUR);
+    if (offset != -1 &&
+        fallocate(fd.get(), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length) == 0) {
+        return adb_lseek(fd, length, SEEK_CUR) != -1;
+    }
+
+    std::fill(buffer.begin(), buffer.end(), 0);
+    while (length > 0) {
+        size_t chunk = std::min<uint64_t>(length, buffer.size());
+        if (!WriteFdExactly(fd, buffer.data(), chunk)) return false;
+        length -= chunk;
+    }
+    return true;
+}
+
+// Reads and throws away |length| bytes.
+static bool skip_send_data(borrowed_fd s, size_t length, std::vector<char>& buffer) {
+    while (length > 0) {
+        size_t chunk = std::min(length, buffer.size());
+        if (!ReadFdExactly(s, &buffer[0], chunk)) return false;
+        length -= chunk;
+    }
+    return true;
+}
+
+// With |sparse|, the file can have ID_HOLE messages among its ID_DATA messages.
 static bool handle_send_file_uncompressed(borrowed_fd s, unique_fd fd, uint32_t* timestamp,
-                                          std::vector<char>& buffer) {
+                                          bool sparse, std::vector<char>& buffer) {
     syncmsg msg;
+    std::unique_ptr<SpliceFileWriter> splice_writer;
+    std::unique_ptr<SendFileWriter> writer;
+    // The writers write wherever |fd| is positioned, so they're finished before each hole, and
+    // started again after it.
+    auto start_writer = [&]() {
+        splice_writer = SpliceFileWriter::Create(fd);
+        if (!splice_writer) {
+            writer = std::make_unique<SendFileWriter>(fd);
+        }
+    };
+    auto finish_writer = [&]() {
+        bool result = splice_writer ? splice_writer->Finish() : writer->Finish();
+        splice_writer.reset();
+        writer.reset();
+        return result;
+    };
+    start_writer();
 
     while (true) {
         if (!ReadFdExactly(s, &msg.data, sizeof(msg.data))) return false;
 
-        if (msg.data.id != ID_DATA) {
+        if (msg.data.id == ID_HOLE && sparse) {
+            if (!finish_writer() || !skip_hole(fd, msg.data.size, buffer)) {
+                SendSyncFailErrno(s, "write failed");
+                return false;
+            }
+            start_writer();
+            continue;
+        } else if (msg.data.id != ID_DATA) {
             if (msg.data.id == ID_DONE) {
+                if (!finish_writer()) {
+                    SendSyncFailErrno(s, "write failed");
+                    return false;
+                }
+                // A file that ends in a hole has to be made long enough to have it.
+                struct stat st;
+                int64_t end = adb_lseek(fd, 0, SEEK_CUR);
+                if (sparse && fstat(fd.get(), &st) == 0 && S_ISREG(st.st_mode) &&
+                    end > st.st_size && ftruncate(fd.get(), end) == -1) {
+                    SendSyncFailErrno(s, "write failed");
+                    return false;
+                }
                 *timestamp = msg.data.size;
                 return true;
             }
@@ -330,59 +885,165 @@ static bool handle_send_file_uncompressed(borrowed_fd s, unique_fd fd, uint32_t*
             return false;
         }
 
-        if (msg.data.size > buffer.size()) {  // TODO: resize buffer?
+        if (msg.data.size > buffer.size()) {
             SendSyncFail(s, "oversize data message");
             return false;
         }
-        if (!ReadFdExactly(s, &buffer[0], msg.data.size)) return false;
-        if (!WriteFdExactly(fd, &buffer[0], msg.data.size)) {
+
+        if (splice_writer) {
+            size_t unread;
+            if (!splice_writer->Write(s, msg.data.size, buffer, &unread)) {
+                if (!splice_writer->Finish()) {
+                    // Get to the end of this message first, so that discard_send_data starts at
+                    // the next one.
+                    int error = errno;
+                    if (skip_send_data(s, unread, buffer)) {
+                        errno = error;
+                        SendSyncFailErrno(s, "write failed");
+                    }
+                }
+                return false;
+            }
+            continue;
+        }
+
+        Block block(msg.data.size);
+        if (!ReadFdExactly(s, block.data(), msg.data.size)) return false;
+        if (!writer->Write(std::move(block))) {
             SendSyncFailErrno(s, "write failed");
             return false;
         }
     }
 }
 
-static bool handle_send_file(borrowed_fd s, const char* path, uint32_t* timestamp, uid_t uid,
-                             gid_t gid, uint64_t capabilities, mode_t mode, bool compressed,
-                             std::vector<char>& buffer, bool do_unlink) {
-    int rc;
+// If there's a problem on the device, we'll send an ID_FAIL message and
+// close the socket. Unfortunately the kernel will sometimes throw that
+// data away if the other end keeps writing without reading (which is
+// the case with old versions of adb). To maintain compatibility, keep
+// reading and throwing away ID_DATA (and ID_COPY, ID_FRAME and ID_HOLE) packets
+// until the other side notices that we've reported an error.
+static void discard_send_data(borrowed_fd s, std::vector<char>& buffer) {
     syncmsg msg;
+    while (true) {
+        if (!ReadFdExactly(s, &msg.data, sizeof(msg.data))) break;
 
-    __android_log_security_bswrite(SEC_TAG_ADB_SEND_FILE, path);
+        if (msg.data.id == ID_DONE) {
+            break;
+        } else if (msg.data.id == ID_COPY) {
+            if (!ReadFdExactly(s, &msg.copy.block, sizeof(msg.copy.block))) break;
+            continue;
+        } else if (msg.data.id == ID_HOLE) {
+            continue;
+        } else if (msg.data.id == ID_FRAME) {
+            if (!ReadFdExactly(s, &msg.frame.compressed_size, sizeof(msg.frame.compressed_size))) {
+                break;
+            }
+            if (msg.frame.compressed_size > SYNC_FRAME_MAX) {
+                D("handle_send_fail received oversized frame of length '%u' during failure",
+                  msg.frame.compressed_size);
+                break;
+            }
+            if (!skip_send_data(s, msg.frame.compressed_size, buffer)) break;
+            continue;
+        } else if (msg.data.id != ID_DATA) {
+            char id[5];
+            memcpy(id, &msg.data.id, sizeof(msg.data.id));
+            id[4] = '\0';
+            D("handle_send_fail received unexpected id '%s' during failure", id);
+            break;
+        }
 
-    unique_fd fd(adb_open_mode(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode));
+        if (msg.data.size > buffer.size()) {
+            D("handle_send_fail received oversized packet of length '%u' during failure",
+              msg.data.size);
+            break;
+        }
 
-    if (fd < 0 && errno == ENOENT) {
-        if (!secure_mkdirs(Dirname(path))) {
-            SendSyncFailErrno(s, "secure_mkdirs failed");
-            goto fail;
+        if (!ReadFdExactly(s, &buffer[0], msg.data.size)) break;
+    }
+}
+
+// Creates the file that a push writes, with the owner and mode it should have. Returns what went
+// wrong, with errno set, if it can't.
+static const char* create_send_file(const char* path, uid_t uid, gid_t gid, mode_t mode,
+                                    SyncDirectoryCache& dirs, unique_fd* fd) {
+    fd->reset(adb_open_mode(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode));
+
+    if (*fd < 0 && errno == ENOENT) {
+        if (!dirs.SecureMkdirs(Dirname(path))) {
+            return "secure_mkdirs failed";
         }
-        fd.reset(adb_open_mode(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode));
+        fd->reset(adb_open_mode(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode));
     }
-    if (fd < 0 && errno == EEXIST) {
-        fd.reset(adb_open_mode(path, O_WRONLY | O_CLOEXEC, mode));
+    // Whatever's there is written to, but not through a symbolic link: a push has already
+    // removed any link that was there, and a resumed push's partial file is never one.
+    if (*fd < 0 && errno == EEXIST) {
+        fd->reset(adb_open_mode(path, O_WRONLY | O_NOFOLLOW | O_CLOEXEC, mode));
+    }
+    if (*fd < 0) {
+        return "couldn't create file";
+    }
+
+    if (fchown(fd->get(), uid, gid) == -1) {
+        return "fchown failed";
     }
-    if (fd < 0) {
-        SendSyncFailErrno(s, "couldn't create file");
-        goto fail;
-    } else {
-        if (fchown(fd.get(), uid, gid) == -1) {
-            SendSyncFailErrno(s, "fchown failed");
-            goto fail;
-        }
 
 #if defined(__ANDROID__)
-        // Not all filesystems support setting SELinux labels. http://b/23530370.
-        selinux_android_restorecon(path, 0);
+    // Not all filesystems support setting SELinux labels. http://b/23530370.
+    selinux_android_restorecon(path, 0);
 #endif
 
-        // fchown clears the setuid bit - restore it if present.
-        // Ignore the result of calling fchmod. It's not supported
-        // by all filesystems, so we don't check for success. b/12441485
-        fchmod(fd.get(), mode);
+    // fchown clears the setuid bit - restore it if present.
+    // Ignore the result of calling fchmod. It's not supported
+    // by all filesystems, so we don't check for success. b/12441485
+    fchmod(fd->get(), mode);
+    return nullptr;
+}
+
+// Whether the filesystem that |fd| is on has room for |size| more bytes. adbd running as root can
+// use the blocks that are reserved for root too.
+static bool have_space_for(borrowed_fd fd, uint64_t size) {
+    struct statvfs st;
+    if (fstatvfs(fd.get(), &st) != 0) return true;
+    uint64_t blocks = geteuid() == 0 ? st.f_bfree : st.f_bavail;
+    return blocks * st.f_frsize >= size;
+}
+
+// |size| is how big the file will be, or 0 if that isn't known.
+static bool handle_send_file(borrowed_fd s, const char* path, uint32_t* timestamp, uid_t uid,
+                             gid_t gid, uint64_t capabilities, mode_t mode,
+                             CompressionType compression, bool framed, bool sparse,
+                             uint64_t size, std::vector<char>& buffer, SyncDirectoryCache& dirs,
+                             bool do_unlink) {
+    int rc;
+    syncmsg msg;
+
+    __android_log_security_bswrite(SEC_TAG_ADB_SEND_FILE, path);
+
+    unique_fd fd;
+    if (const char* error = create_send_file(path, uid, gid, mode, dirs, &fd)) {
+        SendSyncFailErrno(s, error);
+        goto fail;
     }
 
     {
+        // Allocating the space up front keeps the file in fewer pieces, and saves updating its
+        // metadata as it grows. If there isn't room, say so now rather than part way through.
+        // Only a regular file takes space from its filesystem: a push to a device node doesn't.
+        struct stat st;
+        if (size != 0 && fstat(fd.get(), &st) == 0 && S_ISREG(st.st_mode)) {
+            if (!have_space_for(fd, size)) {
+                errno = ENOSPC;
+                SendSyncFailErrno(s, "couldn't allocate space");
+                goto fail;
+            }
+            // Not every filesystem can allocate space, but one that runs out part way can leave
+            // what it did allocate beyond the end of the file, so give that back.
+            if (fallocate(fd.get(), FALLOC_FL_KEEP_SIZE, 0, size) == -1 && errno == ENOSPC) {
+                ftruncate(fd.get(), 0);
+            }
+        }
+
         rc = posix_fadvise(fd.get(), 0, 0,
                            POSIX_FADV_SEQUENTIAL | POSIX_FADV_NOREUSE | POSIX_FADV_WILLNEED);
         if (rc != 0) {
@@ -390,10 +1051,13 @@ static bool handle_send_file(borrowed_fd s, const char* path, uint32_t* timestam
         }
 
         bool result;
-        if (compressed) {
-            result = handle_send_file_compressed(s, std::move(fd), timestamp);
+        if (framed) {
+            result = handle_send_file_framed(s, std::move(fd), timestamp, compression);
+        } else if (compression != CompressionType::None) {
+            result = handle_send_file_compressed(s, std::move(fd), timestamp, compression,
+                                                 buffer);
         } else {
-            result = handle_send_file_uncompressed(s, std::move(fd), timestamp, buffer);
+            result = handle_send_file_uncompressed(s, std::move(fd), timestamp, sparse, buffer);
         }
 
         if (!result) {
@@ -411,45 +1075,19 @@ static bool handle_send_file(borrowed_fd s, const char* path, uint32_t* timestam
     }
 
 fail:
-    // If there's a problem on the device, we'll send an ID_FAIL message and
-    // close the socket. Unfortunately the kernel will sometimes throw that
-    // data away if the other end keeps writing without reading (which is
-    // the case with old versions of adb). To maintain compatibility, keep
-    // reading and throwing away ID_DATA packets until the other side notices
-    // that we've reported an error.
-    while (true) {
-        if (!ReadFdExactly(s, &msg.data, sizeof(msg.data))) break;
-
-        if (msg.data.id == ID_DONE) {
-            break;
-        } else if (msg.data.id != ID_DATA) {
-            char id[5];
-            memcpy(id, &msg.data.id, sizeof(msg.data.id));
-            id[4] = '\0';
-            D("handle_send_fail received unexpected id '%s' during failure", id);
-            break;
-        }
-
-        if (msg.data.size > buffer.size()) {
-            D("handle_send_fail received oversized packet of length '%u' during failure",
-              msg.data.size);
-            break;
-        }
-
-        if (!ReadFdExactly(s, &buffer[0], msg.data.size)) break;
-    }
-
+    discard_send_data(s, buffer);
     if (do_unlink) adb_unlink(path);
     return false;
 }
 
 #if defined(_WIN32)
 extern bool handle_send_link(int s, const std::string& path,
-                             uint32_t* timestamp, std::vector<char>& buffer)
+                             uint32_t* timestamp, std::vector<char>& buffer,
+                             SyncDirectoryCache& dirs)
         __attribute__((error("no symlinks on Windows")));
 #else
 static bool handle_send_link(int s, const std::string& path, uint32_t* timestamp,
-                             std::vector<char>& buffer) {
+                             std::vector<char>& buffer, SyncDirectoryCache& dirs) {
     syncmsg msg;
 
     if (!ReadFdExactly(s, &msg.data, sizeof(msg.data))) return false;
@@ -471,7 +1109,7 @@ static bool handle_send_link(int s, const std::string& path, uint32_t* timestamp
         adb_unlink(path.c_str());
         auto ret = symlink(&buffer[0], path.c_str());
         if (ret && errno == ENOENT) {
-            if (!secure_mkdirs(Dirname(path))) {
+            if (!dirs.SecureMkdirs(Dirname(path))) {
                 SendSyncFailErrno(s, "secure_mkdirs failed");
                 return false;
             }
@@ -483,24 +1121,372 @@ static bool handle_send_link(int s, const std::string& path, uint32_t* timestamp
         }
     }
 
-    if (!ReadFdExactly(s, &msg.data, sizeof(msg.data))) return false;
-
-    if (msg.data.id == ID_DONE) {
-        *timestamp = msg.data.size;
-        msg.status.id = ID_OKAY;
-        msg.status.msglen = 0;
-        if (!WriteFdExactly(s, &msg.status, sizeof(msg.status))) return false;
+    if (!ReadFdExactly(s, &msg.data, sizeof(msg.data))) return false;
+
+    if (msg.data.id == ID_DONE) {
+        *timestamp = msg.data.size;
+        msg.status.id = ID_OKAY;
+        msg.status.msglen = 0;
+        if (!WriteFdExactly(s, &msg.status, sizeof(msg.status))) return false;
+    } else {
+        SendSyncFail(s, "invalid data message: expected ID_DONE");
+        return false;
+    }
+
+    return true;
+}
+#endif
+
+static void get_send_file_attributes(const std::string& path, mode_t* mode, uid_t* uid,
+                                     gid_t* gid, uint64_t* capabilities) {
+    // Copy user permission bits to "group" and "other" permissions.
+    *mode &= 0777;
+    *mode |= ((*mode >> 3) & 0070);
+    *mode |= ((*mode >> 3) & 0007);
+
+    *uid = -1;
+    *gid = -1;
+    *capabilities = 0;
+    if (should_use_fs_config(path)) {
+        adbd_fs_config(path.c_str(), 0, nullptr, uid, gid, mode, capabilities);
+    }
+}
+
+static void set_send_timestamp(const std::string& path, uint32_t timestamp) {
+    struct timeval tv[2];
+    tv[0].tv_sec = timestamp;
+    tv[0].tv_usec = 0;
+    tv[1].tv_sec = timestamp;
+    tv[1].tv_usec = 0;
+    lutimes(path.c_str(), tv);
+}
+
+// A file that's being pushed as ranges, possibly over several connections at once. It's created
+// when the first of its ranges arrives, and completed by whichever range finishes it. The file is
+// removed if the session fails, or if every connection that took part in it closes before it's
+// complete, but only while it's still the file that the session created.
+struct SendRangeSession {
+    ~SendRangeSession() { Discard(); }
+
+    // Removes the file and closes it, unless it's already been completed or discarded.
+    void Discard() {
+        struct stat st;
+        if (fd != -1 && lstat(path.c_str(), &st) == 0 && st.st_dev == dev && st.st_ino == ino) {
+            adb_unlink(path.c_str());
+        }
+        fd.reset();
+    }
+
+    uint64_t id;
+    uint64_t size;
+    std::string path;
+    dev_t dev;
+    ino_t ino;
+    unique_fd fd;
+    uint64_t bytes_done = 0;
+    bool failed = false;
+};
+
+// The range sessions that a sync connection has taken part in and that aren't complete yet. A
+// session lasts as long as any connection still holds it.
+using SendRangeSessions = std::vector<std::shared_ptr<SendRangeSession>>;
+
+// The sessions under way, by path. A session stays here once it's failed, so that its remaining
+// ranges fail too rather than starting the file again, until the connections that took part in it
+// have all closed, or another session for the same path replaces it. The state of every session
+// is guarded by the same mutex.
+static auto& send_range_mutex = *new std::mutex();
+static auto& send_range_sessions =
+        *new std::unordered_map<std::string, std::weak_ptr<SendRangeSession>>();
+
+// Returns the session that |range| belongs to, starting it if this is its first range to arrive,
+// and adds it to the sessions that the connection holds.
+static std::shared_ptr<SendRangeSession> join_send_range_session(borrowed_fd s,
+                                                                 const std::string& path,
+                                                                 mode_t mode,
+                                                                 const sync_send_range& range,
+                                                                 SendRangeSessions& sessions,
+                                                                 SyncDirectoryCache& dirs) {
+    std::lock_guard<std::mutex> lock(send_range_mutex);
+    sessions.erase(std::remove_if(sessions.begin(), sessions.end(),
+                                  [](const std::shared_ptr<SendRangeSession>& session) {
+                                      return session->bytes_done == session->size;
+                                  }),
+                   sessions.end());
+
+    std::shared_ptr<SendRangeSession> session;
+    auto it = send_range_sessions.find(path);
+    if (it != send_range_sessions.end()) {
+        session = it->second.lock();
+        if (!session) {
+            send_range_sessions.erase(it);
+        }
+    }
+    if (session && session->id == range.id) {
+        if (session->failed) {
+            SendSyncFail(s, "another range of the file failed");
+            return nullptr;
+        } else if (session->size != range.size) {
+            SendSyncFail(s, "range of a different size of file");
+            return nullptr;
+        }
+        if (std::find(sessions.begin(), sessions.end(), session) == sessions.end()) {
+            sessions.push_back(session);
+        }
+        return session;
+    }
+
+    // As with a file pushed all at once, replace a regular file or a symbolic link rather than
+    // writing through it. Anything else, such as a device node, is left alone: the client pushes
+    // it as a whole file instead.
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0) {
+        if (!S_ISREG(st.st_mode) && !S_ISLNK(st.st_mode)) {
+            SendSyncFail(s, "ranges can only replace a regular file");
+            return nullptr;
+        }
+        adb_unlink(path.c_str());
+    }
+
+    session = std::make_shared<SendRangeSession>();
+    session->id = range.id;
+    session->size = range.size;
+    session->path = path;
+    int flags = O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC;
+    session->fd.reset(adb_open_mode(path.c_str(), flags, mode));
+    if (session->fd < 0 && errno == ENOENT) {
+        if (!dirs.SecureMkdirs(Dirname(path))) {
+            SendSyncFailErrno(s, "secure_mkdirs failed");
+            return nullptr;
+        }
+        session->fd.reset(adb_open_mode(path.c_str(), flags, mode));
+    }
+    if (session->fd < 0 || fstat(session->fd.get(), &st) == -1) {
+        SendSyncFailErrno(s, "couldn't create file");
+        return nullptr;
+    }
+    session->dev = st.st_dev;
+    session->ino = st.st_ino;
+
+    if (!have_space_for(session->fd, range.size)) {
+        errno = ENOSPC;
+        SendSyncFailErrno(s, "couldn't allocate space");
+        return nullptr;
+    }
+    if (ftruncate(session->fd.get(), range.size) == -1) {
+        SendSyncFailErrno(s, "couldn't set file size");
+        return nullptr;
+    }
+    fallocate(session->fd.get(), FALLOC_FL_KEEP_SIZE, 0, range.size);
+
+    send_range_sessions[path] = session;
+    sessions.push_back(session);
+    return session;
+}
+
+// Receives one range of a file into its place, through a descriptor of its own, so that each
+// range can use the same writers as a whole file does. Once the whole file has arrived, sets its
+// owner, mode, capabilities and mtime, and forgets the session.
+static bool handle_send_range(borrowed_fd s, const std::string& path, uid_t uid, gid_t gid,
+                              uint64_t capabilities, mode_t mode, CompressionType compression,
+                              bool framed, bool sparse, const sync_send_range& range,
+                              std::vector<char>& buffer, SendRangeSessions& sessions,
+                              SyncDirectoryCache& dirs) {
+    __android_log_security_bswrite(SEC_TAG_ADB_SEND_FILE, path.c_str());
+
+    if (range.offset > range.size || range.length > range.size - range.offset) {
+        SendSyncFail(s, "invalid range");
+        discard_send_data(s, buffer);
+        return false;
+    }
+
+    std::shared_ptr<SendRangeSession> session =
+            join_send_range_session(s, path, mode, range, sessions, dirs);
+    if (!session) {
+        discard_send_data(s, buffer);
+        return false;
+    }
+
+    auto fail = [&]() {
+        discard_send_data(s, buffer);
+        std::lock_guard<std::mutex> lock(send_range_mutex);
+        session->failed = true;
+        session->Discard();
+        return false;
+    };
+
+    // Only write to the file that the session created, in case the path's been replaced since.
+    struct stat st;
+    unique_fd fd(adb_open(path.c_str(), O_WRONLY | O_NOFOLLOW | O_CLOEXEC));
+    if (fd < 0) {
+        SendSyncFailErrno(s, "couldn't open file");
+        return fail();
+    }
+    if (fstat(fd.get(), &st) == -1 || st.st_dev != session->dev || st.st_ino != session->ino) {
+        SendSyncFail(s, "file was replaced during push");
+        return fail();
+    }
+    if (adb_lseek(fd, range.offset, SEEK_SET) == -1) {
+        SendSyncFailErrno(s, "seek failed");
+        return fail();
+    }
+    posix_fadvise(fd.get(), range.offset, range.length, POSIX_FADV_SEQUENTIAL | POSIX_FADV_NOREUSE);
+
+    bool result;
+    uint32_t timestamp;
+    if (framed) {
+        result = handle_send_file_framed(s, std::move(fd), &timestamp, compression);
+    } else if (compression != CompressionType::None) {
+        result = handle_send_file_compressed(s, std::move(fd), &timestamp, compression, buffer);
+    } else {
+        result = handle_send_file_uncompressed(s, std::move(fd), &timestamp, sparse, buffer);
+    }
+    if (!result) {
+        return fail();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(send_range_mutex);
+        if (session->failed) {
+            SendSyncFail(s, "another range of the file failed");
+            return false;
+        }
+
+        session->bytes_done += range.length;
+        if (session->bytes_done == session->size) {
+            const char* error = nullptr;
+            if (fchown(session->fd.get(), uid, gid) == -1) {
+                error = "fchown failed";
+            } else {
+#if defined(__ANDROID__)
+                // Not all filesystems support setting SELinux labels. http://b/23530370.
+                selinux_android_restorecon(path.c_str(), 0);
+#endif
+                // fchown clears the setuid bit, so set the mode again, as for a whole file.
+                fchmod(session->fd.get(), mode);
+                if (!update_capabilities(path.c_str(), capabilities)) {
+                    error = "update_capabilities failed";
+                }
+            }
+            if (error) {
+                SendSyncFailErrno(s, error);
+                session->failed = true;
+                session->Discard();
+                return false;
+            }
+
+            set_send_timestamp(path, timestamp);
+            session->fd.reset();
+            auto it = send_range_sessions.find(path);
+            if (it != send_range_sessions.end() && it->second.lock() == session) {
+                send_range_sessions.erase(it);
+            }
+        }
+    }
+
+    syncmsg msg;
+    msg.status.id = ID_OKAY;
+    msg.status.msglen = 0;
+    return WriteFdExactly(s, &msg.status, sizeof(msg.status));
+}
+
+// Receives the rest of a file from |offset| into the partial file next to it, keeping what's
+// already there, and renames it into place once it's complete. A failure leaves the partial file
+// for the next push of the file to resume from.
+static bool handle_send_resume(borrowed_fd s, const std::string& path, uint32_t* timestamp,
+                               uid_t uid, gid_t gid, uint64_t capabilities, mode_t mode,
+                               CompressionType compression, bool framed, bool sparse,
+                               uint64_t offset, std::vector<char>& buffer,
+                               SyncDirectoryCache& dirs) {
+    __android_log_security_bswrite(SEC_TAG_ADB_SEND_FILE, path.c_str());
+
+    std::string partial_path = path + ".adbpart";
+    unique_fd fd;
+    if (const char* error = create_send_file(partial_path.c_str(), uid, gid, mode, dirs, &fd)) {
+        SendSyncFailErrno(s, error);
+        discard_send_data(s, buffer);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd.get(), &st) == -1 || !S_ISREG(st.st_mode) ||
+        static_cast<uint64_t>(st.st_size) < offset) {
+        SendSyncFail(s, "partial file is too short to resume");
+        discard_send_data(s, buffer);
+        return false;
+    }
+    if (ftruncate(fd.get(), offset) == -1 || adb_lseek(fd, offset, SEEK_SET) == -1) {
+        SendSyncFailErrno(s, "couldn't resume partial file");
+        discard_send_data(s, buffer);
+        return false;
+    }
+    posix_fadvise(fd.get(), offset, 0, POSIX_FADV_SEQUENTIAL | POSIX_FADV_NOREUSE);
+
+    bool result;
+    if (framed) {
+        result = handle_send_file_framed(s, std::move(fd), timestamp, compression);
+    } else if (compression != CompressionType::None) {
+        result = handle_send_file_compressed(s, std::move(fd), timestamp, compression, buffer);
     } else {
-        SendSyncFail(s, "invalid data message: expected ID_DONE");
+        result = handle_send_file_uncompressed(s, std::move(fd), timestamp, sparse, buffer);
+    }
+    if (!result) {
+        discard_send_data(s, buffer);
         return false;
     }
 
-    return true;
-}
+    if (!update_capabilities(partial_path.c_str(), capabilities)) {
+        SendSyncFailErrno(s, "update_capabilities failed");
+        return false;
+    }
+    if (rename(partial_path.c_str(), path.c_str()) == -1) {
+        SendSyncFailErrno(s, "couldn't rename partial file");
+        return false;
+    }
+#if defined(__ANDROID__)
+    // The partial file was labelled for its own path. Not all filesystems support setting SELinux
+    // labels. http://b/23530370.
+    selinux_android_restorecon(path.c_str(), 0);
 #endif
 
-static bool send_impl(int s, const std::string& path, mode_t mode, bool compressed,
-                      std::vector<char>& buffer) {
+    syncmsg msg;
+    msg.status.id = ID_OKAY;
+    msg.status.msglen = 0;
+    return WriteFdExactly(s, &msg.status, sizeof(msg.status));
+}
+
+// With |range|, receives just that range of the file. With |resume|, receives the rest of a file
+// that an earlier push left partly written.
+static bool send_impl(int s, const std::string& path, mode_t mode, CompressionType compression,
+                      bool framed, bool sparse, uint64_t size, const sync_send_range* range,
+                      const sync_send_resume* resume, std::vector<char>& buffer,
+                      SendRangeSessions& sessions, SyncDirectoryCache& dirs) {
+    if (range || resume) {
+        if (!S_ISREG(mode)) {
+            SendSyncFail(s, range ? "ranges are only for regular files"
+                                  : "only regular files can be resumed");
+            discard_send_data(s, buffer);
+            return false;
+        }
+
+        uid_t uid;
+        gid_t gid;
+        uint64_t capabilities;
+        get_send_file_attributes(path, &mode, &uid, &gid, &capabilities);
+        if (range) {
+            return handle_send_range(s, path, uid, gid, capabilities, mode, compression, framed,
+                                     sparse, *range, buffer, sessions, dirs);
+        }
+
+        uint32_t timestamp;
+        if (!handle_send_resume(s, path, &timestamp, uid, gid, capabilities, mode, compression,
+                                framed, sparse, resume->offset, buffer, dirs)) {
+            return false;
+        }
+        set_send_timestamp(path, timestamp);
+        return true;
+    }
+
     // Don't delete files before copying if they are not "regular" or symlinks.
     struct stat st;
     bool do_unlink = (lstat(path.c_str(), &st) == -1) || S_ISREG(st.st_mode) ||
@@ -512,38 +1498,43 @@ static bool send_impl(int s, const std::string& path, mode_t mode, bool compress
     bool result;
     uint32_t timestamp;
     if (S_ISLNK(mode)) {
-        result = handle_send_link(s, path, &timestamp, buffer);
+        result = handle_send_link(s, path, &timestamp, buffer, dirs);
     } else {
-        // Copy user permission bits to "group" and "other" permissions.
-        mode &= 0777;
-        mode |= ((mode >> 3) & 0070);
-        mode |= ((mode >> 3) & 0007);
-
-        uid_t uid = -1;
-        gid_t gid = -1;
-        uint64_t capabilities = 0;
-        if (should_use_fs_config(path)) {
-            adbd_fs_config(path.c_str(), 0, nullptr, &uid, &gid, &mode, &capabilities);
-        }
+        uid_t uid;
+        gid_t gid;
+        uint64_t capabilities;
+        get_send_file_attributes(path, &mode, &uid, &gid, &capabilities);
 
         result = handle_send_file(s, path.c_str(), &timestamp, uid, gid, capabilities, mode,
-                                  compressed, buffer, do_unlink);
+                                  compression, framed, sparse, size, buffer, dirs, do_unlink);
     }
 
     if (!result) {
       return false;
     }
 
-    struct timeval tv[2];
-    tv[0].tv_sec = timestamp;
-    tv[0].tv_usec = 0;
-    tv[1].tv_sec = timestamp;
-    tv[1].tv_usec = 0;
-    lutimes(path.c_str(), tv);
+    set_send_timestamp(path, timestamp);
     return true;
 }
 
-static bool do_send_v1(int s, const std::string& spec, std::vector<char>& buffer) {
+// Takes the codec out of the flags of a send_v2 or recv_v2 request. Any flags that are left over,
+// including a second codec, are an error.
+static CompressionType take_compression_flag(uint32_t* flags) {
+    if (*flags & kSyncFlagBrotli) {
+        *flags &= ~kSyncFlagBrotli;
+        return CompressionType::Brotli;
+    } else if (*flags & kSyncFlagLZ4) {
+        *flags &= ~kSyncFlagLZ4;
+        return CompressionType::LZ4;
+    } else if (*flags & kSyncFlagZstd) {
+        *flags &= ~kSyncFlagZstd;
+        return CompressionType::Zstd;
+    }
+    return CompressionType::None;
+}
+
+static bool do_send_v1(int s, const std::string& spec, std::vector<char>& buffer,
+                       SendRangeSessions& sessions, SyncDirectoryCache& dirs) {
     // 'spec' is of the form "/some/path,0755". Break it up.
     size_t comma = spec.find_last_of(',');
     if (comma == std::string::npos) {
@@ -560,10 +1551,12 @@ static bool do_send_v1(int s, const std::string& spec, std::vector<char>& buffer
         return false;
     }
 
-    return send_impl(s, path, mode, false, buffer);
+    return send_impl(s, path, mode, CompressionType::None, false, false, 0, nullptr, nullptr,
+                     buffer, sessions, dirs);
 }
 
-static bool do_send_v2(int s, const std::string& path, std::vector<char>& buffer) {
+static bool do_send_v2(int s, const std::string& path, std::vector<char>& buffer,
+                       SendRangeSessions& sessions, SyncDirectoryCache& dirs) {
     // Read the setup packet.
     syncmsg msg;
     int rc = ReadFdExactly(s, &msg.send_v2_setup, sizeof(msg.send_v2_setup));
@@ -574,31 +1567,466 @@ static bool do_send_v2(int s, const std::string& path, std::vector<char>& buffer
         PLOG(ERROR) << "failed to read send_v2 setup packet";
     }
 
-    bool compressed = false;
-    if (msg.send_v2_setup.flags & kSyncFlagBrotli) {
-        msg.send_v2_setup.flags &= ~kSyncFlagBrotli;
-        compressed = true;
+    uint32_t flags = msg.send_v2_setup.flags;
+    CompressionType compression = take_compression_flag(&flags);
+    bool framed = false;
+    if (flags & kSyncFlagFramed) {
+        flags &= ~kSyncFlagFramed;
+        framed = true;
+    }
+    bool sparse = false;
+    if (flags & kSyncFlagSparse) {
+        flags &= ~kSyncFlagSparse;
+        sparse = true;
+    }
+    sync_send_size size = {};
+    if (flags & kSyncFlagSize) {
+        flags &= ~kSyncFlagSize;
+        if (!ReadFdExactly(s, &size, sizeof(size))) {
+            PLOG(ERROR) << "failed to read send_v2 size";
+            return false;
+        }
+    }
+    std::optional<sync_send_range> range;
+    if (flags & kSyncFlagRange) {
+        flags &= ~kSyncFlagRange;
+        range.emplace();
+        if (!ReadFdExactly(s, &*range, sizeof(*range))) {
+            PLOG(ERROR) << "failed to read send_v2 range";
+            return false;
+        }
+    }
+    std::optional<sync_send_resume> resume;
+    if (flags & kSyncFlagResume) {
+        flags &= ~kSyncFlagResume;
+        resume.emplace();
+        if (!ReadFdExactly(s, &*resume, sizeof(*resume))) {
+            PLOG(ERROR) << "failed to read send_v2 resume offset";
+            return false;
+        }
     }
-    if (msg.send_v2_setup.flags) {
-        SendSyncFail(s, android::base::StringPrintf("unknown flags: %d", msg.send_v2_setup.flags));
+    if (flags) {
+        SendSyncFail(s, android::base::StringPrintf("unknown flags: %d", flags));
         return false;
     }
+    if (framed && compression == CompressionType::None) {
+        SendSyncFail(s, "framed send without compression");
+        return false;
+    }
+    if (sparse && compression != CompressionType::None) {
+        SendSyncFail(s, "sparse send with compression");
+        return false;
+    }
+    if (range && resume) {
+        SendSyncFail(s, "resumed send of a range");
+        return false;
+    }
+
+    errno = 0;
+    return send_impl(s, path, msg.send_v2_setup.mode, compression, framed, sparse, size.size,
+                     range ? &*range : nullptr, resume ? &*resume : nullptr, buffer, sessions,
+                     dirs);
+}
+
+// Writes one file of a send_bundle, as send_impl would have written it from a send_v2. Returns 0,
+// or the errno of what went wrong.
+static int write_bundled_file(const std::string& path, mode_t mode, uint32_t mtime,
+                              std::string_view data, SyncDirectoryCache& dirs) {
+    __android_log_security_bswrite(SEC_TAG_ADB_SEND_FILE, path.c_str());
+
+    struct stat st;
+    bool do_unlink = lstat(path.c_str(), &st) == -1 || S_ISREG(st.st_mode) || S_ISLNK(st.st_mode);
+    if (do_unlink) {
+        adb_unlink(path.c_str());
+    }
 
+    uid_t uid;
+    gid_t gid;
+    uint64_t capabilities;
+    get_send_file_attributes(path, &mode, &uid, &gid, &capabilities);
+
+    // errno is cleared before each step, so that a failure that doesn't set it can't report
+    // whatever an earlier call left there.
+    unique_fd fd;
+    auto fail = [&](int error) {
+        fd.reset();
+        if (do_unlink) adb_unlink(path.c_str());
+        return error != 0 ? error : EIO;
+    };
+    errno = 0;
+    if (create_send_file(path.c_str(), uid, gid, mode, dirs, &fd) != nullptr) {
+        return fail(errno);
+    }
+    errno = 0;
+    if (!WriteFdExactly(fd, data.data(), data.size())) {
+        return fail(errno);
+    }
     errno = 0;
-    return send_impl(s, path, msg.send_v2_setup.mode, compressed, buffer);
+    if (!update_capabilities(path.c_str(), capabilities)) {
+        return fail(errno);
+    }
+    fd.reset();
+
+    set_send_timestamp(path, mtime);
+    return 0;
 }
 
-static bool recv_uncompressed(borrowed_fd s, unique_fd fd, std::vector<char>& buffer) {
+static bool do_send_bundle(int s, SyncDirectoryCache& dirs) {
+    syncmsg msg;
+    if (!ReadFdExactly(s, &msg.send_bundle_setup, sizeof(msg.send_bundle_setup))) {
+        PLOG(ERROR) << "failed to read send_bundle setup packet";
+        return false;
+    }
+
+    uint32_t count = msg.send_bundle_setup.count;
+    if (count > SYNC_BUNDLE_MAX_FILES) {
+        SendSyncFail(s, "too many files");
+        return false;
+    } else if (msg.send_bundle_setup.size > SYNC_BUNDLE_MAX_SIZE) {
+        SendSyncFail(s, "bundle too big");
+        return false;
+    }
+
+    // Read the whole bundle before answering, so that the client never has to read while it's
+    // still writing the request.
+    std::vector<char> bundle(msg.send_bundle_setup.size);
+    if (!ReadFdExactly(s, bundle.data(), bundle.size())) {
+        PLOG(ERROR) << "failed to read send_bundle";
+        return false;
+    }
+
+    // Check that all of it makes sense before writing any of it.
+    struct BundledFile {
+        sync_bundle_file header;
+        std::string path;
+        std::string_view data;
+    };
+    std::vector<BundledFile> files(count);
+    std::string_view rest(bundle.data(), bundle.size());
+    for (BundledFile& file : files) {
+        if (rest.size() < sizeof(file.header)) {
+            SendSyncFail(s, "truncated bundle");
+            return false;
+        }
+        memcpy(&file.header, rest.data(), sizeof(file.header));
+        rest.remove_prefix(sizeof(file.header));
+
+        if (file.header.path_length > 1024 ||
+            rest.size() < static_cast<uint64_t>(file.header.path_length) + file.header.size) {
+            SendSyncFail(s, "truncated bundle");
+            return false;
+        }
+        file.path = rest.substr(0, file.header.path_length);
+        file.data = rest.substr(file.header.path_length, file.header.size);
+        rest.remove_prefix(file.header.path_length + file.header.size);
+    }
+    if (!rest.empty()) {
+        SendSyncFail(s, "trailing data in bundle");
+        return false;
+    }
+
+    std::vector<char> response(sizeof(sync_send_bundle) + count * sizeof(uint32_t));
+    msg.send_bundle_setup.id = ID_SEND_BUNDLE;
+    msg.send_bundle_setup.count = count;
+    msg.send_bundle_setup.size = count * sizeof(uint32_t);
+    memcpy(response.data(), &msg.send_bundle_setup, sizeof(msg.send_bundle_setup));
+    for (uint32_t i = 0; i < count; ++i) {
+        const BundledFile& file = files[i];
+        int error = EINVAL;
+        if (S_ISREG(file.header.mode)) {
+            error = write_bundled_file(file.path, file.header.mode, file.header.mtime, file.data,
+                                       dirs);
+        }
+        uint32_t wire_error = error == 0 ? 0 : errno_to_wire(error);
+        memcpy(response.data() + sizeof(sync_send_bundle) + i * sizeof(wire_error), &wire_error,
+               sizeof(wire_error));
+    }
+    return WriteFdExactly(s, response.data(), response.size());
+}
+
+// Writes the new file described by the rest of a send_v3 to a temporary file beside |path|, and
+// renames it over |path| once it's complete. |temp_path| is left set if the temporary file needs
+// to be removed.
+static bool handle_send_delta(borrowed_fd s, const std::string& path, std::string* temp_path,
+                              uint32_t* timestamp, uid_t uid, gid_t gid, uint64_t capabilities,
+                              mode_t mode, borrowed_fd old_fd, uint64_t old_size,
+                              uint32_t block_size, uint64_t block_count,
+                              std::vector<char>& buffer, SyncDirectoryCache& dirs) {
+    const std::string temp_template = Dirname(path) + "/.adb_send.XXXXXX";
+    *temp_path = temp_template;
+    unique_fd fd(mkostemp(temp_path->data(), O_CLOEXEC));
+    if (fd < 0 && errno == ENOENT) {
+        if (!dirs.SecureMkdirs(Dirname(path))) {
+            temp_path->clear();
+            SendSyncFailErrno(s, "secure_mkdirs failed");
+            return false;
+        }
+        *temp_path = temp_template;
+        fd.reset(mkostemp(temp_path->data(), O_CLOEXEC));
+    }
+    if (fd < 0) {
+        temp_path->clear();
+        SendSyncFailErrno(s, "couldn't create temporary file");
+        return false;
+    }
+
+    if (fchown(fd.get(), uid, gid) == -1) {
+        SendSyncFailErrno(s, "fchown failed");
+        return false;
+    }
+    // As in handle_send_file, fchown clears the setuid bit, and not all filesystems support fchmod.
+    fchmod(fd.get(), mode);
+
     syncmsg msg;
-    msg.data.id = ID_DATA;
-    std::optional<BrotliEncoder<SYNC_DATA_MAX>> encoder;
     while (true) {
-        int r = adb_read(fd.get(), &buffer[0], buffer.size() - sizeof(msg.data));
+        if (!ReadFdExactly(s, &msg.data, sizeof(msg.data))) return false;
+
+        if (msg.data.id == ID_DONE) {
+            *timestamp = msg.data.size;
+            break;
+        } else if (msg.data.id == ID_DATA) {
+            if (msg.data.size > buffer.size()) {
+                SendSyncFail(s, "oversize data message");
+                return false;
+            }
+            if (!ReadFdExactly(s, buffer.data(), msg.data.size)) return false;
+            if (!WriteFdExactly(fd, buffer.data(), msg.data.size)) {
+                SendSyncFailErrno(s, "write failed");
+                return false;
+            }
+        } else if (msg.data.id == ID_COPY) {
+            // The id and count have already been read as a sync_data.
+            if (!ReadFdExactly(s, &msg.copy.block, sizeof(msg.copy.block))) return false;
+            if (msg.copy.block > block_count || msg.copy.count > block_count - msg.copy.block) {
+                SendSyncFail(s, "invalid block reference");
+                return false;
+            }
+
+            uint64_t offset = msg.copy.block * block_size;
+            uint64_t end = std::min(old_size, (msg.copy.block + msg.copy.count) * block_size);
+            while (offset < end) {
+                size_t length = std::min<uint64_t>(end - offset, buffer.size());
+                if (adb_pread(old_fd, buffer.data(), length, offset) != static_cast<int>(length)) {
+                    SendSyncFailErrno(s, "read of old file failed");
+                    return false;
+                }
+                if (!WriteFdExactly(fd, buffer.data(), length)) {
+                    SendSyncFailErrno(s, "write failed");
+                    return false;
+                }
+                offset += length;
+            }
+        } else {
+            SendSyncFail(s, "invalid data message");
+            return false;
+        }
+    }
+
+    if (!update_capabilities(temp_path->c_str(), capabilities)) {
+        SendSyncFailErrno(s, "update_capabilities failed");
+        return false;
+    }
+
+    if (rename(temp_path->c_str(), path.c_str()) == -1) {
+        SendSyncFailErrno(s, "rename failed");
+        return false;
+    }
+    temp_path->clear();
+
+#if defined(__ANDROID__)
+    // Not all filesystems support setting SELinux labels. http://b/23530370.
+    selinux_android_restorecon(path.c_str(), 0);
+#endif
+    return true;
+}
+
+static bool do_send_v3(int s, const std::string& path, std::vector<char>& buffer,
+                       SyncDirectoryCache& dirs) {
+    syncmsg msg;
+    if (!ReadFdExactly(s, &msg.send_v3_setup, sizeof(msg.send_v3_setup))) {
+        PLOG(ERROR) << "failed to read send_v3 setup packet";
+        return false;
+    }
+
+    if (msg.send_v3_setup.flags) {
+        SendSyncFail(s, StringPrintf("unknown flags: %d", msg.send_v3_setup.flags));
+        return false;
+    }
+    mode_t mode = msg.send_v3_setup.mode;
+    if (!S_ISREG(mode)) {
+        SendSyncFail(s, "send_v3 only supports regular files");
+        return false;
+    }
+
+    __android_log_security_bswrite(SEC_TAG_ADB_SEND_FILE, path.c_str());
+
+    // Sign the file that's already there. If there isn't one that we can read, the client has to
+    // send everything as literal data.
+    uint32_t block_size = DeltaBlockSize(0);
+    uint64_t old_size = 0;
+    std::vector<sync_block_signature> signatures;
+    struct stat st;
+    unique_fd old_fd;
+    if (lstat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+        old_fd.reset(adb_open(path.c_str(), O_RDONLY | O_CLOEXEC));
+        if (old_fd >= 0 && fstat(old_fd.get(), &st) == 0) {
+            old_size = st.st_size;
+            block_size = DeltaBlockSize(old_size);
+            posix_fadvise(old_fd.get(), 0, 0, POSIX_FADV_SEQUENTIAL);
+            if (!SignFile(old_fd, block_size, &signatures)) {
+                signatures.clear();
+            }
+        }
+    }
+
+    msg.signatures.id = ID_SIGNATURES;
+    msg.signatures.block_size = block_size;
+    msg.signatures.count = signatures.size();
+    if (!WriteFdExactly(s, &msg.signatures, sizeof(msg.signatures)) ||
+        !WriteFdExactly(s, signatures.data(), signatures.size() * sizeof(signatures[0]))) {
+        return false;
+    }
+
+    uid_t uid;
+    gid_t gid;
+    uint64_t capabilities;
+    get_send_file_attributes(path, &mode, &uid, &gid, &capabilities);
+
+    std::string temp_path;
+    uint32_t timestamp;
+    if (!handle_send_delta(s, path, &temp_path, &timestamp, uid, gid, capabilities, mode, old_fd,
+                           old_size, block_size, signatures.size(), buffer, dirs)) {
+        discard_send_data(s, buffer);
+        if (!temp_path.empty()) adb_unlink(temp_path.c_str());
+        return false;
+    }
+
+    set_send_timestamp(path, timestamp);
+    msg.status.id = ID_OKAY;
+    msg.status.msglen = 0;
+    return WriteFdExactly(s, &msg.status, sizeof(msg.status));
+}
+
+// Sends the first |size| bytes of |fd|, writing the header of each message before using sendfile(2)
+// for its data, so that the data never passes through adbd. If |fd| can't be used with sendfile,
+// reads it instead. Returns false if the transfer has to be abandoned.
+static bool recv_sendfile(borrowed_fd s, borrowed_fd fd, uint64_t size, std::vector<char>& buffer) {
+    syncmsg msg;
+    msg.data.id = ID_DATA;
+    bool use_sendfile = true;
+    while (size > 0) {
+        size_t length = std::min<uint64_t>(size, buffer.size());
+        size -= length;
+        msg.data.size = length;
+        if (!WriteFdExactly(s, &msg.data, sizeof(msg.data))) return false;
+
+        while (length > 0) {
+            ssize_t rc;
+            if (use_sendfile) {
+                rc = TEMP_FAILURE_RETRY(sendfile(s.get(), fd.get(), nullptr, length));
+                if (rc == -1 && (errno == EINVAL || errno == ENOSYS)) {
+                    use_sendfile = false;
+                    continue;
+                }
+            } else {
+                rc = adb_read(fd, buffer.data(), length);
+                if (rc > 0 && !WriteFdExactly(s, buffer.data(), rc)) return false;
+            }
+
+            if (rc <= 0) {
+                // The file got shorter, or couldn't be read, after the size of this message was
+                // sent. Fill the message out, so that the client can read the failure after it.
+                int saved_errno = errno;
+                memset(buffer.data(), 0, length);
+                if (!WriteFdExactly(s, buffer.data(), length)) return false;
+                if (rc == 0) {
+                    SendSyncFail(s, "file truncated while being read");
+                } else {
+                    errno = saved_errno;
+                    SendSyncFailErrno(s, "read failed");
+                }
+                return false;
+            }
+            length -= rc;
+        }
+    }
+    return true;
+}
+
+// Sends |length| bytes of holes as ID_HOLE messages.
+static bool recv_hole(borrowed_fd s, uint64_t length) {
+    syncmsg msg;
+    msg.data.id = ID_HOLE;
+    while (length > 0) {
+        msg.data.size = std::min<uint64_t>(length, UINT32_MAX);
+        if (!WriteFdExactly(s, &msg.data, sizeof(msg.data))) return false;
+        length -= msg.data.size;
+    }
+    return true;
+}
+
+// Sends |size| bytes of a regular file from |offset|, where it's positioned, skipping its holes.
+// A filesystem that doesn't keep track of holes has the whole file sent as data.
+static bool recv_sparse(borrowed_fd s, borrowed_fd fd, uint64_t offset, uint64_t size,
+                        std::vector<char>& buffer) {
+    uint64_t end = offset + size;
+    while (offset < end) {
+        uint64_t data_start = offset;
+        int64_t data = adb_lseek(fd, offset, SEEK_DATA);
+        if (data != -1) {
+            data_start = std::min<uint64_t>(data, end);
+        } else if (errno == ENXIO) {
+            // There's nothing but a hole from here on.
+            data_start = end;
+        }
+        if (!recv_hole(s, data_start - offset)) return false;
+        if (data_start == end) break;
+
+        int64_t hole = adb_lseek(fd, data_start, SEEK_HOLE);
+        uint64_t data_end = hole == -1 ? end : std::min<uint64_t>(hole, end);
+        if (adb_lseek(fd, data_start, SEEK_SET) == -1) {
+            SendSyncFailErrno(s, "seek failed");
+            return false;
+        }
+        if (!recv_sendfile(s, fd, data_end - data_start, buffer)) return false;
+        offset = data_end;
+    }
+
+    if (adb_lseek(fd, end, SEEK_SET) == -1) {
+        SendSyncFailErrno(s, "seek failed");
+        return false;
+    }
+    return true;
+}
+
+// Sends up to |length| bytes of |fd|, from |offset|, where it's already positioned. With |sparse|,
+// sends the holes in a regular file as ID_HOLE messages.
+static bool recv_uncompressed(borrowed_fd s, unique_fd fd, uint64_t offset, uint64_t length,
+                              bool sparse, std::vector<char>& buffer) {
+    // Send what's in a regular file now without copying it, and then read anything that's been
+    // added since, along with anything that isn't a regular file.
+    struct stat st;
+    if (fstat(fd.get(), &st) == 0 && S_ISREG(st.st_mode)) {
+        uint64_t size = static_cast<uint64_t>(st.st_size) > offset ? st.st_size - offset : 0;
+        size = std::min(size, length);
+        if (sparse ? !recv_sparse(s, fd, offset, size, buffer)
+                   : !recv_sendfile(s, fd, size, buffer)) {
+            return false;
+        }
+        length -= size;
+    }
+
+    syncmsg msg;
+    msg.data.id = ID_DATA;
+    while (length > 0) {
+        size_t want = std::min<uint64_t>(length, buffer.size() - sizeof(msg.data));
+        int r = adb_read(fd.get(), &buffer[0], want);
         if (r <= 0) {
             if (r == 0) break;
             SendSyncFailErrno(s, "read failed");
             return false;
         }
+        length -= r;
         msg.data.size = r;
 
         if (!WriteFdExactly(s, &msg.data, sizeof(msg.data)) || !WriteFdExactly(s, &buffer[0], r)) {
@@ -609,51 +2037,76 @@ static bool recv_uncompressed(borrowed_fd s, unique_fd fd, std::vector<char>& bu
     return true;
 }
 
-static bool recv_compressed(borrowed_fd s, unique_fd fd) {
+// With |raw_fallback|, stops compressing part way through the file if it isn't paying off, and
+// sends the rest as it is. Sends no more than |length| bytes of the file, and no ID_DATA message
+// bigger than |data_max|.
+static bool recv_compressed(borrowed_fd s, unique_fd fd, CompressionType compression,
+                            bool raw_fallback, uint64_t length, size_t data_max) {
     syncmsg msg;
     msg.data.id = ID_DATA;
 
-    BrotliEncoder<SYNC_DATA_MAX> encoder;
+    std::unique_ptr<Encoder> encoder = CreateEncoder(compression, data_max);
+    CompressionPolicy policy;
 
-    bool sending = true;
-    while (sending) {
-        Block input(SYNC_DATA_MAX);
+    bool compressing = true;
+    while (true) {
+        Block input(std::min<uint64_t>(data_max, length));
         int r = adb_read(fd.get(), input.data(), input.size());
         if (r < 0) {
             SendSyncFailErrno(s, "read failed");
             return false;
         }
-
-        if (r == 0) {
-            encoder.Finish();
-        } else {
-            input.resize(r);
-            encoder.Append(std::move(input));
-        }
-
-        while (true) {
-            Block output;
-            BrotliEncodeResult result = encoder.Encode(&output);
-            if (result == BrotliEncodeResult::Error) {
-                SendSyncFailErrno(s, "compress failed");
-                return false;
+        input.resize(r);
+        length -= r;
+
+        bool send_raw = !compressing;
+        if (compressing) {
+            if (r > 0 && raw_fallback && !policy.ShouldCompress(input)) {
+                send_raw = true;
+                encoder->Finish();
+            } else if (r == 0) {
+                encoder->Finish();
+            } else {
+                encoder->Append(std::move(input));
             }
 
-            if (!output.empty()) {
-                msg.data.size = output.size();
-                if (!WriteFdExactly(s, &msg.data, sizeof(msg.data)) ||
-                    !WriteFdExactly(s, output.data(), output.size())) {
+            while (true) {
+                Block output;
+                EncodeResult result = encoder->Encode(&output);
+                if (result == EncodeResult::Error) {
+                    SendSyncFailErrno(s, "compress failed");
                     return false;
                 }
+
+                if (!output.empty()) {
+                    policy.RecordOutput(output.size());
+                    msg.data.size = output.size();
+                    if (!WriteFdExactly(s, &msg.data, sizeof(msg.data)) ||
+                        !WriteFdExactly(s, output.data(), output.size())) {
+                        return false;
+                    }
+                }
+
+                if (result == EncodeResult::Done) {
+                    compressing = false;
+                    break;
+                } else if (result == EncodeResult::NeedInput) {
+                    break;
+                } else if (result == EncodeResult::MoreOutput) {
+                    continue;
+                }
             }
+        }
 
-            if (result == BrotliEncodeResult::Done) {
-                sending = false;
-                break;
-            } else if (result == BrotliEncodeResult::NeedInput) {
-                break;
-            } else if (result == BrotliEncodeResult::MoreOutput) {
-                continue;
+        if (r == 0) {
+            break;
+        }
+
+        if (send_raw) {
+            msg.data.size = r;
+            if (!WriteFdExactly(s, &msg.data, sizeof(msg.data)) ||
+                !WriteFdExactly(s, input.data(), r)) {
+                return false;
             }
         }
     }
@@ -661,7 +2114,10 @@ static bool recv_compressed(borrowed_fd s, unique_fd fd) {
     return true;
 }
 
-static bool recv_impl(borrowed_fd s, const char* path, bool compressed, std::vector<char>& buffer) {
+// Sends up to |length| bytes of |path|, from |offset|.
+static bool recv_impl(borrowed_fd s, const char* path, CompressionType compression,
+                      bool raw_fallback, bool sparse, uint64_t offset, uint64_t length,
+                      std::vector<char>& buffer) {
     __android_log_security_bswrite(SEC_TAG_ADB_RECV_FILE, path);
 
     unique_fd fd(adb_open(path, O_RDONLY | O_CLOEXEC));
@@ -670,16 +2126,22 @@ static bool recv_impl(borrowed_fd s, const char* path, bool compressed, std::vec
         return false;
     }
 
+    if (offset != 0 && adb_lseek(fd, offset, SEEK_SET) == -1) {
+        SendSyncFailErrno(s, "seek failed");
+        return false;
+    }
+
     int rc = posix_fadvise(fd.get(), 0, 0, POSIX_FADV_SEQUENTIAL | POSIX_FADV_NOREUSE);
     if (rc != 0) {
         D("[ Failed to fadvise: %s ]", strerror(rc));
     }
 
     bool result;
-    if (compressed) {
-        result = recv_compressed(s, std::move(fd));
+    if (compression != CompressionType::None) {
+        result = recv_compressed(s, std::move(fd), compression, raw_fallback, length,
+                                 buffer.size());
     } else {
-        result = recv_uncompressed(s, std::move(fd), buffer);
+        result = recv_uncompressed(s, std::move(fd), offset, length, sparse, buffer);
     }
 
     if (!result) {
@@ -693,7 +2155,7 @@ static bool recv_impl(borrowed_fd s, const char* path, bool compressed, std::vec
 }
 
 static bool do_recv_v1(borrowed_fd s, const char* path, std::vector<char>& buffer) {
-    return recv_impl(s, path, false, buffer);
+    return recv_impl(s, path, CompressionType::None, false, false, 0, UINT64_MAX, buffer);
 }
 
 static bool do_recv_v2(borrowed_fd s, const char* path, std::vector<char>& buffer) {
@@ -707,17 +2169,53 @@ static bool do_recv_v2(borrowed_fd s, const char* path, std::vector<char>& buffe
         PLOG(ERROR) << "failed to read recv_v2 setup packet";
     }
 
-    bool compressed = false;
-    if (msg.recv_v2_setup.flags & kSyncFlagBrotli) {
-        msg.recv_v2_setup.flags &= ~kSyncFlagBrotli;
-        compressed = true;
+    uint32_t flags = msg.recv_v2_setup.flags;
+    CompressionType compression = take_compression_flag(&flags);
+    bool raw_fallback = false;
+    if (flags & kSyncFlagRawFallback) {
+        flags &= ~kSyncFlagRawFallback;
+        raw_fallback = true;
+    }
+    bool sparse = false;
+    if (flags & kSyncFlagSparse) {
+        flags &= ~kSyncFlagSparse;
+        sparse = true;
+    }
+    sync_recv_range range = {.offset = 0, .length = UINT64_MAX};
+    if (flags & kSyncFlagRange) {
+        flags &= ~kSyncFlagRange;
+        if (!ReadFdExactly(s, &range, sizeof(range))) {
+            PLOG(ERROR) << "failed to read recv_v2 range";
+            return false;
+        }
     }
-    if (msg.recv_v2_setup.flags) {
-        SendSyncFail(s, android::base::StringPrintf("unknown flags: %d", msg.recv_v2_setup.flags));
+    if (flags) {
+        SendSyncFail(s, android::base::StringPrintf("unknown flags: %d", flags));
+        return false;
+    }
+    if (sparse && compression != CompressionType::None) {
+        SendSyncFail(s, "sparse recv with compression");
+        return false;
+    }
+
+    return recv_impl(s, path, compression, raw_fallback, sparse, range.offset, range.length,
+                     buffer);
+}
+
+// Agrees on the biggest ID_DATA message for the rest of the connection, and sizes |buffer| to fit.
+static bool do_data_max(int s, std::vector<char>& buffer) {
+    syncmsg msg;
+    if (!ReadFdExactly(s, &msg.data_max_setup, sizeof(msg.data_max_setup))) {
+        PLOG(ERROR) << "failed to read data_max setup packet";
         return false;
     }
 
-    return recv_impl(s, path, compressed, buffer);
+    size_t size = std::clamp<size_t>(msg.data_max_setup.size, SYNC_DATA_MAX, SYNC_DATA_MAX_LARGE);
+    buffer.resize(size);
+
+    msg.data_max_setup.id = ID_DATA_MAX;
+    msg.data_max_setup.size = size;
+    return WriteFdExactly(s, &msg.data_max_setup, sizeof(msg.data_max_setup));
 }
 
 static const char* sync_id_to_name(uint32_t id) {
@@ -728,18 +2226,32 @@ static const char* sync_id_to_name(uint32_t id) {
       return "lstat_v2";
     case ID_STAT_V2:
       return "stat_v2";
+    case ID_STAT_BATCH:
+      return "stat_batch";
+    case ID_HASH_BATCH:
+      return "hash_batch";
+    case ID_HASH_RANGE:
+      return "hash_range";
     case ID_LIST_V1:
       return "list_v1";
     case ID_LIST_V2:
       return "list_v2";
+    case ID_LIST_RECURSIVE:
+      return "list_recursive";
     case ID_SEND_V1:
         return "send_v1";
     case ID_SEND_V2:
         return "send_v2";
+    case ID_SEND_V3:
+        return "send_v3";
+    case ID_SEND_BUNDLE:
+        return "send_bundle";
     case ID_RECV_V1:
         return "recv_v1";
     case ID_RECV_V2:
         return "recv_v2";
+    case ID_DATA_MAX:
+        return "data_max";
     case ID_QUIT:
         return "quit";
     default:
@@ -747,7 +2259,8 @@ static const char* sync_id_to_name(uint32_t id) {
   }
 }
 
-static bool handle_sync_command(int fd, std::vector<char>& buffer) {
+static bool handle_sync_command(int fd, std::vector<char>& buffer, SendRangeSessions& sessions,
+                                SyncDirectoryCache& dirs) {
     D("sync: waiting for request");
 
     SyncRequest request;
@@ -778,17 +2291,35 @@ static bool handle_sync_command(int fd, std::vector<char>& buffer) {
         case ID_STAT_V2:
             if (!do_stat_v2(fd, request.id, name)) return false;
             break;
+        case ID_STAT_BATCH:
+            if (!do_stat_batch(fd)) return false;
+            break;
+        case ID_HASH_BATCH:
+            if (!do_hash_batch(fd)) return false;
+            break;
+        case ID_HASH_RANGE:
+            if (!do_hash_range(fd, name)) return false;
+            break;
         case ID_LIST_V1:
             if (!do_list_v1(fd, name)) return false;
             break;
         case ID_LIST_V2:
             if (!do_list_v2(fd, name)) return false;
             break;
+        case ID_LIST_RECURSIVE:
+            if (!do_list_recursive(fd, name)) return false;
+            break;
         case ID_SEND_V1:
-            if (!do_send_v1(fd, name, buffer)) return false;
+            if (!do_send_v1(fd, name, buffer, sessions, dirs)) return false;
             break;
         case ID_SEND_V2:
-            if (!do_send_v2(fd, name, buffer)) return false;
+            if (!do_send_v2(fd, name, buffer, sessions, dirs)) return false;
+            break;
+        case ID_SEND_V3:
+            if (!do_send_v3(fd, name, buffer, dirs)) return false;
+            break;
+        case ID_SEND_BUNDLE:
+            if (!do_send_bundle(fd, dirs)) return false;
             break;
         case ID_RECV_V1:
             if (!do_recv_v1(fd, name, buffer)) return false;
@@ -796,6 +2327,9 @@ static bool handle_sync_command(int fd, std::vector<char>& buffer) {
         case ID_RECV_V2:
             if (!do_recv_v2(fd, name, buffer)) return false;
             break;
+        case ID_DATA_MAX:
+            if (!do_data_max(fd, buffer)) return false;
+            break;
         case ID_QUIT:
             return false;
         default:
@@ -808,8 +2342,10 @@ static bool handle_sync_command(int fd, std::vector<char>& buffer) {
 
 void file_sync_service(unique_fd fd) {
     std::vector<char> buffer(SYNC_DATA_MAX);
+    SendRangeSessions sessions;
+    SyncDirectoryCache dirs;
 
-    while (handle_sync_command(fd.get(), buffer)) {
+    while (handle_sync_command(fd.get(), buffer, sessions, dirs)) {
     }
 
     D("sync: done");
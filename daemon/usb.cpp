@@ -31,37 +31,184 @@
 #include <sys/eventfd.h>
 
 #include <algorithm>
-#include <array>
+#include <atomic>
+#include <chrono>
 #include <future>
 #include <memory>
 #include <mutex>
 #include <optional>
 #include <vector>
 
-#include <asyncio/AsyncIO.h>
-
+#include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/macros.h>
 #include <android-base/properties.h>
+#include <android-base/strings.h>
 #include <android-base/thread_annotations.h>
 
 #include "adb_unique_fd.h"
 #include "adb_utils.h"
+#include "daemon/usb.h"
 #include "daemon/usb_ffs.h"
 #include "sysdeps/chrono.h"
 #include "transport.h"
 #include "types.h"
+#include "usb_endpoint_pairs.h"
 
 using android::base::StringPrintf;
 
-// Not all USB controllers support operations larger than 16k, so don't go above that.
+// Not all USB controllers support operations larger than 16k, so don't go above that by default.
 // Also, each submitted operation does an allocation in the kernel of that size, so we want to
 // minimize our queue depth while still maintaining a deep enough queue to keep the USB stack fed.
-static constexpr size_t kUsbReadQueueDepth = 8;
-static constexpr size_t kUsbReadSize = 4 * PAGE_SIZE;
+//
+// SuperSpeed controllers can't be kept busy by 8 16k transfers, because the completion latency
+// is about the same as on high speed, so they start out with a deeper queue. The write queue
+// grows further at runtime for as long as doing so improves throughput.
+static constexpr size_t kUsbQueueDepth = 8;
+static constexpr size_t kUsbSuperSpeedQueueDepth = 16;
+static constexpr size_t kUsbTransferSize = 4 * PAGE_SIZE;
+
+// Upper bounds on what can be requested via sysprops or reached by adapting the write queue.
+static constexpr size_t kUsbMaxQueueDepth = 64;
+static constexpr size_t kUsbMaxTransferSize = 64 * PAGE_SIZE;
+
+// Amount of data written between decisions about whether to grow the write queue.
+static constexpr size_t kUsbWriteTuningWindow = 4 * 1024 * 1024;
+
+// How often the IO counters are dumped when USB tracing is enabled.
+static constexpr auto kUsbStatsInterval = 10s;
+
+enum class UsbSpeed {
+    Unknown,
+    Full,
+    High,
+    Super,
+    SuperPlus,
+};
+
+static const char* to_string(UsbSpeed speed) {
+    switch (speed) {
+        case UsbSpeed::Unknown:
+            return "unknown";
+        case UsbSpeed::Full:
+            return "full-speed";
+        case UsbSpeed::High:
+            return "high-speed";
+        case UsbSpeed::Super:
+            return "super-speed";
+        case UsbSpeed::SuperPlus:
+            return "super-speed-plus";
+    }
+}
+
+// The speed the controller negotiated with the host, which is only meaningful once we've been
+// enabled.
+static UsbSpeed get_controller_speed() {
+    std::string controller = android::base::GetProperty("sys.usb.controller", "");
+    if (controller.empty()) {
+        return UsbSpeed::Unknown;
+    }
+
+    std::string speed;
+    std::string path = "/sys/class/udc/" + controller + "/current_speed";
+    if (!android::base::ReadFileToString(path, &speed)) {
+        PLOG(WARNING) << "failed to read " << path;
+        return UsbSpeed::Unknown;
+    }
+
+    speed = android::base::Trim(speed);
+    if (speed == "super-speed-plus") {
+        return UsbSpeed::SuperPlus;
+    } else if (speed == "super-speed") {
+        return UsbSpeed::Super;
+    } else if (speed == "high-speed") {
+        return UsbSpeed::High;
+    } else if (speed == "full-speed" || speed == "low-speed") {
+        return UsbSpeed::Full;
+    }
+    return UsbSpeed::Unknown;
+}
+
+struct UsbFfsQueueConfig {
+    size_t read_queue_depth = kUsbQueueDepth;
+    size_t read_size = kUsbTransferSize;
+
+    // The write queue starts out at write_queue_depth, and can grow up to max_write_queue_depth.
+    size_t write_queue_depth = kUsbQueueDepth;
+    size_t max_write_queue_depth = kUsbQueueDepth;
+    size_t write_size = kUsbTransferSize;
+
+    static UsbFfsQueueConfig Create(UsbSpeed speed) {
+        UsbFfsQueueConfig config;
+        if (speed == UsbSpeed::Super || speed == UsbSpeed::SuperPlus) {
+            config.read_queue_depth = kUsbSuperSpeedQueueDepth;
+            config.write_queue_depth = kUsbSuperSpeedQueueDepth;
+            config.max_write_queue_depth = kUsbMaxQueueDepth;
+        }
 
-static constexpr size_t kUsbWriteQueueDepth = 8;
-static constexpr size_t kUsbWriteSize = 4 * PAGE_SIZE;
+        using android::base::GetUintProperty;
+        config.read_queue_depth = GetUintProperty<size_t>(
+                "persist.adb.usb.read_queue_depth", config.read_queue_depth, kUsbMaxQueueDepth);
+        config.read_size = GetUintProperty<size_t>("persist.adb.usb.read_size", config.read_size,
+                                                   kUsbMaxTransferSize);
+        config.write_queue_depth = GetUintProperty<size_t>(
+                "persist.adb.usb.write_queue_depth", config.write_queue_depth, kUsbMaxQueueDepth);
+        config.max_write_queue_depth =
+                GetUintProperty<size_t>("persist.adb.usb.max_write_queue_depth",
+                                        config.max_write_queue_depth, kUsbMaxQueueDepth);
+        config.write_size = GetUintProperty<size_t>("persist.adb.usb.write_size",
+                                                    config.write_size, kUsbMaxTransferSize);
+
+        // Reads must be able to hold an entire amessage, since the header is read on its own.
+        config.read_queue_depth = std::max<size_t>(config.read_queue_depth, 1);
+        config.read_size = std::max(config.read_size, sizeof(amessage));
+        config.write_queue_depth = std::max<size_t>(config.write_queue_depth, 1);
+        config.max_write_queue_depth =
+                std::max(config.max_write_queue_depth, config.write_queue_depth);
+        config.write_size = std::max<size_t>(config.write_size, 1);
+        return config;
+    }
+};
+
+// Counters for the IO in flight on the endpoints, to make it visible when the controller is being
+// starved of requests.
+struct UsbFfsStats {
+    std::atomic<size_t> reads_in_flight = 0;
+    std::atomic<size_t> writes_in_flight = 0;
+    std::atomic<size_t> writes_queued = 0;
+    std::atomic<size_t> write_queue_depth = 0;
+    std::atomic<size_t> max_writes_in_flight = 0;
+
+    // Read completions after which no read was left pending in the kernel.
+    std::atomic<uint64_t> read_starvations = 0;
+
+    // Times we had writes waiting, but the write queue was already full.
+    std::atomic<uint64_t> write_stalls = 0;
+
+    std::atomic<uint64_t> bytes_read = 0;
+    std::atomic<uint64_t> bytes_written = 0;
+
+    // Payload bytes that didn't land where they belonged, and had to be copied or moved.
+    std::atomic<uint64_t> bytes_copied = 0;
+
+    // Payload bytes whose read buffer was handed over with the packet, rather than copied.
+    std::atomic<uint64_t> bytes_handed_over = 0;
+
+    // Moving average of the time from submission to completion of a write.
+    std::atomic<uint64_t> write_latency_us = 0;
+
+    std::string ToString() const {
+        return StringPrintf(
+                "reads in flight = %zu, writes in flight = %zu (max %zu, depth %zu), writes queued "
+                "= %zu, read starvations = %" PRIu64 ", write stalls = %" PRIu64
+                ", write latency = %" PRIu64 "us, read %" PRIu64 " bytes (%" PRIu64
+                " copied, %" PRIu64 " handed over), wrote %" PRIu64 " bytes",
+                reads_in_flight.load(), writes_in_flight.load(), max_writes_in_flight.load(),
+                write_queue_depth.load(), writes_queued.load(), read_starvations.load(),
+                write_stalls.load(), write_latency_us.load(), bytes_read.load(),
+                bytes_copied.load(), bytes_handed_over.load(), bytes_written.load());
+    }
+};
 
 static const char* to_string(enum usb_functionfs_event_type type) {
     switch (type) {
@@ -82,139 +229,121 @@ static const char* to_string(enum usb_functionfs_event_type type) {
     }
 }
 
-enum class TransferDirection : uint64_t {
-    READ = 0,
-    WRITE = 1,
-};
-
-struct TransferId {
-    TransferDirection direction : 1;
-    uint64_t id : 63;
-
-    TransferId() : TransferId(TransferDirection::READ, 0) {}
-
-  private:
-    TransferId(TransferDirection direction, uint64_t id) : direction(direction), id(id) {}
-
-  public:
-    explicit operator uint64_t() const {
-        uint64_t result;
-        static_assert(sizeof(*this) == sizeof(result));
-        memcpy(&result, this, sizeof(*this));
-        return result;
-    }
-
-    static TransferId read(uint64_t id) { return TransferId(TransferDirection::READ, id); }
-    static TransferId write(uint64_t id) { return TransferId(TransferDirection::WRITE, id); }
-
-    static TransferId from_value(uint64_t value) {
-        TransferId result;
-        memcpy(&result, &value, sizeof(value));
-        return result;
-    }
-};
-
 template <class Payload>
 struct IoBlock {
     bool pending = false;
-    struct iocb control = {};
+    UsbFfsTransfer transfer;
     Payload payload;
+    std::chrono::steady_clock::time_point submit_time;
 
-    TransferId id() const { return TransferId::from_value(control.aio_data); }
+    TransferId id() const { return transfer.id; }
+};
+
+// Reads normally land in the block's own buffer, which is allocated once and reused for the
+// lifetime of the connection. Once we know the length of the payload being received, reads can
+// instead be posted straight into the buffer it's being assembled in.
+struct IoReadBlock : public IoBlock<Block> {
+    // The offset in the incoming payload that a direct read was posted at.
+    std::optional<size_t> payload_offset;
+
+    // The number of bytes actually read.
+    size_t size = 0;
 };
 
-using IoReadBlock = IoBlock<Block>;
 using IoWriteBlock = IoBlock<std::shared_ptr<Block>>;
 
-struct ScopedAioContext {
-    ScopedAioContext() = default;
-    ~ScopedAioContext() { reset(); }
+// The reads on one pair of bulk endpoints. Packets never span pairs, so the reads on each pair are
+// put back in order and assembled into packets independently.
+struct EndpointReads {
+    std::vector<IoReadBlock> requests;
 
-    ScopedAioContext(ScopedAioContext&& move) { reset(move.release()); }
-    ScopedAioContext(const ScopedAioContext& copy) = delete;
+    // ID of the next request that we're going to send out.
+    size_t next_id = 0;
 
-    ScopedAioContext& operator=(ScopedAioContext&& move) {
-        reset(move.release());
-        return *this;
-    }
-    ScopedAioContext& operator=(const ScopedAioContext& copy) = delete;
+    // ID of the next packet we're waiting for.
+    size_t needed_id = 0;
 
-    static ScopedAioContext Create(size_t max_events) {
-        aio_context_t ctx = 0;
-        if (io_setup(max_events, &ctx) != 0) {
-            PLOG(FATAL) << "failed to create aio_context_t";
-        }
-        ScopedAioContext result;
-        result.reset(ctx);
-        return result;
-    }
+    size_t in_flight = 0;
 
-    aio_context_t release() {
-        aio_context_t result = context_;
-        context_ = 0;
-        return result;
-    }
+    std::optional<amessage> incoming_header;
 
-    void reset(aio_context_t new_context = 0) {
-        if (context_ != 0) {
-            io_destroy(context_);
-        }
+    // The payload of the packet currently being received. A payload that's bigger than a read is
+    // allocated once its header arrives, so that reads can be posted straight into it. One that
+    // isn't is normally taken from the read block that it lands in instead.
+    Block incoming_payload;
 
-        context_ = new_context;
-    }
+    // The number of bytes of incoming_payload that have been received in order.
+    size_t incoming_payload_size = 0;
 
-    aio_context_t get() { return context_; }
+    // Where the next read will be expected to land in incoming_payload, if every read that's in
+    // flight is filled.
+    size_t incoming_payload_posted = 0;
+};
 
-  private:
-    aio_context_t context_ = 0;
+// The writes on one pair of bulk endpoints. Each pair gets a write queue of its own, of the depth
+// that the connection is currently using.
+struct EndpointWrites {
+    std::deque<IoWriteBlock> requests;
+    size_t next_id = 0;
+    size_t submitted = 0;
 };
 
 struct UsbFfsConnection : public Connection {
-    UsbFfsConnection(unique_fd control, unique_fd read, unique_fd write,
-                     std::promise<void> destruction_notifier)
+    UsbFfsConnection(unique_fd control, std::vector<UsbFfsEndpoints> endpoints,
+                     std::promise<void> destruction_notifier, std::unique_ptr<UsbFfsIo> io)
         : worker_started_(false),
           stopped_(false),
           destruction_notifier_(std::move(destruction_notifier)),
           control_fd_(std::move(control)),
-          read_fd_(std::move(read)),
-          write_fd_(std::move(write)) {
-        LOG(INFO) << "UsbFfsConnection constructed";
-        worker_event_fd_.reset(eventfd(0, EFD_CLOEXEC));
-        if (worker_event_fd_ == -1) {
-            PLOG(FATAL) << "failed to create eventfd";
-        }
-
+          endpoints_(std::move(endpoints)),
+          io_(std::move(io)),
+          router_(endpoints_.size(), false) {
+        CHECK(!endpoints_.empty());
         monitor_event_fd_.reset(eventfd(0, EFD_CLOEXEC));
         if (monitor_event_fd_ == -1) {
             PLOG(FATAL) << "failed to create eventfd";
         }
 
-        aio_context_ = ScopedAioContext::Create(kUsbReadQueueDepth + kUsbWriteQueueDepth);
+        if (!io_) {
+            io_ = CreateUsbFfsIo(control_fd_, endpoints_,
+                                 2 * kUsbMaxQueueDepth * endpoints_.size());
+        }
+        reads_.resize(endpoints_.size());
+        writes_.resize(endpoints_.size());
+        LOG(INFO) << "UsbFfsConnection constructed, using " << io_->name() << " with "
+                  << endpoints_.size() << " endpoint pair(s)";
     }
 
     ~UsbFfsConnection() {
         LOG(INFO) << "UsbFfsConnection being destroyed";
         Stop();
-        monitor_thread_.join();
+        if (monitor_thread_.joinable()) {
+            monitor_thread_.join();
+        } else if (worker_thread_.joinable()) {
+            worker_thread_.join();
+        }
+
+        LOG(INFO) << "UsbFfsConnection stats: " << stats_.ToString();
 
         // We need to explicitly close our file descriptors before we notify our destruction,
         // because the thread listening on the future will immediately try to reopen the endpoint.
-        aio_context_.reset();
+        io_.reset();
         control_fd_.reset();
-        read_fd_.reset();
-        write_fd_.reset();
+        endpoints_.clear();
 
         destruction_notifier_.set_value();
     }
 
     virtual bool Write(std::unique_ptr<apacket> packet) override final {
-        LOG(DEBUG) << "USB write: " << dump_header(&packet->msg);
+        size_t pair = router_.RouteOutgoing(*packet);
+        LOG(DEBUG) << "USB write on pair " << pair << ": " << dump_header(&packet->msg);
         auto header = std::make_shared<Block>(sizeof(packet->msg));
         memcpy(header->data(), &packet->msg, sizeof(packet->msg));
 
         std::lock_guard<std::mutex> lock(write_mutex_);
-        write_requests_.push_back(
-                CreateWriteBlock(std::move(header), 0, sizeof(packet->msg), next_write_id_++));
+        EndpointWrites& writes = writes_[pair];
+        writes.requests.push_back(CreateWriteBlock(std::move(header), 0, sizeof(packet->msg),
+                                                   TransferId::write(writes.next_id++, pair)));
         if (!packet->payload.empty()) {
             // The kernel attempts to allocate a contiguous block of memory for each write,
             // which can fail if the write is large and the kernel heap is fragmented.
@@ -224,39 +353,37 @@ struct UsbFfsConnection : public Connection {
             size_t len = payload->size();
 
             while (len > 0) {
-                size_t write_size = std::min(kUsbWriteSize, len);
-                write_requests_.push_back(
-                        CreateWriteBlock(payload, offset, write_size, next_write_id_++));
+                size_t write_size = std::min(config_.write_size, len);
+                writes.requests.push_back(CreateWriteBlock(
+                        payload, offset, write_size, TransferId::write(writes.next_id++, pair)));
                 len -= write_size;
                 offset += write_size;
             }
         }
+        UpdateWriteStats();
 
         // Wake up the worker thread to submit writes.
-        uint64_t notify = 1;
-        ssize_t rc = adb_write(worker_event_fd_.get(), &notify, sizeof(notify));
-        if (rc < 0) {
-            PLOG(FATAL) << "failed to notify worker eventfd to submit writes";
-        }
-
+        io_->Wake();
         return true;
     }
 
-    virtual void Start() override final { StartMonitor(); }
+    virtual void Start() override final {
+        if (io_->HandlesControl()) {
+            StartWorker();
+        } else {
+            StartMonitor();
+        }
+    }
 
     virtual void Stop() override final {
         if (stopped_.exchange(true)) {
             return;
         }
         stopped_ = true;
-        uint64_t notify = 1;
-        ssize_t rc = adb_write(worker_event_fd_.get(), &notify, sizeof(notify));
-        if (rc < 0) {
-            PLOG(FATAL) << "failed to notify worker eventfd to stop UsbFfsConnection";
-        }
-        CHECK_EQ(static_cast<size_t>(rc), sizeof(notify));
+        io_->Wake();
 
-        rc = adb_write(monitor_event_fd_.get(), &notify, sizeof(notify));
+        uint64_t notify = 1;
+        ssize_t rc = adb_write(monitor_event_fd_.get(), &notify, sizeof(notify));
         if (rc < 0) {
             PLOG(FATAL) << "failed to notify monitor eventfd to stop UsbFfsConnection";
         }
@@ -280,6 +407,9 @@ struct UsbFfsConnection : public Connection {
         // until it dies, and then report failure to the transport via HandleError, which will
         // eventually result in the transport being destroyed, which will result in UsbFfsConnection
         // being destroyed, which unblocks the open thread and restarts this entire process.
+        //
+        // This is only needed with the AIO backend: io_uring never blocks in submission, and lets
+        // the worker thread wait for control events alongside everything else.
         static std::once_flag handler_once;
         std::call_once(handler_once, []() { signal(kInterruptionSignal, [](int) {}); });
 
@@ -287,17 +417,14 @@ struct UsbFfsConnection : public Connection {
             adb_thread_setname("UsbFfs-monitor");
             LOG(INFO) << "UsbFfs-monitor thread spawned";
 
-            bool bound = false;
-            bool enabled = false;
-            bool running = true;
-            while (running) {
+            while (true) {
                 adb_pollfd pfd[2] = {
                   { .fd = control_fd_.get(), .events = POLLIN, .revents = 0 },
                   { .fd = monitor_event_fd_.get(), .events = POLLIN, .revents = 0 },
                 };
 
                 // If we don't see our first bind within a second, try again.
-                int timeout_ms = bound ? -1 : 1000;
+                int timeout_ms = bound_ ? -1 : 1000;
 
                 int rc = TEMP_FAILURE_RETRY(adb_poll(pfd, 2, timeout_ms));
                 if (rc == -1) {
@@ -324,139 +451,210 @@ struct UsbFfsConnection : public Connection {
                                << sizeof(event) << ", got " << rc;
                 }
 
-                LOG(INFO) << "USB event: "
-                          << to_string(static_cast<usb_functionfs_event_type>(event.type));
+                if (!HandleControlEvent(event)) {
+                    break;
+                }
+            }
 
-                switch (event.type) {
-                    case FUNCTIONFS_BIND:
-                        if (bound) {
-                            LOG(WARNING) << "received FUNCTIONFS_BIND while already bound?";
-                            running = false;
-                            break;
-                        }
+            StopWorker();
+            HandleError("monitor thread finished");
+        });
+    }
 
-                        if (enabled) {
-                            LOG(WARNING) << "received FUNCTIONFS_BIND while already enabled?";
-                            running = false;
-                            break;
-                        }
+    // Returns whether we should keep listening for control events.
+    bool HandleControlEvent(const usb_functionfs_event& event) {
+        LOG(INFO) << "USB event: " << to_string(static_cast<usb_functionfs_event_type>(event.type));
 
-                        bound = true;
-                        break;
+        switch (event.type) {
+            case FUNCTIONFS_BIND:
+                if (bound_) {
+                    LOG(WARNING) << "received FUNCTIONFS_BIND while already bound?";
+                    return false;
+                }
 
-                    case FUNCTIONFS_ENABLE:
-                        if (!bound) {
-                            LOG(WARNING) << "received FUNCTIONFS_ENABLE while not bound?";
-                            running = false;
-                            break;
-                        }
+                if (enabled_) {
+                    LOG(WARNING) << "received FUNCTIONFS_BIND while already enabled?";
+                    return false;
+                }
 
-                        if (enabled) {
-                            LOG(WARNING) << "received FUNCTIONFS_ENABLE while already enabled?";
-                            running = false;
-                            break;
-                        }
+                bound_ = true;
+                break;
 
-                        enabled = true;
-                        StartWorker();
-                        break;
+            case FUNCTIONFS_ENABLE:
+                if (!bound_) {
+                    LOG(WARNING) << "received FUNCTIONFS_ENABLE while not bound?";
+                    return false;
+                }
 
-                    case FUNCTIONFS_DISABLE:
-                        if (!bound) {
-                            LOG(WARNING) << "received FUNCTIONFS_DISABLE while not bound?";
-                        }
+                if (enabled_) {
+                    LOG(WARNING) << "received FUNCTIONFS_ENABLE while already enabled?";
+                    return false;
+                }
 
-                        if (!enabled) {
-                            LOG(WARNING) << "received FUNCTIONFS_DISABLE while not enabled?";
-                        }
+                enabled_ = true;
+                if (io_->HandlesControl()) {
+                    // We're already on the worker thread.
+                    return StartReads();
+                }
+                StartWorker();
+                break;
 
-                        enabled = false;
-                        running = false;
-                        break;
+            case FUNCTIONFS_DISABLE:
+                if (!bound_) {
+                    LOG(WARNING) << "received FUNCTIONFS_DISABLE while not bound?";
+                }
 
-                    case FUNCTIONFS_UNBIND:
-                        if (enabled) {
-                            LOG(WARNING) << "received FUNCTIONFS_UNBIND while still enabled?";
-                        }
+                if (!enabled_) {
+                    LOG(WARNING) << "received FUNCTIONFS_DISABLE while not enabled?";
+                }
 
-                        if (!bound) {
-                            LOG(WARNING) << "received FUNCTIONFS_UNBIND when not bound?";
-                        }
+                enabled_ = false;
+                return false;
 
-                        bound = false;
-                        running = false;
-                        break;
+            case FUNCTIONFS_UNBIND:
+                if (enabled_) {
+                    LOG(WARNING) << "received FUNCTIONFS_UNBIND while still enabled?";
+                }
 
-                    case FUNCTIONFS_SETUP: {
-                        LOG(INFO) << "received FUNCTIONFS_SETUP control transfer: bRequestType = "
-                                  << static_cast<int>(event.u.setup.bRequestType)
-                                  << ", bRequest = " << static_cast<int>(event.u.setup.bRequest)
-                                  << ", wValue = " << static_cast<int>(event.u.setup.wValue)
-                                  << ", wIndex = " << static_cast<int>(event.u.setup.wIndex)
-                                  << ", wLength = " << static_cast<int>(event.u.setup.wLength);
-
-                        if ((event.u.setup.bRequestType & USB_DIR_IN)) {
-                            LOG(INFO) << "acking device-to-host control transfer";
-                            ssize_t rc = adb_write(control_fd_.get(), "", 0);
-                            if (rc != 0) {
-                                PLOG(ERROR) << "failed to write empty packet to host";
-                                break;
-                            }
-                        } else {
-                            std::string buf;
-                            buf.resize(event.u.setup.wLength + 1);
-
-                            ssize_t rc = adb_read(control_fd_.get(), buf.data(), buf.size());
-                            if (rc != event.u.setup.wLength) {
-                                LOG(ERROR)
-                                        << "read " << rc
-                                        << " bytes when trying to read control request, expected "
-                                        << event.u.setup.wLength;
-                            }
-
-                            LOG(INFO) << "control request contents: " << buf;
-                            break;
-                        }
+                if (!bound_) {
+                    LOG(WARNING) << "received FUNCTIONFS_UNBIND when not bound?";
+                }
+
+                bound_ = false;
+                return false;
+
+            case FUNCTIONFS_SETUP: {
+                LOG(INFO) << "received FUNCTIONFS_SETUP control transfer: bRequestType = "
+                          << static_cast<int>(event.u.setup.bRequestType)
+                          << ", bRequest = " << static_cast<int>(event.u.setup.bRequest)
+                          << ", wValue = " << static_cast<int>(event.u.setup.wValue)
+                          << ", wIndex = " << static_cast<int>(event.u.setup.wIndex)
+                          << ", wLength = " << static_cast<int>(event.u.setup.wLength);
+
+                if ((event.u.setup.bRequestType & USB_DIR_IN)) {
+                    LOG(INFO) << "acking device-to-host control transfer";
+                    ssize_t rc = adb_write(control_fd_.get(), "", 0);
+                    if (rc != 0) {
+                        PLOG(ERROR) << "failed to write empty packet to host";
+                        break;
+                    }
+                } else {
+                    std::string buf;
+                    buf.resize(event.u.setup.wLength + 1);
+
+                    ssize_t rc = adb_read(control_fd_.get(), buf.data(), buf.size());
+                    if (rc != event.u.setup.wLength) {
+                        LOG(ERROR) << "read " << rc
+                                   << " bytes when trying to read control request, expected "
+                                   << event.u.setup.wLength;
                     }
+
+                    LOG(INFO) << "control request contents: " << buf;
+                    break;
                 }
             }
+        }
 
-            StopWorker();
-            HandleError("monitor thread finished");
-        });
+        return true;
     }
 
     void StartWorker() {
         CHECK(!worker_started_);
         worker_started_ = true;
+
         worker_thread_ = std::thread([this]() {
             adb_thread_setname("UsbFfs-worker");
             LOG(INFO) << "UsbFfs-worker thread spawned";
 
-            for (size_t i = 0; i < kUsbReadQueueDepth; ++i) {
-                read_requests_[i] = CreateReadBlock(next_read_id_++);
-                if (!SubmitRead(&read_requests_[i])) {
-                    return;
-                }
+            // If the backend doesn't deliver control events, the monitor thread only starts us
+            // once we've been enabled.
+            bool handles_control = io_->HandlesControl();
+            if (!handles_control && !StartReads()) {
+                return;
             }
 
+            std::vector<UsbFfsIoEvent> events;
             while (!stopped_) {
-                uint64_t dummy;
-                ssize_t rc = adb_read(worker_event_fd_.get(), &dummy, sizeof(dummy));
-                if (rc == -1) {
-                    PLOG(FATAL) << "failed to read from eventfd";
-                } else if (rc == 0) {
-                    LOG(FATAL) << "hit EOF on eventfd";
+                // If we don't see our first bind within a second, try again.
+                std::optional<std::chrono::milliseconds> timeout;
+                if (handles_control && !bound_) {
+                    timeout = 1000ms;
                 }
 
-                ReadEvents();
+                events.clear();
+                if (!io_->Wait(&events, timeout)) {
+                    if (errno == ETIMEDOUT) {
+                        LOG(WARNING) << "timed out while waiting for FUNCTIONFS_BIND, trying again";
+                    } else {
+                        HandleError(StringPrintf("failed to wait for USB events: %s",
+                                                 strerror(errno)));
+                    }
+                    break;
+                }
 
-                std::lock_guard<std::mutex> lock(write_mutex_);
-                SubmitWrites();
+                if (!HandleEvents(events)) {
+                    break;
+                }
+
+                if (reads_started_) {
+                    std::lock_guard<std::mutex> lock(write_mutex_);
+                    SubmitWrites();
+                }
+
+                MaybeDumpStats();
+            }
+
+            if (handles_control) {
+                HandleError("worker thread finished");
             }
         });
     }
 
+    bool StartReads() {
+        // The controller speed is only known once we've been enabled, so this is the earliest
+        // point at which we can size our queues.
+        UsbSpeed speed = get_controller_speed();
+        {
+            std::lock_guard<std::mutex> lock(write_mutex_);
+            config_ = UsbFfsQueueConfig::Create(speed);
+            write_queue_depth_ = config_.write_queue_depth;
+            stats_.write_queue_depth = write_queue_depth_;
+        }
+        LOG(INFO) << "USB controller speed " << to_string(speed) << ": "
+                  << config_.read_queue_depth << " reads of " << config_.read_size << " bytes, "
+                  << config_.write_queue_depth << "-" << config_.max_write_queue_depth
+                  << " writes of " << config_.write_size << " bytes";
+
+        // Every pair gets reads queued, since the host only tells us which ones it's using by
+        // sending on them.
+        for (size_t pair = 0; pair < reads_.size(); ++pair) {
+            EndpointReads& reads = reads_[pair];
+            reads.requests.resize(config_.read_queue_depth);
+            for (size_t i = 0; i < reads.requests.size(); ++i) {
+                reads.requests[i] = CreateReadBlock(pair, reads.next_id++);
+                if (!SubmitRead(pair, &reads.requests[i])) {
+                    return false;
+                }
+            }
+        }
+
+        reads_started_ = true;
+        return true;
+    }
+
+    void MaybeDumpStats() {
+        if (!VLOG_IS_ON(USB)) {
+            return;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (now < last_stats_dump_ + kUsbStatsInterval) {
+            return;
+        }
+        last_stats_dump_ = now;
+        D("USB stats: %s", stats_.ToString().c_str());
+    }
+
     void StopWorker() {
         if (!worker_started_) {
             return;
@@ -485,210 +683,372 @@ struct UsbFfsConnection : public Connection {
         worker_thread_.join();
     }
 
-    void PrepareReadBlock(IoReadBlock* block, uint64_t id) {
+    void PrepareReadBlock(size_t pair, IoReadBlock* block, uint64_t id) {
+        EndpointReads& reads = reads_[pair];
         block->pending = false;
-        if (block->payload.capacity() >= kUsbReadSize) {
-            block->payload.resize(kUsbReadSize);
-        } else {
-            block->payload = Block(kUsbReadSize);
+        block->size = 0;
+        block->transfer.id = TransferId::read(id, pair);
+
+        // If the reads already in flight can't hold the rest of the payload we're waiting for,
+        // even if they're all filled, this one is going to receive part of it: read it directly
+        // into place. It can only end up somewhere else if the host ends a transfer early, which
+        // ProcessRead takes care of.
+        if (reads.incoming_header &&
+            reads.incoming_payload_posted < reads.incoming_header->data_length) {
+            size_t length =
+                    std::min(config_.read_size,
+                             reads.incoming_header->data_length - reads.incoming_payload_posted);
+            block->payload_offset = reads.incoming_payload_posted;
+            block->transfer.data = reads.incoming_payload.data() + reads.incoming_payload_posted;
+            block->transfer.length = length;
+            block->transfer.buffer_index = -1;
+            reads.incoming_payload_posted += length;
+            return;
         }
-        block->control.aio_data = static_cast<uint64_t>(TransferId::read(id));
-        block->control.aio_buf = reinterpret_cast<uintptr_t>(block->payload.data());
-        block->control.aio_nbytes = block->payload.size();
+
+        block->payload_offset.reset();
+        block->transfer.data = block->payload.data();
+        block->transfer.length = block->payload.size();
+        block->transfer.buffer_index = pair * kUsbMaxQueueDepth + id % reads.requests.size();
     }
 
-    IoReadBlock CreateReadBlock(uint64_t id) {
+    IoReadBlock CreateReadBlock(size_t pair, uint64_t id) {
         IoReadBlock block;
-        PrepareReadBlock(&block, id);
-        block.control.aio_rw_flags = 0;
-        block.control.aio_lio_opcode = IOCB_CMD_PREAD;
-        block.control.aio_reqprio = 0;
-        block.control.aio_fildes = read_fd_.get();
-        block.control.aio_offset = 0;
-        block.control.aio_flags = IOCB_FLAG_RESFD;
-        block.control.aio_resfd = worker_event_fd_.get();
+        block.payload = Block(config_.read_size);
+        PrepareReadBlock(pair, &block, id);
         return block;
     }
 
-    void ReadEvents() {
-        static constexpr size_t kMaxEvents = kUsbReadQueueDepth + kUsbWriteQueueDepth;
-        struct io_event events[kMaxEvents];
-        struct timespec timeout = {.tv_sec = 0, .tv_nsec = 0};
-        int rc = io_getevents(aio_context_.get(), 0, kMaxEvents, events, &timeout);
-        if (rc == -1) {
-            HandleError(StringPrintf("io_getevents failed while reading: %s", strerror(errno)));
-            return;
-        }
+    bool HandleEvents(const std::vector<UsbFfsIoEvent>& events) {
+        for (const UsbFfsIoEvent& event : events) {
+            switch (event.type) {
+                case UsbFfsIoEvent::Type::Transfer: {
+                    TransferId id = event.id;
+                    if (event.result < 0) {
+                        std::string error = StringPrintf(
+                                "%s %" PRIu64 " failed with error %s",
+                                id.direction == TransferDirection::READ ? "read" : "write",
+                                static_cast<uint64_t>(id.id), strerror(-event.result));
+                        HandleError(error);
+                        return false;
+                    }
 
-        for (int event_idx = 0; event_idx < rc; ++event_idx) {
-            auto& event = events[event_idx];
-            TransferId id = TransferId::from_value(event.data);
+                    if (id.direction == TransferDirection::READ) {
+                        if (!HandleRead(id, event.result)) {
+                            return false;
+                        }
+                    } else {
+                        HandleWrite(id);
+                    }
+                    break;
+                }
 
-            if (event.res < 0) {
-                std::string error =
-                        StringPrintf("%s %" PRIu64 " failed with error %s",
-                                     id.direction == TransferDirection::READ ? "read" : "write",
-                                     id.id, strerror(-event.res));
-                HandleError(error);
-                return;
-            }
+                case UsbFfsIoEvent::Type::Control:
+                    if (event.result < 0) {
+                        HandleError(StringPrintf("failed to read functionfs event: %s",
+                                                 strerror(-event.result)));
+                        return false;
+                    } else if (event.result == 0) {
+                        LOG(WARNING) << "hit EOF on functionfs control fd";
+                        return false;
+                    } else if (event.result != sizeof(event.control)) {
+                        LOG(FATAL) << "read functionfs event of unexpected size, expected "
+                                   << sizeof(event.control) << ", got " << event.result;
+                    }
 
-            if (id.direction == TransferDirection::READ) {
-                if (!HandleRead(id, event.res)) {
-                    return;
-                }
-            } else {
-                HandleWrite(id);
+                    if (!HandleControlEvent(event.control)) {
+                        return false;
+                    }
+                    break;
+
+                case UsbFfsIoEvent::Type::Wakeup:
+                    break;
             }
         }
+        return true;
     }
 
     bool HandleRead(TransferId id, int64_t size) {
-        uint64_t read_idx = id.id % kUsbReadQueueDepth;
-        IoReadBlock* block = &read_requests_[read_idx];
+        size_t pair = id.pair;
+        EndpointReads& reads = reads_[pair];
+        uint64_t read_idx = id.id % reads.requests.size();
+        IoReadBlock* block = &reads.requests[read_idx];
         block->pending = false;
-        block->payload.resize(size);
+        block->size = size;
+
+        stats_.bytes_read += size;
+        --stats_.reads_in_flight;
+        if (--reads.in_flight == 0) {
+            // The controller has nowhere to put data from the host until we resubmit.
+            ++stats_.read_starvations;
+        }
 
         // Notification for completed reads can be received out of order.
-        if (block->id().id != needed_read_id_) {
-            LOG(VERBOSE) << "read " << block->id().id << " completed while waiting for "
-                         << needed_read_id_;
+        if (block->id().id != reads.needed_id) {
+            LOG(VERBOSE) << "read " << block->id().id << " on pair " << pair
+                         << " completed while waiting for " << reads.needed_id;
             return true;
         }
 
-        for (uint64_t id = needed_read_id_;; ++id) {
-            size_t read_idx = id % kUsbReadQueueDepth;
-            IoReadBlock* current_block = &read_requests_[read_idx];
+        for (uint64_t id = reads.needed_id;; ++id) {
+            size_t read_idx = id % reads.requests.size();
+            IoReadBlock* current_block = &reads.requests[read_idx];
             if (current_block->pending) {
                 break;
             }
-            if (!ProcessRead(current_block)) {
+            if (!ProcessRead(pair, current_block)) {
                 return false;
             }
-            ++needed_read_id_;
+            ++reads.needed_id;
         }
 
         return true;
     }
 
-    bool ProcessRead(IoReadBlock* block) {
-        if (!block->payload.empty()) {
-            if (!incoming_header_.has_value()) {
-                if (block->payload.size() != sizeof(amessage)) {
+    bool ProcessRead(size_t pair, IoReadBlock* block) {
+        EndpointReads& reads = reads_[pair];
+        if (block->size != 0) {
+            const char* data = block->transfer.data;
+            if (!reads.incoming_header.has_value()) {
+                if (block->payload_offset || block->size != sizeof(amessage)) {
                     HandleError("received packet of unexpected length while reading header");
                     return false;
                 }
-                amessage& msg = incoming_header_.emplace();
-                memcpy(&msg, block->payload.data(), sizeof(msg));
-                LOG(DEBUG) << "USB read:" << dump_header(&msg);
-                incoming_header_ = msg;
+                amessage& msg = reads.incoming_header.emplace();
+                memcpy(&msg, data, sizeof(msg));
+                LOG(DEBUG) << "USB read on pair " << pair << ":" << dump_header(&msg);
+                if (msg.data_length > MAX_PAYLOAD) {
+                    // The payload is allocated up front, so don't trust the header with that.
+                    HandleError(StringPrintf("received packet with oversized payload: %" PRIu32,
+                                             msg.data_length));
+                    return false;
+                }
+
+                reads.incoming_payload_size = 0;
+                if (msg.data_length <= config_.read_size) {
+                    // The host sends the payload in one transfer, so it'll land in a single read.
+                    reads.incoming_payload.clear();
+                    reads.incoming_payload_posted = msg.data_length;
+                } else {
+                    reads.incoming_payload = Block(msg.data_length);
+
+                    // Everything in flight is going into the read blocks' own buffers.
+                    reads.incoming_payload_posted =
+                            (reads.requests.size() - 1) * config_.read_size;
+                }
             } else {
-                size_t bytes_left = incoming_header_->data_length - incoming_payload_.size();
-                if (block->payload.size() > bytes_left) {
+                size_t bytes_left =
+                        reads.incoming_header->data_length - reads.incoming_payload_size;
+                if (block->size > bytes_left) {
                     HandleError("received too many bytes while waiting for payload");
                     return false;
                 }
-                incoming_payload_.append(std::move(block->payload));
+
+                if (reads.incoming_payload_size == 0 && !block->payload_offset &&
+                    block->size == reads.incoming_header->data_length &&
+                    block->size * 2 >= config_.read_size) {
+                    // The whole payload is in this block's buffer: hand the buffer over with the
+                    // packet, and read into a new one. Smaller payloads are copied instead, so
+                    // that they don't each hold on to a whole read buffer.
+                    reads.incoming_payload = std::move(block->payload);
+                    reads.incoming_payload.resize(block->size);
+                    block->payload = Block(config_.read_size);
+                    stats_.bytes_handed_over += block->size;
+                } else {
+                    if (reads.incoming_payload.size() != reads.incoming_header->data_length) {
+                        if (reads.incoming_header->data_length > MAX_PAYLOAD) {
+                            HandleError("received packet with oversized payload");
+                            return false;
+                        }
+                        reads.incoming_payload = Block(reads.incoming_header->data_length);
+                    }
+
+                    // Otherwise, data read into a block's own buffer needs to be copied. A direct
+                    // read can only have landed past where it belongs, if the host ended a
+                    // transfer early, and never overlaps a region that a pending read was posted
+                    // into.
+                    char* dst = reads.incoming_payload.data() + reads.incoming_payload_size;
+                    if (dst != data) {
+                        memmove(dst, data, block->size);
+                        stats_.bytes_copied += block->size;
+                    }
+                }
+                reads.incoming_payload_size += block->size;
             }
 
-            if (incoming_header_->data_length == incoming_payload_.size()) {
+            if (reads.incoming_header->data_length == reads.incoming_payload_size) {
                 auto packet = std::make_unique<apacket>();
-                packet->msg = *incoming_header_;
-
-                // TODO: Make apacket contain an IOVector so we don't have to coalesce.
-                packet->payload = std::move(incoming_payload_).coalesce();
+                packet->msg = *reads.incoming_header;
+                packet->payload = std::move(reads.incoming_payload);
+                router_.HandleIncoming(packet->msg, pair);
                 read_callback_(this, std::move(packet));
 
-                incoming_header_.reset();
-                // reuse the capacity of the incoming payload while we can.
-                auto free_block = incoming_payload_.clear();
-                if (block->payload.capacity() == 0) {
-                    block->payload = std::move(free_block);
-                }
+                reads.incoming_header.reset();
+                reads.incoming_payload_size = 0;
+                reads.incoming_payload_posted = 0;
             }
         }
 
-        PrepareReadBlock(block, block->id().id + kUsbReadQueueDepth);
-        SubmitRead(block);
+        PrepareReadBlock(pair, block, block->id().id + reads.requests.size());
+        SubmitRead(pair, block);
         return true;
     }
 
-    bool SubmitRead(IoReadBlock* block) {
+    bool SubmitRead(size_t pair, IoReadBlock* block) {
         block->pending = true;
-        struct iocb* iocb = &block->control;
-        if (io_submit(aio_context_.get(), 1, &iocb) != 1) {
+        if (!io_->Submit(std::span<const UsbFfsTransfer>(&block->transfer, 1))) {
             HandleError(StringPrintf("failed to submit read: %s", strerror(errno)));
             return false;
         }
 
+        ++reads_[pair].in_flight;
+        ++stats_.reads_in_flight;
         return true;
     }
 
     void HandleWrite(TransferId id) {
         std::lock_guard<std::mutex> lock(write_mutex_);
-        auto it =
-                std::find_if(write_requests_.begin(), write_requests_.end(), [id](const auto& req) {
-                    return static_cast<uint64_t>(req.id()) == static_cast<uint64_t>(id);
-                });
-        CHECK(it != write_requests_.end());
-
-        write_requests_.erase(it);
-        size_t outstanding_writes = --writes_submitted_;
+        EndpointWrites& writes = writes_[id.pair];
+        auto it = std::find_if(writes.requests.begin(), writes.requests.end(),
+                               [id](const auto& req) {
+                                   return static_cast<uint64_t>(req.id()) ==
+                                          static_cast<uint64_t>(id);
+                               });
+        CHECK(it != writes.requests.end());
+
+        // If there were writes waiting for room in the queue, the controller was as busy as we
+        // could make it, so this completion tells us something about the queue depth.
+        bool saturated = writes.submitted >= write_queue_depth_ &&
+                         writes.requests.size() > writes.submitted;
+        size_t bytes = it->transfer.length;
+        auto latency = std::chrono::steady_clock::now() - it->submit_time;
+
+        writes.requests.erase(it);
+        --writes.submitted;
+        size_t outstanding_writes = UpdateWriteStats();
         LOG(DEBUG) << "USB write: reaped, down to " << outstanding_writes;
+
+        stats_.bytes_written += bytes;
+        TuneWriteQueue(bytes, latency, saturated);
+    }
+
+    // Update the write counters in stats_, and return the number of writes in flight.
+    size_t UpdateWriteStats() REQUIRES(write_mutex_) {
+        size_t submitted = 0;
+        size_t queued = 0;
+        for (const EndpointWrites& writes : writes_) {
+            submitted += writes.submitted;
+            queued += writes.requests.size() - writes.submitted;
+        }
+
+        stats_.writes_in_flight = submitted;
+        stats_.writes_queued = queued;
+        if (submitted > stats_.max_writes_in_flight) {
+            stats_.max_writes_in_flight = submitted;
+        }
+        return submitted;
+    }
+
+    // Grow the write queue for as long as doing so improves throughput while it's saturated.
+    // Once an increase stops paying off, go back to the previous depth and stay there.
+    void TuneWriteQueue(size_t bytes, std::chrono::steady_clock::duration latency, bool saturated)
+            REQUIRES(write_mutex_) {
+        uint64_t latency_us =
+                std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+        uint64_t average_us = stats_.write_latency_us;
+        stats_.write_latency_us = average_us == 0 ? latency_us : (7 * average_us + latency_us) / 8;
+
+        if (write_queue_tuned_ || write_queue_depth_ >= config_.max_write_queue_depth) {
+            return;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (tuning_window_bytes_ == 0) {
+            tuning_window_start_ = now - latency;
+        }
+        tuning_window_bytes_ += bytes;
+        tuning_window_completions_ += 1;
+        tuning_window_saturated_ += saturated;
+        if (tuning_window_bytes_ < kUsbWriteTuningWindow) {
+            return;
+        }
+
+        // Only draw conclusions from windows where we were mostly limited by the queue depth.
+        if (tuning_window_saturated_ * 4 >= tuning_window_completions_ * 3) {
+            std::chrono::duration<double> elapsed = now - tuning_window_start_;
+            double throughput = tuning_window_bytes_ / elapsed.count();
+            if (tuning_last_throughput_ == 0 || throughput > tuning_last_throughput_ * 1.05) {
+                tuning_previous_depth_ = write_queue_depth_;
+                tuning_last_throughput_ = throughput;
+                write_queue_depth_ = std::min(write_queue_depth_ + kUsbQueueDepth / 2,
+                                              config_.max_write_queue_depth);
+            } else {
+                write_queue_depth_ = tuning_previous_depth_;
+                write_queue_tuned_ = true;
+            }
+            stats_.write_queue_depth = write_queue_depth_;
+            D("USB write queue depth now %zu (%.1f MB/s, latency %" PRIu64 "us)",
+              write_queue_depth_, throughput / (1024 * 1024), stats_.write_latency_us.load());
+        }
+
+        tuning_window_bytes_ = 0;
+        tuning_window_completions_ = 0;
+        tuning_window_saturated_ = 0;
     }
 
     IoWriteBlock CreateWriteBlock(std::shared_ptr<Block> payload, size_t offset, size_t len,
-                                  uint64_t id) {
+                                  TransferId id) {
         auto block = IoWriteBlock();
         block.payload = std::move(payload);
-        block.control.aio_data = static_cast<uint64_t>(TransferId::write(id));
-        block.control.aio_rw_flags = 0;
-        block.control.aio_lio_opcode = IOCB_CMD_PWRITE;
-        block.control.aio_reqprio = 0;
-        block.control.aio_fildes = write_fd_.get();
-        block.control.aio_buf = reinterpret_cast<uintptr_t>(block.payload->data() + offset);
-        block.control.aio_nbytes = len;
-        block.control.aio_offset = 0;
-        block.control.aio_flags = IOCB_FLAG_RESFD;
-        block.control.aio_resfd = worker_event_fd_.get();
+        block.transfer.id = id;
+        block.transfer.data = block.payload->data() + offset;
+        block.transfer.length = len;
         return block;
     }
 
-    IoWriteBlock CreateWriteBlock(Block&& payload, uint64_t id) {
-        size_t len = payload.size();
-        return CreateWriteBlock(std::make_shared<Block>(std::move(payload)), 0, len, id);
+    void SubmitWrites() REQUIRES(write_mutex_) {
+        for (EndpointWrites& writes : writes_) {
+            if (!SubmitWrites(&writes)) {
+                return;
+            }
+        }
     }
 
-    void SubmitWrites() REQUIRES(write_mutex_) {
-        if (writes_submitted_ == kUsbWriteQueueDepth) {
-            return;
+    bool SubmitWrites(EndpointWrites* writes) REQUIRES(write_mutex_) {
+        if (writes->submitted >= write_queue_depth_) {
+            if (writes->requests.size() > writes->submitted) {
+                ++stats_.write_stalls;
+            }
+            return true;
         }
 
-        ssize_t writes_to_submit = std::min(kUsbWriteQueueDepth - writes_submitted_,
-                                            write_requests_.size() - writes_submitted_);
+        ssize_t writes_to_submit = std::min(write_queue_depth_ - writes->submitted,
+                                            writes->requests.size() - writes->submitted);
         CHECK_GE(writes_to_submit, 0);
         if (writes_to_submit == 0) {
-            return;
+            return true;
         }
 
-        struct iocb* iocbs[kUsbWriteQueueDepth];
+        auto now = std::chrono::steady_clock::now();
+        UsbFfsTransfer transfers[kUsbMaxQueueDepth];
         for (int i = 0; i < writes_to_submit; ++i) {
-            CHECK(!write_requests_[writes_submitted_ + i].pending);
-            write_requests_[writes_submitted_ + i].pending = true;
-            iocbs[i] = &write_requests_[writes_submitted_ + i].control;
-            LOG(VERBOSE) << "submitting write_request " << static_cast<void*>(iocbs[i]);
+            IoWriteBlock& block = writes->requests[writes->submitted + i];
+            CHECK(!block.pending);
+            block.pending = true;
+            block.submit_time = now;
+            transfers[i] = block.transfer;
+            LOG(VERBOSE) << "submitting write_request " << transfers[i].id.id << " on pair "
+                         << transfers[i].id.pair;
         }
 
-        writes_submitted_ += writes_to_submit;
+        writes->submitted += writes_to_submit;
+        UpdateWriteStats();
 
-        int rc = io_submit(aio_context_.get(), writes_to_submit, iocbs);
-        if (rc == -1) {
+        if (!io_->Submit(std::span<const UsbFfsTransfer>(transfers, writes_to_submit))) {
             HandleError(StringPrintf("failed to submit write requests: %s", strerror(errno)));
-            return;
-        } else if (rc != writes_to_submit) {
-            LOG(FATAL) << "failed to submit all writes: wanted to submit " << writes_to_submit
-                       << ", actually submitted " << rc;
+            return false;
         }
+        return true;
     }
 
     void HandleError(const std::string& error) {
@@ -705,46 +1065,70 @@ struct UsbFfsConnection : public Connection {
     bool worker_started_;
     std::thread worker_thread_;
 
+    // Only accessed by whichever thread handles control events.
+    bool bound_ = false;
+    bool enabled_ = false;
+
+    // Only accessed by the worker thread.
+    bool reads_started_ = false;
+
     std::atomic<bool> stopped_;
     std::promise<void> destruction_notifier_;
     std::once_flag error_flag_;
 
-    unique_fd worker_event_fd_;
     unique_fd monitor_event_fd_;
 
-    ScopedAioContext aio_context_;
     unique_fd control_fd_;
-    unique_fd read_fd_;
-    unique_fd write_fd_;
+    std::vector<UsbFfsEndpoints> endpoints_;
+    std::unique_ptr<UsbFfsIo> io_;
 
-    std::optional<amessage> incoming_header_;
-    IOVector incoming_payload_;
+    // Decided when the worker is started, and constant afterwards.
+    UsbFfsQueueConfig config_;
+    UsbFfsStats stats_;
+    std::chrono::steady_clock::time_point last_stats_dump_;
 
-    std::array<IoReadBlock, kUsbReadQueueDepth> read_requests_;
-    IOVector read_data_;
+    UsbEndpointPairRouter router_;
 
-    // ID of the next request that we're going to send out.
-    size_t next_read_id_ = 0;
-
-    // ID of the next packet we're waiting for.
-    size_t needed_read_id_ = 0;
+    // Only accessed by the worker thread.
+    std::vector<EndpointReads> reads_;
 
     std::mutex write_mutex_;
-    std::deque<IoWriteBlock> write_requests_ GUARDED_BY(write_mutex_);
-    size_t next_write_id_ GUARDED_BY(write_mutex_) = 0;
-    size_t writes_submitted_ GUARDED_BY(write_mutex_) = 0;
+    std::vector<EndpointWrites> writes_ GUARDED_BY(write_mutex_);
+    size_t write_queue_depth_ GUARDED_BY(write_mutex_) = kUsbQueueDepth;
+
+    // State for TuneWriteQueue.
+    bool write_queue_tuned_ GUARDED_BY(write_mutex_) = false;
+    size_t tuning_previous_depth_ GUARDED_BY(write_mutex_) = 0;
+    double tuning_last_throughput_ GUARDED_BY(write_mutex_) = 0;
+    std::chrono::steady_clock::time_point tuning_window_start_ GUARDED_BY(write_mutex_);
+    size_t tuning_window_bytes_ GUARDED_BY(write_mutex_) = 0;
+    size_t tuning_window_completions_ GUARDED_BY(write_mutex_) = 0;
+    size_t tuning_window_saturated_ GUARDED_BY(write_mutex_) = 0;
 
     static constexpr int kInterruptionSignal = SIGUSR1;
 };
 
+std::unique_ptr<Connection> CreateUsbFfsConnection(unique_fd control,
+                                                   std::vector<UsbFfsEndpoints> endpoints,
+                                                   std::promise<void> destruction_notifier,
+                                                   std::unique_ptr<UsbFfsIo> io) {
+    return std::make_unique<UsbFfsConnection>(std::move(control), std::move(endpoints),
+                                              std::move(destruction_notifier), std::move(io));
+}
+
 static void usb_ffs_open_thread() {
     adb_thread_setname("usb ffs open");
 
+    // Hosts only spread streams over extra endpoint pairs once they've seen that we support it,
+    // but the pairs are visible to every host, so they're opt-in.
+    size_t endpoint_pairs = android::base::GetUintProperty<size_t>(
+            "persist.adb.usb.endpoint_pairs", 1, kUsbFfsMaxEndpointPairs);
+    endpoint_pairs = std::max<size_t>(endpoint_pairs, 1);
+
     while (true) {
         unique_fd control;
-        unique_fd bulk_out;
-        unique_fd bulk_in;
-        if (!open_functionfs(&control, &bulk_out, &bulk_in)) {
+        std::vector<UsbFfsEndpoints> endpoints;
+        if (!open_functionfs(&control, &endpoints, endpoint_pairs)) {
             std::this_thread::sleep_for(1s);
             continue;
         }
@@ -753,9 +1137,8 @@ static void usb_ffs_open_thread() {
         transport->serial = "UsbFfs";
         std::promise<void> destruction_notifier;
         std::future<void> future = destruction_notifier.get_future();
-        transport->SetConnection(std::make_unique<UsbFfsConnection>(
-                std::move(control), std::move(bulk_out), std::move(bulk_in),
-                std::move(destruction_notifier)));
+        transport->SetConnection(CreateUsbFfsConnection(std::move(control), std::move(endpoints),
+                                                        std::move(destruction_notifier)));
         register_transport(transport);
         future.wait();
     }
@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <future>
+#include <memory>
+#include <vector>
+
+#include "adb_unique_fd.h"
+#include "daemon/usb_ffs.h"
+#include "daemon/usb_ffs_io.h"
+#include "transport.h"
+
+// Create a Connection over the FunctionFS control endpoint and one or more pairs of bulk
+// endpoints. If |io| is null, the preferred backend supported by the running kernel is used.
+std::unique_ptr<Connection> CreateUsbFfsConnection(unique_fd control,
+                                                   std::vector<UsbFfsEndpoints> endpoints,
+                                                   std::promise<void> destruction_notifier,
+                                                   std::unique_ptr<UsbFfsIo> io = nullptr);
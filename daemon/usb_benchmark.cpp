@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <benchmark/benchmark.h>
+
+#include "adb.h"
+#include "adb_trace.h"
+#include "daemon/usb.h"
+#include "daemon/usb_ffs_io_fake.h"
+
+#define ADB_USB_BENCHMARK(benchmark_name) \
+    BENCHMARK(benchmark_name)             \
+        ->Arg(0)                          \
+        ->Arg(4096)                       \
+        ->Arg(16384)                      \
+        ->Arg(65536)                      \
+        ->Arg(MAX_PAYLOAD)                \
+        ->UseRealTime()
+
+struct UsbFfsBenchmarkConnection {
+    explicit UsbFfsBenchmarkConnection(bool auto_complete_writes) {
+        auto io = std::make_unique<FakeUsbFfsIo>(auto_complete_writes);
+        this->io = io.get();
+        connection = CreateUsbFfsConnection(unique_fd(), std::vector<UsbFfsEndpoints>(1),
+                                            std::promise<void>(), std::move(io));
+        connection->SetReadCallback([this](Connection*, std::unique_ptr<apacket> packet) {
+            received_packets += 1;
+            return true;
+        });
+        connection->SetErrorCallback([](Connection*, const std::string& error) {
+            LOG(INFO) << "connection closed: " << error;
+        });
+        connection->Start();
+
+        this->io->SendControlEvent(FUNCTIONFS_BIND);
+        this->io->SendControlEvent(FUNCTIONFS_ENABLE);
+        read_size = this->io->WaitForRead(0).length;
+    }
+
+    std::atomic<size_t> received_packets = 0;
+    FakeUsbFfsIo* io;
+    std::unique_ptr<Connection> connection;
+    size_t read_size;
+};
+
+// Packets from the host, through HandleRead and ProcessRead.
+void BM_UsbFfsConnection_Read(benchmark::State& state) {
+    UsbFfsBenchmarkConnection c(false);
+
+    size_t data_size = state.range(0);
+    amessage msg = {};
+    msg.command = A_WRTE;
+    msg.data_length = data_size;
+    msg.magic = A_WRTE ^ 0xffffffff;
+    std::string header(reinterpret_cast<const char*>(&msg), sizeof(msg));
+    std::string payload(data_size, 0xff);
+
+    uint64_t read_id = 0;
+    for (auto _ : state) {
+        c.io->CompleteRead(read_id++, header);
+        for (size_t offset = 0; offset < data_size; offset += c.read_size) {
+            c.io->CompleteRead(read_id++, std::string_view(payload).substr(offset, c.read_size));
+        }
+    }
+
+    while (c.received_packets < static_cast<size_t>(state.iterations())) {
+        continue;
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * data_size);
+}
+
+ADB_USB_BENCHMARK(BM_UsbFfsConnection_Read);
+
+// Packets to the host, through Write and SubmitWrites.
+void BM_UsbFfsConnection_Write(benchmark::State& state) {
+    UsbFfsBenchmarkConnection c(true);
+
+    // Don't let the amount of queued data grow without bound.
+    static constexpr size_t kBatchSize = 64;
+
+    size_t data_size = state.range(0);
+    uint64_t expected_bytes = 0;
+    size_t batch = 0;
+    for (auto _ : state) {
+        auto packet = std::make_unique<apacket>();
+        packet->msg.command = A_WRTE;
+        packet->msg.data_length = data_size;
+        packet->payload.resize(data_size);
+        memset(packet->payload.data(), 0xff, data_size);
+
+        expected_bytes += sizeof(packet->msg) + data_size;
+        c.connection->Write(std::move(packet));
+        if (++batch == kBatchSize) {
+            c.io->WaitForBytesWritten(expected_bytes);
+            batch = 0;
+        }
+    }
+
+    c.io->WaitForBytesWritten(expected_bytes);
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * data_size);
+}
+
+ADB_USB_BENCHMARK(BM_UsbFfsConnection_Write);
+
+int main(int argc, char** argv) {
+    android::base::SetMinimumLogSeverity(android::base::WARNING);
+    adb_trace_init(argv);
+    ::benchmark::Initialize(&argc, argv);
+    if (::benchmark::ReportUnrecognizedArguments(argc, argv)) return 1;
+    ::benchmark::RunSpecifiedBenchmarks();
+}
@@ -20,15 +20,23 @@
 
 #include "daemon/usb_ffs.h"
 
+#include <stddef.h>
+#include <string.h>
+
 #include <linux/usb/ch9.h>
 #include <linux/usb/functionfs.h>
 
+#include <string>
+
 #include <android-base/logging.h>
 #include <android-base/properties.h>
+#include <android-base/stringprintf.h>
 #include <android-base/unique_fd.h>
 
 #include "adb.h"
 
+using android::base::StringPrintf;
+
 #define MAX_PACKET_SIZE_FS 64
 #define MAX_PACKET_SIZE_HS 512
 #define MAX_PACKET_SIZE_SS 1024
@@ -58,14 +66,11 @@ struct ss_func_desc {
     struct usb_ss_ep_comp_descriptor sink_comp;
 } __attribute__((packed));
 
-struct desc_v1 {
-    struct usb_functionfs_descs_head_v1 {
-        __le32 magic;
-        __le32 length;
-        __le32 fs_count;
-        __le32 hs_count;
-    } __attribute__((packed)) header;
-    struct func_desc fs_descs, hs_descs;
+struct usb_functionfs_descs_head_v1 {
+    __le32 magic;
+    __le32 length;
+    __le32 fs_count;
+    __le32 hs_count;
 } __attribute__((packed));
 
 template <size_t PropertyNameLength, size_t PropertyDataLength>
@@ -96,21 +101,6 @@ usb_ext_prop_values os_prop_values = {
     .guid = os_desc_guid,
 };
 
-struct desc_v2 {
-    struct usb_functionfs_descs_head_v2 header;
-    // The rest of the structure depends on the flags in the header.
-    __le32 fs_count;
-    __le32 hs_count;
-    __le32 ss_count;
-    __le32 os_count;
-    struct func_desc fs_descs, hs_descs;
-    struct ss_func_desc ss_descs;
-    struct usb_os_desc_header os_header;
-    struct usb_ext_compat_desc os_desc;
-    struct usb_os_desc_header os_prop_header;
-    struct usb_ext_prop_values os_prop_values;
-} __attribute__((packed));
-
 static struct func_desc fs_descriptors = {
     .intf = {
         .bLength = sizeof(fs_descriptors.intf),
@@ -249,27 +239,97 @@ static const struct {
 };
 // clang-format on
 
-bool open_functionfs(android::base::unique_fd* out_control, android::base::unique_fd* out_bulk_out,
-                     android::base::unique_fd* out_bulk_in) {
-    unique_fd control, bulk_out, bulk_in;
-    struct desc_v1 v1_descriptor = {};
-    struct desc_v2 v2_descriptor = {};
-
-    v2_descriptor.header.magic = cpu_to_le32(FUNCTIONFS_DESCRIPTORS_MAGIC_V2);
-    v2_descriptor.header.length = cpu_to_le32(sizeof(v2_descriptor));
-    v2_descriptor.header.flags = FUNCTIONFS_HAS_FS_DESC | FUNCTIONFS_HAS_HS_DESC |
-                                 FUNCTIONFS_HAS_SS_DESC | FUNCTIONFS_HAS_MS_OS_DESC;
-    v2_descriptor.fs_count = 3;
-    v2_descriptor.hs_count = 3;
-    v2_descriptor.ss_count = 5;
-    v2_descriptor.os_count = 2;
-    v2_descriptor.fs_descs = fs_descriptors;
-    v2_descriptor.hs_descs = hs_descriptors;
-    v2_descriptor.ss_descs = ss_descriptors;
-    v2_descriptor.os_header = os_desc_header;
-    v2_descriptor.os_desc = os_desc_compat;
-    v2_descriptor.os_prop_header = os_prop_header;
-    v2_descriptor.os_prop_values = os_prop_values;
+template <typename T>
+static void append_descriptor(std::string* buf, const T& desc) {
+    buf->append(reinterpret_cast<const char*>(&desc), sizeof(desc));
+}
+
+// Append the interface descriptor from |descs|, followed by its endpoints, repeated with new
+// addresses for each pair: endpoints 1 and 2 are the first pair, 3 and 4 the second, and so on.
+// FunctionFS exposes them as ep1, ep2, ... in the same order.
+static void append_func_descs(std::string* buf, func_desc descs, size_t endpoint_pairs) {
+    descs.intf.bNumEndpoints = 2 * endpoint_pairs;
+    append_descriptor(buf, descs.intf);
+    for (size_t i = 0; i < endpoint_pairs; ++i) {
+        descs.source.bEndpointAddress = (2 * i + 1) | USB_DIR_OUT;
+        descs.sink.bEndpointAddress = (2 * i + 2) | USB_DIR_IN;
+        append_descriptor(buf, descs.source);
+        append_descriptor(buf, descs.sink);
+    }
+}
+
+static void append_func_descs(std::string* buf, ss_func_desc descs, size_t endpoint_pairs) {
+    descs.intf.bNumEndpoints = 2 * endpoint_pairs;
+    append_descriptor(buf, descs.intf);
+    for (size_t i = 0; i < endpoint_pairs; ++i) {
+        descs.source.bEndpointAddress = (2 * i + 1) | USB_DIR_OUT;
+        descs.sink.bEndpointAddress = (2 * i + 2) | USB_DIR_IN;
+        append_descriptor(buf, descs.source);
+        append_descriptor(buf, descs.source_comp);
+        append_descriptor(buf, descs.sink);
+        append_descriptor(buf, descs.sink_comp);
+    }
+}
+
+template <typename Header>
+static void set_descriptors_length(std::string* buf) {
+    __le32 length = cpu_to_le32(buf->size());
+    memcpy(buf->data() + offsetof(Header, length), &length, sizeof(length));
+}
+
+static std::string build_v2_descriptors(size_t endpoint_pairs) {
+    std::string buf;
+    struct usb_functionfs_descs_head_v2 header = {
+        .magic = cpu_to_le32(FUNCTIONFS_DESCRIPTORS_MAGIC_V2),
+        .flags = FUNCTIONFS_HAS_FS_DESC | FUNCTIONFS_HAS_HS_DESC | FUNCTIONFS_HAS_SS_DESC |
+                 FUNCTIONFS_HAS_MS_OS_DESC,
+    };
+    append_descriptor(&buf, header);
+
+    // The rest of the descriptors depend on the flags in the header.
+    __le32 fs_count = cpu_to_le32(1 + 2 * endpoint_pairs);
+    __le32 hs_count = cpu_to_le32(1 + 2 * endpoint_pairs);
+    __le32 ss_count = cpu_to_le32(1 + 4 * endpoint_pairs);
+    __le32 os_count = cpu_to_le32(2);
+    append_descriptor(&buf, fs_count);
+    append_descriptor(&buf, hs_count);
+    append_descriptor(&buf, ss_count);
+    append_descriptor(&buf, os_count);
+
+    append_func_descs(&buf, fs_descriptors, endpoint_pairs);
+    append_func_descs(&buf, hs_descriptors, endpoint_pairs);
+    append_func_descs(&buf, ss_descriptors, endpoint_pairs);
+    append_descriptor(&buf, os_desc_header);
+    append_descriptor(&buf, os_desc_compat);
+    append_descriptor(&buf, os_prop_header);
+    append_descriptor(&buf, os_prop_values);
+
+    set_descriptors_length<usb_functionfs_descs_head_v2>(&buf);
+    return buf;
+}
+
+static std::string build_v1_descriptors(size_t endpoint_pairs) {
+    std::string buf;
+    struct usb_functionfs_descs_head_v1 header = {
+        .magic = cpu_to_le32(FUNCTIONFS_DESCRIPTORS_MAGIC),
+        .fs_count = cpu_to_le32(1 + 2 * endpoint_pairs),
+        .hs_count = cpu_to_le32(1 + 2 * endpoint_pairs),
+    };
+    append_descriptor(&buf, header);
+    append_func_descs(&buf, fs_descriptors, endpoint_pairs);
+    append_func_descs(&buf, hs_descriptors, endpoint_pairs);
+
+    set_descriptors_length<usb_functionfs_descs_head_v1>(&buf);
+    return buf;
+}
+
+bool open_functionfs(android::base::unique_fd* out_control,
+                     std::vector<UsbFfsEndpoints>* out_endpoints, size_t endpoint_pairs) {
+    CHECK_GE(endpoint_pairs, 1U);
+    CHECK_LE(endpoint_pairs, kUsbFfsMaxEndpointPairs);
+
+    unique_fd control;
+    std::vector<UsbFfsEndpoints> endpoints(endpoint_pairs);
 
     if (out_control->get() < 0) {  // might have already done this before
         LOG(INFO) << "opening control endpoint " << USB_FFS_ADB_EP0;
@@ -279,16 +339,12 @@ bool open_functionfs(android::base::unique_fd* out_control, android::base::uniqu
             return false;
         }
 
-        if (adb_write(control.get(), &v2_descriptor, sizeof(v2_descriptor)) < 0) {
+        std::string v2_descriptors = build_v2_descriptors(endpoint_pairs);
+        if (adb_write(control.get(), v2_descriptors.data(), v2_descriptors.size()) < 0) {
             D("[ %s: Switching to V1_descriptor format errno=%s ]", USB_FFS_ADB_EP0,
               strerror(errno));
-            v1_descriptor.header.magic = cpu_to_le32(FUNCTIONFS_DESCRIPTORS_MAGIC);
-            v1_descriptor.header.length = cpu_to_le32(sizeof(v1_descriptor));
-            v1_descriptor.header.fs_count = 3;
-            v1_descriptor.header.hs_count = 3;
-            v1_descriptor.fs_descs = fs_descriptors;
-            v1_descriptor.hs_descs = hs_descriptors;
-            if (adb_write(control.get(), &v1_descriptor, sizeof(v1_descriptor)) < 0) {
+            std::string v1_descriptors = build_v1_descriptors(endpoint_pairs);
+            if (adb_write(control.get(), v1_descriptors.data(), v1_descriptors.size()) < 0) {
                 PLOG(ERROR) << "failed to write USB descriptors";
                 return false;
             }
@@ -302,20 +358,23 @@ bool open_functionfs(android::base::unique_fd* out_control, android::base::uniqu
         android::base::SetProperty("sys.usb.ffs.ready", "1");
     }
 
-    bulk_out.reset(adb_open(USB_FFS_ADB_OUT, O_RDONLY));
-    if (bulk_out < 0) {
-        PLOG(ERROR) << "cannot open bulk-out endpoint " << USB_FFS_ADB_OUT;
-        return false;
-    }
+    for (size_t i = 0; i < endpoint_pairs; ++i) {
+        std::string bulk_out_path = StringPrintf(USB_FFS_ADB_PATH "ep%zu", 2 * i + 1);
+        endpoints[i].bulk_out.reset(adb_open(bulk_out_path.c_str(), O_RDONLY));
+        if (endpoints[i].bulk_out < 0) {
+            PLOG(ERROR) << "cannot open bulk-out endpoint " << bulk_out_path;
+            return false;
+        }
 
-    bulk_in.reset(adb_open(USB_FFS_ADB_IN, O_WRONLY));
-    if (bulk_in < 0) {
-        PLOG(ERROR) << "cannot open bulk-in endpoint " << USB_FFS_ADB_IN;
-        return false;
+        std::string bulk_in_path = StringPrintf(USB_FFS_ADB_PATH "ep%zu", 2 * i + 2);
+        endpoints[i].bulk_in.reset(adb_open(bulk_in_path.c_str(), O_WRONLY));
+        if (endpoints[i].bulk_in < 0) {
+            PLOG(ERROR) << "cannot open bulk-in endpoint " << bulk_in_path;
+            return false;
+        }
     }
 
     *out_control = std::move(control);
-    *out_bulk_in = std::move(bulk_in);
-    *out_bulk_out = std::move(bulk_out);
+    *out_endpoints = std::move(endpoints);
     return true;
 }
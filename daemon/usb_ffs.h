@@ -16,7 +16,22 @@
 
 #pragma once
 
+#include <stddef.h>
+
+#include <vector>
+
 #include <android-base/unique_fd.h>
 
-bool open_functionfs(android::base::unique_fd* control, android::base::unique_fd* bulk_out,
-                     android::base::unique_fd* bulk_in);
+// The most bulk endpoint pairs that adbd can be configured to advertise.
+static constexpr size_t kUsbFfsMaxEndpointPairs = 4;
+
+// A pair of bulk endpoints: bulk out carries data from the host, and bulk in carries data to it.
+struct UsbFfsEndpoints {
+    android::base::unique_fd bulk_out;
+    android::base::unique_fd bulk_in;
+};
+
+// Open the control endpoint and |endpoint_pairs| pairs of bulk endpoints. The first pair is the
+// one that hosts which only know about a single pair will use.
+bool open_functionfs(android::base::unique_fd* control, std::vector<UsbFfsEndpoints>* endpoints,
+                     size_t endpoint_pairs = 1);
@@ -0,0 +1,500 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define TRACE_TAG USB
+
+#include "sysdeps.h"
+
+#include "daemon/usb_ffs_io.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+#include <vector>
+
+#include <asyncio/AsyncIO.h>
+#include <liburing.h>
+
+#include <android-base/logging.h>
+#include <android-base/properties.h>
+
+#include "adb_unique_fd.h"
+
+using android::base::borrowed_fd;
+
+static unique_fd create_eventfd() {
+    unique_fd fd(eventfd(0, EFD_CLOEXEC));
+    if (fd == -1) {
+        PLOG(FATAL) << "failed to create eventfd";
+    }
+    return fd;
+}
+
+static void notify_eventfd(borrowed_fd fd) {
+    uint64_t notify = 1;
+    ssize_t rc = adb_write(fd.get(), &notify, sizeof(notify));
+    if (rc < 0) {
+        PLOG(FATAL) << "failed to notify eventfd";
+    }
+    CHECK_EQ(static_cast<size_t>(rc), sizeof(notify));
+}
+
+struct ScopedAioContext {
+    ScopedAioContext() = default;
+    ~ScopedAioContext() { reset(); }
+
+    ScopedAioContext(ScopedAioContext&& move) { reset(move.release()); }
+    ScopedAioContext(const ScopedAioContext& copy) = delete;
+
+    ScopedAioContext& operator=(ScopedAioContext&& move) {
+        reset(move.release());
+        return *this;
+    }
+    ScopedAioContext& operator=(const ScopedAioContext& copy) = delete;
+
+    static ScopedAioContext Create(size_t max_events) {
+        aio_context_t ctx = 0;
+        if (io_setup(max_events, &ctx) != 0) {
+            PLOG(FATAL) << "failed to create aio_context_t";
+        }
+        ScopedAioContext result;
+        result.reset(ctx);
+        return result;
+    }
+
+    aio_context_t release() {
+        aio_context_t result = context_;
+        context_ = 0;
+        return result;
+    }
+
+    void reset(aio_context_t new_context = 0) {
+        if (context_ != 0) {
+            io_destroy(context_);
+        }
+
+        context_ = new_context;
+    }
+
+    aio_context_t get() { return context_; }
+
+  private:
+    aio_context_t context_ = 0;
+};
+
+// Legacy Linux AIO. Completions are signalled via an eventfd, which Wake also uses.
+//
+// io_submit can block if it's called as the endpoint becomes disabled, so the control endpoint is
+// left for the caller to monitor from another thread, which can interrupt us with a signal.
+struct UsbFfsAio final : public UsbFfsIo {
+    UsbFfsAio(std::span<const UsbFfsEndpoints> endpoints, size_t max_transfers)
+        : max_transfers_(max_transfers) {
+        for (const UsbFfsEndpoints& pair : endpoints) {
+            read_fds_.push_back(pair.bulk_out.get());
+            write_fds_.push_back(pair.bulk_in.get());
+        }
+        event_fd_ = create_eventfd();
+        aio_context_ = ScopedAioContext::Create(max_transfers);
+        iocbs_.resize(max_transfers);
+        iocb_pointers_.resize(max_transfers);
+        io_events_.resize(max_transfers);
+    }
+
+    const char* name() const override final { return "aio"; }
+
+    bool HandlesControl() const override final { return false; }
+
+    bool Submit(std::span<const UsbFfsTransfer> transfers) override final {
+        CHECK_LE(transfers.size(), max_transfers_);
+        for (size_t i = 0; i < transfers.size(); ++i) {
+            const UsbFfsTransfer& transfer = transfers[i];
+            bool read = transfer.id.direction == TransferDirection::READ;
+            struct iocb* iocb = &iocbs_[i];
+            *iocb = {};
+            iocb->aio_data = static_cast<uint64_t>(transfer.id);
+            iocb->aio_lio_opcode = read ? IOCB_CMD_PREAD : IOCB_CMD_PWRITE;
+            iocb->aio_fildes =
+                    read ? read_fds_[transfer.id.pair] : write_fds_[transfer.id.pair];
+            iocb->aio_buf = reinterpret_cast<uintptr_t>(transfer.data);
+            iocb->aio_nbytes = transfer.length;
+            iocb->aio_offset = 0;
+            iocb->aio_flags = IOCB_FLAG_RESFD;
+            iocb->aio_resfd = event_fd_.get();
+            iocb_pointers_[i] = iocb;
+        }
+
+        int rc = io_submit(aio_context_.get(), transfers.size(), iocb_pointers_.data());
+        if (rc == -1) {
+            return false;
+        } else if (static_cast<size_t>(rc) != transfers.size()) {
+            LOG(FATAL) << "failed to submit all transfers: wanted to submit " << transfers.size()
+                       << ", actually submitted " << rc;
+        }
+        return true;
+    }
+
+    bool Wait(std::vector<UsbFfsIoEvent>* events,
+              std::optional<std::chrono::milliseconds> timeout) override final {
+        if (timeout) {
+            adb_pollfd pfd = {.fd = event_fd_.get(), .events = POLLIN, .revents = 0};
+            int rc = TEMP_FAILURE_RETRY(adb_poll(&pfd, 1, timeout->count()));
+            if (rc == -1) {
+                return false;
+            } else if (rc == 0) {
+                errno = ETIMEDOUT;
+                return false;
+            }
+        }
+
+        uint64_t dummy;
+        ssize_t rc = adb_read(event_fd_.get(), &dummy, sizeof(dummy));
+        if (rc == -1) {
+            PLOG(FATAL) << "failed to read from eventfd";
+        } else if (rc == 0) {
+            LOG(FATAL) << "hit EOF on eventfd";
+        }
+
+        struct timespec zero_timeout = {.tv_sec = 0, .tv_nsec = 0};
+        int count = io_getevents(aio_context_.get(), 0, io_events_.size(), io_events_.data(),
+                                 &zero_timeout);
+        if (count == -1) {
+            return false;
+        }
+
+        for (int i = 0; i < count; ++i) {
+            events->push_back({.type = UsbFfsIoEvent::Type::Transfer,
+                               .id = TransferId::from_value(io_events_[i].data),
+                               .result = io_events_[i].res});
+        }
+
+        if (count == 0) {
+            events->push_back({.type = UsbFfsIoEvent::Type::Wakeup});
+        }
+        return true;
+    }
+
+    void Wake() override final { notify_eventfd(event_fd_); }
+
+  private:
+    std::vector<int> read_fds_;
+    std::vector<int> write_fds_;
+    size_t max_transfers_;
+
+    unique_fd event_fd_;
+    ScopedAioContext aio_context_;
+
+    std::vector<struct iocb> iocbs_;
+    std::vector<struct iocb*> iocb_pointers_;
+    std::vector<struct io_event> io_events_;
+};
+
+// io_uring, with the endpoints registered as fixed files, and read buffers registered with the
+// kernel when it's supported.
+//
+// Unlike AIO, submission never blocks on the state of the endpoint, so control events are read on
+// the same ring, and a single thread can drive everything.
+struct UsbFfsUring final : public UsbFfsIo {
+    UsbFfsUring() = default;
+
+    ~UsbFfsUring() override final {
+        if (!initialized_) {
+            return;
+        }
+
+        // Reads on the bulk out endpoint stay queued in the controller until they complete, and
+        // tearing the ring down doesn't wait for them, so cancel everything and reap every
+        // completion before the caller frees the buffers. If the function has been disabled, the
+        // kernel has already completed them. The cancellation is repeated each time around, in case
+        // it raced with a transfer that was still being issued.
+        while (in_flight_ > 0) {
+            if (io_uring_sqe* sqe = GetSqe()) {
+                io_uring_prep_cancel64(sqe, 0, IORING_ASYNC_CANCEL_ANY);
+                io_uring_sqe_set_data64(sqe, kCancelUserData);
+            }
+            io_uring_submit(&ring_);
+
+            struct __kernel_timespec ts = {.tv_sec = 1, .tv_nsec = 0};
+            io_uring_cqe* cqe;
+            int rc = io_uring_wait_cqe_timeout(&ring_, &cqe, &ts);
+            if (rc == -ETIME) {
+                LOG(WARNING) << "still waiting for " << in_flight_ << " USB transfer(s) to cancel";
+                continue;
+            } else if (rc < 0 && rc != -EINTR) {
+                LOG(FATAL) << "failed to reap cancelled USB transfers: " << strerror(-rc);
+            }
+
+            unsigned head;
+            unsigned count = 0;
+            io_uring_for_each_cqe(&ring_, head, cqe) {
+                ++count;
+                if (io_uring_cqe_get_data64(cqe) != kCancelUserData) {
+                    --in_flight_;
+                }
+            }
+            io_uring_cq_advance(&ring_, count);
+        }
+
+        // The ring is torn down asynchronously, so let go of the endpoints and buffers now: the
+        // caller is about to reopen the endpoints.
+        io_uring_unregister_files(&ring_);
+        io_uring_unregister_buffers(&ring_);
+        io_uring_queue_exit(&ring_);
+    }
+
+    bool Init(borrowed_fd control, std::span<const UsbFfsEndpoints> endpoints,
+              size_t max_transfers) {
+        // Every transfer can be in flight at once, along with reads of control and wake_fd_.
+        int rc = io_uring_queue_init(max_transfers + 2, &ring_, 0);
+        if (rc < 0) {
+            LOG(INFO) << "failed to create io_uring: " << strerror(-rc);
+            return false;
+        }
+        initialized_ = true;
+
+        wake_fd_ = create_eventfd();
+
+        std::vector<int> files(kFirstEndpointFile + 2 * endpoints.size());
+        files[kControlFile] = control.get();
+        files[kWakeFile] = wake_fd_.get();
+        for (size_t i = 0; i < endpoints.size(); ++i) {
+            files[ReadFile(i)] = endpoints[i].bulk_out.get();
+            files[WriteFile(i)] = endpoints[i].bulk_in.get();
+        }
+        rc = io_uring_register_files(&ring_, files.data(), files.size());
+        if (rc < 0) {
+            LOG(INFO) << "failed to register files with io_uring: " << strerror(-rc);
+            return false;
+        }
+
+        rc = io_uring_register_buffers_sparse(&ring_, max_transfers);
+        if (rc < 0) {
+            LOG(INFO) << "not using registered buffers for USB reads: " << strerror(-rc);
+        } else {
+            registered_buffers_.resize(max_transfers);
+        }
+        return true;
+    }
+
+    const char* name() const override final { return "io_uring"; }
+
+    bool HandlesControl() const override final { return true; }
+
+    bool Submit(std::span<const UsbFfsTransfer> transfers) override final {
+        for (const UsbFfsTransfer& transfer : transfers) {
+            io_uring_sqe* sqe = GetSqe();
+            if (!sqe) {
+                return false;
+            }
+
+            size_t pair = transfer.id.pair;
+            if (transfer.id.direction == TransferDirection::WRITE) {
+                io_uring_prep_write(sqe, WriteFile(pair), transfer.data, transfer.length, 0);
+            } else if (RegisterBuffer(transfer)) {
+                io_uring_prep_read_fixed(sqe, ReadFile(pair), transfer.data, transfer.length, 0,
+                                         transfer.buffer_index);
+            } else {
+                io_uring_prep_read(sqe, ReadFile(pair), transfer.data, transfer.length, 0);
+            }
+            io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+            io_uring_sqe_set_data64(sqe, static_cast<uint64_t>(transfer.id));
+            ++in_flight_;
+        }
+        return true;
+    }
+
+    bool Wait(std::vector<UsbFfsIoEvent>* events,
+              std::optional<std::chrono::milliseconds> timeout) override final {
+        // The reads of the control endpoint and wake_fd_ are rearmed lazily, so that the caller
+        // can finish handling a control event (which can involve reading from the control
+        // endpoint itself) before we start listening again.
+        if (!control_armed_) {
+            io_uring_sqe* sqe = GetSqe();
+            if (!sqe) {
+                return false;
+            }
+            io_uring_prep_read(sqe, kControlFile, &control_event_, sizeof(control_event_), 0);
+            io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+            io_uring_sqe_set_data64(sqe, kControlUserData);
+            control_armed_ = true;
+            ++in_flight_;
+        }
+
+        if (!wake_armed_) {
+            io_uring_sqe* sqe = GetSqe();
+            if (!sqe) {
+                return false;
+            }
+            io_uring_prep_read(sqe, kWakeFile, &wake_value_, sizeof(wake_value_), 0);
+            io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+            io_uring_sqe_set_data64(sqe, kWakeUserData);
+            wake_armed_ = true;
+            ++in_flight_;
+        }
+
+        struct __kernel_timespec ts = {};
+        if (timeout) {
+            ts.tv_sec = timeout->count() / 1000;
+            ts.tv_nsec = (timeout->count() % 1000) * 1000000;
+        }
+
+        io_uring_cqe* cqe;
+        int rc;
+        do {
+            rc = io_uring_submit_and_wait_timeout(&ring_, &cqe, 1, timeout ? &ts : nullptr,
+                                                  nullptr);
+        } while (rc == -EINTR);
+
+        if (rc == -ETIME) {
+            errno = ETIMEDOUT;
+            return false;
+        } else if (rc < 0) {
+            errno = -rc;
+            return false;
+        }
+
+        unsigned head;
+        unsigned count = 0;
+        io_uring_for_each_cqe(&ring_, head, cqe) {
+            ++count;
+            uint64_t user_data = io_uring_cqe_get_data64(cqe);
+            if (user_data != kCancelUserData) {
+                --in_flight_;
+            }
+            if (user_data == kControlUserData) {
+                control_armed_ = false;
+                events->push_back({.type = UsbFfsIoEvent::Type::Control,
+                                   .result = cqe->res,
+                                   .control = control_event_});
+            } else if (user_data == kWakeUserData) {
+                wake_armed_ = false;
+                if (cqe->res < 0) {
+                    LOG(FATAL) << "failed to read from eventfd: " << strerror(-cqe->res);
+                }
+                events->push_back({.type = UsbFfsIoEvent::Type::Wakeup});
+            } else if (user_data != kCancelUserData) {
+                events->push_back({.type = UsbFfsIoEvent::Type::Transfer,
+                                   .id = TransferId::from_value(user_data),
+                                   .result = cqe->res});
+            }
+        }
+        io_uring_cq_advance(&ring_, count);
+        return true;
+    }
+
+    void Wake() override final { notify_eventfd(wake_fd_); }
+
+  private:
+    io_uring_sqe* GetSqe() {
+        io_uring_sqe* sqe = io_uring_get_sqe(&ring_);
+        if (!sqe) {
+            // The submission queue is full of things that haven't been handed to the kernel yet.
+            int rc = io_uring_submit(&ring_);
+            if (rc < 0) {
+                errno = -rc;
+                return nullptr;
+            }
+            sqe = io_uring_get_sqe(&ring_);
+            if (!sqe) {
+                errno = EBUSY;
+            }
+        }
+        return sqe;
+    }
+
+    bool RegisterBuffer(const UsbFfsTransfer& transfer) {
+        if (transfer.buffer_index < 0 ||
+            static_cast<size_t>(transfer.buffer_index) >= registered_buffers_.size()) {
+            return false;
+        }
+
+        struct iovec& registered = registered_buffers_[transfer.buffer_index];
+        if (registered.iov_base == transfer.data && registered.iov_len >= transfer.length) {
+            return true;
+        }
+
+        struct iovec iov = {.iov_base = transfer.data, .iov_len = transfer.length};
+        int rc = io_uring_register_buffers_update_tag(&ring_, transfer.buffer_index, &iov,
+                                                      nullptr, 1);
+        if (rc < 0) {
+            LOG(WARNING) << "failed to update registered buffer, giving up on them: "
+                         << strerror(-rc);
+            registered_buffers_.clear();
+            return false;
+        }
+        registered = iov;
+        return true;
+    }
+
+    // The endpoints are registered after the control endpoint and wake_fd_, a pair at a time.
+    enum FixedFile {
+        kControlFile,
+        kWakeFile,
+        kFirstEndpointFile,
+    };
+
+    static int ReadFile(size_t pair) { return kFirstEndpointFile + 2 * pair; }
+    static int WriteFile(size_t pair) { return kFirstEndpointFile + 2 * pair + 1; }
+
+    // Transfer ids only count up from zero, so they'll never collide with these.
+    static constexpr uint64_t kControlUserData = UINT64_MAX;
+    static constexpr uint64_t kWakeUserData = UINT64_MAX - 1;
+    static constexpr uint64_t kCancelUserData = UINT64_MAX - 2;
+
+    bool initialized_ = false;
+    io_uring ring_;
+
+    // Transfers and reads of control and wake_fd_ that have been queued but not reaped.
+    size_t in_flight_ = 0;
+    unique_fd wake_fd_;
+
+    bool control_armed_ = false;
+    usb_functionfs_event control_event_;
+
+    bool wake_armed_ = false;
+    uint64_t wake_value_;
+
+    std::vector<struct iovec> registered_buffers_;
+};
+
+std::unique_ptr<UsbFfsIo> CreateUsbFfsAio(borrowed_fd control,
+                                          std::span<const UsbFfsEndpoints> endpoints,
+                                          size_t max_transfers) {
+    return std::make_unique<UsbFfsAio>(endpoints, max_transfers);
+}
+
+std::unique_ptr<UsbFfsIo> CreateUsbFfsUring(borrowed_fd control,
+                                            std::span<const UsbFfsEndpoints> endpoints,
+                                            size_t max_transfers) {
+    auto result = std::make_unique<UsbFfsUring>();
+    if (!result->Init(control, endpoints, max_transfers)) {
+        return nullptr;
+    }
+    return result;
+}
+
+std::unique_ptr<UsbFfsIo> CreateUsbFfsIo(borrowed_fd control,
+                                         std::span<const UsbFfsEndpoints> endpoints,
+                                         size_t max_transfers) {
+    if (android::base::GetBoolProperty("persist.adb.usb.io_uring", true)) {
+        if (auto result = CreateUsbFfsUring(control, endpoints, max_transfers)) {
+            return result;
+        }
+        LOG(INFO) << "io_uring unavailable, falling back to aio for USB";
+    }
+    return CreateUsbFfsAio(control, endpoints, max_transfers);
+}
@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <linux/usb/functionfs.h>
+
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include <android-base/unique_fd.h>
+
+#include "daemon/usb_ffs.h"
+
+enum class TransferDirection : uint64_t {
+    READ = 0,
+    WRITE = 1,
+};
+
+struct TransferId {
+    TransferDirection direction : 1;
+    uint64_t pair : 3;
+    uint64_t id : 60;
+
+    TransferId() : TransferId(TransferDirection::READ, 0, 0) {}
+
+  private:
+    TransferId(TransferDirection direction, size_t pair, uint64_t id)
+        : direction(direction), pair(pair), id(id) {}
+
+  public:
+    explicit operator uint64_t() const {
+        uint64_t result;
+        static_assert(sizeof(*this) == sizeof(result));
+        memcpy(&result, this, sizeof(*this));
+        return result;
+    }
+
+    static TransferId read(uint64_t id, size_t pair = 0) {
+        return TransferId(TransferDirection::READ, pair, id);
+    }
+    static TransferId write(uint64_t id, size_t pair = 0) {
+        return TransferId(TransferDirection::WRITE, pair, id);
+    }
+
+    static TransferId from_value(uint64_t value) {
+        TransferId result;
+        memcpy(&result, &value, sizeof(value));
+        return result;
+    }
+};
+
+static_assert(kUsbFfsMaxEndpointPairs <= 8, "TransferId can't address every endpoint pair");
+
+// A single transfer on one of the bulk endpoints. Reads go to the bulk out endpoint, writes to the
+// bulk in endpoint, as determined by the direction of the id, of the pair that the id names.
+struct UsbFfsTransfer {
+    TransferId id;
+    char* data = nullptr;
+    size_t length = 0;
+
+    // Slot in the read queue that the buffer belongs to, or -1. Buffers in the same slot tend to
+    // be reused, which lets a backend register them with the kernel once instead of per transfer.
+    ssize_t buffer_index = -1;
+};
+
+struct UsbFfsIoEvent {
+    enum class Type {
+        // A transfer completed: result is the number of bytes transferred, or -errno.
+        Transfer,
+
+        // An event was read from the control endpoint: result is the size of the read, or -errno.
+        Control,
+
+        // Wait was interrupted via Wake.
+        Wakeup,
+    };
+
+    Type type;
+    TransferId id;
+    int64_t result = 0;
+    usb_functionfs_event control = {};
+};
+
+// The mechanism used to perform asynchronous IO on the FunctionFS endpoints.
+//
+// Everything other than Wake must be called from a single thread.
+struct UsbFfsIo {
+    virtual ~UsbFfsIo() = default;
+
+    // The name of the backend, for logging.
+    virtual const char* name() const = 0;
+
+    // Whether events from the control endpoint are delivered by Wait. If they aren't, the caller
+    // is responsible for monitoring the control endpoint itself.
+    virtual bool HandlesControl() const = 0;
+
+    // Queue transfers for submission. Backends may defer actually submitting them to the kernel
+    // until the next call to Wait. Returns false and sets errno on failure.
+    virtual bool Submit(std::span<const UsbFfsTransfer> transfers) = 0;
+
+    // Block until at least one event is available, and append the available events to |events|.
+    // Returns false and sets errno on failure, or to ETIMEDOUT if |timeout| expired first.
+    virtual bool Wait(std::vector<UsbFfsIoEvent>* events,
+                      std::optional<std::chrono::milliseconds> timeout = std::nullopt) = 0;
+
+    // Make a concurrent or subsequent call to Wait return. Safe to call from any thread.
+    virtual void Wake() = 0;
+};
+
+// Create a backend using legacy Linux AIO.
+std::unique_ptr<UsbFfsIo> CreateUsbFfsAio(android::base::borrowed_fd control,
+                                          std::span<const UsbFfsEndpoints> endpoints,
+                                          size_t max_transfers);
+
+// Create a backend using io_uring, or return nullptr if the kernel doesn't support it.
+std::unique_ptr<UsbFfsIo> CreateUsbFfsUring(android::base::borrowed_fd control,
+                                            std::span<const UsbFfsEndpoints> endpoints,
+                                            size_t max_transfers);
+
+// Create the preferred backend that's supported by the running kernel.
+std::unique_ptr<UsbFfsIo> CreateUsbFfsIo(android::base::borrowed_fd control,
+                                         std::span<const UsbFfsEndpoints> endpoints,
+                                         size_t max_transfers);
@@ -0,0 +1,197 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <android-base/thread_annotations.h>
+
+#include "daemon/usb_ffs_io.h"
+
+// A UsbFfsIo that simulates the endpoints in memory, so that UsbFfsConnection can be driven from
+// tests and benchmarks on the host.
+//
+// Transfers submitted by the connection stay pending until the test completes them, in whatever
+// order it likes. Control events are delivered through Wait, like with io_uring.
+class FakeUsbFfsIo : public UsbFfsIo {
+  public:
+    // If |auto_complete_writes| is set, writes complete as soon as they're submitted, and only the
+    // number of bytes written is kept track of.
+    explicit FakeUsbFfsIo(bool auto_complete_writes = false)
+        : auto_complete_writes_(auto_complete_writes) {}
+
+    const char* name() const override final { return "fake"; }
+
+    bool HandlesControl() const override final { return true; }
+
+    bool Submit(std::span<const UsbFfsTransfer> transfers) override final {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const UsbFfsTransfer& transfer : transfers) {
+            if (transfer.id.direction == TransferDirection::READ) {
+                pending_reads_.push_back(transfer);
+            } else if (auto_complete_writes_) {
+                bytes_written_ += transfer.length;
+                events_.push_back({.type = UsbFfsIoEvent::Type::Transfer,
+                                   .id = transfer.id,
+                                   .result = static_cast<int64_t>(transfer.length)});
+            } else {
+                pending_writes_.push_back(transfer);
+            }
+        }
+        cv_.notify_all();
+        return true;
+    }
+
+    bool Wait(std::vector<UsbFfsIoEvent>* events,
+              std::optional<std::chrono::milliseconds> timeout) override final {
+        std::unique_lock<std::mutex> lock(mutex_);
+        waiting_ = true;
+        cv_.notify_all();
+
+        auto ready = [this]() REQUIRES(mutex_) { return !events_.empty(); };
+        if (timeout) {
+            if (!cv_.wait_for(lock, *timeout, ready)) {
+                waiting_ = false;
+                errno = ETIMEDOUT;
+                return false;
+            }
+        } else {
+            cv_.wait(lock, ready);
+        }
+
+        waiting_ = false;
+        events->insert(events->end(), events_.begin(), events_.end());
+        events_.clear();
+        return true;
+    }
+
+    void Wake() override final {
+        std::lock_guard<std::mutex> lock(mutex_);
+        events_.push_back({.type = UsbFfsIoEvent::Type::Wakeup});
+        cv_.notify_all();
+    }
+
+    void SendControlEvent(usb_functionfs_event_type type) {
+        UsbFfsIoEvent event = {.type = UsbFfsIoEvent::Type::Control,
+                               .result = sizeof(usb_functionfs_event)};
+        event.control.type = type;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        events_.push_back(event);
+        cv_.notify_all();
+    }
+
+    // Wait for the read with the given id on the given endpoint pair to be submitted, and return
+    // it.
+    UsbFfsTransfer WaitForRead(uint64_t id, size_t pair = 0) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        return *WaitForReadLocked(lock, id, pair);
+    }
+
+    // Complete the read with the given id (waiting for it to be submitted, if needed), as if the
+    // host had sent |data|.
+    void CompleteRead(uint64_t id, std::string_view data, size_t pair = 0) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto it = WaitForReadLocked(lock, id, pair);
+        CHECK_LE(data.size(), it->length);
+        memcpy(it->data, data.data(), data.size());
+        events_.push_back({.type = UsbFfsIoEvent::Type::Transfer,
+                           .id = it->id,
+                           .result = static_cast<int64_t>(data.size())});
+        pending_reads_.erase(it);
+        cv_.notify_all();
+    }
+
+    // Wait until at least |count| writes are pending.
+    void WaitForWrites(size_t count) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [&]() REQUIRES(mutex_) { return pending_writes_.size() >= count; });
+    }
+
+    // Complete all of the pending writes, or only those on |pair| if it's set, and return the data
+    // that was written.
+    std::string CompleteWrites(std::optional<size_t> pair = std::nullopt) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::string result;
+        for (auto it = pending_writes_.begin(); it != pending_writes_.end();) {
+            if (pair && it->id.pair != *pair) {
+                ++it;
+                continue;
+            }
+            result.append(it->data, it->length);
+            bytes_written_ += it->length;
+            events_.push_back({.type = UsbFfsIoEvent::Type::Transfer,
+                               .id = it->id,
+                               .result = static_cast<int64_t>(it->length)});
+            it = pending_writes_.erase(it);
+        }
+        cv_.notify_all();
+        return result;
+    }
+
+    void WaitForBytesWritten(uint64_t bytes) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [&]() REQUIRES(mutex_) { return bytes_written_ >= bytes; });
+    }
+
+    // Wait until the connection has handled every event we've delivered, and gone back to waiting.
+    void WaitForIdle() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this]() REQUIRES(mutex_) { return waiting_ && events_.empty(); });
+    }
+
+    size_t pending_reads() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return pending_reads_.size();
+    }
+
+  private:
+    std::deque<UsbFfsTransfer>::iterator WaitForReadLocked(std::unique_lock<std::mutex>& lock,
+                                                           uint64_t id, size_t pair)
+            REQUIRES(mutex_) {
+        auto it = pending_reads_.end();
+        cv_.wait(lock, [&]() REQUIRES(mutex_) {
+            it = std::find_if(pending_reads_.begin(), pending_reads_.end(),
+                              [id, pair](const UsbFfsTransfer& read) {
+                                  return read.id.id == id && read.id.pair == pair;
+                              });
+            return it != pending_reads_.end();
+        });
+        return it;
+    }
+
+    const bool auto_complete_writes_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool waiting_ GUARDED_BY(mutex_) = false;
+    std::vector<UsbFfsIoEvent> events_ GUARDED_BY(mutex_);
+    std::deque<UsbFfsTransfer> pending_reads_ GUARDED_BY(mutex_);
+    std::deque<UsbFfsTransfer> pending_writes_ GUARDED_BY(mutex_);
+    uint64_t bytes_written_ GUARDED_BY(mutex_) = 0;
+};
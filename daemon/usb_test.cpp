@@ -0,0 +1,346 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "daemon/usb.h"
+
+#include <gtest/gtest.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "adb.h"
+#include "daemon/usb_ffs_io_fake.h"
+#include "sysdeps/chrono.h"
+
+static std::string make_header(uint32_t command, size_t data_length, uint32_t arg0 = 0,
+                               uint32_t arg1 = 0) {
+    amessage msg = {};
+    msg.command = command;
+    msg.arg0 = arg0;
+    msg.arg1 = arg1;
+    msg.data_length = data_length;
+    msg.magic = command ^ 0xffffffff;
+    return std::string(reinterpret_cast<const char*>(&msg), sizeof(msg));
+}
+
+class UsbFfsConnectionTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        auto io = std::make_unique<FakeUsbFfsIo>();
+        io_ = io.get();
+        connection_ = CreateUsbFfsConnection(unique_fd(),
+                                             std::vector<UsbFfsEndpoints>(endpoint_pairs_),
+                                             std::promise<void>(), std::move(io));
+        connection_->SetReadCallback([this](Connection*, std::unique_ptr<apacket> packet) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            packets_.push_back(std::move(packet));
+            cv_.notify_all();
+            return true;
+        });
+        connection_->SetErrorCallback([this](Connection*, const std::string& error) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            errors_.push_back(error);
+            cv_.notify_all();
+        });
+        connection_->Start();
+
+        io_->SendControlEvent(FUNCTIONFS_BIND);
+        io_->SendControlEvent(FUNCTIONFS_ENABLE);
+        read_size_ = io_->WaitForRead(0).length;
+        io_->WaitForIdle();
+        read_queue_depth_ = io_->pending_reads() / endpoint_pairs_;
+    }
+
+    void TearDown() override { connection_.reset(); }
+
+    std::unique_ptr<apacket> WaitForPacket() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (!cv_.wait_for(lock, 10s, [this]() { return !packets_.empty(); })) {
+            return nullptr;
+        }
+        auto packet = std::move(packets_.front());
+        packets_.pop_front();
+        return packet;
+    }
+
+    std::string WaitForError() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (!cv_.wait_for(lock, 10s, [this]() { return !errors_.empty(); })) {
+            return "";
+        }
+        return errors_.front();
+    }
+
+    size_t packet_count() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return packets_.size();
+    }
+
+    size_t endpoint_pairs_ = 1;
+    FakeUsbFfsIo* io_;
+    std::unique_ptr<Connection> connection_;
+    size_t read_size_;
+    size_t read_queue_depth_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::unique_ptr<apacket>> packets_;
+    std::vector<std::string> errors_;
+};
+
+static std::string payload_string(const apacket& packet) {
+    return std::string(packet.payload.data(), packet.payload.size());
+}
+
+TEST_F(UsbFfsConnectionTest, read_in_order) {
+    io_->CompleteRead(0, make_header(A_WRTE, 5));
+    io_->CompleteRead(1, "hello");
+
+    auto packet = WaitForPacket();
+    ASSERT_NE(nullptr, packet);
+    EXPECT_EQ(static_cast<uint32_t>(A_WRTE), packet->msg.command);
+    EXPECT_EQ("hello", payload_string(*packet));
+}
+
+TEST_F(UsbFfsConnectionTest, read_out_of_order) {
+    io_->CompleteRead(4, "bar");
+    io_->CompleteRead(2, make_header(A_OKAY, 0));
+    io_->CompleteRead(1, "foo");
+    io_->CompleteRead(3, make_header(A_WRTE, 3));
+
+    // Nothing can be delivered until the first header arrives.
+    io_->WaitForIdle();
+    EXPECT_EQ(0U, packet_count());
+
+    io_->CompleteRead(0, make_header(A_WRTE, 3));
+
+    auto first = WaitForPacket();
+    ASSERT_NE(nullptr, first);
+    EXPECT_EQ(static_cast<uint32_t>(A_WRTE), first->msg.command);
+    EXPECT_EQ("foo", payload_string(*first));
+
+    auto second = WaitForPacket();
+    ASSERT_NE(nullptr, second);
+    EXPECT_EQ(static_cast<uint32_t>(A_OKAY), second->msg.command);
+    EXPECT_EQ("", payload_string(*second));
+
+    auto third = WaitForPacket();
+    ASSERT_NE(nullptr, third);
+    EXPECT_EQ(static_cast<uint32_t>(A_WRTE), third->msg.command);
+    EXPECT_EQ("bar", payload_string(*third));
+
+    // Every completed read should have been resubmitted.
+    io_->WaitForIdle();
+    EXPECT_EQ(read_queue_depth_, io_->pending_reads());
+}
+
+TEST_F(UsbFfsConnectionTest, read_payload_spanning_blocks) {
+    std::string payload;
+    for (size_t i = 0; i < 2 * read_size_ + 100; ++i) {
+        payload.push_back('a' + i % 26);
+    }
+
+    io_->CompleteRead(3, payload.substr(2 * read_size_));
+    io_->CompleteRead(1, payload.substr(0, read_size_));
+    io_->CompleteRead(2, payload.substr(read_size_, read_size_));
+    io_->CompleteRead(0, make_header(A_WRTE, payload.size()));
+
+    auto packet = WaitForPacket();
+    ASSERT_NE(nullptr, packet);
+    EXPECT_EQ(payload, payload_string(*packet));
+}
+
+TEST_F(UsbFfsConnectionTest, read_short_header) {
+    io_->CompleteRead(0, "short");
+    EXPECT_EQ("received packet of unexpected length while reading header", WaitForError());
+}
+
+TEST_F(UsbFfsConnectionTest, read_payload_too_long) {
+    io_->CompleteRead(1, "toolong");
+    io_->CompleteRead(0, make_header(A_WRTE, 3));
+    EXPECT_EQ("received too many bytes while waiting for payload", WaitForError());
+}
+
+TEST_F(UsbFfsConnectionTest, read_oversized_payload) {
+    io_->CompleteRead(0, make_header(A_WRTE, UINT32_MAX));
+    EXPECT_EQ("received packet with oversized payload: 4294967295", WaitForError());
+}
+
+TEST_F(UsbFfsConnectionTest, write) {
+    std::string payload(2 * read_size_ + 100, 'x');
+    auto packet = std::make_unique<apacket>();
+    packet->msg.command = A_WRTE;
+    packet->msg.data_length = payload.size();
+    packet->payload = Block(payload.begin(), payload.end());
+    std::string expected = std::string(reinterpret_cast<const char*>(&packet->msg),
+                                       sizeof(packet->msg)) +
+                           payload;
+    ASSERT_TRUE(connection_->Write(std::move(packet)));
+
+    std::string written;
+    while (written.size() < expected.size()) {
+        io_->WaitForWrites(1);
+        written += io_->CompleteWrites();
+    }
+    EXPECT_EQ(expected, written);
+}
+
+// Feed |payload| into the reads starting at |first_read_id|, filling each read as far as it'll go,
+// except that the read at |short_read_index| (if any) only gets |short_read_size| bytes, as if the
+// host had split the payload into several transfers.
+static uint64_t feed_payload(FakeUsbFfsIo* io, uint64_t first_read_id, std::string_view payload,
+                             size_t short_read_index = SIZE_MAX, size_t short_read_size = 0) {
+    uint64_t read_id = first_read_id;
+    while (!payload.empty()) {
+        size_t length = std::min(io->WaitForRead(read_id).length, payload.size());
+        if (read_id - first_read_id == short_read_index) {
+            length = std::min(length, short_read_size);
+        }
+        io->CompleteRead(read_id++, payload.substr(0, length));
+        payload.remove_prefix(length);
+    }
+    return read_id;
+}
+
+static std::string make_payload(size_t length) {
+    std::string payload;
+    for (size_t i = 0; i < length; ++i) {
+        payload.push_back('a' + i % 23);
+    }
+    return payload;
+}
+
+TEST_F(UsbFfsConnectionTest, read_large_payloads) {
+    // Large enough that most of each payload is read directly into place.
+    std::string payload = make_payload(4 * read_queue_depth_ * read_size_ + 123);
+
+    uint64_t read_id = 0;
+    for (int i = 0; i < 3; ++i) {
+        io_->CompleteRead(read_id++, make_header(A_WRTE, payload.size()));
+        read_id = feed_payload(io_, read_id, payload);
+
+        auto packet = WaitForPacket();
+        ASSERT_NE(nullptr, packet);
+        EXPECT_EQ(payload, payload_string(*packet));
+    }
+
+    io_->CompleteRead(read_id++, make_header(A_OKAY, 0));
+    auto packet = WaitForPacket();
+    ASSERT_NE(nullptr, packet);
+    EXPECT_EQ(static_cast<uint32_t>(A_OKAY), packet->msg.command);
+}
+
+TEST_F(UsbFfsConnectionTest, read_large_payload_split_transfers) {
+    std::string payload = make_payload(4 * read_queue_depth_ * read_size_ + 123);
+
+    // End a transfer early both before and after reads start being posted into the payload.
+    uint64_t read_id = 0;
+    for (size_t short_read_index : {size_t(1), read_queue_depth_ + 2, 3 * read_queue_depth_}) {
+        io_->CompleteRead(read_id++, make_header(A_WRTE, payload.size()));
+        read_id = feed_payload(io_, read_id, payload, short_read_index, read_size_ / 3);
+
+        auto packet = WaitForPacket();
+        ASSERT_NE(nullptr, packet);
+        EXPECT_EQ(payload, payload_string(*packet));
+    }
+}
+
+TEST_F(UsbFfsConnectionTest, read_payloads_in_one_read) {
+    // Payloads that fit in a read have their read's buffer handed over, or are copied if they're
+    // small or the host splits them. Go round the queue a few times, to reuse every read.
+    uint64_t read_id = 0;
+    for (size_t i = 0; i < 3 * read_queue_depth_; ++i) {
+        size_t length = i % 3 == 0 ? read_size_ : i % 3 == 1 ? read_size_ / 2 + 1 : 100;
+        size_t short_read_index = i % 2 == 0 ? SIZE_MAX : 0;
+        std::string payload = make_payload(length);
+        io_->CompleteRead(read_id++, make_header(A_WRTE, payload.size()));
+        read_id = feed_payload(io_, read_id, payload, short_read_index, length / 3);
+
+        auto packet = WaitForPacket();
+        ASSERT_NE(nullptr, packet);
+        EXPECT_EQ(payload, payload_string(*packet));
+    }
+
+    io_->WaitForIdle();
+    EXPECT_EQ(read_queue_depth_, io_->pending_reads());
+}
+
+class UsbFfsConnectionEndpointPairsTest : public UsbFfsConnectionTest {
+  protected:
+    void SetUp() override {
+        endpoint_pairs_ = 2;
+        UsbFfsConnectionTest::SetUp();
+    }
+
+    // Write a packet, and return the pair that it was written on.
+    size_t WritePacket(uint32_t command, uint32_t arg0, uint32_t arg1) {
+        auto packet = std::make_unique<apacket>();
+        packet->msg.command = command;
+        packet->msg.arg0 = arg0;
+        packet->msg.arg1 = arg1;
+        EXPECT_TRUE(connection_->Write(std::move(packet)));
+
+        io_->WaitForWrites(1);
+        for (size_t pair = 0; pair < endpoint_pairs_; ++pair) {
+            if (!io_->CompleteWrites(pair).empty()) {
+                return pair;
+            }
+        }
+        return SIZE_MAX;
+    }
+};
+
+TEST_F(UsbFfsConnectionEndpointPairsTest, read_on_each_pair) {
+    // Packets on different pairs are independent, so one pair's payload being incomplete doesn't
+    // hold up the other.
+    io_->CompleteRead(0, make_header(A_WRTE, 6), 0);
+    io_->CompleteRead(1, "foo", 0);
+    io_->CompleteRead(0, make_header(A_WRTE, 3), 1);
+    io_->CompleteRead(1, "bar", 1);
+
+    auto packet = WaitForPacket();
+    ASSERT_NE(nullptr, packet);
+    EXPECT_EQ("bar", payload_string(*packet));
+
+    io_->CompleteRead(2, "baz", 0);
+    packet = WaitForPacket();
+    ASSERT_NE(nullptr, packet);
+    EXPECT_EQ("foobaz", payload_string(*packet));
+}
+
+TEST_F(UsbFfsConnectionEndpointPairsTest, reply_on_open_pair) {
+    EXPECT_EQ(0U, WritePacket(A_CNXN, 0, 0));
+
+    // The host opens its stream 5 on pair 1, and stream 6 on pair 0.
+    std::string service = "sync:";
+    io_->CompleteRead(0, make_header(A_OPEN, service.size(), 5), 1);
+    io_->CompleteRead(1, service, 1);
+    ASSERT_NE(nullptr, WaitForPacket());
+    io_->CompleteRead(0, make_header(A_OPEN, 0, 6), 0);
+    ASSERT_NE(nullptr, WaitForPacket());
+
+    // Everything we send back for a stream goes on the pair it was opened on.
+    EXPECT_EQ(1U, WritePacket(A_OKAY, 1, 5));
+    EXPECT_EQ(1U, WritePacket(A_WRTE, 1, 5));
+    EXPECT_EQ(0U, WritePacket(A_OKAY, 2, 6));
+
+    // Once the stream is closed, its id can be reused on another pair.
+    EXPECT_EQ(1U, WritePacket(A_CLSE, 1, 5));
+    EXPECT_EQ(0U, WritePacket(A_WRTE, 1, 5));
+}
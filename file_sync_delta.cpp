@@ -0,0 +1,214 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "file_sync_delta.h"
+
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include <openssl/sha.h>
+
+#include "sysdeps.h"
+
+// How much of a file to read at a time.
+static constexpr size_t kReadSize = 256 * 1024;
+
+uint32_t DeltaBlockSize(uint64_t file_size) {
+    constexpr uint64_t kMinBlockSize = 2 * 1024;
+    uint64_t block_size = static_cast<uint64_t>(sqrt(static_cast<double>(file_size))) & ~1023ULL;
+    return std::clamp<uint64_t>(block_size, kMinBlockSize, SYNC_DATA_MAX);
+}
+
+void RollingChecksum::Reset(const char* data, size_t length) {
+    a_ = 0;
+    b_ = 0;
+    length_ = length;
+    for (size_t i = 0; i < length; ++i) {
+        uint8_t c = data[i];
+        a_ += c;
+        b_ += (length - i) * c;
+    }
+}
+
+void RollingChecksum::Roll(char out, char in) {
+    a_ += static_cast<uint8_t>(in) - static_cast<uint8_t>(out);
+    b_ += a_ - length_ * static_cast<uint8_t>(out);
+}
+
+void SignBlock(const char* data, size_t length, sync_block_signature* signature) {
+    RollingChecksum checksum;
+    checksum.Reset(data, length);
+    signature->weak = checksum.Value();
+
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    SHA256(reinterpret_cast<const uint8_t*>(data), length, digest);
+    memcpy(signature->strong, digest, sizeof(signature->strong));
+}
+
+bool SignFile(borrowed_fd fd, uint32_t block_size, std::vector<sync_block_signature>* signatures) {
+    // Read several blocks at a time, but always whole ones.
+    std::vector<char> buf(std::max<size_t>(kReadSize / block_size, 1) * block_size);
+    while (true) {
+        size_t length = 0;
+        while (length < buf.size()) {
+            int rc = adb_read(fd, buf.data() + length, buf.size() - length);
+            if (rc < 0) return false;
+            if (rc == 0) break;
+            length += rc;
+        }
+
+        for (size_t offset = 0; offset < length; offset += block_size) {
+            if (signatures->size() >= SYNC_DELTA_MAX_BLOCKS) {
+                errno = EFBIG;
+                return false;
+            }
+            signatures->emplace_back();
+            SignBlock(buf.data() + offset, std::min<size_t>(block_size, length - offset),
+                      &signatures->back());
+        }
+
+        if (length < buf.size()) return true;
+    }
+}
+
+DeltaEncoder::DeltaEncoder(uint32_t block_size, const std::vector<sync_block_signature>& signatures)
+    : block_size_(block_size), signatures_(signatures) {
+    blocks_by_weak_.reserve(signatures.size());
+    for (size_t i = 0; i < signatures.size(); ++i) {
+        blocks_by_weak_.emplace(signatures[i].weak, i);
+    }
+}
+
+std::optional<uint64_t> DeltaEncoder::FindBlock(const char* data, uint32_t weak,
+                                                uint64_t preferred) const {
+    auto [begin, end] = blocks_by_weak_.equal_range(weak);
+    if (begin == end) {
+        return std::nullopt;
+    }
+
+    sync_block_signature signature;
+    SignBlock(data, block_size_, &signature);
+
+    // A file that was changed in place usually reuses the block after the previous one, so prefer
+    // that when a block appears more than once, to keep the runs long.
+    std::optional<uint64_t> result;
+    for (auto it = begin; it != end; ++it) {
+        if (memcmp(signatures_[it->second].strong, signature.strong, sizeof(signature.strong))) {
+            continue;
+        }
+        if (it->second == preferred) {
+            return preferred;
+        }
+        if (!result) {
+            result = it->second;
+        }
+    }
+    return result;
+}
+
+bool DeltaEncoder::Encode(borrowed_fd fd, const LiteralCallback& literal,
+                          const CopyCallback& copy) {
+    // buf holds everything from the first byte that hasn't been sent yet (literal_start), through
+    // the window being checked (pos to pos + block_size_), to whatever has been read beyond it.
+    std::vector<char> buf;
+    size_t literal_start = 0;
+    size_t pos = 0;
+    bool eof = false;
+
+    RollingChecksum checksum;
+    bool have_checksum = false;
+
+    uint64_t run_block = 0;
+    uint32_t run_count = 0;
+
+    auto flush_copy = [&]() {
+        if (run_count == 0) return true;
+        uint32_t count = run_count;
+        run_count = 0;
+        return copy(run_block, count);
+    };
+
+    auto flush_literal = [&](size_t end) {
+        while (literal_start < end) {
+            if (!flush_copy()) return false;
+            size_t length = std::min<size_t>(end - literal_start, SYNC_DATA_MAX);
+            if (!literal(buf.data() + literal_start, length)) return false;
+            literal_start += length;
+        }
+        return true;
+    };
+
+    while (true) {
+        // Make sure that there's a whole window, and the byte after it to roll in.
+        if (!eof && buf.size() - pos <= block_size_) {
+            buf.erase(buf.begin(), buf.begin() + literal_start);
+            pos -= literal_start;
+            literal_start = 0;
+
+            size_t size = buf.size();
+            buf.resize(size + kReadSize);
+            int rc = adb_read(fd, buf.data() + size, kReadSize);
+            if (rc < 0) return false;
+            buf.resize(size + rc);
+            eof = (rc == 0);
+            continue;
+        }
+
+        if (buf.size() - pos < block_size_) {
+            break;
+        }
+
+        if (!have_checksum) {
+            checksum.Reset(buf.data() + pos, block_size_);
+            have_checksum = true;
+        }
+
+        std::optional<uint64_t> block =
+                FindBlock(buf.data() + pos, checksum.Value(), run_block + run_count);
+        if (block) {
+            if (!flush_literal(pos)) return false;
+            if (run_count != 0 && *block == run_block + run_count && run_count < UINT32_MAX) {
+                ++run_count;
+            } else {
+                if (!flush_copy()) return false;
+                run_block = *block;
+                run_count = 1;
+            }
+            pos += block_size_;
+            literal_start = pos;
+            have_checksum = false;
+            continue;
+        }
+
+        if (buf.size() - pos == block_size_) {
+            // There's nothing left to roll in.
+            break;
+        }
+
+        // Send unmatched data as it builds up, so that buf doesn't grow without bound.
+        if (pos - literal_start >= SYNC_DATA_MAX) {
+            if (!flush_literal(pos)) return false;
+        }
+
+        checksum.Roll(buf[pos], buf[pos + block_size_]);
+        ++pos;
+    }
+
+    return flush_literal(buf.size()) && flush_copy();
+}
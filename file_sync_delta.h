@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include "adb_unique_fd.h"
+#include "file_sync_protocol.h"
+
+// The block size that adbd signs an old file of |file_size| bytes with. Like rsync, this grows with
+// the square root of the size, which keeps both the signatures and the literal data sent around
+// each change small.
+uint32_t DeltaBlockSize(uint64_t file_size);
+
+// rsync's weak checksum, which can be moved along a buffer one byte at a time.
+class RollingChecksum {
+  public:
+    void Reset(const char* data, size_t length);
+    void Roll(char out, char in);
+
+    uint32_t Value() const { return (b_ << 16) | (a_ & 0xffff); }
+
+  private:
+    uint32_t a_ = 0;
+    uint32_t b_ = 0;
+    uint32_t length_ = 0;
+};
+
+// Fills in the signature of one block of data.
+void SignBlock(const char* data, size_t length, sync_block_signature* signature);
+
+// Reads |fd| to the end, appending the signature of each |block_size| bytes to |signatures|.
+bool SignFile(borrowed_fd fd, uint32_t block_size, std::vector<sync_block_signature>* signatures);
+
+// Describes a new file in terms of the blocks of an old one, given the old file's signatures.
+class DeltaEncoder {
+  public:
+    // Called with at most SYNC_DATA_MAX bytes that have to be sent as they are.
+    using LiteralCallback = std::function<bool(const char* data, size_t length)>;
+    // Called for each run of consecutive blocks of the old file that can be reused.
+    using CopyCallback = std::function<bool(uint64_t block, uint32_t count)>;
+
+    DeltaEncoder(uint32_t block_size, const std::vector<sync_block_signature>& signatures);
+
+    // Reads |fd| to the end. Returns false if reading fails, or as soon as a callback does.
+    bool Encode(borrowed_fd fd, const LiteralCallback& literal, const CopyCallback& copy);
+
+  private:
+    std::optional<uint64_t> FindBlock(const char* data, uint32_t weak, uint64_t preferred) const;
+
+    uint32_t block_size_;
+    const std::vector<sync_block_signature>& signatures_;
+    std::unordered_multimap<uint32_t, uint64_t> blocks_by_weak_;
+};
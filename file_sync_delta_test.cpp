@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "file_sync_delta.h"
+
+#include <gtest/gtest.h>
+
+#include <string.h>
+#include <unistd.h>
+
+#include <random>
+#include <string>
+
+#include <android-base/file.h>
+
+// Like the adb_io tests, these use TemporaryFile's fd, which adb_read() can't use on Windows.
+#if defined(_WIN32)
+#define POSIX_TEST(x, y) TEST(DISABLED_##x, y)
+#else
+#define POSIX_TEST TEST
+#endif
+
+static std::string RandomData(size_t length, uint32_t seed) {
+    std::mt19937 generator(seed);
+    std::string result(length, '\0');
+    for (char& c : result) {
+        c = static_cast<char>(generator());
+    }
+    return result;
+}
+
+struct Delta {
+    std::string reconstructed;
+    size_t literal_bytes = 0;
+    size_t copies = 0;
+};
+
+// Encodes |new_data| against |old_data|, and applies the result to |old_data| the way adbd would.
+static Delta EncodeAndApply(const std::string& old_data, const std::string& new_data,
+                            uint32_t block_size) {
+    Delta result;
+
+    TemporaryFile old_file;
+    EXPECT_TRUE(android::base::WriteStringToFd(old_data, old_file.fd));
+    EXPECT_EQ(0, lseek(old_file.fd, 0, SEEK_SET));
+    std::vector<sync_block_signature> signatures;
+    EXPECT_TRUE(SignFile(old_file.fd, block_size, &signatures));
+
+    TemporaryFile new_file;
+    EXPECT_TRUE(android::base::WriteStringToFd(new_data, new_file.fd));
+    EXPECT_EQ(0, lseek(new_file.fd, 0, SEEK_SET));
+
+    DeltaEncoder encoder(block_size, signatures);
+    bool success = encoder.Encode(
+            new_file.fd,
+            [&](const char* data, size_t length) {
+                EXPECT_LE(length, static_cast<size_t>(SYNC_DATA_MAX));
+                result.reconstructed.append(data, length);
+                result.literal_bytes += length;
+                return true;
+            },
+            [&](uint64_t block, uint32_t count) {
+                EXPECT_LE(block + count, signatures.size());
+                result.reconstructed.append(old_data.substr(block * block_size,
+                                                            uint64_t(count) * block_size));
+                ++result.copies;
+                return true;
+            });
+    EXPECT_TRUE(success);
+    return result;
+}
+
+TEST(file_sync_delta, DeltaBlockSize) {
+    EXPECT_EQ(2048U, DeltaBlockSize(0));
+    EXPECT_EQ(2048U, DeltaBlockSize(1024 * 1024));
+    EXPECT_EQ(17408U, DeltaBlockSize(300 * 1024 * 1024));
+    EXPECT_EQ(static_cast<uint32_t>(SYNC_DATA_MAX), DeltaBlockSize(1ULL << 40));
+}
+
+TEST(file_sync_delta, RollingChecksum) {
+    std::string data = RandomData(4096, 1);
+    const size_t window = 1000;
+
+    RollingChecksum rolling;
+    rolling.Reset(data.data(), window);
+    for (size_t i = 0; i + window < data.size(); ++i) {
+        rolling.Roll(data[i], data[i + window]);
+
+        RollingChecksum fresh;
+        fresh.Reset(data.data() + i + 1, window);
+        ASSERT_EQ(fresh.Value(), rolling.Value()) << "at offset " << i + 1;
+    }
+}
+
+POSIX_TEST(file_sync_delta, SignFile) {
+    std::string data = RandomData(10000, 2);
+    TemporaryFile tf;
+    ASSERT_TRUE(android::base::WriteStringToFd(data, tf.fd));
+    ASSERT_EQ(0, lseek(tf.fd, 0, SEEK_SET));
+
+    std::vector<sync_block_signature> signatures;
+    ASSERT_TRUE(SignFile(tf.fd, 4096, &signatures));
+    ASSERT_EQ(3U, signatures.size());
+
+    // The last block is short.
+    sync_block_signature last;
+    SignBlock(data.data() + 8192, 10000 - 8192, &last);
+    EXPECT_EQ(last.weak, signatures[2].weak);
+    EXPECT_EQ(0, memcmp(last.strong, signatures[2].strong, sizeof(last.strong)));
+}
+
+POSIX_TEST(file_sync_delta, unchanged) {
+    std::string data = RandomData(1024 * 1024, 3);
+    Delta delta = EncodeAndApply(data, data, 4096);
+    EXPECT_EQ(data, delta.reconstructed);
+    EXPECT_EQ(0U, delta.literal_bytes);
+    EXPECT_EQ(1U, delta.copies);
+}
+
+POSIX_TEST(file_sync_delta, edited) {
+    std::string old_data = RandomData(1024 * 1024, 4);
+    std::string new_data = old_data;
+    new_data.insert(0, "inserted at the start");
+    new_data.replace(300000, 100, RandomData(100, 5));
+    new_data.erase(700000, 12345);
+    new_data += "appended at the end";
+
+    Delta delta = EncodeAndApply(old_data, new_data, 4096);
+    EXPECT_EQ(new_data, delta.reconstructed);
+
+    // Each edit costs at most a couple of blocks' worth of literal data.
+    EXPECT_LT(delta.literal_bytes, 5U * 4096);
+}
+
+POSIX_TEST(file_sync_delta, no_old_file) {
+    std::string data = RandomData(200000, 6);
+    Delta delta = EncodeAndApply("", data, 2048);
+    EXPECT_EQ(data, delta.reconstructed);
+    EXPECT_EQ(data.size(), delta.literal_bytes);
+    EXPECT_EQ(0U, delta.copies);
+}
+
+POSIX_TEST(file_sync_delta, rearranged) {
+    std::string a = RandomData(50000, 7);
+    std::string b = RandomData(50000, 8);
+    Delta delta = EncodeAndApply(a + b, b + a + a, 2048);
+    EXPECT_EQ(b + a + a, delta.reconstructed);
+    EXPECT_LT(delta.literal_bytes, 3U * 2048);
+}
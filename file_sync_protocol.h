@@ -21,14 +21,22 @@
 #define ID_LSTAT_V1 MKID('S', 'T', 'A', 'T')
 #define ID_STAT_V2 MKID('S', 'T', 'A', '2')
 #define ID_LSTAT_V2 MKID('L', 'S', 'T', '2')
+#define ID_STAT_BATCH MKID('S', 'T', 'A', 'B')
+#define ID_HASH_BATCH MKID('H', 'S', 'H', 'B')
+#define ID_HASH MKID('H', 'A', 'S', 'H')
+#define ID_HASH_RANGE MKID('H', 'S', 'H', 'R')
 
 #define ID_LIST_V1 MKID('L', 'I', 'S', 'T')
 #define ID_LIST_V2 MKID('L', 'I', 'S', '2')
 #define ID_DENT_V1 MKID('D', 'E', 'N', 'T')
 #define ID_DENT_V2 MKID('D', 'N', 'T', '2')
+#define ID_LIST_RECURSIVE MKID('R', 'L', 'S', 'T')
+#define ID_RDENT MKID('R', 'D', 'N', 'T')
 
 #define ID_SEND_V1 MKID('S', 'E', 'N', 'D')
 #define ID_SEND_V2 MKID('S', 'N', 'D', '2')
+#define ID_SEND_V3 MKID('S', 'N', 'D', '3')
+#define ID_SEND_BUNDLE MKID('S', 'N', 'D', 'B')
 #define ID_RECV_V1 MKID('R', 'E', 'C', 'V')
 #define ID_RECV_V2 MKID('R', 'C', 'V', '2')
 #define ID_DONE MKID('D', 'O', 'N', 'E')
@@ -36,6 +44,11 @@
 #define ID_OKAY MKID('O', 'K', 'A', 'Y')
 #define ID_FAIL MKID('F', 'A', 'I', 'L')
 #define ID_QUIT MKID('Q', 'U', 'I', 'T')
+#define ID_SIGNATURES MKID('S', 'I', 'G', 'S')
+#define ID_COPY MKID('C', 'O', 'P', 'Y')
+#define ID_FRAME MKID('F', 'R', 'M', 'E')
+#define ID_DATA_MAX MKID('D', 'M', 'A', 'X')
+#define ID_HOLE MKID('H', 'O', 'L', 'E')
 
 struct SyncRequest {
     uint32_t id;           // ID_STAT, et cetera.
@@ -89,9 +102,70 @@ struct __attribute__((packed)) sync_dent_v2 {
     uint32_t namelen;
 };  // followed by `namelen` bytes of the name.
 
+// hash_batch is sent like stat_batch, but with a sync_hash_batch. adbd hashes the files in
+// parallel and answers with one sync_hash per path, in order.
+struct __attribute__((packed)) sync_hash_batch {
+    uint32_t id;
+    uint32_t count;  // <= SYNC_HASH_BATCH_MAX
+};
+
+struct __attribute__((packed)) sync_hash {
+    uint32_t id;
+    uint32_t error;
+    uint64_t size;
+    uint8_t sha256[32];
+};
+
+// With kFeatureResume, hash_range sends the path in the first request, followed by a
+// sync_hash_range. adbd answers with a sync_hash of just `length` bytes of the file from `offset`,
+// or fewer if the file ends first, with `size` saying how many it hashed.
+struct __attribute__((packed)) sync_hash_range {
+    uint32_t id;
+    uint64_t offset;
+    uint64_t length;
+};
+
+// list_recursive sends the directory to list in the request, like list_v2. adbd walks the tree,
+// following symbolic links, and answers with a sync_rdent for each entry (directories before their
+// contents) and then a sync_rdent with id ID_DONE.
+struct __attribute__((packed)) sync_rdent {
+    uint32_t id;
+    uint32_t mode;
+    uint64_t size;
+    int64_t mtime;
+    uint32_t namelen;
+};  // followed by `namelen` bytes of the path, relative to the directory being listed.
+
 enum SyncFlag : uint32_t {
     kSyncFlagNone = 0,
     kSyncFlagBrotli = 1,
+    kSyncFlagLZ4 = 2,
+    kSyncFlagZstd = 4,
+    // For recv_v2, asks adbd to stop compressing when it isn't paying off (see below).
+    kSyncFlagRawFallback = 8,
+    // For a compressed send_v2, sends the file as sync_frames (see below).
+    kSyncFlagFramed = 16,
+    // For send_v2, follows the sync_send_v2 with a sync_send_size (see below).
+    kSyncFlagSize = 32,
+    // For send_v2 or recv_v2, follows the sync_send_v2 or sync_recv_v2 with a sync_send_range or
+    // sync_recv_range (see below).
+    kSyncFlagRange = 64,
+    // For an uncompressed send_v2 or recv_v2, lets the sender skip holes (see below).
+    kSyncFlagSparse = 128,
+    // For send_v2, follows the sync_send_v2 with a sync_send_resume (see below).
+    kSyncFlagResume = 256,
+};
+
+// With kFeatureSendRecv2RawFallback, the sender of a compressed send_v2 or recv_v2 file can end
+// the compressed stream early, and send the rest of the file as ID_DATA messages of raw bytes.
+// adbd only does so for recv_v2 if it's asked to with kSyncFlagRawFallback.
+
+enum class CompressionType {
+    None,
+    Any,  // Whichever codec the device supports that's cheapest to run.
+    Brotli,
+    LZ4,
+    Zstd,
 };
 
 // send_v1 sent the path in a buffer, followed by a comma and the mode as a string.
@@ -103,17 +177,136 @@ struct __attribute__((packed)) sync_send_v2 {
     uint32_t flags;
 };
 
+// With kFeatureSendSize, a send_v2 with kSyncFlagSize follows its sync_send_v2 with a
+// sync_send_size, so that adbd can allocate the file's space before any of the file arrives.
+struct __attribute__((packed)) sync_send_size {
+    uint64_t size;
+};
+
+// With kFeatureSendRange, a send_v2 with kSyncFlagRange follows its sync_send_v2 with a
+// sync_send_range, and sends just `length` bytes of the file from `offset`. Several connections
+// can each send ranges of one file at once. adbd creates the file, `size` bytes long, when the
+// first range with a new `id` arrives, and only sets its owner, capabilities and mtime once all of
+// it has arrived. Each range is answered once it's written; the range that completes the file is
+// answered once the file is complete.
+struct __attribute__((packed)) sync_send_range {
+    uint64_t id;  // Chosen by the client, and the same for every range of the file.
+    uint64_t size;
+    uint64_t offset;
+    uint64_t length;
+};
+
+// With kFeatureResume, a send_v2 with kSyncFlagResume follows its sync_send_v2, and any
+// sync_send_size, with a sync_send_resume, and sends the file from `offset`. adbd writes it to
+// the path with ".adbpart" added, keeping the first `offset` bytes of what's there already, and
+// fails if there aren't that many. Only once the whole file has arrived does adbd rename it into
+// place, so a push that's cut off leaves the partial file behind for a later push to resume.
+struct __attribute__((packed)) sync_send_resume {
+    uint64_t offset;
+};
+
+// send_v3 is sent like send_v2, but with a sync_send_v3, and sends the file as a delta against
+// whatever regular file is already at the path. adbd first answers with a sync_signatures and then
+// `count` sync_block_signatures, one for each `block_size` bytes of the old file (`count` is 0 if
+// there's no old file it can read). The new file follows as ID_DATA messages of literal bytes and
+// sync_copy messages that each reuse a run of the old file's blocks, ended by an ID_DONE with the
+// mtime. adbd writes the new file next to the old one and renames it into place before answering
+// with ID_OKAY or ID_FAIL.
+struct __attribute__((packed)) sync_send_v3 {
+    uint32_t id;
+    uint32_t mode;
+    uint32_t flags;  // No flags are defined yet.
+};
+
+struct __attribute__((packed)) sync_signatures {
+    uint32_t id;
+    uint32_t block_size;  // <= SYNC_DATA_MAX
+    uint32_t count;       // <= SYNC_DELTA_MAX_BLOCKS
+};
+
+struct __attribute__((packed)) sync_block_signature {
+    uint32_t weak;       // The rolling checksum of the block.
+    uint8_t strong[16];  // The start of the block's SHA-256.
+};
+
+struct __attribute__((packed)) sync_copy {
+    uint32_t id;
+    uint32_t count;  // The number of blocks to copy.
+    uint64_t block;  // The index of the first of them.
+};
+
+// stat_batch sends an empty path in the first request, followed by a sync_stat_batch and then
+// `count` paths, each of which is a uint32_t length followed by that many bytes (<= 1024). adbd
+// reads every path before answering with one sync_stat_v2 per path, in order.
+struct __attribute__((packed)) sync_stat_batch {
+    uint32_t id;
+    uint32_t stat_id;  // ID_STAT_V2 or ID_LSTAT_V2.
+    uint32_t count;    // <= SYNC_STAT_BATCH_MAX
+};
+
+// send_bundle sends an empty path in the first request, followed by a sync_send_bundle and then
+// `count` small regular files, each of which is a sync_bundle_file followed by `path_length` bytes
+// of path and `size` bytes of data. `size` in the sync_send_bundle is the size of all of the files,
+// with their sync_bundle_files and paths. adbd reads the whole bundle before writing each file as a
+// send_v2 would, and answers with a sync_send_bundle with the same `count` and a `size` of 4 *
+// `count`, followed by a uint32_t error for each file, in order: 0 if it was written, and
+// otherwise an errno, as in sync_stat_v2.
+struct __attribute__((packed)) sync_send_bundle {
+    uint32_t id;
+    uint32_t count;  // <= SYNC_BUNDLE_MAX_FILES
+    uint32_t size;   // <= SYNC_BUNDLE_MAX_SIZE
+};
+
+struct __attribute__((packed)) sync_bundle_file {
+    uint32_t mode;
+    uint32_t mtime;
+    uint32_t path_length;  // <= 1024
+    uint32_t size;
+};
+
 // Likewise, recv_v1 just sent the path without any accompanying data.
 struct __attribute__((packed)) sync_recv_v2 {
     uint32_t id;
     uint32_t flags;
 };
 
+// With kFeatureRecvRange, a recv_v2 with kSyncFlagRange follows its sync_recv_v2 with a
+// sync_recv_range, and adbd sends just that part of the file: `length` bytes from `offset`, or
+// fewer if the file ends first. Several connections can each pull a range of one big file at once.
+struct __attribute__((packed)) sync_recv_range {
+    uint64_t offset;
+    uint64_t length;
+};
+
 struct __attribute__((packed)) sync_data {
     uint32_t id;
     uint32_t size;
 };  // followed by `size` bytes of data.
 
+// With kFeatureSendRecv2Sparse, the sender of an uncompressed send_v2 or recv_v2 with
+// kSyncFlagSparse can send a hole in the file as a sync_data with id ID_HOLE and nothing following,
+// in place of `size` bytes of zeroes. The receiver leaves a hole there if it can. A hole of more
+// than UINT32_MAX bytes takes several messages.
+
+// With kFeatureSendRecv2Framed, a compressed send_v2 with kSyncFlagFramed sends the file as
+// sync_frames rather than ID_DATA messages, ended by the usual ID_DONE. Each frame is compressed
+// on its own, so that both ends can work on several at once. A frame that doesn't get any smaller
+// is sent as it is, with compressed_size equal to size.
+struct __attribute__((packed)) sync_frame {
+    uint32_t id;
+    uint32_t size;             // <= SYNC_FRAME_MAX
+    uint32_t compressed_size;  // <= size
+};  // followed by `compressed_size` bytes of data.
+
+// With kFeatureSyncDataMax, data_max sends an empty path in the first request, followed by a
+// sync_data_max with the most data the client wants in an ID_DATA message. adbd answers with a
+// sync_data_max of its own, with the size that both ends use in place of SYNC_DATA_MAX for the
+// rest of the connection: the smaller of the two sizes, but never less than SYNC_DATA_MAX.
+struct __attribute__((packed)) sync_data_max {
+    uint32_t id;
+    uint32_t size;  // <= SYNC_DATA_MAX_LARGE
+};
+
 struct __attribute__((packed)) sync_status {
     uint32_t id;
     uint32_t msglen;
@@ -125,9 +318,27 @@ union syncmsg {
     sync_dent_v1 dent_v1;
     sync_dent_v2 dent_v2;
     sync_data data;
+    sync_frame frame;
     sync_status status;
     sync_send_v2 send_v2_setup;
+    sync_send_v3 send_v3_setup;
+    sync_signatures signatures;
+    sync_copy copy;
     sync_recv_v2 recv_v2_setup;
+    sync_stat_batch stat_batch_setup;
+    sync_hash_batch hash_batch_setup;
+    sync_hash hash;
+    sync_hash_range hash_range_setup;
+    sync_rdent rdent;
+    sync_data_max data_max_setup;
+    sync_send_bundle send_bundle_setup;
 };
 
 #define SYNC_DATA_MAX (64 * 1024)
+#define SYNC_DATA_MAX_LARGE (1024 * 1024)
+#define SYNC_FRAME_MAX (4 * 1024 * 1024)
+#define SYNC_STAT_BATCH_MAX 4096
+#define SYNC_HASH_BATCH_MAX 256
+#define SYNC_DELTA_MAX_BLOCKS (1024 * 1024)
+#define SYNC_BUNDLE_MAX_FILES 1024
+#define SYNC_BUNDLE_MAX_SIZE (1024 * 1024)
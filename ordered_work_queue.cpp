@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ordered_work_queue.h"
+
+#include <utility>
+
+OrderedWorkQueue::OrderedWorkQueue(size_t thread_count) {
+    for (size_t i = 0; i < thread_count; ++i) {
+        threads_.emplace_back([this]() { Run(); });
+    }
+}
+
+OrderedWorkQueue::~OrderedWorkQueue() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    work_available_.notify_all();
+    for (std::thread& thread : threads_) {
+        thread.join();
+    }
+}
+
+void OrderedWorkQueue::Push(Block block, Work work) {
+    auto job = std::make_unique<Job>();
+    job->block = std::move(block);
+    job->work = std::move(work);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending_.push_back(job.get());
+        jobs_.push_back(std::move(job));
+    }
+    work_available_.notify_one();
+}
+
+bool OrderedWorkQueue::Pop(Block* block) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    Job* job = jobs_.front().get();
+    work_done_.wait(lock, [job]() { return job->done; });
+
+    *block = std::move(job->block);
+    bool result = job->result;
+    jobs_.pop_front();
+    return result;
+}
+
+void OrderedWorkQueue::Run() {
+    while (true) {
+        Job* job;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            work_available_.wait(lock, [this]() { return stopping_ || !pending_.empty(); });
+            if (stopping_) {
+                return;
+            }
+            job = pending_.front();
+            pending_.pop_front();
+        }
+
+        bool result = job->work(&job->block);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            job->done = true;
+            job->result = result;
+        }
+        work_done_.notify_all();
+    }
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "types.h"
+
+// Runs work on blocks on a pool of threads, and hands the blocks back in the order they went in.
+// It's meant for one thread to feed it and collect from it, like a file being sent in frames.
+class OrderedWorkQueue {
+  public:
+    // Changes the block in place, returning false on failure.
+    using Work = std::function<bool(Block* block)>;
+
+    explicit OrderedWorkQueue(size_t thread_count);
+    ~OrderedWorkQueue();
+
+    // Queues |work| to be run on |block|.
+    void Push(Block block, Work work);
+
+    // Waits for the oldest block that hasn't been collected yet, of which there has to be one.
+    // Returns false if its work failed.
+    bool Pop(Block* block);
+
+    // The number of blocks that have been pushed but not popped.
+    size_t size() const { return jobs_.size(); }
+
+  private:
+    struct Job {
+        Block block;
+        Work work;
+        bool done = false;
+        bool result = false;
+    };
+
+    void Run();
+
+    std::mutex mutex_;
+    std::condition_variable work_available_;
+    std::condition_variable work_done_;
+    bool stopping_ = false;
+
+    // Every job that's been pushed but not popped, in order, and the ones no thread has taken yet.
+    std::deque<std::unique_ptr<Job>> jobs_;
+    std::deque<Job*> pending_;
+
+    std::vector<std::thread> threads_;
+};
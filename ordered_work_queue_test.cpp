@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ordered_work_queue.h"
+
+#include <gtest/gtest.h>
+
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+
+static Block MakeBlock(const std::string& s) {
+    Block block(s.size());
+    memcpy(block.data(), s.data(), s.size());
+    return block;
+}
+
+static std::string BlockToString(const Block& block) {
+    return std::string(block.data(), block.size());
+}
+
+TEST(OrderedWorkQueue, in_order) {
+    OrderedWorkQueue queue(4);
+    for (int i = 0; i < 100; ++i) {
+        // Make the early blocks the slowest, so that they finish out of order.
+        queue.Push(MakeBlock(std::to_string(i)), [i](Block* block) {
+            usleep((100 - i) * 100);
+            block->data()[0] = 'x';
+            return true;
+        });
+    }
+    ASSERT_EQ(100U, queue.size());
+
+    for (int i = 0; i < 100; ++i) {
+        Block block;
+        ASSERT_TRUE(queue.Pop(&block));
+        std::string expected = std::to_string(i);
+        expected[0] = 'x';
+        EXPECT_EQ(expected, BlockToString(block));
+    }
+    EXPECT_EQ(0U, queue.size());
+}
+
+TEST(OrderedWorkQueue, failure) {
+    OrderedWorkQueue queue(2);
+    queue.Push(MakeBlock("a"), [](Block*) { return true; });
+    queue.Push(MakeBlock("b"), [](Block*) { return false; });
+    queue.Push(MakeBlock("c"), [](Block*) { return true; });
+
+    Block block;
+    EXPECT_TRUE(queue.Pop(&block));
+    EXPECT_FALSE(queue.Pop(&block));
+    EXPECT_EQ("b", BlockToString(block));
+    EXPECT_TRUE(queue.Pop(&block));
+}
+
+TEST(OrderedWorkQueue, abandoned) {
+    // Destroying the queue with work still queued doesn't wait for it, or crash.
+    OrderedWorkQueue queue(1);
+    for (int i = 0; i < 10; ++i) {
+        queue.Push(MakeBlock("a"), [](Block*) {
+            usleep(1000);
+            return true;
+        });
+    }
+}
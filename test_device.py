@@ -18,7 +18,9 @@
 from __future__ import print_function
 
 import contextlib
+import errno
 import hashlib
+import json
 import os
 import posixpath
 import random
@@ -27,7 +29,9 @@ import shlex
 import shutil
 import signal
 import socket
+import stat
 import string
+import struct
 import subprocess
 import sys
 import tempfile
@@ -784,6 +788,285 @@ class FileOperationsTest(DeviceTest):
 
         os.remove(tmp.name)
 
+    def test_push_delta(self):
+        """Only the changed parts of a large file are pushed over an old copy."""
+        if 'send_delta' not in self.device._simple_call(['features']).split():
+            raise unittest.SkipTest('send_delta not supported on device')
+
+        size = 8 * 1024 * 1024
+        data = bytearray(os.urandom(size))
+        tmp = tempfile.NamedTemporaryFile(mode='wb', delete=False)
+        tmp.write(data)
+        tmp.close()
+
+        try:
+            self.device.shell(['rm', '-rf', self.DEVICE_TEMP_FILE])
+            self.device._simple_call(['push', tmp.name, self.DEVICE_TEMP_FILE])
+
+            data[size // 2:size // 2 + 100] = os.urandom(100)
+            data[:0] = b'inserted'
+            with open(tmp.name, 'wb') as f:
+                f.write(data)
+
+            output = self.device._simple_call(['push', tmp.name, self.DEVICE_TEMP_FILE])
+            bytes_sent = int(re.search(r'\((\d+) bytes in', output).group(1))
+            self.assertLess(bytes_sent, size // 10)
+            self._verify_remote(compute_md5(data), self.DEVICE_TEMP_FILE)
+            self.device.shell(['rm', '-f', self.DEVICE_TEMP_FILE])
+        finally:
+            os.remove(tmp.name)
+
+    def test_push_pull_compressed(self):
+        """Files survive a round trip through each codec the device supports."""
+        features = self.device._simple_call(['features']).split()
+        data = (os.urandom(64 * 1024) + bytes(64 * 1024)) * 16
+        tmp = tempfile.NamedTemporaryFile(mode='wb', delete=False)
+        tmp.write(data)
+        tmp.close()
+        host_copy = tmp.name + '.pulled'
+
+        try:
+            for compression in ['brotli', 'lz4', 'zstd']:
+                if 'sendrecv_v2_' + compression not in features:
+                    continue
+                self.device.shell(['rm', '-f', self.DEVICE_TEMP_FILE])
+                self.device._simple_call(
+                    ['push', '-z', compression, tmp.name, self.DEVICE_TEMP_FILE])
+                self._verify_remote(compute_md5(data), self.DEVICE_TEMP_FILE)
+
+                self.device._simple_call(
+                    ['pull', '-z', compression, self.DEVICE_TEMP_FILE, host_copy])
+                with open(host_copy, 'rb') as f:
+                    self.assertEqual(compute_md5(data), compute_md5(f.read()))
+            self.device.shell(['rm', '-f', self.DEVICE_TEMP_FILE])
+        finally:
+            os.remove(tmp.name)
+            if os.path.exists(host_copy):
+                os.remove(host_copy)
+
+    def test_push_pull_incompressible(self):
+        """Compression gives up part way through random data without breaking the transfer."""
+        features = self.device._simple_call(['features']).split()
+        if 'sendrecv_v2_raw_fallback' not in features:
+            raise unittest.SkipTest('sendrecv_v2_raw_fallback not supported on device')
+
+        data = os.urandom(4 * 1024 * 1024)
+        tmp = tempfile.NamedTemporaryFile(mode='wb', delete=False)
+        tmp.write(data)
+        tmp.close()
+        host_copy = tmp.name + '.pulled'
+
+        try:
+            self.device.shell(['rm', '-f', self.DEVICE_TEMP_FILE])
+            self.device._simple_call(['push', '-z', 'any', tmp.name, self.DEVICE_TEMP_FILE])
+            self._verify_remote(compute_md5(data), self.DEVICE_TEMP_FILE)
+
+            self.device._simple_call(['pull', '-z', 'any', self.DEVICE_TEMP_FILE, host_copy])
+            with open(host_copy, 'rb') as f:
+                self.assertEqual(compute_md5(data), compute_md5(f.read()))
+            self.device.shell(['rm', '-f', self.DEVICE_TEMP_FILE])
+        finally:
+            os.remove(tmp.name)
+            if os.path.exists(host_copy):
+                os.remove(host_copy)
+
+    def test_push_framed(self):
+        """Push a file big enough to be compressed in frames, some of which don't compress."""
+        features = self.device._simple_call(['features']).split()
+        if 'sendrecv_v2_framed' not in features:
+            raise unittest.SkipTest('sendrecv_v2_framed not supported on device')
+
+        # An odd size, so that the last frame is short.
+        data = (b'compressible ' * 500000) + os.urandom(3 * 1024 * 1024 + 12345)
+        tmp = tempfile.NamedTemporaryFile(mode='wb', delete=False)
+        tmp.write(data)
+        tmp.close()
+
+        try:
+            for compression in ['brotli', 'lz4', 'zstd']:
+                self.device.shell(['rm', '-f', self.DEVICE_TEMP_FILE])
+                self.device._simple_call(
+                    ['push', '-z', compression, tmp.name, self.DEVICE_TEMP_FILE])
+                self._verify_remote(compute_md5(data), self.DEVICE_TEMP_FILE)
+            self.device.shell(['rm', '-f', self.DEVICE_TEMP_FILE])
+        finally:
+            os.remove(tmp.name)
+
+    def test_push_ranged(self):
+        """Push a file big enough to be split into ranges over several connections."""
+        if 'send_range' not in self.device._simple_call(['features']).split():
+            raise unittest.SkipTest('send_range not supported on device')
+
+        # An odd size, so that the last range is longer than the others.
+        data = os.urandom(64 * 1024 * 1024 + 7 * 1024 + 3)
+        tmp = tempfile.NamedTemporaryFile(mode='wb', delete=False)
+        tmp.write(data)
+        tmp.close()
+        os.utime(tmp.name, (1500000000, 1500000000))
+
+        try:
+            self.device.shell(['rm', '-f', self.DEVICE_TEMP_FILE])
+            self.device._simple_call(['push', '-z', 'none', tmp.name, self.DEVICE_TEMP_FILE])
+            self._verify_remote(compute_md5(data), self.DEVICE_TEMP_FILE)
+            mtime = self.device.shell(['stat', '-c', '%Y', self.DEVICE_TEMP_FILE])[0].strip()
+            self.assertEqual('1500000000', mtime)
+            self.device.shell(['rm', '-f', self.DEVICE_TEMP_FILE])
+        finally:
+            os.remove(tmp.name)
+
+    def test_push_pull_resume(self):
+        """--resume carries on from a partial file that an interrupted transfer left behind."""
+        if 'sync_resume' not in self.device._simple_call(['features']).split():
+            raise unittest.SkipTest('sync_resume not supported on device')
+
+        data = os.urandom(8 * 1024 * 1024 + 12345)
+        half = len(data) // 2
+        tmp = tempfile.NamedTemporaryFile(mode='wb', delete=False)
+        tmp.write(data)
+        tmp.close()
+        os.utime(tmp.name, (1500000000, 1500000000))
+        partial = tmp.name + '.half'
+        with open(partial, 'wb') as f:
+            f.write(data[:half])
+        host_copy = tmp.name + '.pulled'
+
+        try:
+            # Leave the first half of the file where an interrupted push would have left it.
+            self.device.shell(['rm', '-f', self.DEVICE_TEMP_FILE])
+            self.device.push(partial, self.DEVICE_TEMP_FILE + '.adbpart')
+            output = self.device._simple_call(
+                ['push', '--resume', '-z', 'none', tmp.name, self.DEVICE_TEMP_FILE])
+            self.assertIn('%d bytes resumed' % half, output)
+            self._verify_remote(compute_md5(data), self.DEVICE_TEMP_FILE)
+            mtime = self.device.shell(['stat', '-c', '%Y', self.DEVICE_TEMP_FILE])[0].strip()
+            self.assertEqual('1500000000', mtime)
+            self.assertEqual('', self.device.shell(
+                ['ls', self.DEVICE_TEMP_FILE + '.adbpart', '2>/dev/null', '||', 'true'])[0])
+
+            # A complete copy is skipped.
+            output = self.device._simple_call(
+                ['push', '--resume', tmp.name, self.DEVICE_TEMP_FILE])
+            self.assertIn('0 files pushed, 1 skipped', output)
+
+            # Likewise for a pull, with a partial file on the host.
+            shutil.copyfile(partial, host_copy + '.adbpart')
+            output = self.device._simple_call(
+                ['pull', '--resume', self.DEVICE_TEMP_FILE, host_copy])
+            self.assertIn('%d bytes resumed' % half, output)
+            with open(host_copy, 'rb') as f:
+                self.assertEqual(data, f.read())
+            self.assertFalse(os.path.exists(host_copy + '.adbpart'))
+            self.assertEqual(1500000000, int(os.stat(host_copy).st_mtime))
+
+            # Only the chunks before the first one that differs are kept, even if the end of
+            # the partial file matches.
+            edited = bytearray(data[:half])
+            edited[half - 1] ^= 0xff
+            with open(host_copy + '.adbpart', 'wb') as f:
+                f.write(edited)
+            os.remove(host_copy)
+            output = self.device._simple_call(
+                ['pull', '--resume', self.DEVICE_TEMP_FILE, host_copy])
+            self.assertIn('%d bytes resumed' % (4 * 1024 * 1024), output)
+            with open(host_copy, 'rb') as f:
+                self.assertEqual(data, f.read())
+
+            edited = bytearray(data[:half])
+            edited[0] ^= 0xff
+            with open(host_copy + '.adbpart', 'wb') as f:
+                f.write(edited)
+            os.remove(host_copy)
+            output = self.device._simple_call(
+                ['pull', '--resume', self.DEVICE_TEMP_FILE, host_copy])
+            self.assertNotIn('bytes resumed', output)
+            with open(host_copy, 'rb') as f:
+                self.assertEqual(data, f.read())
+
+            # A partial file that doesn't match is started again.
+            with open(host_copy + '.adbpart', 'wb') as f:
+                f.write(os.urandom(half))
+            os.remove(host_copy)
+            output = self.device._simple_call(
+                ['pull', '--resume', self.DEVICE_TEMP_FILE, host_copy])
+            self.assertNotIn('bytes resumed', output)
+            with open(host_copy, 'rb') as f:
+                self.assertEqual(data, f.read())
+            self.device.shell(['rm', '-f', self.DEVICE_TEMP_FILE])
+        finally:
+            for path in [tmp.name, partial, host_copy, host_copy + '.adbpart']:
+                if os.path.exists(path):
+                    os.remove(path)
+
+    def test_sync_stats(self):
+        """$ADB_SYNC_STATS gets the phases and files of a push and a pull as JSON."""
+        host_dir = tempfile.mkdtemp()
+        pull_dir = tempfile.mkdtemp()
+        stats_path = os.path.join(pull_dir, 'stats.json')
+        try:
+            self.device.shell(['rm', '-rf', self.DEVICE_TEMP_DIR])
+            temp_files = make_random_host_files(in_dir=host_dir, num_files=8)
+            os.environ['ADB_SYNC_STATS'] = stats_path
+            try:
+                self.device.push(host_dir, self.DEVICE_TEMP_DIR)
+                with open(stats_path) as f:
+                    pushed = json.load(f)
+                self.device.pull(self.DEVICE_TEMP_DIR, os.path.join(pull_dir, 'pulled'))
+                with open(stats_path) as f:
+                    pulled = json.load(f)
+            finally:
+                del os.environ['ADB_SYNC_STATS']
+
+            for stats, direction in [(pushed, 'push'), (pulled, 'pull')]:
+                self.assertEqual(direction, stats['direction'])
+                self.assertEqual(len(temp_files), stats['files_transferred'])
+                total_size = sum(os.path.getsize(f.full_path) for f in temp_files)
+                self.assertEqual(total_size, stats['bytes_transferred'])
+                self.assertEqual({'list', 'transfer', 'ack_wait'}, set(stats['phases']))
+                self.assertIn('count', stats['stalls'])
+                self.assertEqual(len(temp_files), len(stats['files']))
+                for f in stats['files']:
+                    self.assertTrue(f['name'].startswith(self.DEVICE_TEMP_DIR))
+                    self.assertGreaterEqual(f['wire_bytes'], 0)
+            self.device.shell(['rm', '-rf', self.DEVICE_TEMP_DIR])
+        finally:
+            shutil.rmtree(host_dir)
+            shutil.rmtree(pull_dir)
+
+    def test_push_pull_sparse(self):
+        """A sparse file keeps its holes, including one at its end, through a push and a pull."""
+        if 'sendrecv_v2_sparse' not in self.device._simple_call(['features']).split():
+            raise unittest.SkipTest('sendrecv_v2_sparse not supported on device')
+
+        size = 256 * 1024 * 1024
+        extents = [(0, os.urandom(64 * 1024)), (100 * 1024 * 1024, os.urandom(12345))]
+        tmp = tempfile.NamedTemporaryFile(mode='wb', delete=False)
+        for offset, data in extents:
+            tmp.seek(offset)
+            tmp.write(data)
+        tmp.truncate(size)
+        tmp.close()
+        with open(tmp.name, 'rb') as f:
+            checksum = compute_md5(f.read())
+        host_copy = tmp.name + '.pulled'
+
+        try:
+            self.device.shell(['rm', '-f', self.DEVICE_TEMP_FILE])
+            self.device._simple_call(['push', '-z', 'none', tmp.name, self.DEVICE_TEMP_FILE])
+            self._verify_remote(checksum, self.DEVICE_TEMP_FILE)
+            blocks = self.device.shell(['stat', '-c', '%b', self.DEVICE_TEMP_FILE])[0].strip()
+            self.assertLess(int(blocks) * 512, size // 16)
+
+            self.device._simple_call(['pull', '-z', 'none', self.DEVICE_TEMP_FILE, host_copy])
+            self.assertEqual(size, os.path.getsize(host_copy))
+            self._verify_local(checksum, host_copy)
+            if hasattr(os.stat(host_copy), 'st_blocks'):
+                self.assertLess(os.stat(host_copy).st_blocks * 512, size // 16)
+            self.device.shell(['rm', '-f', self.DEVICE_TEMP_FILE])
+        finally:
+            os.remove(tmp.name)
+            if os.path.exists(host_copy):
+                os.remove(host_copy)
+
     def test_push_dir(self):
         """Push a randomly generated directory of files to the device."""
         self.device.shell(['rm', '-rf', self.DEVICE_TEMP_DIR])
@@ -809,6 +1092,68 @@ class FileOperationsTest(DeviceTest):
             if host_dir is not None:
                 shutil.rmtree(host_dir)
 
+    def test_push_dir_bundled(self):
+        """Push more small files than fit in one bundle, keeping their timestamps."""
+        if 'send_bundle' not in self.device._simple_call(['features']).split():
+            raise unittest.SkipTest('send_bundle not supported on device')
+
+        self.device.shell(['rm', '-rf', self.DEVICE_TEMP_DIR])
+        self.device.shell(['mkdir', self.DEVICE_TEMP_DIR])
+
+        try:
+            host_dir = tempfile.mkdtemp()
+            os.chmod(host_dir, 0o700)
+
+            temp_files = make_random_host_files(in_dir=host_dir, num_files=300)
+            for temp_file in temp_files:
+                os.utime(temp_file.full_path, (1500000000, 1500000000))
+            self.device.push(host_dir, self.DEVICE_TEMP_DIR)
+
+            remote_dir = posixpath.join(self.DEVICE_TEMP_DIR, os.path.basename(host_dir))
+            output = self.device.shell(
+                ['cd', remote_dir, '&&', get_md5_prog(self.device), '*'])[0]
+            remote_checksums = {}
+            for line in output.splitlines():
+                checksum, name = line.split()
+                remote_checksums[name] = checksum
+            for temp_file in temp_files:
+                self.assertEqual(temp_file.checksum, remote_checksums[temp_file.base_name])
+
+            mtimes = self.device.shell(['stat', '-c', '%Y', remote_dir + '/*'])[0].split()
+            self.assertEqual(['1500000000'] * len(temp_files), mtimes)
+            self.device.shell(['rm', '-rf', self.DEVICE_TEMP_DIR])
+        finally:
+            if host_dir is not None:
+                shutil.rmtree(host_dir)
+
+    def test_push_dir_parallel(self):
+        """Push a directory tree over several sync connections at once."""
+        self.device.shell(['rm', '-rf', self.DEVICE_TEMP_DIR])
+        self.device.shell(['mkdir', self.DEVICE_TEMP_DIR])
+
+        try:
+            host_dir = tempfile.mkdtemp()
+            os.chmod(host_dir, 0o700)
+
+            subdir = os.path.join(host_dir, 'subdir')
+            os.mkdir(subdir)
+            temp_files = make_random_host_files(in_dir=host_dir, num_files=16)
+            subdir_files = make_random_host_files(in_dir=subdir, num_files=16)
+
+            self.device._simple_call(['push', '-j', '4', host_dir, self.DEVICE_TEMP_DIR])
+
+            remote_dir = posixpath.join(self.DEVICE_TEMP_DIR, os.path.basename(host_dir))
+            for temp_file in temp_files:
+                self._verify_remote(temp_file.checksum,
+                                    posixpath.join(remote_dir, temp_file.base_name))
+            for temp_file in subdir_files:
+                self._verify_remote(temp_file.checksum,
+                                    posixpath.join(remote_dir, 'subdir', temp_file.base_name))
+            self.device.shell(['rm', '-rf', self.DEVICE_TEMP_DIR])
+        finally:
+            if host_dir is not None:
+                shutil.rmtree(host_dir)
+
     def disabled_test_push_empty(self):
         """Push an empty directory to the device."""
         self.device.shell(['rm', '-rf', self.DEVICE_TEMP_DIR])
@@ -992,6 +1337,35 @@ class FileOperationsTest(DeviceTest):
         self._test_pull(self.DEVICE_TEMP_FILE, dev_md5)
         self.device.shell_nocheck(['rm', self.DEVICE_TEMP_FILE])
 
+    def test_pull_ranged(self):
+        """Pull a file big enough to be split into ranges over several connections."""
+        features = self.device._simple_call(['features']).split()
+        if 'recv_range' not in features:
+            raise unittest.SkipTest('recv_range not supported on device')
+
+        kbytes = 64 * 1024 + 7
+        self.device.shell(['rm', '-rf', self.DEVICE_TEMP_FILE])
+        cmd = ['dd', 'if=/dev/urandom',
+               'of={}'.format(self.DEVICE_TEMP_FILE), 'bs=1024',
+               'count={}'.format(kbytes)]
+        self.device.shell(cmd)
+        dev_md5, _ = self.device.shell(
+            [get_md5_prog(self.device), self.DEVICE_TEMP_FILE])[0].split()
+
+        tmp = tempfile.NamedTemporaryFile(mode='wb', delete=False)
+        tmp.close()
+        try:
+            for compression in ['none', 'zstd']:
+                os.remove(tmp.name)
+                self.device._simple_call(
+                    ['pull', '-z', compression, self.DEVICE_TEMP_FILE, tmp.name])
+                self.assertEqual(kbytes * 1024, os.path.getsize(tmp.name))
+                self._verify_local(dev_md5, tmp.name)
+        finally:
+            if os.path.exists(tmp.name):
+                os.remove(tmp.name)
+            self.device.shell_nocheck(['rm', self.DEVICE_TEMP_FILE])
+
     def test_pull_dir(self):
         """Pull a randomly generated directory of files from the device."""
         try:
@@ -1258,6 +1632,42 @@ class FileOperationsTest(DeviceTest):
             if temp_dir is not None:
                 shutil.rmtree(temp_dir)
 
+    def test_push_checksum(self):
+        """Files with new timestamps but the same contents are skipped with --checksum."""
+
+        try:
+            temp_dir = tempfile.mkdtemp()
+            temp_files = make_random_host_files(in_dir=temp_dir, num_files=8)
+
+            self.device.shell(['rm', '-rf', self.DEVICE_TEMP_DIR])
+            self.device.shell(['mkdir', self.DEVICE_TEMP_DIR])
+            device_dir = posixpath.join(self.DEVICE_TEMP_DIR, os.path.basename(temp_dir))
+            self.device._simple_call(['push', '--sync', temp_dir, self.DEVICE_TEMP_DIR])
+
+            # Change the contents of one file, and move every file's timestamp forward.
+            with open(temp_files[0].full_path, 'r+b') as f:
+                data = os.urandom(len(f.read()))
+                f.seek(0)
+                f.write(data)
+            temp_files[0].checksum = compute_md5(data)
+            for temp_file in temp_files:
+                mtime = time.time() + 100
+                os.utime(temp_file.full_path, (mtime, mtime))
+
+            output = self.device._simple_call(
+                ['push', '--checksum', temp_dir, self.DEVICE_TEMP_DIR])
+            self.assertIn('1 file pushed, 7 skipped', output)
+            self.verify_sync(self.device, temp_files, device_dir)
+
+            # The identical files were given the new timestamps, so comparing those is enough now.
+            output = self.device._simple_call(['push', '--sync', temp_dir, self.DEVICE_TEMP_DIR])
+            self.assertIn('0 files pushed, 8 skipped', output)
+
+            self.device.shell(['rm', '-rf', self.DEVICE_TEMP_DIR])
+        finally:
+            if temp_dir is not None:
+                shutil.rmtree(temp_dir)
+
     def test_unicode_paths(self):
         """Ensure that we can support non-ASCII paths, even on Windows."""
         name = u'로보카 폴리'
@@ -1284,6 +1694,157 @@ class FileOperationsTest(DeviceTest):
         self.device.shell(['rm', '-f', '/data/local/tmp/adb-test-*'])
 
 
+class SyncProtocolTest(DeviceTest):
+    """Requests that adb only makes in bulk, sent to adbd's sync service directly."""
+
+    DEVICE_TEMP_DIR = '/data/local/tmp/adb_test_sync_protocol'
+
+    def setUp(self):
+        self.device.shell(['rm', '-rf', self.DEVICE_TEMP_DIR])
+        self.device.shell(['mkdir', self.DEVICE_TEMP_DIR])
+
+    def tearDown(self):
+        self.device.shell(['rm', '-rf', self.DEVICE_TEMP_DIR])
+
+    def _require_feature(self, feature):
+        if feature not in self.device._simple_call(['features']).split():
+            raise unittest.SkipTest('%s not supported on device' % feature)
+
+    def _connect(self):
+        s = socket.create_connection(("localhost", 5037))
+        self.addCleanup(s.close)
+
+        def adb_length_prefixed(string):
+            encoded = string.encode("utf8")
+            return b"%04x%s" % (len(encoded), encoded)
+
+        if "ANDROID_SERIAL" in os.environ:
+            transport_string = "host:transport:" + os.environ["ANDROID_SERIAL"]
+        else:
+            transport_string = "host:transport-any"
+        for service in [transport_string, "sync:"]:
+            s.sendall(adb_length_prefixed(service))
+            self.assertEqual(b"OKAY", self._recv(s, 4))
+        return s
+
+    def _recv(self, s, length):
+        data = b""
+        while len(data) < length:
+            read = s.recv(length - len(data))
+            if not read:
+                self.fail('connection closed after %d of %d bytes' % (len(data), length))
+            data += read
+        return data
+
+    def _request(self, s, request_id, path=b''):
+        s.sendall(request_id + struct.pack('<I', len(path)) + path)
+
+    def _path_list(self, paths):
+        return b''.join(struct.pack('<I', len(path)) + path for path in paths)
+
+    def _expect_fail(self, s, message):
+        request_id, length = struct.unpack('<4sI', self._recv(s, 8))
+        self.assertEqual(b'FAIL', request_id)
+        self.assertEqual(message, self._recv(s, length).decode('utf8'))
+
+    def _stat_batch(self, s, stat_id, paths):
+        self._request(s, b'STAB')
+        s.sendall(b'STAB' + stat_id + struct.pack('<I', len(paths)) + self._path_list(paths))
+        results = []
+        for _ in paths:
+            (response_id, error, dev, ino, mode, nlink, uid, gid, size, atime, mtime,
+             ctime) = struct.unpack('<4sIQQIIIIQqqq', self._recv(s, 72))
+            self.assertEqual(stat_id, response_id)
+            results.append((error, mode, size))
+        return results
+
+    def _list_recursive(self, s, path):
+        self._request(s, b'RLST', path)
+        entries = []
+        while True:
+            response_id, mode, size, mtime, namelen = struct.unpack(
+                '<4sIQqI', self._recv(s, 28))
+            name = self._recv(s, namelen).decode('utf8')
+            if response_id == b'DONE':
+                return entries
+            self.assertEqual(b'RDNT', response_id)
+            entries.append((name, mode, size))
+
+    def test_stat_batch(self):
+        """Each path in a stat_batch gets its own answer, or its own error."""
+        self._require_feature('stat_batch')
+        base = self.DEVICE_TEMP_DIR.encode()
+        self.device.shell(['echo', 'hello', '>', self.DEVICE_TEMP_DIR + '/file'])
+        self.device.shell(['ln', '-s', 'file', self.DEVICE_TEMP_DIR + '/link'])
+        paths = [base + b'/file', base + b'/missing', base + b'/file/child', base + b'/link']
+
+        s = self._connect()
+        lstats = self._stat_batch(s, b'LST2', paths)
+        self.assertEqual((0, 6), (lstats[0][0], lstats[0][2]))
+        self.assertTrue(stat.S_ISREG(lstats[0][1]))
+        self.assertEqual(errno.ENOENT, lstats[1][0])
+        self.assertEqual(errno.ENOTDIR, lstats[2][0])
+        self.assertEqual(0, lstats[3][0])
+        self.assertTrue(stat.S_ISLNK(lstats[3][1]))
+
+        # The same connection carries on with a stat that follows the link.
+        stats = self._stat_batch(s, b'STA2', paths)
+        self.assertEqual([error for error, _, _ in lstats], [error for error, _, _ in stats])
+        self.assertEqual(lstats[0], stats[3])
+
+    def test_stat_batch_limit(self):
+        """A stat_batch can have up to 4096 paths, and no more."""
+        self._require_feature('stat_batch')
+        path = self.DEVICE_TEMP_DIR.encode()
+
+        s = self._connect()
+        results = self._stat_batch(s, b'LST2', [path] * 4096)
+        self.assertEqual(4096, len(results))
+        self.assertTrue(all(error == 0 and stat.S_ISDIR(mode) for error, mode, _ in results))
+
+        self._request(s, b'STAB')
+        s.sendall(b'STAB' + b'LST2' + struct.pack('<I', 4097))
+        self._expect_fail(s, 'too many paths')
+
+    def test_stat_batch_unknown_stat_id(self):
+        """A stat_batch has to ask for a stat or an lstat."""
+        self._require_feature('stat_batch')
+        s = self._connect()
+        self._request(s, b'STAB')
+        s.sendall(b'STAB' + b'LIST' + struct.pack('<I', 1))
+        self._expect_fail(s, 'unknown stat id: %#x' % struct.unpack('<I', b'LIST')[0])
+
+
+    def test_list_recursive(self):
+        """list_recursive walks the whole tree, following links, and visits each directory once."""
+        self._require_feature('ls_recursive')
+        base = self.DEVICE_TEMP_DIR
+        self.device.shell(['mkdir', '-p', base + '/sub/deeper'])
+        for name in ['a', 'sub/b', 'sub/deeper/c']:
+            self.device.shell(['echo', 'x', '>', base + '/' + name])
+        self.device.shell(['ln', '-s', '.', base + '/loop'])
+        self.device.shell(['ln', '-s', 'missing', base + '/dangling'])
+
+        s = self._connect()
+        entries = self._list_recursive(s, base.encode())
+        names = [name for name, _, _ in entries]
+        self.assertEqual(sorted(['a', 'sub', 'sub/b', 'sub/deeper', 'sub/deeper/c', 'loop',
+                                 'dangling']), sorted(names))
+        self.assertLess(names.index('sub'), names.index('sub/b'))
+        self.assertLess(names.index('sub/deeper'), names.index('sub/deeper/c'))
+
+        modes = {name: (mode, size) for name, mode, size in entries}
+        self.assertTrue(stat.S_ISREG(modes['sub/deeper/c'][0]))
+        self.assertEqual(2, modes['sub/deeper/c'][1])
+        self.assertTrue(stat.S_ISDIR(modes['loop'][0]))
+        self.assertTrue(stat.S_ISLNK(modes['dangling'][0]))
+
+        # A directory that isn't there has no entries, and the connection carries on.
+        self.assertEqual([], self._list_recursive(s, (base + '/missing').encode()))
+        self.assertEqual(['b', 'deeper', 'deeper/c'], sorted(
+            name for name, _, _ in self._list_recursive(s, (base + '/sub').encode())))
+
+
 class DeviceOfflineTest(DeviceTest):
     def _get_device_state(self, serialno):
         output = subprocess.check_output(self.device.adb_cmd + ['devices'])
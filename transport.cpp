@@ -83,6 +83,22 @@ const char* const kFeatureAbbExec = "abb_exec";
 const char* const kFeatureRemountShell = "remount_shell";
 const char* const kFeatureSendRecv2 = "sendrecv_v2";
 const char* const kFeatureSendRecv2Brotli = "sendrecv_v2_brotli";
+const char* const kFeatureSendRecv2LZ4 = "sendrecv_v2_lz4";
+const char* const kFeatureSendRecv2Zstd = "sendrecv_v2_zstd";
+const char* const kFeatureSendRecv2RawFallback = "sendrecv_v2_raw_fallback";
+const char* const kFeatureSendRecv2Framed = "sendrecv_v2_framed";
+const char* const kFeatureSendDelta = "send_delta";
+const char* const kFeatureUsbEndpointPairs = "usb_endpoint_pairs";
+const char* const kFeatureStatBatch = "stat_batch";
+const char* const kFeatureListRecursive = "ls_recursive";
+const char* const kFeatureHashBatch = "hash_batch";
+const char* const kFeatureSyncDataMax = "sync_data_max";
+const char* const kFeatureSendSize = "send_size";
+const char* const kFeatureRecvRange = "recv_range";
+const char* const kFeatureSendRange = "send_range";
+const char* const kFeatureSendRecv2Sparse = "sendrecv_v2_sparse";
+const char* const kFeatureSendBundle = "send_bundle";
+const char* const kFeatureResume = "sync_resume";
 
 namespace {
 
@@ -1184,6 +1200,22 @@ const FeatureSet& supported_features() {
             kFeatureRemountShell,
             kFeatureSendRecv2,
             kFeatureSendRecv2Brotli,
+            kFeatureSendRecv2LZ4,
+            kFeatureSendRecv2Zstd,
+            kFeatureSendRecv2RawFallback,
+            kFeatureSendRecv2Framed,
+            kFeatureSendDelta,
+            kFeatureUsbEndpointPairs,
+            kFeatureStatBatch,
+            kFeatureListRecursive,
+            kFeatureHashBatch,
+            kFeatureSyncDataMax,
+            kFeatureSendSize,
+            kFeatureRecvRange,
+            kFeatureSendRange,
+            kFeatureSendRecv2Sparse,
+            kFeatureSendBundle,
+            kFeatureResume,
             // Increment ADB_SERVER_VERSION when adding a feature that adbd needs
             // to know about. Otherwise, the client can be stuck running an old
             // version of the server even after upgrading their copy of adb.
@@ -1216,6 +1248,9 @@ bool atransport::has_feature(const std::string& feature) const {
 
 void atransport::SetFeatures(const std::string& features_string) {
     features_ = StringToFeatureSet(features_string);
+    if (auto connection = this->connection()) {
+        connection->SetPeerFeatures(features_);
+    }
 }
 
 void atransport::AddDisconnect(adisconnect* disconnect) {
@@ -87,6 +87,38 @@ extern const char* const kFeatureRemountShell;
 extern const char* const kFeatureSendRecv2;
 // adbd supports brotli for send/recv v2.
 extern const char* const kFeatureSendRecv2Brotli;
+// adbd supports LZ4 for send/recv v2.
+extern const char* const kFeatureSendRecv2LZ4;
+// adbd supports Zstd for send/recv v2.
+extern const char* const kFeatureSendRecv2Zstd;
+// adbd accepts raw data after the end of a compressed send v2 stream, and sends it for recv v2.
+extern const char* const kFeatureSendRecv2RawFallback;
+// adbd accepts compressed send v2 data as independently compressed frames.
+extern const char* const kFeatureSendRecv2Framed;
+// adbd can reconstruct a pushed file from a delta against the old one, with ID_SEND_V3.
+extern const char* const kFeatureSendDelta;
+// adbd answers each stream on the USB bulk endpoint pair that it was opened on.
+extern const char* const kFeatureUsbEndpointPairs;
+// adbd supports stat'ing many paths in one ID_STAT_BATCH request.
+extern const char* const kFeatureStatBatch;
+// adbd can walk a directory tree itself for ID_LIST_RECURSIVE.
+extern const char* const kFeatureListRecursive;
+// adbd can return SHA-256 digests of files for ID_HASH_BATCH.
+extern const char* const kFeatureHashBatch;
+// adbd can agree to ID_DATA messages bigger than SYNC_DATA_MAX, with ID_DATA_MAX.
+extern const char* const kFeatureSyncDataMax;
+// adbd accepts the size of a file being pushed up front, with kSyncFlagSize.
+extern const char* const kFeatureSendSize;
+// adbd can send part of a file for a recv_v2, with kSyncFlagRange.
+extern const char* const kFeatureRecvRange;
+// adbd can take part of a file for a send_v2, with kSyncFlagRange.
+extern const char* const kFeatureSendRange;
+// adbd can skip the holes in sparse files for uncompressed send_v2 and recv_v2.
+extern const char* const kFeatureSendRecv2Sparse;
+// adbd can take many small files in one send_bundle.
+extern const char* const kFeatureSendBundle;
+// adbd can resume a push from a partial file, and hash part of a file.
+extern const char* const kFeatureResume;
 
 TransportId NextTransportId();
 
@@ -122,6 +154,9 @@ struct Connection {
     // Stop, and reset the device if it's a USB connection.
     virtual void Reset();
 
+    // Called with the features of the other end whenever its banner is received.
+    virtual void SetPeerFeatures(const FeatureSet& features) {}
+
     std::string transport_name_;
     ReadCallback read_callback_;
     ErrorCallback error_callback_;
@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "usb_endpoint_pairs.h"
+
+#include <algorithm>
+
+#include <android-base/strings.h>
+
+#include "adb.h"
+#include "adb_utils.h"
+
+UsbEndpointPairRouter::UsbEndpointPairRouter(size_t pair_count, bool host)
+    : pair_count_(std::max<size_t>(pair_count, 1)), host_(host) {}
+
+std::optional<uint32_t> UsbEndpointPairRouter::StreamId(const amessage& msg, bool outgoing) const {
+    switch (msg.command) {
+        case A_OPEN:
+            // Only the host opens streams on pairs other than 0.
+            if (host_ == outgoing) {
+                return msg.arg0;
+            }
+            return std::nullopt;
+
+        case A_OKAY:
+        case A_WRTE:
+        case A_CLSE:
+            // arg0 is always the sender's local id, and arg1 the receiver's.
+            return host_ == outgoing ? msg.arg0 : msg.arg1;
+
+        default:
+            return std::nullopt;
+    }
+}
+
+size_t UsbEndpointPairRouter::RouteOutgoing(const apacket& packet) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (packet.msg.command == A_CNXN) {
+        stream_pairs_.clear();
+        return 0;
+    }
+
+    std::optional<uint32_t> id = StreamId(packet.msg, true);
+    if (!id) {
+        return 0;
+    }
+
+    if (packet.msg.command == A_OPEN) {
+        std::string_view service(packet.payload.data(), packet.payload.size());
+        if (pair_count_ == 1 || !IsBulkService(StripTrailingNulls(service))) {
+            stream_pairs_.erase(*id);
+            return 0;
+        }
+
+        size_t pair = 1 + next_bulk_pair_++ % (pair_count_ - 1);
+        stream_pairs_[*id] = pair;
+        return pair;
+    }
+
+    auto it = stream_pairs_.find(*id);
+    if (it == stream_pairs_.end()) {
+        return 0;
+    }
+
+    size_t pair = it->second;
+    if (packet.msg.command == A_CLSE) {
+        stream_pairs_.erase(it);
+    }
+    return pair;
+}
+
+void UsbEndpointPairRouter::HandleIncoming(const amessage& msg, size_t pair) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (msg.command == A_CNXN) {
+        stream_pairs_.clear();
+        return;
+    }
+
+    std::optional<uint32_t> id = StreamId(msg, false);
+    if (!id) {
+        return;
+    }
+
+    if (msg.command == A_OPEN && pair != 0 && pair < pair_count_) {
+        stream_pairs_[*id] = pair;
+    } else if (msg.command == A_OPEN || msg.command == A_CLSE) {
+        stream_pairs_.erase(*id);
+    }
+}
+
+bool IsBulkService(std::string_view service) {
+    using android::base::StartsWith;
+    return StartsWith(service, "sync:") || StartsWith(service, "exec:") ||
+           StartsWith(service, "abb_exec:");
+}
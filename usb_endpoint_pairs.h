@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mutex>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+
+#include <android-base/thread_annotations.h>
+
+#include "types.h"
+
+// Spreads the streams of a USB connection over several pairs of bulk endpoints, so that a stream
+// moving a lot of data doesn't hold up everything else behind it.
+//
+// Packets never span pairs, and every packet belonging to a stream goes over the same pair, so
+// each stream stays in order. The host picks the pair when it opens a stream, and adbd sends
+// everything for the stream back on the pair that its OPEN arrived on. Streams opened by adbd,
+// and packets that don't belong to a stream, always use pair 0.
+//
+// Streams are identified by the host's local id. The host only picks pairs other than 0 once the
+// device has advertised kFeatureUsbEndpointPairs, so adbd never needs to know whether the host
+// supports this: it only ever answers on pairs that the host has already used.
+class UsbEndpointPairRouter {
+  public:
+    UsbEndpointPairRouter(size_t pair_count, bool host);
+
+    size_t pair_count() const { return pair_count_; }
+
+    // Returns the pair that an outgoing packet should be sent on.
+    size_t RouteOutgoing(const apacket& packet);
+
+    // Keep track of a packet that was received on |pair|.
+    void HandleIncoming(const amessage& msg, size_t pair);
+
+  private:
+    // The host's local id for the stream that a packet belongs to, if any.
+    std::optional<uint32_t> StreamId(const amessage& msg, bool outgoing) const;
+
+    const size_t pair_count_;
+    const bool host_;
+
+    std::mutex mutex_;
+    std::unordered_map<uint32_t, size_t> stream_pairs_ GUARDED_BY(mutex_);
+    size_t next_bulk_pair_ GUARDED_BY(mutex_) = 0;
+};
+
+// Whether a service is expected to move enough data to be worth keeping off the pair used by
+// everything else.
+bool IsBulkService(std::string_view service);
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "usb_endpoint_pairs.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+
+#include "adb.h"
+
+static apacket make_packet(uint32_t command, uint32_t arg0, uint32_t arg1,
+                           const std::string& payload = "") {
+    apacket packet;
+    packet.msg.command = command;
+    packet.msg.arg0 = arg0;
+    packet.msg.arg1 = arg1;
+    packet.msg.data_length = payload.size();
+    packet.payload = apacket::payload_type(payload.begin(), payload.end());
+    return packet;
+}
+
+TEST(UsbEndpointPairRouter, host_bulk_streams) {
+    UsbEndpointPairRouter router(3, true);
+
+    // Bulk services are spread over every pair but the first, and everything else stays on it.
+    EXPECT_EQ(1U, router.RouteOutgoing(make_packet(A_OPEN, 1, 0, std::string("sync:\0", 6))));
+    EXPECT_EQ(0U, router.RouteOutgoing(make_packet(A_OPEN, 2, 0, "shell:ls")));
+    EXPECT_EQ(2U, router.RouteOutgoing(make_packet(A_OPEN, 3, 0, "exec:cat foo")));
+    EXPECT_EQ(1U, router.RouteOutgoing(make_packet(A_OPEN, 4, 0, "abb_exec:package")));
+
+    EXPECT_EQ(1U, router.RouteOutgoing(make_packet(A_WRTE, 1, 100)));
+    EXPECT_EQ(0U, router.RouteOutgoing(make_packet(A_WRTE, 2, 101)));
+    EXPECT_EQ(2U, router.RouteOutgoing(make_packet(A_OKAY, 3, 102)));
+
+    // A stream is forgotten once it's closed from either end.
+    EXPECT_EQ(1U, router.RouteOutgoing(make_packet(A_CLSE, 1, 100)));
+    EXPECT_EQ(0U, router.RouteOutgoing(make_packet(A_WRTE, 1, 100)));
+    router.HandleIncoming(make_packet(A_CLSE, 102, 3).msg, 2);
+    EXPECT_EQ(0U, router.RouteOutgoing(make_packet(A_WRTE, 3, 102)));
+
+    // A new connection forgets everything.
+    router.HandleIncoming(make_packet(A_CNXN, 0, 0).msg, 0);
+    EXPECT_EQ(0U, router.RouteOutgoing(make_packet(A_WRTE, 4, 103)));
+}
+
+TEST(UsbEndpointPairRouter, host_single_pair) {
+    UsbEndpointPairRouter router(1, true);
+    EXPECT_EQ(0U, router.RouteOutgoing(make_packet(A_OPEN, 1, 0, "sync:")));
+    EXPECT_EQ(0U, router.RouteOutgoing(make_packet(A_WRTE, 1, 100)));
+}
+
+TEST(UsbEndpointPairRouter, device_follows_host) {
+    UsbEndpointPairRouter router(2, false);
+
+    router.HandleIncoming(make_packet(A_OPEN, 1, 0).msg, 1);
+    router.HandleIncoming(make_packet(A_OPEN, 2, 0).msg, 0);
+
+    EXPECT_EQ(1U, router.RouteOutgoing(make_packet(A_OKAY, 100, 1)));
+    EXPECT_EQ(0U, router.RouteOutgoing(make_packet(A_OKAY, 101, 2)));
+
+    // Streams that adbd opens stay on the first pair.
+    EXPECT_EQ(0U, router.RouteOutgoing(make_packet(A_OPEN, 102, 0, "sync:")));
+
+    // Reopening an id on another pair moves it.
+    router.HandleIncoming(make_packet(A_CLSE, 1, 100).msg, 1);
+    EXPECT_EQ(0U, router.RouteOutgoing(make_packet(A_WRTE, 100, 1)));
+    router.HandleIncoming(make_packet(A_OPEN, 2, 0).msg, 1);
+    EXPECT_EQ(1U, router.RouteOutgoing(make_packet(A_WRTE, 101, 2)));
+}